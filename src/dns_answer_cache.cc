@@ -0,0 +1,324 @@
+#include "ares.h"
+#include "ares_dns.h"
+
+#include <arpa/nameser.h>
+#include <arpa/nameser_compat.h>
+
+#include <algorithm>
+#include <limits>
+
+#include "src/dns_answer_cache.h"
+
+#include "common/common/assert.h"
+
+#include "absl/strings/ascii.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+AnswerCache::AnswerCache(Upstream::ClusterManager& cluster_manager, uint32_t max_responses)
+    : max_responses_(max_responses), responses_(), lru_list_(), cluster_manager_(cluster_manager),
+      clusters_(),
+      cluster_update_handle_(cluster_manager.addThreadLocalClusterUpdateCallbacks(*this)) {}
+
+AnswerCache::~AnswerCache() {
+  cluster_update_handle_.reset();
+
+  for (auto& cluster : clusters_) {
+    if (cluster.second.priority_update_handle_ != nullptr) {
+      cluster.second.priority_update_handle_->remove();
+    }
+  }
+}
+
+bool AnswerCache::lookup(const Formats::Message& dns_request, Buffer::Instance& dns_response) {
+  const Formats::QuestionRecord& question = dns_request.questionRecord();
+
+  const int index = responsesIndex(question.qType(), dns_request.edns().has_value());
+  if (index < 0) {
+    return false;
+  }
+
+  auto response_it = responses_[index].find(question.qName());
+  if (response_it == responses_[index].end()) {
+    return false;
+  }
+
+  const std::string& cached_response = response_it->second.response_;
+  ASSERT(cached_response.size() >= HFIXEDSZ, "Cached DNS response is smaller than the header");
+
+  // The response is built again, and truncated, for a client with a smaller payload size
+  if (cached_response.size() > dns_request.maxResponseSize()) {
+    return false;
+  }
+
+  // The cached response carries the header of the query that populated the entry. Only the ID
+  // and the RD bit are echoed back from the query and can differ between two queries for the same
+  // question.
+  unsigned char header[HFIXEDSZ];
+  std::memcpy(header, cached_response.data(), HFIXEDSZ);
+
+  const Formats::Header& request_header = dns_request.header();
+  DNS_HEADER_SET_QID(header, request_header.id());
+  header[2] &= ~Formats::HeaderRdMask;
+  DNS_HEADER_SET_RD(header, request_header.rd());
+
+  dns_response.add(header, HFIXEDSZ);
+  dns_response.add(cached_response.data() + HFIXEDSZ, cached_response.size() - HFIXEDSZ);
+
+  lru_list_.splice(lru_list_.begin(), lru_list_, response_it->second.lru_it_);
+  return true;
+}
+
+void AnswerCache::insert(const Formats::Message& dns_request, const std::string& cluster_name,
+                         const Buffer::Instance& dns_response) {
+  const Formats::QuestionRecord& question = dns_request.questionRecord();
+
+  const int index = responsesIndex(question.qType(), dns_request.edns().has_value());
+  if (index < 0 || dns_response.length() < HFIXEDSZ) {
+    return;
+  }
+
+  // A truncated response only suits clients with the same payload size
+  unsigned char header[HFIXEDSZ];
+  dns_response.copyOut(0, HFIXEDSZ, header);
+  if (DNS_HEADER_TC(header)) {
+    return;
+  }
+
+  // Names are matched case insensitively but the response echoes the question as it was asked.
+  // Only cache the lower case form so that clients randomizing the case of the name cannot fill
+  // the cache with variants of the same name.
+  const std::string& q_name = question.qName();
+  if (std::any_of(q_name.begin(), q_name.end(), absl::ascii_isupper)) {
+    return;
+  }
+
+  ClusterEntry* cluster_entry = clusterEntry(cluster_name);
+  if (cluster_entry == nullptr) {
+    return;
+  }
+
+  ResponseMap& responses = responses_[index];
+  auto response_it = responses.find(q_name);
+  if (response_it != responses.end()) {
+    erase(responses, response_it);
+  } else if (lru_list_.size() >= max_responses_) {
+    const ResponseRef& least_recent = lru_list_.back();
+    erase(*least_recent.map_, least_recent.map_->find(*least_recent.key_));
+  }
+
+  response_it =
+      responses.emplace(q_name, CachedResponse{dns_response.toString(), cluster_entry, {}}).first;
+  lru_list_.push_front({&responses, &response_it->first});
+  response_it->second.lru_it_ = lru_list_.begin();
+  cluster_entry->names_[q_name]++;
+}
+
+AnswerCache::ClusterHosts* AnswerCache::hosts(const std::string& cluster_name,
+                                              uint32_t healthy_panic_threshold) {
+  ClusterEntry* cluster_entry = clusterEntry(cluster_name);
+  if (cluster_entry == nullptr) {
+    return nullptr;
+  }
+
+  ClusterHosts& hosts = cluster_entry->hosts_;
+  if (!hosts.selected_) {
+    selectHosts(*cluster_entry->priority_set_, healthy_panic_threshold, hosts);
+    hosts.selected_ = true;
+  }
+
+  return &hosts;
+}
+
+void AnswerCache::drop(const std::string& name) {
+  for (auto& responses : responses_) {
+    auto response_it = responses.find(name);
+    if (response_it != responses.end()) {
+      erase(responses, response_it);
+    }
+  }
+}
+
+void AnswerCache::clear() {
+  for (auto& responses : responses_) {
+    responses.clear();
+  }
+
+  lru_list_.clear();
+  for (auto& cluster : clusters_) {
+    cluster.second.names_.clear();
+  }
+}
+
+size_t AnswerCache::size() const { return lru_list_.size(); }
+
+void AnswerCache::onClusterAddOrUpdate(Upstream::ThreadLocalCluster& cluster) {
+  // An update replaces the cluster along with its priority set, so the priority update callback
+  // registered on the previous priority set is already gone.
+  dropCluster(cluster.info()->name());
+}
+
+void AnswerCache::onClusterRemoval(const std::string& cluster_name) { dropCluster(cluster_name); }
+
+int AnswerCache::responsesIndex(uint16_t q_type, bool edns) {
+  const int edns_offset = edns ? CachedQuestionTypes : 0;
+
+  switch (q_type) {
+  case T_A:
+    return edns_offset;
+  case T_AAAA:
+    return edns_offset + 1;
+  case T_SRV:
+    return edns_offset + 2;
+  default:
+    return -1;
+  }
+}
+
+uint32_t AnswerCache::hostSetHealth(const Upstream::HostSet& host_set) {
+  if (host_set.hosts().empty()) {
+    return 0;
+  }
+
+  return std::min<uint32_t>(100, host_set.overprovisioningFactor() *
+                                     host_set.healthyHosts().size() / host_set.hosts().size());
+}
+
+void AnswerCache::selectHosts(const Upstream::PrioritySet& priority_set,
+                              uint32_t healthy_panic_threshold, ClusterHosts& hosts) {
+  const std::vector<Upstream::HostSetPtr>& host_sets = priority_set.hostSetsPerPriority();
+
+  uint32_t cluster_health = 0;
+  for (const auto& host_set : host_sets) {
+    cluster_health += hostSetHealth(*host_set);
+  }
+
+  hosts.panic_ = std::min<uint32_t>(100, cluster_health) < healthy_panic_threshold;
+  if (hosts.panic_) {
+    for (const auto& host_set : host_sets) {
+      for (const auto& host : host_set->hosts()) {
+        addHost(*host, host_set->priority(), hosts);
+      }
+    }
+
+    return;
+  }
+
+  // A priority only takes load while the priorities before it are less than 100% healthy
+  uint32_t covered_health = 0;
+  for (const auto& host_set : host_sets) {
+    if (covered_health >= 100) {
+      break;
+    }
+
+    covered_health += hostSetHealth(*host_set);
+    for (const auto& host : host_set->healthyHosts()) {
+      addHost(*host, host_set->priority(), hosts);
+    }
+  }
+}
+
+void AnswerCache::addHost(const Upstream::Host& host, uint32_t priority, ClusterHosts& hosts) {
+  const Network::Address::Ip* ip = host.address()->ip();
+  if (ip == nullptr) {
+    return;
+  }
+
+  // Load balancing weights go up to 128, priorities are far fewer than 65536 in practice
+  constexpr uint32_t max_value = std::numeric_limits<uint16_t>::max();
+  const SrvEndpoint endpoint{static_cast<uint16_t>(std::min(priority, max_value)),
+                             static_cast<uint16_t>(std::min(host.weight(), max_value)),
+                             static_cast<uint16_t>(ip->port())};
+
+  switch (ip->version()) {
+  case Network::Address::IpVersion::v4:
+    hosts.addresses_.ipv4_.push_back(ip->ipv4()->address());
+    hosts.endpoints_.ipv4_.push_back(endpoint);
+    break;
+  case Network::Address::IpVersion::v6:
+    hosts.addresses_.ipv6_.push_back(ip->ipv6()->address());
+    hosts.endpoints_.ipv6_.push_back(endpoint);
+    break;
+  }
+}
+
+AnswerCache::ClusterEntry* AnswerCache::clusterEntry(const std::string& cluster_name) {
+  auto cluster_it = clusters_.find(cluster_name);
+  if (cluster_it != clusters_.end()) {
+    return &cluster_it->second;
+  }
+
+  Upstream::ThreadLocalCluster* cluster = cluster_manager_.get(cluster_name);
+  if (cluster == nullptr) {
+    return nullptr;
+  }
+
+  const Upstream::PrioritySet& priority_set = cluster->prioritySet();
+
+  // Unlike member updates, priority updates also report health check failures and outlier ejections
+  Common::CallbackHandle* priority_update_handle = priority_set.addPriorityUpdateCb(
+      [this, cluster_name](uint32_t, const Upstream::HostVector&,
+                           const Upstream::HostVector&) -> void {
+        ENVOY_LOG(debug, "DnsFilter: cluster {} hosts changed. Dropping cached answers",
+                  cluster_name);
+
+        auto it = clusters_.find(cluster_name);
+        if (it != clusters_.end()) {
+          invalidate(it->second);
+        }
+      });
+
+  auto inserted =
+      clusters_.emplace(cluster_name, ClusterEntry{&priority_set, priority_update_handle, {}, {}});
+  return &inserted.first->second;
+}
+
+void AnswerCache::invalidate(ClusterEntry& cluster_entry) {
+  // Erasing the last response of a name also drops it from the names of the cluster
+  while (!cluster_entry.names_.empty()) {
+    const std::string name = cluster_entry.names_.begin()->first;
+    for (auto& responses : responses_) {
+      auto response_it = responses.find(name);
+      if (response_it != responses.end() && response_it->second.cluster_entry_ == &cluster_entry) {
+        erase(responses, response_it);
+      }
+    }
+
+    cluster_entry.names_.erase(name);
+  }
+
+  cluster_entry.hosts_.addresses_.ipv4_.clear();
+  cluster_entry.hosts_.addresses_.ipv6_.clear();
+  cluster_entry.hosts_.endpoints_.ipv4_.clear();
+  cluster_entry.hosts_.endpoints_.ipv6_.clear();
+  cluster_entry.hosts_.selected_ = false;
+}
+
+void AnswerCache::dropCluster(const std::string& cluster_name) {
+  auto cluster_it = clusters_.find(cluster_name);
+  if (cluster_it == clusters_.end()) {
+    return;
+  }
+
+  invalidate(cluster_it->second);
+  clusters_.erase(cluster_it);
+}
+
+void AnswerCache::erase(ResponseMap& map, ResponseMap::iterator it) {
+  std::unordered_map<std::string, uint32_t>& names = it->second.cluster_entry_->names_;
+  auto name_it = names.find(it->first);
+  if (name_it != names.end() && --name_it->second == 0) {
+    names.erase(name_it);
+  }
+
+  lru_list_.erase(it->second.lru_it_);
+  map.erase(it);
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
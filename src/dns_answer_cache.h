@@ -0,0 +1,203 @@
+#pragma once
+
+#include <array>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "envoy/buffer/buffer.h"
+#include "envoy/common/callback.h"
+#include "envoy/upstream/cluster_manager.h"
+#include "envoy/upstream/upstream.h"
+
+#include "common/common/logger.h"
+
+#include "src/dns_codec.h"
+
+#include "absl/numeric/int128.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+/**
+ * Addresses packed per address family, in network byte order, as the RDATA of A and AAAA records.
+ */
+struct PackedAddresses {
+  std::vector<uint32_t> ipv4_;
+  std::vector<absl::uint128> ipv6_;
+};
+
+/**
+ * What the SRV record of a host carries besides its target, RFC 2782.
+ */
+struct SrvEndpoint {
+  // The priority of the host in its cluster
+  uint16_t priority_;
+  // The load balancing weight of the host
+  uint16_t weight_;
+  uint16_t port_;
+};
+
+/**
+ * The SRV endpoints of hosts per address family, in the order of their PackedAddresses.
+ */
+struct PackedEndpoints {
+  std::vector<SrvEndpoint> ipv4_;
+  std::vector<SrvEndpoint> ipv6_;
+};
+
+/**
+ * Per worker cache of fully encoded responses for known domain names, keyed on the question name
+ * and type. An entry is built from the hosts of a cluster and is dropped as soon as the priority
+ * set of that cluster reports an update, which covers membership and health changes, or the cluster
+ * itself is updated or removed.
+ *
+ * A cached response is the complete wire format message that was sent for the first query of
+ * a (qName, qType). Subsequent queries only differ in the header ID and the RD bit, which are
+ * patched while copying the cached bytes into the outgoing buffer.
+ *
+ * Responses to queries with and without EDNS(0) are cached apart, as only the former carry an OPT
+ * record. Truncated responses are not cached, and a cached response is only used for a query whose
+ * client accepts a response of its size.
+ *
+ * The addresses of the hosts of a cluster that answers are built from are kept along with the
+ * responses, and are dropped together with them. So is the priority set of the cluster, which is
+ * only looked up again once the cluster is updated or removed.
+ *
+ * The names matched by a pattern are not bounded, so neither is the number of responses. A full
+ * cache makes room by dropping the response used least recently.
+ */
+class AnswerCache : public Upstream::ClusterUpdateCallbacks, Logger::Loggable<Logger::Id::filter> {
+public:
+  /**
+   * The addresses of the hosts of a cluster that answers are built from, in the order of their
+   * priorities.
+   */
+  struct ClusterHosts {
+    PackedAddresses addresses_;
+    PackedEndpoints endpoints_;
+    // Where the next response that only holds some of the addresses of a family starts
+    size_t next_ipv4_offset_{0};
+    size_t next_ipv6_offset_{0};
+    // Whether the cluster is too unhealthy, so addresses_ holds all its hosts
+    bool panic_{false};
+    // Whether the hosts were collected since the priority set last reported an update. A cluster
+    // without any host to answer with is not collected again for every query.
+    bool selected_{false};
+
+    bool empty() const { return addresses_.ipv4_.empty() && addresses_.ipv6_.empty(); }
+  };
+
+  /**
+   * @param max_responses bounds the number of cached responses.
+   */
+  AnswerCache(Upstream::ClusterManager& cluster_manager, uint32_t max_responses);
+  ~AnswerCache();
+
+  /**
+   * @return the hosts of the cluster cluster_name that answers are built from, or nullptr if the
+   * cluster does not exist. They are collected from the priority set of the cluster once, and kept
+   * until it reports an update.
+   * @param healthy_panic_threshold is the health of the cluster in percent below which all its
+   * hosts are used, rather than the healthy ones of the priorities that take load.
+   */
+  ClusterHosts* hosts(const std::string& cluster_name, uint32_t healthy_panic_threshold);
+
+  /**
+   * Writes the cached response for the question in dns_request to dns_response.
+   * @return true if a response was found in the cache, false otherwise.
+   */
+  bool lookup(const Formats::Message& dns_request, Buffer::Instance& dns_response);
+
+  /**
+   * Caches the serialized dns_response that was built for dns_request from the hosts() of the
+   * cluster cluster_name. The cached response is dropped when the priority set of the cluster
+   * reports an update.
+   */
+  void insert(const Formats::Message& dns_request, const std::string& cluster_name,
+              const Buffer::Instance& dns_response);
+
+  /**
+   * Drops the cached responses to the questions for the lower case name.
+   */
+  void drop(const std::string& name);
+
+  /**
+   * Drops all the cached responses.
+   */
+  void clear();
+
+  /**
+   * @return the number of cached responses.
+   */
+  size_t size() const;
+
+  // Upstream::ClusterUpdateCallbacks
+  void onClusterAddOrUpdate(Upstream::ThreadLocalCluster& cluster) override;
+  void onClusterRemoval(const std::string& cluster_name) override;
+
+private:
+  // The only question types that are served from the cache - A, AAAA and SRV
+  static constexpr size_t CachedQuestionTypes = 3;
+
+  struct ClusterEntry {
+    // Owned by the thread local cluster. The entry is dropped once the cluster is updated or
+    // removed.
+    const Upstream::PrioritySet* priority_set_;
+    // Owned by the priority set of the cluster. Must not be removed once the cluster is gone.
+    Common::CallbackHandle* priority_update_handle_;
+    // Question names with a cached response built from this cluster, with their number of cached
+    // responses
+    std::unordered_map<std::string, uint32_t> names_;
+    ClusterHosts hosts_;
+  };
+
+  struct CachedResponse;
+  typedef std::unordered_map<std::string, CachedResponse> ResponseMap;
+
+  // Refers to a response by its map and its key, which stay in place as long as the response
+  struct ResponseRef {
+    ResponseMap* map_;
+    const std::string* key_;
+  };
+
+  typedef std::list<ResponseRef> LruList;
+
+  struct CachedResponse {
+    std::string response_;
+    // The entry of the cluster the response was built from
+    ClusterEntry* cluster_entry_;
+    LruList::iterator lru_it_;
+  };
+
+  // Index of the responses to queries of q_type, with or without EDNS(0)
+  static int responsesIndex(uint16_t q_type, bool edns);
+
+  // The healthy hosts of a priority in percent, scaled by its overprovisioning factor
+  static uint32_t hostSetHealth(const Upstream::HostSet& host_set);
+  static void selectHosts(const Upstream::PrioritySet& priority_set,
+                          uint32_t healthy_panic_threshold, ClusterHosts& hosts);
+  static void addHost(const Upstream::Host& host, uint32_t priority, ClusterHosts& hosts);
+
+  // The entry of the cluster cluster_name, or nullptr if the cluster does not exist
+  ClusterEntry* clusterEntry(const std::string& cluster_name);
+  void invalidate(ClusterEntry& cluster_entry);
+  void dropCluster(const std::string& cluster_name);
+  void erase(ResponseMap& map, ResponseMap::iterator it);
+
+  const uint32_t max_responses_;
+  std::array<ResponseMap, 2 * CachedQuestionTypes> responses_;
+  // Every response of responses_, the one used most recently first
+  LruList lru_list_;
+  Upstream::ClusterManager& cluster_manager_;
+  std::unordered_map<std::string, ClusterEntry> clusters_;
+  Upstream::ClusterUpdateCallbacksHandlePtr cluster_update_handle_;
+};
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
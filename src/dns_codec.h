@@ -8,6 +8,10 @@
 #include "envoy/common/pure.h"
 #include "envoy/buffer/buffer.h"
 
+#include "absl/numeric/int128.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+
 namespace Envoy {
 namespace Extensions {
 namespace ListenerFilters {
@@ -27,6 +31,47 @@ enum class MessageType { Query, Response };
 
 enum class ResourceRecordSection { Answer, Additional };
 
+// The transport a message was received over, which determines the size of the response
+enum class Transport { Udp, Tcp };
+
+// The outcome of decoding a request. Malformed requests are reported without an exception, as
+// they are mostly garbage sent at a high rate.
+enum class DecodeStatus {
+  Ok,
+  // Shorter than the 12 byte header
+  ShortHeader,
+  // The QR bit is set
+  NotQuery,
+  // No question, or more questions and records than the message has room for
+  InvalidCounts,
+  // A name that runs past the end of the message or is longer than 255 bytes, or has a label type
+  // other than a length or a compression pointer
+  InvalidName,
+  // A compression pointer that is truncated or does not point backwards
+  InvalidPointer,
+  // A question or resource record that runs past the end of the message
+  TruncatedRecord,
+  // A repeated OPT record, or one not owned by the root name
+  InvalidOpt
+};
+
+// Largest response sent over UDP to a client without EDNS(0), RFC 1035 section 4.2.1
+constexpr uint16_t MaxUdpPayloadSizeWithoutEdns = 512;
+// The UDP payload size advertised in the OPT record of a response. Larger sizes advertised by a
+// client are limited to it.
+constexpr uint16_t MaxUdpPayloadSize = 4096;
+// Messages sent over TCP are prefixed with a 16 bit length, RFC 1035 section 4.2.2
+constexpr uint16_t MaxTcpMessageSize = 65535;
+
+// The RD and TC bits in the third byte of the header. The DNS_HEADER_SET_* macros of c-ares only
+// set bits, so a flag copied from another message is cleared with its mask before it is set.
+constexpr unsigned char HeaderRdMask = 0x01;
+constexpr unsigned char HeaderTcMask = 0x02;
+// The opcode in the third byte and the CD bit in the fourth byte of the header, which a response
+// echoes from its request
+constexpr unsigned char HeaderOpcodeMask = 0x78;
+constexpr unsigned char HeaderCdMask = 0x10;
+
 class Encode {
 public:
   virtual ~Encode() = default;
@@ -58,10 +103,17 @@ public:
 class Message : public Encode {
 public:
   struct ResponseOptions {
+    // Codes above 15, i.e. BADVERS, are only sent to clients that use EDNS(0)
     uint16_t response_code;
     bool authoritative_bit;
   };
 
+  // The contents of the OPT pseudo record, RFC 6891
+  struct EdnsOptions {
+    uint16_t udp_payload_size;
+    uint8_t version;
+  };
+
   virtual ~Message() = default;
 
   /**
@@ -69,32 +121,71 @@ public:
    */
   virtual const Network::Address::InstanceConstSharedPtr& from() const PURE;
 
+  /**
+   * The transport the message was received over.
+   */
+  virtual Transport transport() const PURE;
+
   /**
    * The header section of the message
    */
   virtual const Header& header() const PURE;
 
   /**
-   * The question record of the message
+   * The first question record of the message
    */
   virtual const QuestionRecord& questionRecord() const PURE;
 
+  /**
+   * The question record at index, which must be less than the qdCount of the header
+   */
+  virtual const QuestionRecord& questionRecord(uint16_t index) const PURE;
+
+  /**
+   * The EDNS(0) options of the message, if it has an OPT record in the additional section.
+   * A response echoes the OPT record of its request.
+   */
+  virtual const absl::optional<EdnsOptions>& edns() const PURE;
+
+  /**
+   * The largest response the client accepts. Over TCP this is the largest DNS message. Over UDP it
+   * is the payload size advertised in its OPT record, limited to MaxUdpPayloadSize, or 512 bytes
+   * for clients without EDNS(0).
+   * A response that does not fit is truncated at a record boundary with the TC bit set.
+   */
+  virtual uint16_t maxResponseSize() const PURE;
+
+  /**
+   * The bytes the message was decoded from. They are only valid as long as the decoded message,
+   * and are empty for copies of the message and for responses.
+   */
+  virtual absl::string_view raw() const PURE;
+
   /**
    * Add the A resource record for the address specified.
+   * @param name is the owner name of the record, usually the name of the question it answers.
+   * @param address is the ipv4 address in network byte order, as Ipv4::address() returns it.
    */
-  virtual void addARecord(ResourceRecordSection section, uint32_t ttl,
-                          const Network::Address::Ipv4* address) PURE;
+  virtual void addARecord(ResourceRecordSection section, const std::string& name, uint32_t ttl,
+                          uint32_t address) PURE;
 
   /**
    * Add the AAAA resource record for the address specified.
+   * @param name is the owner name of the record, usually the name of the question it answers.
+   * @param address is the ipv6 address in network byte order, as Ipv6::address() returns it.
    */
-  virtual void addAAAARecord(ResourceRecordSection section, uint32_t ttl,
-                             const Network::Address::Ipv6* address) PURE;
+  virtual void addAAAARecord(ResourceRecordSection section, const std::string& name, uint32_t ttl,
+                             absl::uint128 address) PURE;
 
   /**
-   * Add the SRV resource record for the address specified.
+   * Add the SRV resource record for the target specified to the answer section, RFC 2782.
+   * @param name is the owner name of the record, usually the name of the question it answers.
+   * @param priority is the priority of the target, lower values are tried first.
+   * @param weight is the share of the load the target takes among the targets of its priority.
+   * @param target is the name of the host listening on port.
    */
-  virtual void addSRVRecord(uint32_t ttl, uint16_t port, const std::string& host) PURE;
+  virtual void addSRVRecord(const std::string& name, uint32_t ttl, uint16_t priority,
+                            uint16_t weight, uint16_t port, const std::string& target) PURE;
 
   /**
    * Constructs the response message by populating the header
@@ -103,6 +194,12 @@ public:
    */
   virtual ResponseMessageSharedPtr
   createResponseMessage(const ResponseOptions& response_options) const PURE;
+
+  /**
+   * Creates a copy of the message that owns all of its contents. Used when a decoded request has
+   * to outlive the decoder that produced it, i.e. while a recursive query is pending.
+   */
+  virtual RequestMessageConstSharedPtr clone() const PURE;
 };
 
 /**
@@ -127,6 +224,11 @@ class Header {
 public:
   virtual ~Header() = default;
 
+  /**
+   * Gets the message ID
+   */
+  virtual uint16_t id() const PURE;
+
   /**
    * Gets the query or response bit
    */
@@ -259,13 +361,33 @@ public:
    * Decodes the contents of data into a dns query message.
    * @param data is the buffer instance backing the contents of the dns query.
    * @param from is the address of the query requestor.
-   * @return Formats::RequestMessageConstSharedPtr is the decoded dns query.
-   *
-   * Throws EnvoyException if the dns query cannot be constructed. This mostly indicates a
-   * corruption on the wire or a rogue client.
+   * @return Formats::DecodeStatus::Ok if the query was decoded into message(). Any other status
+   * mostly indicates a corruption on the wire or a rogue client.
+   */
+  virtual Formats::DecodeStatus decode(Buffer::Instance& data,
+                                       const Network::Address::InstanceConstSharedPtr& from) PURE;
+
+  /**
+   * Decodes the header and the questions of data into message(), so that the query can be turned
+   * away before the rest of it is decoded. decodeRecords() completes the decode.
+   * @return Formats::DecodeStatus::Ok if the header and the questions were decoded.
+   */
+  virtual Formats::DecodeStatus
+  decodeQuestions(Buffer::Instance& data,
+                  const Network::Address::InstanceConstSharedPtr& from) PURE;
+
+  /**
+   * Decodes the records that follow the questions of the last successful call to decodeQuestions.
+   * The data passed to it must not have changed.
+   * @return Formats::DecodeStatus::Ok if the query was decoded into message().
+   */
+  virtual Formats::DecodeStatus decodeRecords() PURE;
+
+  /**
+   * @return the query of the last successful call to decode. The message is owned by the decoder
+   * and is reused by the next call to decode. Use Formats::Message::clone() to keep it longer.
    */
-  virtual Formats::RequestMessageConstSharedPtr
-  decode(Buffer::Instance& data, const Network::Address::InstanceConstSharedPtr& from) PURE;
+  virtual const Formats::Message& message() const PURE;
 };
 
 using DecoderPtr = std::unique_ptr<Decoder>;
@@ -1,8 +1,8 @@
-#include <sstream>
-
 #include "ares.h"
 #include "ares_dns.h"
 
+#include <algorithm>
+
 #include "src/dns_codec_impl.h"
 #include "common/common/assert.h"
 
@@ -11,34 +11,6 @@ namespace Extensions {
 namespace ListenerFilters {
 namespace Dns {
 
-void encodeDomainString(Buffer::Instance& dns_response, const std::string& name) {
-  std::stringstream stream(name);
-  // represents the part of the domain within the '.' character
-  std::string name_component;
-
-  unsigned char size = 0;
-  while (std::getline(stream, name_component, '.')) {
-    size = static_cast<unsigned char>(name_component.length());
-    dns_response.add(&size, sizeof(size));
-    dns_response.add(name_component);
-  }
-
-  size = 0;
-  dns_response.add(&size, sizeof(size));
-}
-
-// This is in network byte order
-void add2DnsBytes(Buffer::Instance& dns_response, uint16_t value) {
-  uint16_t dns_value = htons(value);
-  dns_response.add(&dns_value, 2);
-}
-
-// This is in network byte order
-void add4DnsBytes(Buffer::Instance& dns_response, uint32_t value) {
-  uint32_t dns_value = htonl(value);
-  dns_response.add(&dns_value, 4);
-}
-
 // Begin HeaderSectionImpl
 DecoderImpl::HeaderSectionImpl::HeaderSectionImpl() : header_() {
   std::fill(std::begin(header_), std::end(header_), 0);
@@ -50,6 +22,8 @@ DecoderImpl::HeaderSectionImpl::HeaderSectionImpl(const HeaderSectionImpl& reque
   }
 }
 
+uint16_t DecoderImpl::HeaderSectionImpl::id() const { return DNS_HEADER_QID(&header_[0]); }
+
 Formats::MessageType DecoderImpl::HeaderSectionImpl::qrCode() const {
   return DNS_HEADER_QR(&header_[0]) == 0 ? Formats::MessageType::Query
                                          : Formats::MessageType::Response;
@@ -78,6 +52,11 @@ uint16_t DecoderImpl::HeaderSectionImpl::arCount() const { return DNS_HEADER_ARC
 
 void DecoderImpl::HeaderSectionImpl::setResponseBit() { DNS_HEADER_SET_QR(&header_[0], 1); }
 
+void DecoderImpl::HeaderSectionImpl::resetFlags() {
+  header_[2] &= Formats::HeaderOpcodeMask | Formats::HeaderRdMask;
+  header_[3] &= Formats::HeaderCdMask;
+}
+
 void DecoderImpl::HeaderSectionImpl::resetAnswerCounts() {
   DNS_HEADER_SET_ANCOUNT(&header_[0], 0);
   DNS_HEADER_SET_NSCOUNT(&header_[0], 0);
@@ -86,6 +65,11 @@ void DecoderImpl::HeaderSectionImpl::resetAnswerCounts() {
 
 void DecoderImpl::HeaderSectionImpl::aa(bool value) { DNS_HEADER_SET_AA(&header_[0], value); }
 
+void DecoderImpl::HeaderSectionImpl::tc(bool value) {
+  header_[2] &= ~Formats::HeaderTcMask;
+  DNS_HEADER_SET_TC(&header_[0], value);
+}
+
 void DecoderImpl::HeaderSectionImpl::ra(bool value) { DNS_HEADER_SET_RA(&header_[0], value); }
 
 void DecoderImpl::HeaderSectionImpl::setAnCount(uint16_t count) {
@@ -96,25 +80,29 @@ void DecoderImpl::HeaderSectionImpl::setArCount(uint16_t count) {
   DNS_HEADER_SET_ARCOUNT(&header_[0], count);
 }
 
-size_t DecoderImpl::HeaderSectionImpl::decode(Buffer::RawSlice& request, size_t offset) {
+Formats::DecodeStatus DecoderImpl::HeaderSectionImpl::decode(const Buffer::RawSlice& request,
+                                                             size_t& offset) {
   ASSERT(offset == 0,
          fmt::format("Offset is {}. Expected to be 0 while decoding DNS header", offset));
 
   // The header is expected to be 12 bytes. If there is less than 12 bytes of data in the buffer,
   // this is not a valid DNS message
   if (request.len_ < HFIXEDSZ) {
-    throw EnvoyException(fmt::format(
-        "Invalid DNS Header length. Message size is {} bytes. DNS header size is {} bytes.",
-        request.len_, HFIXEDSZ));
+    return Formats::DecodeStatus::ShortHeader;
   }
 
   std::memcpy(reinterpret_cast<void*>(header_), request.mem_, HFIXEDSZ);
+  offset += HFIXEDSZ;
+
+  return Formats::DecodeStatus::Ok;
+}
 
-  return HFIXEDSZ;
+void DecoderImpl::HeaderSectionImpl::encode(ResponseWriter& writer) const {
+  writer.writeBytes(&header_[0], HFIXEDSZ);
 }
 
-void DecoderImpl::HeaderSectionImpl::encode(Buffer::Instance& response) const {
-  response.add(&header_[0], HFIXEDSZ);
+void DecoderImpl::HeaderSectionImpl::patch(ResponseWriter& writer) const {
+  writer.patchBytes(0, &header_[0], HFIXEDSZ);
 }
 
 // End HeaderSectionImpl
@@ -133,44 +121,134 @@ uint16_t DecoderImpl::QuestionRecordImpl::qClass() const { return q_class_; }
 
 const std::string& DecoderImpl::QuestionRecordImpl::qName() const { return q_name_; }
 
-size_t DecoderImpl::QuestionRecordImpl::decode(Buffer::RawSlice& request, size_t offset) {
-  q_name_.clear();
-
-  unsigned char* request_buffer = static_cast<unsigned char*>(request.mem_);
-  unsigned char* question = request_buffer + offset;
-
-  long name_len;
-  char* name;
-  int ret = ares_expand_name(question, request_buffer, request.len_, &name, &name_len);
+Formats::DecodeStatus DecoderImpl::QuestionRecordImpl::decode(const Buffer::RawSlice& request,
+                                                              size_t& offset) {
+  const unsigned char* request_buffer = static_cast<const unsigned char*>(request.mem_);
+  const unsigned char* question = request_buffer + offset;
 
-  if (ret != ARES_SUCCESS) {
-    throw EnvoyException(
-        fmt::format("Invalid DNS Question name. ares_expand_name failed with {}", ret));
+  size_t name_len = 0;
+  const Formats::DecodeStatus status =
+      decodeName(request_buffer, request.len_, offset, q_name_, name_len);
+  if (status != Formats::DecodeStatus::Ok) {
+    return status;
   }
 
-  // copy the string and free the memory for name
-  q_name_ = std::string(name);
-  ares_free_string(name);
-
   // Followed by the qname, are the qtype - 2 bytes and qClass - 2 more bytes.
   if ((request.len_ - offset - name_len) < QFIXEDSZ) {
-    throw EnvoyException(
-        fmt::format("Invalid DNS Question. Name Length is {} and Request Length is {}. Request len "
-                    "must be at least 4 bytes more than name_len",
-                    name_len, request.len_));
+    return Formats::DecodeStatus::TruncatedRecord;
   }
 
   q_type_ = DNS_QUESTION_TYPE(question + name_len);
   q_class_ = DNS_QUESTION_CLASS(question + name_len);
+  offset += name_len + QFIXEDSZ;
+
+  return Formats::DecodeStatus::Ok;
+}
+
+Formats::DecodeStatus DecoderImpl::QuestionRecordImpl::decodeName(const unsigned char* request,
+                                                                  size_t request_len,
+                                                                  size_t offset, std::string& name,
+                                                                  size_t& name_len) {
+  // Same result as ares_expand_name, but written into the storage of name instead of a freshly
+  // allocated C string.
+  name.clear();
+
+  size_t position = offset;
+  // Number of bytes the name occupies at offset. Only known once the end of the name or the first
+  // compression pointer is reached.
+  name_len = 0;
+  bool compressed = false;
+  // Length of the name in wire format, which must not exceed MAXCDNAME
+  size_t expanded_len = 0;
+
+  while (true) {
+    if (position >= request_len) {
+      return Formats::DecodeStatus::InvalidName;
+    }
+
+    const unsigned char label_len = request[position];
+
+    if ((label_len & INDIR_MASK) == INDIR_MASK) {
+      if (position + 1 >= request_len) {
+        return Formats::DecodeStatus::InvalidPointer;
+      }
+
+      const size_t target = ((label_len & ~INDIR_MASK) << 8) | request[position + 1];
+
+      // Pointers may only refer to an earlier part of the message. Combined with the limit on the
+      // expanded length, this rules out pointer loops.
+      if (target >= position) {
+        return Formats::DecodeStatus::InvalidPointer;
+      }
+
+      if (!compressed) {
+        name_len = position + 2 - offset;
+        compressed = true;
+      }
+
+      position = target;
+      continue;
+    }
+
+    // Extended label types are obsolete, RFC 6891 section 5
+    if ((label_len & INDIR_MASK) != 0) {
+      return Formats::DecodeStatus::InvalidName;
+    }
+
+    if (label_len == 0) {
+      if (!compressed) {
+        name_len = position + 1 - offset;
+      }
+
+      break;
+    }
+
+    expanded_len += label_len + 1;
+    if (expanded_len + 1 > MAXCDNAME || position + 1 + label_len > request_len) {
+      return Formats::DecodeStatus::InvalidName;
+    }
+
+    if (!name.empty()) {
+      name.push_back('.');
+    }
+
+    appendLabel(request + position + 1, label_len, name);
+    position += label_len + 1;
+  }
 
-  return name_len + QFIXEDSZ;
+  return Formats::DecodeStatus::Ok;
+}
+
+void DecoderImpl::QuestionRecordImpl::appendLabel(const unsigned char* label, size_t label_len,
+                                                  std::string& name) {
+  for (size_t i = 0; i < label_len; i++) {
+    const unsigned char c = label[i];
+
+    // Escape the characters that cannot be told apart from the dotted form, as c-ares does
+    if (c == '.' || c == '\\') {
+      name.push_back('\\');
+      name.push_back(c);
+    } else if (c < 0x20 || c >= 0x7f) {
+      name.push_back('\\');
+      name.push_back('0' + c / 100);
+      name.push_back('0' + (c / 10) % 10);
+      name.push_back('0' + c % 10);
+    } else {
+      name.push_back(c);
+    }
+  }
 }
 
-void DecoderImpl::QuestionRecordImpl::encode(Buffer::Instance& dns_response) const {
-  encodeDomainString(dns_response, q_name_);
+void DecoderImpl::QuestionRecordImpl::encode(ResponseWriter& writer) const {
+  writer.writeName(q_name_);
 
-  add2DnsBytes(dns_response, q_type_);
-  add2DnsBytes(dns_response, q_class_);
+  writer.write16(q_type_);
+  writer.write16(q_class_);
+}
+
+size_t DecoderImpl::QuestionRecordImpl::maxEncodedSize() const {
+  // The dotted name is one byte shorter than its labels, plus the root label
+  return q_name_.size() + 2 + QFIXEDSZ;
 }
 // End QuestionRecordImpl
 
@@ -185,200 +263,385 @@ uint16_t DecoderImpl::ResourceRecordImpl::type() const { return type_; }
 
 uint32_t DecoderImpl::ResourceRecordImpl::ttl() const { return ttl_; }
 
-void DecoderImpl::ResourceRecordImpl::encode(Buffer::Instance& dns_response) const {
+void DecoderImpl::ResourceRecordImpl::encode(ResponseWriter& writer) const {
   // Encode the name, type and class
-  encodeDomainString(dns_response, name_);
-  add2DnsBytes(dns_response, type_);
-  add2DnsBytes(dns_response, 1); // class is always 1
+  writer.writeName(name_);
+  writer.write16(type_);
+  writer.write16(C_IN);
 
   // Encode the TTL next
-  add4DnsBytes(dns_response, ttl_);
+  writer.write32(ttl_);
+
+  // The RDATA is kept in wire format by the sub classes
+  writer.write16(rdLength());
+  writer.writeBytes(rData(), rdLength());
+}
 
-  // Rest of the fields are encoded in sub classes
+size_t DecoderImpl::ResourceRecordImpl::maxEncodedSize() const {
+  return name_.size() + 2 + RRFIXEDSZ + rdLength();
 }
 
 DecoderImpl::ResourceRecordAImpl::ResourceRecordAImpl(const std::string& name, uint32_t ttl,
-                                                      const Network::Address::Ipv4* address)
-    : ResourceRecordImpl(name, T_A, ttl), address_(address->address()) {}
+                                                      uint32_t address)
+    : ResourceRecordImpl(name, T_A, ttl), address_(address) {}
 
 uint16_t DecoderImpl::ResourceRecordAImpl::rdLength() const {
+  static_assert(sizeof(address_) == 4, "Size of A Record address must be 4 bytes");
   return static_cast<uint16_t>(sizeof(address_));
 }
 
 const unsigned char* DecoderImpl::ResourceRecordAImpl::rData() const {
-  return reinterpret_cast<const unsigned char*>(&address_);
-}
-
-void DecoderImpl::ResourceRecordAImpl::encode(Buffer::Instance& dns_response) const {
-  ResourceRecordImpl::encode(dns_response);
-
-  ASSERT(sizeof(address_) == 4, "Size of A Record address must be 4 bytes");
-
-  // Write the length first - it is only 2 bytes
-  add2DnsBytes(dns_response, 4);
-
   // The address_ is already in network byte order
-  dns_response.add(&address_, 4);
+  return reinterpret_cast<const unsigned char*>(&address_);
 }
 
 DecoderImpl::ResourceRecordAAAAImpl::ResourceRecordAAAAImpl(const std::string& name, uint32_t ttl,
-                                                            const Network::Address::Ipv6* address)
-    : ResourceRecordImpl(name, T_AAAA, ttl), address_(address->address()) {}
+                                                            absl::uint128 address)
+    : ResourceRecordImpl(name, T_AAAA, ttl), address_(address) {}
 
 uint16_t DecoderImpl::ResourceRecordAAAAImpl::rdLength() const {
+  static_assert(sizeof(address_) == 16, "Size of AAAA Record address must be 16 bytes");
   return static_cast<uint16_t>(sizeof(address_));
 }
 
 const unsigned char* DecoderImpl::ResourceRecordAAAAImpl::rData() const {
-  return reinterpret_cast<const unsigned char*>(&address_);
-}
-
-void DecoderImpl::ResourceRecordAAAAImpl::encode(Buffer::Instance& dns_response) const {
-  ResourceRecordImpl::encode(dns_response);
-
-  ASSERT(sizeof(address_) == 16, "Size of AAAA Record address must be 16 bytes");
-
-  // Write the length first - it is only 2 bytes
-  add2DnsBytes(dns_response, 16);
-
   // The address_ is already in network byte order
-  dns_response.add(&address_, 16);
+  return reinterpret_cast<const unsigned char*>(&address_);
 }
 
 DecoderImpl::ResourceRecordSRVImpl::ResourceRecordSRVImpl(const std::string& name, uint32_t ttl,
-                                                          uint16_t port, const std::string& host)
-    : ResourceRecordImpl(name, T_SRV, ttl), port_(port), host_(host), rdLength_(0),
-      encoded_r_data_() {
+                                                          uint16_t priority, uint16_t weight,
+                                                          uint16_t port, const std::string& target)
+    : ResourceRecordImpl(name, T_SRV, ttl), priority_(priority), weight_(weight), port_(port),
+      target_(target), encoded_r_data_() {
   encodeRData();
 }
 
-uint16_t DecoderImpl::ResourceRecordSRVImpl::rdLength() const { return rdLength_; }
-
-const unsigned char* DecoderImpl::ResourceRecordSRVImpl::rData() const {
-  return reinterpret_cast<const unsigned char*>(linearized_pointer_to_encoded_r_data_);
+uint16_t DecoderImpl::ResourceRecordSRVImpl::rdLength() const {
+  return static_cast<uint16_t>(encoded_r_data_.size());
 }
 
-void DecoderImpl::ResourceRecordSRVImpl::encode(Buffer::Instance& dns_response) const {
-  ResourceRecordImpl::encode(dns_response);
-
-  // Write the length first - it is only 2 bytes
-  add2DnsBytes(dns_response, rdLength_);
-
-  dns_response.add(encoded_r_data_);
+const unsigned char* DecoderImpl::ResourceRecordSRVImpl::rData() const {
+  return reinterpret_cast<const unsigned char*>(encoded_r_data_.data());
 }
 
 void DecoderImpl::ResourceRecordSRVImpl::encodeRData() {
-  ASSERT(encoded_r_data_.length() == 0, "ResourceRecordSRVImpl already encoded r data.");
+  ASSERT(encoded_r_data_.empty(), "ResourceRecordSRVImpl already encoded r data.");
 
-  Buffer::OwnedImpl host_buffer;
-  encodeDomainString(host_buffer, host_);
-  rdLength_ = 6 + host_buffer.length();
+  ResponseWriter writer(6 + target_.size() + 2);
 
-  // Priority and Weight is set to 0
-  add2DnsBytes(encoded_r_data_, 0);
-  add2DnsBytes(encoded_r_data_, 0);
-  add2DnsBytes(encoded_r_data_, port_);
-  encoded_r_data_.add(host_buffer);
+  writer.write16(priority_);
+  writer.write16(weight_);
+  writer.write16(port_);
 
-  linearized_pointer_to_encoded_r_data_ = encoded_r_data_.linearize(rdLength_);
+  // RFC 2782 does not allow the target to be compressed
+  writer.writeName(target_, false);
+
+  encoded_r_data_ = std::string(writer.data());
 }
 // End ResourceRecordImpl
 
 // Begin MessageImpl
-DecoderImpl::MessageImpl::MessageImpl(const Network::Address::InstanceConstSharedPtr& from)
-    : from_(from), header_(), question_(), answers_() {}
+DecoderImpl::MessageImpl::MessageImpl(const Network::Address::InstanceConstSharedPtr& from,
+                                      Formats::Transport transport)
+    : from_(from), transport_(transport), header_(), questions_(), question_count_(0), edns_(),
+      raw_(), extended_rcode_(0), answers_() {}
 
 DecoderImpl::MessageImpl::MessageImpl(const MessageImpl& request_message)
-    : from_(request_message.from()), header_(request_message.header_),
-      question_(request_message.question_), answers_() {}
+    : from_(request_message.from()), transport_(request_message.transport_),
+      header_(request_message.header_),
+      questions_(request_message.questions_.begin(),
+                 request_message.questions_.begin() + request_message.question_count_),
+      question_count_(request_message.question_count_), edns_(request_message.edns_), raw_(),
+      extended_rcode_(0), answers_() {}
+
+void DecoderImpl::MessageImpl::reset(const Network::Address::InstanceConstSharedPtr& from) {
+  from_ = from;
+  question_count_ = 0;
+  edns_.reset();
+  raw_ = absl::string_view();
+  answers_.clear();
+  additional_.clear();
+}
 
 const Network::Address::InstanceConstSharedPtr& DecoderImpl::MessageImpl::from() const {
   return from_;
 }
 
+Formats::Transport DecoderImpl::MessageImpl::transport() const { return transport_; }
+
 const Formats::Header& DecoderImpl::MessageImpl::header() const { return header_; }
 
 const Formats::QuestionRecord& DecoderImpl::MessageImpl::questionRecord() const {
-  return question_;
+  return questionRecord(0);
+}
+
+const Formats::QuestionRecord& DecoderImpl::MessageImpl::questionRecord(uint16_t index) const {
+  ASSERT(index < question_count_,
+         fmt::format("Question {} requested of a message with {}", index, question_count_));
+  return questions_[index];
 }
 
-size_t DecoderImpl::MessageImpl::decode(Buffer::RawSlice& dns_request, size_t offset) {
+const absl::optional<Formats::Message::EdnsOptions>& DecoderImpl::MessageImpl::edns() const {
+  return edns_;
+}
+
+uint16_t DecoderImpl::MessageImpl::maxResponseSize() const {
+  if (transport_ == Formats::Transport::Tcp) {
+    return Formats::MaxTcpMessageSize;
+  }
+
+  if (!edns_.has_value()) {
+    return Formats::MaxUdpPayloadSizeWithoutEdns;
+  }
+
+  // Payload sizes below 512 bytes are treated as 512 bytes, RFC 6891 section 6.2.3
+  const uint16_t udp_payload_size =
+      std::max(edns_->udp_payload_size, Formats::MaxUdpPayloadSizeWithoutEdns);
+  return std::min(udp_payload_size, Formats::MaxUdpPayloadSize);
+}
+
+absl::string_view DecoderImpl::MessageImpl::raw() const { return raw_; }
+
+Formats::DecodeStatus DecoderImpl::MessageImpl::decode(const Buffer::RawSlice& dns_request,
+                                                       size_t& offset) {
+  const Formats::DecodeStatus status = decodeQuestions(dns_request, offset);
+  if (status != Formats::DecodeStatus::Ok) {
+    return status;
+  }
+
+  return decodeRecords(dns_request, offset);
+}
+
+Formats::DecodeStatus
+DecoderImpl::MessageImpl::decodeQuestions(const Buffer::RawSlice& dns_request, size_t& offset) {
   ASSERT(offset == 0, "DNS Message decode: Offset must be 0");
 
-  size_t size = 0;
+  raw_ = absl::string_view(static_cast<const char*>(dns_request.mem_), dns_request.len_);
+
+  Formats::DecodeStatus status = header_.decode(dns_request, offset);
+  if (status != Formats::DecodeStatus::Ok) {
+    return status;
+  }
+
+  // The question count was checked against the message length before any storage is set aside
+  // for the questions
+  const uint16_t question_count = header_.qdCount();
+  if (questions_.size() < question_count) {
+    questions_.resize(question_count);
+  }
+
+  for (uint16_t i = 0; i < question_count; i++) {
+    status = questions_[i].decode(dns_request, offset);
+    if (status != Formats::DecodeStatus::Ok) {
+      return status;
+    }
+  }
 
-  size += header_.decode(dns_request, size);
-  size += question_.decode(dns_request, size);
+  question_count_ = question_count;
 
-  return size;
+  return Formats::DecodeStatus::Ok;
 }
 
-void DecoderImpl::MessageImpl::encode(Buffer::Instance& dns_response) const {
-  header_.encode(dns_response);
-  question_.encode(dns_response);
+Formats::DecodeStatus DecoderImpl::MessageImpl::decodeRecords(const Buffer::RawSlice& dns_request,
+                                                              size_t& offset) {
+  const unsigned char* request = static_cast<const unsigned char*>(dns_request.mem_);
+  const size_t request_len = dns_request.len_;
+
+  const uint32_t additional_start = header_.anCount() + header_.nsCount();
+  const uint32_t record_count = additional_start + header_.arCount();
+
+  for (uint32_t i = 0; i < record_count; i++) {
+    size_t name_len = 0;
+    const Formats::DecodeStatus status = skipName(request, request_len, offset, name_len);
+    if (status != Formats::DecodeStatus::Ok) {
+      return status;
+    }
 
-  if (!answers_.empty()) {
-    ASSERT(answers_.size() == header_.anCount(),
-           fmt::format("Answer count {} must match header anCount {}", answers_.size(),
-                       header_.anCount()));
+    if (request_len - offset - name_len < RRFIXEDSZ) {
+      return Formats::DecodeStatus::TruncatedRecord;
+    }
 
-    for (auto const& answer : answers_) {
-      answer->encode(dns_response);
+    const unsigned char* record = request + offset + name_len;
+    const uint16_t rd_length = DNS_RR_LEN(record);
+    if (request_len - offset - name_len - RRFIXEDSZ < rd_length) {
+      return Formats::DecodeStatus::TruncatedRecord;
     }
+
+    if (i >= additional_start && DNS_RR_TYPE(record) == T_OPT) {
+      if (edns_.has_value() || name_len != 1) {
+        return Formats::DecodeStatus::InvalidOpt;
+      }
+
+      // The class holds the UDP payload size, and the TTL the extended response code, the version
+      // and the flags
+      edns_ = Formats::Message::EdnsOptions{
+          DNS_RR_CLASS(record), static_cast<uint8_t>((DNS_RR_TTL(record) >> 16) & 0xFF)};
+    }
+
+    offset += name_len + RRFIXEDSZ + rd_length;
+  }
+
+  return Formats::DecodeStatus::Ok;
+}
+
+Formats::DecodeStatus DecoderImpl::MessageImpl::skipName(const unsigned char* request,
+                                                         size_t request_len, size_t offset,
+                                                         size_t& name_len) {
+  size_t position = offset;
+
+  while (position < request_len) {
+    const unsigned char label_len = request[position];
+
+    if (label_len == 0) {
+      name_len = position + 1 - offset;
+      return Formats::DecodeStatus::Ok;
+    }
+
+    // A compression pointer ends the name
+    if ((label_len & INDIR_MASK) == INDIR_MASK) {
+      if (position + 1 >= request_len) {
+        return Formats::DecodeStatus::InvalidPointer;
+      }
+
+      name_len = position + 2 - offset;
+      return Formats::DecodeStatus::Ok;
+    }
+
+    if ((label_len & INDIR_MASK) != 0) {
+      return Formats::DecodeStatus::InvalidName;
+    }
+
+    position += label_len + 1;
+  }
+
+  return Formats::DecodeStatus::InvalidName;
+}
+
+void DecoderImpl::MessageImpl::encode(Buffer::Instance& dns_response) const {
+  // The whole message is written into one contiguous buffer sized for the uncompressed message,
+  // and added to the response with a single copy.
+  size_t max_size = HFIXEDSZ + OptRecordSize;
+  for (uint16_t i = 0; i < question_count_; i++) {
+    max_size += questions_[i].maxEncodedSize();
+  }
+  for (auto const& answer : answers_) {
+    max_size += answer->maxEncodedSize();
+  }
+  for (auto const& additional : additional_) {
+    max_size += additional->maxEncodedSize();
+  }
+
+  ResponseWriter writer(max_size);
+
+  // The record counts and the TC bit are patched in once it is known which records fit
+  HeaderSectionImpl header(header_);
+  header.encode(writer);
+  for (uint16_t i = 0; i < question_count_; i++) {
+    questions_[i].encode(writer);
+  }
+
+  ASSERT(answers_.size() == header_.anCount(),
+         fmt::format("Answer count {} must match header anCount {}", answers_.size(),
+                     header_.anCount()));
+  ASSERT(additional_.size() == header_.arCount(),
+         fmt::format("Additional count {} must match header arCount {}", additional_.size(),
+                     header_.arCount()));
+
+  // The OPT record is always sent to a client that sent one, so room is left for it
+  const size_t max_records_size = maxResponseSize() - (edns_.has_value() ? OptRecordSize : 0);
+
+  const uint16_t an_count = encodeRecords(writer, answers_, max_records_size);
+  const bool truncated = an_count < answers_.size();
+
+  // Additional records are optional. Leaving some of them out does not truncate the response,
+  // RFC 2181 section 9.
+  uint16_t ar_count = truncated ? 0 : encodeRecords(writer, additional_, max_records_size);
+
+  if (edns_.has_value()) {
+    encodeOptRecord(writer);
+    ar_count++;
   }
 
-  if (!additional_.empty()) {
-    ASSERT(additional_.size() == header_.arCount(),
-           fmt::format("Additional count {} must match header arCount {}", additional_.size(),
-                       header_.arCount()));
+  if (truncated) {
+    ENVOY_LOG(debug, "DNS response truncated to {} of {} answers to fit into {} bytes", an_count,
+              answers_.size(), maxResponseSize());
+  }
+
+  header.setAnCount(an_count);
+  header.setArCount(ar_count);
+  header.tc(truncated);
+  header.patch(writer);
+
+  writer.addTo(dns_response);
+}
+
+uint16_t
+DecoderImpl::MessageImpl::encodeRecords(ResponseWriter& writer,
+                                        const std::vector<ResourceRecordImplPtr>& records,
+                                        size_t max_size) {
+  uint16_t count = 0;
+  for (auto const& record : records) {
+    const size_t record_start = writer.size();
+    record->encode(writer);
 
-    for (auto const& additional : additional_) {
-      additional->encode(dns_response);
+    if (writer.size() > max_size) {
+      writer.truncate(record_start);
+      break;
     }
+
+    count++;
   }
+
+  return count;
 }
 
-void DecoderImpl::MessageImpl::addARecord(Formats::ResourceRecordSection section, uint32_t ttl,
-                                          const Network::Address::Ipv4* address) {
-  ASSERT(address != nullptr, "addARecord address is null");
+void DecoderImpl::MessageImpl::encodeOptRecord(ResponseWriter& writer) const {
+  // Owned by the root name. The class carries the payload size the server accepts, and the TTL
+  // the extended response code, version 0 and no flags. No options are sent.
+  writer.writeName("");
+  writer.write16(T_OPT);
+  writer.write16(Formats::MaxUdpPayloadSize);
+  writer.write32(static_cast<uint32_t>(extended_rcode_) << 24);
+  writer.write16(0);
+}
 
+void DecoderImpl::MessageImpl::addARecord(Formats::ResourceRecordSection section,
+                                          const std::string& name, uint32_t ttl, uint32_t address) {
   switch (section) {
   case Formats::ResourceRecordSection::Answer:
-    answers_.emplace_back(std::make_unique<ResourceRecordAImpl>(question_.qName(), ttl, address));
+    answers_.emplace_back(std::make_unique<ResourceRecordAImpl>(name, ttl, address));
     break;
   case Formats::ResourceRecordSection::Additional:
-    additional_.emplace_back(
-        std::make_unique<ResourceRecordAImpl>(question_.qName(), ttl, address));
+    additional_.emplace_back(std::make_unique<ResourceRecordAImpl>(name, ttl, address));
     break;
   }
 
   UpdateAnswerCountInHeader(section);
 }
 
-void DecoderImpl::MessageImpl::addAAAARecord(Formats::ResourceRecordSection section, uint32_t ttl,
-                                             const Network::Address::Ipv6* address) {
-  ASSERT(address != nullptr, "addAAAARecord address is null");
-
+void DecoderImpl::MessageImpl::addAAAARecord(Formats::ResourceRecordSection section,
+                                             const std::string& name, uint32_t ttl,
+                                             absl::uint128 address) {
   switch (section) {
   case Formats::ResourceRecordSection::Answer:
-    answers_.emplace_back(
-        std::make_unique<ResourceRecordAAAAImpl>(question_.qName(), ttl, address));
+    answers_.emplace_back(std::make_unique<ResourceRecordAAAAImpl>(name, ttl, address));
     break;
   case Formats::ResourceRecordSection::Additional:
-    additional_.emplace_back(
-        std::make_unique<ResourceRecordAAAAImpl>(question_.qName(), ttl, address));
+    additional_.emplace_back(std::make_unique<ResourceRecordAAAAImpl>(name, ttl, address));
     break;
   }
 
   UpdateAnswerCountInHeader(section);
 }
 
-void DecoderImpl::MessageImpl::addSRVRecord(uint32_t ttl, uint16_t port,
+void DecoderImpl::MessageImpl::addSRVRecord(const std::string& name, uint32_t ttl,
+                                            uint16_t priority, uint16_t weight, uint16_t port,
                                             const std::string& target) {
-  ENVOY_LOG(debug, "DNS Server: Adding SRV record qName {} port {}", question_.qName(), port);
+  ENVOY_LOG(debug, "DNS Server: Adding SRV record name {} target {} port {}", name, target, port);
 
   answers_.emplace_back(
-      std::make_unique<ResourceRecordSRVImpl>(question_.qName(), ttl, port, target));
+      std::make_unique<ResourceRecordSRVImpl>(name, ttl, priority, weight, port, target));
 
   UpdateAnswerCountInHeader(Formats::ResourceRecordSection::Answer);
 }
@@ -387,17 +650,26 @@ Formats::ResponseMessageSharedPtr DecoderImpl::MessageImpl::createResponseMessag
     const Formats::Message::ResponseOptions& response_options) const {
   MessageImpl* response = new MessageImpl(*this);
 
+  // A request may carry any response code and flags, which must not end up in the response, or in
+  // the answer cache along with it
+  response->header_.resetFlags();
+
   // We support recursive queries for unknown domains
   response->header_.ra(true);
   response->header_.setResponseBit();
   response->header_.resetAnswerCounts();
   response->header_.rCode(response_options.response_code);
+  response->extended_rcode_ = static_cast<uint8_t>(response_options.response_code >> 4);
   response->header_.aa(response_options.authoritative_bit);
 
   Formats::ResponseMessageSharedPtr response_sharedptr(response);
   return response_sharedptr;
 }
 
+Formats::RequestMessageConstSharedPtr DecoderImpl::MessageImpl::clone() const {
+  return std::make_shared<const MessageImpl>(*this);
+}
+
 void DecoderImpl::MessageImpl::UpdateAnswerCountInHeader(Formats::ResourceRecordSection section) {
   switch (section) {
   case Formats::ResourceRecordSection::Answer:
@@ -411,21 +683,71 @@ void DecoderImpl::MessageImpl::UpdateAnswerCountInHeader(Formats::ResourceRecord
 // End MessageImpl
 
 // Begin DecoderImpl
-Formats::RequestMessageConstSharedPtr
-DecoderImpl::decode(Buffer::Instance& data, const Network::Address::InstanceConstSharedPtr& from) {
+DecoderImpl::DecoderImpl(Formats::Transport transport)
+    : request_(nullptr, transport), request_slice_(), records_offset_(0) {}
+
+Formats::DecodeStatus DecoderImpl::decode(Buffer::Instance& data,
+                                          const Network::Address::InstanceConstSharedPtr& from) {
+  const Formats::DecodeStatus status = decodeQuestions(data, from);
+  if (status != Formats::DecodeStatus::Ok) {
+    return status;
+  }
+
+  return decodeRecords();
+}
+
+Formats::DecodeStatus
+DecoderImpl::decodeQuestions(Buffer::Instance& data,
+                             const Network::Address::InstanceConstSharedPtr& from) {
   ENVOY_LOG(trace, "decoding {} bytes", data.length());
 
-  // Linearize the entire request into a single buffer as the requests are generally under 512
-  // bytes.
+  // A datagram is received into a single slice, which is decoded in place. Only linearize the
+  // request if it is spread over more than one slice.
   Buffer::RawSlice raw_slice = {0};
-  raw_slice.len_ = data.length();
-  raw_slice.mem_ = data.linearize(static_cast<uint32_t>(data.length()));
+  if (data.getRawSlices(&raw_slice, 1) != 1) {
+    raw_slice.len_ = data.length();
+    raw_slice.mem_ = data.linearize(static_cast<uint32_t>(data.length()));
+  }
 
-  MessageImpl* message = new MessageImpl(from);
-  message->decode(raw_slice, 0);
-  Formats::RequestMessageConstSharedPtr message_sharedptr(message);
+  const Formats::DecodeStatus status =
+      checkHeader(static_cast<const unsigned char*>(raw_slice.mem_), raw_slice.len_);
+  if (status != Formats::DecodeStatus::Ok) {
+    return status;
+  }
+
+  request_.reset(from);
+  request_slice_ = raw_slice;
+  records_offset_ = 0;
+  return request_.decodeQuestions(request_slice_, records_offset_);
+}
+
+Formats::DecodeStatus DecoderImpl::decodeRecords() {
+  return request_.decodeRecords(request_slice_, records_offset_);
+}
+
+const Formats::Message& DecoderImpl::message() const { return request_; }
+
+Formats::DecodeStatus DecoderImpl::checkHeader(const unsigned char* request, size_t request_len) {
+  if (request_len < HFIXEDSZ) {
+    return Formats::DecodeStatus::ShortHeader;
+  }
+
+  // Responses are never answered, or two servers would keep answering each other
+  if (DNS_HEADER_QR(request) != 0) {
+    return Formats::DecodeStatus::NotQuery;
+  }
+
+  // Every question takes at least the root label and the type and class, and every record the
+  // root label and the fixed fields of a resource record
+  const size_t question_count = DNS_HEADER_QDCOUNT(request);
+  const size_t record_count =
+      DNS_HEADER_ANCOUNT(request) + DNS_HEADER_NSCOUNT(request) + DNS_HEADER_ARCOUNT(request);
+  if (question_count == 0 ||
+      question_count * (1 + QFIXEDSZ) + record_count * (1 + RRFIXEDSZ) > request_len - HFIXEDSZ) {
+    return Formats::DecodeStatus::InvalidCounts;
+  }
 
-  return message_sharedptr;
+  return Formats::DecodeStatus::Ok;
 }
 // End DecoderImpl
 
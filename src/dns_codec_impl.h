@@ -1,6 +1,7 @@
 #pragma once
 
 #include "src/dns_codec.h"
+#include "src/dns_response_writer.h"
 #include "common/common/logger.h"
 #include "common/buffer/buffer_impl.h"
 
@@ -20,28 +21,36 @@ public:
   /**
    * Decode the contents from a dns_request.
    * @param dns_request is the slice to the original DNS request.
-   * @param offset is the offset to the content within the request.
+   * @param offset is the offset to the content within the request. It is advanced past the
+   * decoded content.
    *
-   * @return the size of the section decoded in bytes.
-   * API Throws an EnvoyException if the buffer is smaller than the expected size or contents are
-   * unexpected.
+   * @return Formats::DecodeStatus::Ok, or the first malformation found in the content, in which
+   * case offset is left anywhere within the content.
    */
-  virtual size_t decode(Buffer::RawSlice& dns_request, size_t offset) PURE;
+  virtual Formats::DecodeStatus decode(const Buffer::RawSlice& dns_request, size_t& offset) PURE;
 };
 
 class DecoderImpl : public Decoder, Logger::Loggable<Logger::Id::filter> {
 public:
+  DecoderImpl(Formats::Transport transport = Formats::Transport::Udp);
+
   // Dns::Decoder methods
-  Formats::RequestMessageConstSharedPtr
-  decode(Buffer::Instance& data, const Network::Address::InstanceConstSharedPtr& from) override;
+  Formats::DecodeStatus decode(Buffer::Instance& data,
+                               const Network::Address::InstanceConstSharedPtr& from) override;
+  Formats::DecodeStatus
+  decodeQuestions(Buffer::Instance& data,
+                  const Network::Address::InstanceConstSharedPtr& from) override;
+  Formats::DecodeStatus decodeRecords() override;
+  const Formats::Message& message() const override;
 
 private:
-  class HeaderSectionImpl : public Formats::Header, public Formats::Encode, public Decode {
+  class HeaderSectionImpl : public Formats::Header, public Decode {
   public:
     HeaderSectionImpl();
     HeaderSectionImpl(const HeaderSectionImpl& request_header);
 
     // Formats::HeaderSection
+    uint16_t id() const override;
     Formats::MessageType qrCode() const override;
     uint16_t opCode() const override;
     uint16_t rCode() const override;
@@ -52,24 +61,35 @@ private:
     uint16_t arCount() const override;
 
     // Decode
-    size_t decode(Buffer::RawSlice& dns_request, size_t offset) override;
+    Formats::DecodeStatus decode(const Buffer::RawSlice& dns_request, size_t& offset) override;
 
-    // Formats::Encode
-    void encode(Buffer::Instance& dns_response) const override;
+    void encode(ResponseWriter& writer) const;
+
+    /**
+     * Overwrites the header written by encode, once the record counts are known.
+     */
+    void patch(ResponseWriter& writer) const;
 
     void setResponseBit();
+
+    /**
+     * Clears the flags and the response code copied from the request, apart from the opcode and
+     * the RD and CD bits the response echoes.
+     */
+    void resetFlags();
     void resetAnswerCounts();
     void setAnCount(uint16_t count);
     void setArCount(uint16_t count);
     void rCode(uint16_t response_code);
     void aa(bool value);
+    void tc(bool value);
     void ra(bool value);
 
   private:
     unsigned char header_[HFIXEDSZ];
   };
 
-  class QuestionRecordImpl : public Formats::QuestionRecord, public Formats::Encode, public Decode {
+  class QuestionRecordImpl : public Formats::QuestionRecord, public Decode {
   public:
     QuestionRecordImpl();
     QuestionRecordImpl(const QuestionRecordImpl& request_question);
@@ -80,26 +100,43 @@ private:
     uint16_t qClass() const override;
 
     // Decode
-    size_t decode(Buffer::RawSlice& dns_request, size_t offset) override;
+    Formats::DecodeStatus decode(const Buffer::RawSlice& dns_request, size_t& offset) override;
 
-    // Formats::Encode
-    void encode(Buffer::Instance& dns_response) const override;
+    void encode(ResponseWriter& writer) const;
+    size_t maxEncodedSize() const;
 
   private:
+    /**
+     * Expands the name at offset into name.
+     * @param name_len is set to the number of bytes the name occupies at offset.
+     */
+    static Formats::DecodeStatus decodeName(const unsigned char* request, size_t request_len,
+                                            size_t offset, std::string& name, size_t& name_len);
+    static void appendLabel(const unsigned char* label, size_t label_len, std::string& name);
+
+    // Reused across decodes so that its capacity is only allocated once per decoder
     std::string q_name_;
     uint16_t q_type_;
     uint16_t q_class_;
   };
 
-  class ResourceRecordImpl : public Formats::ResourceRecord, public Formats::Encode {
+  class ResourceRecordImpl : public Formats::ResourceRecord {
   public:
     // Formats::ResourceRecord
     const std::string& name() const override;
     uint16_t type() const override;
     uint32_t ttl() const override;
 
-    // Formats::Encode
-    virtual void encode(Buffer::Instance& dns_response) const override;
+    /**
+     * Writes the record. The name is compressed against the names written before it, and the
+     * RDATA is copied from rData().
+     */
+    void encode(ResponseWriter& writer) const;
+
+    /**
+     * @return the size of the record when its name is not compressed.
+     */
+    size_t maxEncodedSize() const;
 
   protected:
     ResourceRecordImpl(const std::string& name, uint16_t type, uint32_t ttl);
@@ -112,93 +149,147 @@ private:
 
   class ResourceRecordAImpl : public ResourceRecordImpl {
   public:
-    ResourceRecordAImpl(const std::string& name, uint32_t ttl,
-                        const Network::Address::Ipv4* address);
+    ResourceRecordAImpl(const std::string& name, uint32_t ttl, uint32_t address);
 
     // Formats::ResourceRecord
     uint16_t rdLength() const override;
     const unsigned char* rData() const override;
 
-    // ResourceRecordImpl
-    void encode(Buffer::Instance& dns_response) const override;
-
   private:
     uint32_t address_;
   };
 
   class ResourceRecordAAAAImpl : public ResourceRecordImpl {
   public:
-    ResourceRecordAAAAImpl(const std::string& name, uint32_t ttl,
-                           const Network::Address::Ipv6* address);
+    ResourceRecordAAAAImpl(const std::string& name, uint32_t ttl, absl::uint128 address);
 
     // Formats::ResourceRecord
     uint16_t rdLength() const override;
     const unsigned char* rData() const override;
 
-    // ResourceRecordImpl
-    void encode(Buffer::Instance& dns_response) const override;
-
   private:
     absl::uint128 address_;
   };
 
   class ResourceRecordSRVImpl : public ResourceRecordImpl {
   public:
-    ResourceRecordSRVImpl(const std::string& name, uint32_t ttl, uint16_t port,
-                          const std::string& host);
+    ResourceRecordSRVImpl(const std::string& name, uint32_t ttl, uint16_t priority,
+                          uint16_t weight, uint16_t port, const std::string& target);
 
     // Formats::ResourceRecord
     uint16_t rdLength() const override;
     const unsigned char* rData() const override;
 
-    // ResourceRecordImpl
-    void encode(Buffer::Instance& dns_response) const override;
-
   private:
     void encodeRData();
 
+    const uint16_t priority_;
+    const uint16_t weight_;
     const uint16_t port_;
-    const std::string host_;
+    const std::string target_;
 
-    uint16_t rdLength_;
-    Buffer::OwnedImpl encoded_r_data_;
-    const void* linearized_pointer_to_encoded_r_data_;
+    std::string encoded_r_data_;
   };
 
   typedef std::unique_ptr<ResourceRecordImpl> ResourceRecordImplPtr;
 
   class MessageImpl : public Formats::Message, public Decode {
   public:
-    MessageImpl(const Network::Address::InstanceConstSharedPtr& from);
+    MessageImpl(const Network::Address::InstanceConstSharedPtr& from,
+                Formats::Transport transport);
     MessageImpl(const MessageImpl& request_message);
 
     // Formats::Message
     const Network::Address::InstanceConstSharedPtr& from() const override;
+    Formats::Transport transport() const override;
     const Formats::Header& header() const override;
     const Formats::QuestionRecord& questionRecord() const override;
-    void addARecord(Formats::ResourceRecordSection section, uint32_t ttl,
-                    const Network::Address::Ipv4* address) override;
-    void addAAAARecord(Formats::ResourceRecordSection section, uint32_t ttl,
-                       const Network::Address::Ipv6* address) override;
-    void addSRVRecord(uint32_t ttl, uint16_t port, const std::string& host) override;
+    const Formats::QuestionRecord& questionRecord(uint16_t index) const override;
+    const absl::optional<Formats::Message::EdnsOptions>& edns() const override;
+    uint16_t maxResponseSize() const override;
+    absl::string_view raw() const override;
+    void addARecord(Formats::ResourceRecordSection section, const std::string& name, uint32_t ttl,
+                    uint32_t address) override;
+    void addAAAARecord(Formats::ResourceRecordSection section, const std::string& name,
+                       uint32_t ttl, absl::uint128 address) override;
+    void addSRVRecord(const std::string& name, uint32_t ttl, uint16_t priority, uint16_t weight,
+                      uint16_t port, const std::string& target) override;
     Formats::ResponseMessageSharedPtr
     createResponseMessage(const Formats::Message::ResponseOptions& response_options) const override;
+    Formats::RequestMessageConstSharedPtr clone() const override;
 
     // Decode
-    size_t decode(Buffer::RawSlice& dns_request, size_t offset) override;
+    Formats::DecodeStatus decode(const Buffer::RawSlice& dns_request, size_t& offset) override;
 
     // Formats::Encode
     void encode(Buffer::Instance& dns_response) const override;
 
+    /**
+     * Prepares the message to be reused for the next request from the address specified.
+     */
+    void reset(const Network::Address::InstanceConstSharedPtr& from);
+
+    /**
+     * Decodes the header and the questions. offset is advanced past the last question.
+     */
+    Formats::DecodeStatus decodeQuestions(const Buffer::RawSlice& dns_request, size_t& offset);
+
+    /**
+     * Walks the answer, authority and additional records of a request and picks up the OPT
+     * record. The other records are skipped. offset is advanced past the last record.
+     */
+    Formats::DecodeStatus decodeRecords(const Buffer::RawSlice& dns_request, size_t& offset);
+
   private:
+    // Root name, type, class, TTL and RDLENGTH of an OPT record without options
+    static constexpr size_t OptRecordSize = 11;
+
     void UpdateAnswerCountInHeader(Formats::ResourceRecordSection section);
 
-    const Network::Address::InstanceConstSharedPtr from_;
+    /**
+     * Writes the records that end within max_size bytes of the message. The first record that
+     * does not fit is taken back, and no further records are written.
+     * @return the number of records written.
+     */
+    static uint16_t encodeRecords(ResponseWriter& writer,
+                                  const std::vector<ResourceRecordImplPtr>& records,
+                                  size_t max_size);
+
+    void encodeOptRecord(ResponseWriter& writer) const;
+
+    /**
+     * @param name_len is set to the number of bytes the name at offset occupies.
+     */
+    static Formats::DecodeStatus skipName(const unsigned char* request, size_t request_len,
+                                          size_t offset, size_t& name_len);
+
+    Network::Address::InstanceConstSharedPtr from_;
+    const Formats::Transport transport_;
     HeaderSectionImpl header_;
-    QuestionRecordImpl question_;
+    // Reused across decodes, only the first question_count_ records belong to the message
+    std::vector<QuestionRecordImpl> questions_;
+    uint16_t question_count_;
+    absl::optional<Formats::Message::EdnsOptions> edns_;
+    // Points into the buffer of the request being decoded, not owned
+    absl::string_view raw_;
+    // The upper 8 bits of the 12 bit response code, sent in the OPT record
+    uint8_t extended_rcode_;
     std::vector<ResourceRecordImplPtr> answers_;
     std::vector<ResourceRecordImplPtr> additional_;
   };
+
+  /**
+   * Sanity checks of the header of a request, run on the raw bytes before anything is decoded
+   * into the message, so that garbage is turned away as cheaply as possible.
+   */
+  static Formats::DecodeStatus checkHeader(const unsigned char* request, size_t request_len);
+
+  // Every request is decoded into the same message, so decoding does not allocate once the
+  // message has seen a name of the same length.
+  MessageImpl request_;
+  // The request passed to decodeQuestions, and the offset of its first record
+  Buffer::RawSlice request_slice_;
+  size_t records_offset_;
 };
 
 } // namespace Dns
@@ -1,7 +1,10 @@
 #include "src/dns_config.h"
 #include "common/common/fmt.h"
+#include "common/network/utility.h"
 #include "common/protobuf/utility.h"
 
+#include "absl/strings/match.h"
+
 namespace Envoy {
 namespace Extensions {
 namespace ListenerFilters {
@@ -12,54 +15,207 @@ namespace Dns {
                                 : (default_value))
 
 ConfigImpl::ConfigImpl(const envoy::config::filter::listener::udp::DnsConfig& config)
-    : recursive_query_timeout_(std::chrono::seconds(
-          PROTOBUF_GET_SECONDS_OR_DEFAULT(config.client_settings(), recursive_query_timeout, 5))),
-      known_domain_names_(),
-      ttl_(std::chrono::seconds(PROTOBUF_GET_SECONDS_OR_DEFAULT(config.server_settings(), ttl, 5))),
-      dns_map_() {
-  // This must have been validated in the proto validation
-  ASSERT(!config.server_settings().known_domainname_suffixes().empty());
+    : recursive_query_timeout_(std::chrono::milliseconds(
+          PROTOBUF_GET_MS_OR_DEFAULT(config.client_settings(), recursive_query_timeout, 5000))),
+      max_pending_recursive_queries_(PROTOBUF_GET_WRAPPED_OR_DEFAULT(
+          config.client_settings(), max_pending_recursive_queries, 10000)),
+      max_waiters_per_recursive_query_(PROTOBUF_GET_WRAPPED_OR_DEFAULT(
+          config.client_settings(), max_waiters_per_recursive_query, 1024)),
+      min_cache_ttl_(std::chrono::seconds(
+          PROTOBUF_GET_SECONDS_OR_DEFAULT(config.client_settings(), min_cache_ttl, 0))),
+      max_cache_ttl_(std::chrono::seconds(
+          PROTOBUF_GET_SECONDS_OR_DEFAULT(config.client_settings(), max_cache_ttl, 3600))),
+      max_cached_responses_(
+          PROTOBUF_GET_WRAPPED_OR_DEFAULT(config.client_settings(), max_cached_responses, 10000)),
+      name_servers_(), forwarding_upstream_(), known_domain_name_suffixes_(), known_suffixes_(),
+      ttl_(std::chrono::seconds(
+          PROTOBUF_GET_SECONDS_OR_DEFAULT(config.server_settings(), ttl, 5))),
+      max_answers_(PROTOBUF_GET_WRAPPED_OR_DEFAULT(config.server_settings(), max_answers, 0)),
+      healthy_panic_threshold_(PROTOBUF_GET_WRAPPED_OR_DEFAULT(config.server_settings(),
+                                                               healthy_panic_threshold, 50)),
+      max_outstanding_queries_per_connection_(PROTOBUF_GET_WRAPPED_OR_DEFAULT(
+          config.server_settings(), max_outstanding_queries_per_connection, 100)),
+      tcp_idle_timeout_(std::chrono::milliseconds(
+          PROTOBUF_GET_MS_OR_DEFAULT(config.server_settings(), tcp_idle_timeout, 10000))),
+      max_cached_answers_(PROTOBUF_GET_WRAPPED_OR_DEFAULT(config.server_settings(),
+                                                          max_cached_answers, 10000)),
+      response_rate_limit_(),
+      dns_entries_(config.server_settings().dns_entries().begin(),
+                   config.server_settings().dns_entries().end()),
+      dns_entries_path_(config.server_settings().dns_entries_path()),
+      dns_snapshot_path_(config.server_settings().dns_snapshot_path()) {
+  if (min_cache_ttl_ > max_cache_ttl_) {
+    throw EnvoyException(fmt::format("min_cache_ttl {}s must not be larger than max_cache_ttl {}s",
+                                     min_cache_ttl_.count(), max_cache_ttl_.count()));
+  }
+
+  // Throws an EnvoyException for a name server that is not an ip:port
+  for (const auto& name_server : config.client_settings().name_servers()) {
+    name_servers_.push_back(Network::Utility::parseInternetAddressAndPort(name_server));
+  }
 
+  if (config.client_settings().has_forwarding()) {
+    forwarding_upstream_ = Network::Utility::parseInternetAddressAndPort(
+        config.client_settings().forwarding().upstream());
+  }
+
+  // The known names of a snapshot are compiled into it
+  if (!dns_snapshot_path_.empty()) {
+    if (!config.server_settings().known_domainname_suffixes().empty() || !dns_entries_.empty() ||
+        !dns_entries_path_.empty()) {
+      throw EnvoyException(fmt::format("dns_snapshot_path {} cannot be combined with "
+                                       "known_domainname_suffixes, dns_entries or dns_entries_path",
+                                       dns_snapshot_path_));
+    }
+  } else if (config.server_settings().known_domainname_suffixes().empty()) {
+    throw EnvoyException("known_domainname_suffixes must not be empty without dns_snapshot_path");
+  }
+
+  // Duplicates end up on the same node of the trie
   for (const auto& known_domain_name : config.server_settings().known_domainname_suffixes()) {
-    // Ignore duplicates while updating the domain names
-    if (known_domain_names_.find(known_domain_name) == known_domain_names_.end()) {
-      known_domain_names_.insert(known_domain_name);
+    known_domain_name_suffixes_.push_back(known_domain_name);
+    known_suffixes_.addSuffix(known_domain_name);
+  }
+
+  known_suffixes_.shrinkToFit();
+
+  // The entries of the file are validated when they are loaded
+  if (dns_entries_path_.empty() && dns_snapshot_path_.empty()) {
+    known_names_ = buildKnownNames(dns_entries_);
+  }
+
+  if (config.server_settings().has_response_rate_limit()) {
+    const auto& rate_limit = config.server_settings().response_rate_limit();
+    const uint32_t table_size = PROTOBUF_GET_WRAPPED_OR_DEFAULT(rate_limit, table_size, 65536);
+    uint32_t table_size_power_of_2 = 1;
+    while (table_size_power_of_2 < table_size) {
+      table_size_power_of_2 <<= 1;
     }
+
+    response_rate_limit_ = ResponseRateLimitSettings{
+        rate_limit.responses_per_second(),
+        PROTOBUF_GET_WRAPPED_OR_DEFAULT(rate_limit, slip, 2),
+        PROTOBUF_GET_WRAPPED_OR_DEFAULT(rate_limit, ipv4_prefix_length, 24),
+        PROTOBUF_GET_WRAPPED_OR_DEFAULT(rate_limit, ipv6_prefix_length, 56),
+        table_size_power_of_2};
+  }
+}
+
+std::chrono::milliseconds ConfigImpl::recursiveQueryTimeout() const {
+  return recursive_query_timeout_;
+}
+
+uint32_t ConfigImpl::maxPendingRecursiveQueries() const { return max_pending_recursive_queries_; }
+
+uint32_t ConfigImpl::maxWaitersPerRecursiveQuery() const {
+  return max_waiters_per_recursive_query_;
+}
+
+const Network::Address::InstanceConstSharedPtr& ConfigImpl::forwardingUpstream() const {
+  return forwarding_upstream_;
+}
+
+std::chrono::seconds ConfigImpl::minCacheTtl() const { return min_cache_ttl_; }
+
+std::chrono::seconds ConfigImpl::maxCacheTtl() const { return max_cache_ttl_; }
+
+uint32_t ConfigImpl::maxCachedResponses() const { return max_cached_responses_; }
+
+const std::vector<Network::Address::InstanceConstSharedPtr>& ConfigImpl::nameServers() const {
+  return name_servers_;
+}
+
+bool ConfigImpl::belongsToKnownDomainName(const std::string& input) const {
+  // Checks if the domain_name is at or below one of the known domain names
+  return known_suffixes_.find(input).known_suffix_;
+}
+
+std::chrono::seconds ConfigImpl::ttl() const { return ttl_; }
+
+uint32_t ConfigImpl::maxAnswers() const { return max_answers_; }
+
+uint32_t ConfigImpl::healthyPanicThreshold() const { return healthy_panic_threshold_; }
+
+uint32_t ConfigImpl::maxCachedAnswers() const { return max_cached_answers_; }
+
+uint32_t ConfigImpl::maxOutstandingQueriesPerConnection() const {
+  return max_outstanding_queries_per_connection_;
+}
+
+std::chrono::milliseconds ConfigImpl::tcpIdleTimeout() const { return tcp_idle_timeout_; }
+
+const absl::optional<ResponseRateLimitSettings>& ConfigImpl::responseRateLimit() const {
+  return response_rate_limit_;
+}
+
+const DnsEntryMap& ConfigImpl::dnsEntries() const { return dns_entries_; }
+
+const std::string& ConfigImpl::dnsEntriesPath() const { return dns_entries_path_; }
+
+const std::string& ConfigImpl::dnsSnapshotPath() const { return dns_snapshot_path_; }
+
+const DomainNameTrieConstSharedPtr& ConfigImpl::knownNames() const { return known_names_; }
+
+DomainNameTrieConstSharedPtr ConfigImpl::buildKnownNames(const DnsEntryMap& dns_entries) const {
+  auto known_names = std::make_shared<DomainNameTrie>();
+  for (const auto& known_domain_name : known_domain_name_suffixes_) {
+    known_names->addSuffix(known_domain_name);
   }
 
   // Add these entries after populating known_domain_names so that we can validate the dns entries
   // belong to the known domain names
-  for (const auto& map_entry : config.server_settings().dns_entries()) {
+  for (const auto& map_entry : dns_entries) {
     if (!belongsToKnownDomainName(map_entry.first)) {
       throw EnvoyException(fmt::format(
           "Dns Entry {} does not belong to any known domain name specified", map_entry.first));
     }
 
-    // If there is a duplicate entry, the newer value replaces the older one
-    dns_map_[map_entry.first] = map_entry.second;
-  }
-}
-
-std::chrono::seconds ConfigImpl::recursiveQueryTimeout() const { return recursive_query_timeout_; }
+    // Only the first label of an entry can be a pattern, and only a {cluster} entry can build its
+    // cluster name from the label it matches
+    const absl::string_view name = map_entry.first;
+    const size_t dot = name.find('.');
+    if (dot != absl::string_view::npos &&
+        (absl::StrContains(name.substr(dot), DomainNameTrie::WildcardLabel) ||
+         absl::StrContains(name.substr(dot), DomainNameTrie::ClusterLabel))) {
+      throw EnvoyException(fmt::format(
+          "Dns Entry {} has a pattern in a label other than the first one", map_entry.first));
+    }
 
-bool ConfigImpl::belongsToKnownDomainName(const std::string& input) const {
-  // Checks if the domain_name is a substring of 1 of the known domain names
-  for (const auto& known_domain : known_domain_names_) {
-    if (isSuffixString(input, known_domain)) {
-      return true;
+    if (absl::StrContains(map_entry.second, DomainNameTrie::ClusterLabel) &&
+        name.substr(0, dot) != DomainNameTrie::ClusterLabel) {
+      throw EnvoyException(fmt::format("Dns Entry {} refers to {{cluster}} in its cluster name {}",
+                                       map_entry.first, map_entry.second));
     }
+
+    // If there is a duplicate entry, the newer value replaces the older one
+    known_names->addEntry(map_entry.first, map_entry.second);
   }
 
-  return false;
+  // The known names are not modified from here on
+  known_names->shrinkToFit();
+  return known_names;
 }
 
-std::chrono::seconds ConfigImpl::ttl() const { return ttl_; }
+std::shared_ptr<const Config>
+ConfigRegistry::getOrCreate(const envoy::config::filter::listener::udp::DnsConfig& proto_config) {
+  // The text format lists the entries of a map in key order, equal configs print the same
+  std::string key;
+  Protobuf::TextFormat::PrintToString(proto_config, &key);
 
-const std::unordered_map<std::string, std::string>& ConfigImpl::dnsMap() const { return dns_map_; }
+  // The configs of listeners that are gone
+  for (auto it = configs_.begin(); it != configs_.end();) {
+    it = it->second.expired() ? configs_.erase(it) : std::next(it);
+  }
+
+  auto it = configs_.find(key);
+  if (it != configs_.end()) {
+    return it->second.lock();
+  }
 
-bool ConfigImpl::isSuffixString(const std::string& input, const std::string& suffix) {
-  return (input.size() >= suffix.size()) &&
-         (input.compare(input.size() - suffix.size(), suffix.size(), suffix) == 0);
+  auto config = std::make_shared<ConfigImpl>(proto_config);
+  config->registry_ = shared_from_this();
+  configs_.emplace(key, config);
+  return config;
 }
 
 } // namespace Dns
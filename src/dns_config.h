@@ -1,17 +1,39 @@
 #pragma once
 
+#include "envoy/common/callback.h"
 #include "envoy/common/pure.h"
+#include "envoy/network/address.h"
+#include "envoy/singleton/instance.h"
 
 #include "src/dns.pb.h"
-#include <unordered_set>
-#include <unordered_map>
+#include "src/dns_name_trie.h"
+
+#include "absl/types/optional.h"
+
 #include <chrono>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 
 namespace Envoy {
 namespace Extensions {
 namespace ListenerFilters {
 namespace Dns {
 
+// Maps a dns name to the cluster that answers for it
+typedef std::unordered_map<std::string, std::string> DnsEntryMap;
+
+// @see ResponseRateLimit in dns.proto
+struct ResponseRateLimitSettings {
+  uint32_t responses_per_second_;
+  uint32_t slip_;
+  uint32_t ipv4_prefix_length_;
+  uint32_t ipv6_prefix_length_;
+  // A power of 2
+  uint32_t table_size_;
+};
+
 /**
  * Interface for the DNS filter config. Used for mocking the object
  */
@@ -20,35 +42,151 @@ public:
   virtual ~Config() = default;
 
   // Client Config
-  virtual std::chrono::seconds recursiveQueryTimeout() const PURE;
+  virtual std::chrono::milliseconds recursiveQueryTimeout() const PURE;
+  virtual uint32_t maxPendingRecursiveQueries() const PURE;
+  virtual uint32_t maxWaitersPerRecursiveQuery() const PURE;
+  virtual std::chrono::seconds minCacheTtl() const PURE;
+  virtual std::chrono::seconds maxCacheTtl() const PURE;
+  virtual uint32_t maxCachedResponses() const PURE;
+  virtual const std::vector<Network::Address::InstanceConstSharedPtr>& nameServers() const PURE;
+  // nullptr unless the queries the filter does not answer are forwarded, @see Forwarding
+  virtual const Network::Address::InstanceConstSharedPtr& forwardingUpstream() const PURE;
 
   // Server Config
   virtual bool belongsToKnownDomainName(const std::string& input) const PURE;
   virtual std::chrono::seconds ttl() const PURE;
-  virtual const std::unordered_map<std::string, std::string>& dnsMap() const PURE;
+  virtual uint32_t maxAnswers() const PURE;
+  virtual uint32_t healthyPanicThreshold() const PURE;
+  virtual uint32_t maxCachedAnswers() const PURE;
+  virtual uint32_t maxOutstandingQueriesPerConnection() const PURE;
+  virtual std::chrono::milliseconds tcpIdleTimeout() const PURE;
+  // Unset if responses are not rate limited
+  virtual const absl::optional<ResponseRateLimitSettings>& responseRateLimit() const PURE;
+  virtual const DnsEntryMap& dnsEntries() const PURE;
+  virtual const std::string& dnsEntriesPath() const PURE;
+  virtual const std::string& dnsSnapshotPath() const PURE;
+
+  /**
+   * The known domain names built from the config and its dns_entries when it was created. Not set
+   * when the dns entries are loaded from dns_entries_path or dns_snapshot_path.
+   */
+  virtual const DomainNameTrieConstSharedPtr& knownNames() const PURE;
+
+  /**
+   * Builds the known domain names from the known domain name suffixes of the config and the
+   * dns_entries. Throws an EnvoyException if an entry does not belong to any of the suffixes.
+   */
+  virtual DomainNameTrieConstSharedPtr buildKnownNames(const DnsEntryMap& dns_entries) const PURE;
 };
 
+/**
+ * The known domain names and dns entries a server answers from. The dns entries can be replaced
+ * while the server runs.
+ */
+class KnownNames {
+public:
+  virtual ~KnownNames() = default;
+
+  /**
+   * Called after the dns entries were replaced.
+   * @param changed_names are the lower case names whose entry was added, removed or moved to
+   * another cluster. A pattern stands for all the names it matches, and a swapped snapshot is
+   * reported as "*", as any name may have changed.
+   */
+  typedef std::function<void(const std::vector<std::string>& changed_names)> UpdateCb;
+
+  /**
+   * Matches input against the known domain names and the dns entries. The cluster name of a
+   * {cluster} entry is already built for input, and is owned by the match. The other cluster names
+   * are valid until the dns entries are replaced.
+   */
+  virtual DomainNameMatch matchDomainName(const std::string& input) const PURE;
+
+  /**
+   * Adds a callback invoked every time the dns entries are replaced.
+   * @return the handle to remove the callback with.
+   */
+  virtual Common::CallbackHandle* addUpdateCb(UpdateCb callback) PURE;
+};
+
+typedef std::shared_ptr<KnownNames> KnownNamesSharedPtr;
+
 class ConfigImpl : public Config {
 public:
   ConfigImpl() = default;
   ConfigImpl(const envoy::config::filter::listener::udp::DnsConfig& config);
 
   // Client Config
-  std::chrono::seconds recursiveQueryTimeout() const override;
+  std::chrono::milliseconds recursiveQueryTimeout() const override;
+  uint32_t maxPendingRecursiveQueries() const override;
+  uint32_t maxWaitersPerRecursiveQuery() const override;
+  std::chrono::seconds minCacheTtl() const override;
+  std::chrono::seconds maxCacheTtl() const override;
+  uint32_t maxCachedResponses() const override;
+  const std::vector<Network::Address::InstanceConstSharedPtr>& nameServers() const override;
+  const Network::Address::InstanceConstSharedPtr& forwardingUpstream() const override;
 
   // Server Config
   bool belongsToKnownDomainName(const std::string& input) const override;
   std::chrono::seconds ttl() const override;
-  const std::unordered_map<std::string, std::string>& dnsMap() const override;
+  uint32_t maxAnswers() const override;
+  uint32_t healthyPanicThreshold() const override;
+  uint32_t maxCachedAnswers() const override;
+  uint32_t maxOutstandingQueriesPerConnection() const override;
+  std::chrono::milliseconds tcpIdleTimeout() const override;
+  const absl::optional<ResponseRateLimitSettings>& responseRateLimit() const override;
+  const DnsEntryMap& dnsEntries() const override;
+  const std::string& dnsEntriesPath() const override;
+  const std::string& dnsSnapshotPath() const override;
+  const DomainNameTrieConstSharedPtr& knownNames() const override;
+  DomainNameTrieConstSharedPtr buildKnownNames(const DnsEntryMap& dns_entries) const override;
 
 private:
-  static bool isSuffixString(const std::string& input, const std::string& suffix);
+  std::chrono::milliseconds recursive_query_timeout_;
+  uint32_t max_pending_recursive_queries_;
+  uint32_t max_waiters_per_recursive_query_;
+  std::chrono::seconds min_cache_ttl_;
+  std::chrono::seconds max_cache_ttl_;
+  uint32_t max_cached_responses_;
+  std::vector<Network::Address::InstanceConstSharedPtr> name_servers_;
+  Network::Address::InstanceConstSharedPtr forwarding_upstream_;
 
-  std::chrono::seconds recursive_query_timeout_;
-
-  std::unordered_set<std::string> known_domain_names_;
+  std::vector<std::string> known_domain_name_suffixes_;
+  // Holds only the known domain name suffixes, the dns entries are added by buildKnownNames
+  DomainNameTrie known_suffixes_;
   std::chrono::seconds ttl_;
-  std::unordered_map<std::string, std::string> dns_map_;
+  uint32_t max_answers_;
+  uint32_t healthy_panic_threshold_;
+  uint32_t max_outstanding_queries_per_connection_;
+  std::chrono::milliseconds tcp_idle_timeout_;
+  uint32_t max_cached_answers_;
+  absl::optional<ResponseRateLimitSettings> response_rate_limit_;
+  DnsEntryMap dns_entries_;
+  std::string dns_entries_path_;
+  std::string dns_snapshot_path_;
+  DomainNameTrieConstSharedPtr known_names_;
+  // The singleton manager only holds the registry weakly, the configs in use keep it alive
+  Singleton::InstanceSharedPtr registry_;
+
+  friend class ConfigRegistry;
+};
+
+/**
+ * The configs of the listeners, keyed on their proto. The UDP and TCP listeners of the same config
+ * share it, so its known domain names are only built once.
+ */
+class ConfigRegistry : public Singleton::Instance,
+                       public std::enable_shared_from_this<ConfigRegistry> {
+public:
+  /**
+   * @return the config of the listeners with proto_config. It is created if there is none, which
+   * throws an EnvoyException if proto_config is not valid, @see ConfigImpl.
+   */
+  std::shared_ptr<const Config>
+  getOrCreate(const envoy::config::filter::listener::udp::DnsConfig& proto_config);
+
+private:
+  std::unordered_map<std::string, std::weak_ptr<const Config>> configs_;
 };
 
 } // namespace Dns
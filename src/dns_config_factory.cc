@@ -3,10 +3,15 @@
 #include "src/dns_config_factory.h"
 
 #include "envoy/registry/registry.h"
+#include "envoy/singleton/manager.h"
 
 #include "src/dns_config.h"
 #include "src/dns.pb.validate.h"
+#include "src/dns_entries_provider.h"
 #include "src/dns_filter.h"
+#include "src/dns_recursive_resolver_impl.h"
+#include "src/dns_server_impl.h"
+#include "src/dns_tcp_filter.h"
 
 namespace Envoy {
 namespace Extensions {
@@ -14,6 +19,43 @@ namespace ListenerFilters {
 namespace Dns {
 
 const std::string DnsFilterName = "envoy.listener.udp.dns";
+const std::string DnsTcpFilterName = "envoy.filters.network.dns";
+const std::string DnsStatsPrefix = "dns_filter.";
+
+SINGLETON_MANAGER_REGISTRATION(dns_config_registry);
+SINGLETON_MANAGER_REGISTRATION(dns_entries_provider_registry);
+
+namespace {
+
+// The config built from proto_config, shared with the other listeners of the same config
+std::shared_ptr<const Config>
+dnsConfig(const envoy::config::filter::listener::udp::DnsConfig& proto_config,
+          Server::Configuration::FactoryContext& context) {
+  std::shared_ptr<ConfigRegistry> registry = context.singletonManager().getTyped<ConfigRegistry>(
+      SINGLETON_MANAGER_REGISTERED_NAME(dns_config_registry),
+      []() -> Singleton::InstanceSharedPtr { return std::make_shared<ConfigRegistry>(); });
+
+  return registry->getOrCreate(proto_config);
+}
+
+// The provider of the dns entries of the config, shared with the other listeners of the same
+// server settings
+DnsEntriesProviderSharedPtr
+dnsEntriesProvider(const envoy::config::filter::listener::udp::DnsConfig& proto_config,
+                   std::shared_ptr<const Config> config,
+                   Server::Configuration::FactoryContext& context, Stats::Scope& scope) {
+  std::shared_ptr<DnsEntriesProviderRegistry> registry =
+      context.singletonManager().getTyped<DnsEntriesProviderRegistry>(
+          SINGLETON_MANAGER_REGISTERED_NAME(dns_entries_provider_registry),
+          []() -> Singleton::InstanceSharedPtr {
+            return std::make_shared<DnsEntriesProviderRegistry>();
+          });
+
+  return registry->getOrCreate(proto_config, std::move(config), context.threadLocal(),
+                               context.dispatcher(), context.api(), scope);
+}
+
+} // namespace
 
 Network::UdpListenerFilterFactoryCb DnsConfigFactory::createFilterFactoryFromProto(
     const Protobuf::Message& message, Server::Configuration::ListenerFactoryContext& context) {
@@ -21,10 +63,18 @@ Network::UdpListenerFilterFactoryCb DnsConfigFactory::createFilterFactoryFromPro
       MessageUtil::downcastAndValidate<const envoy::config::filter::listener::udp::DnsConfig&>(
           message);
 
-  return [proto_config, &context](Network::UdpListenerFilterManager& filter_manager,
-                                  Network::UdpReadFilterCallbacks& callbacks) -> void {
-    filter_manager.addReadFilter(std::make_unique<ProdDnsFilter>(
-        std::make_unique<ConfigImpl>(proto_config), callbacks, context.clusterManager()));
+  // The config is built once and shared by the filters of all the workers
+  std::shared_ptr<const Config> config = dnsConfig(proto_config, context);
+  std::shared_ptr<Stats::Scope> scope = context.scope().createScope(DnsStatsPrefix);
+  DnsEntriesProviderSharedPtr dns_entries_provider =
+      dnsEntriesProvider(proto_config, config, context, *scope);
+
+  return [config, dns_entries_provider, &context,
+          scope](Network::UdpListenerFilterManager& filter_manager,
+                 Network::UdpReadFilterCallbacks& callbacks) -> void {
+    filter_manager.addReadFilter(
+        std::make_unique<ProdDnsFilter>(config, dns_entries_provider->knownNames(), callbacks,
+                                        context.clusterManager(), *scope));
   };
 }
 
@@ -39,6 +89,55 @@ std::string DnsConfigFactory::name() { return DnsFilterName; }
  */
 REGISTER_FACTORY(DnsConfigFactory, Server::Configuration::NamedUdpListenerFilterConfigFactory);
 
+Network::FilterFactoryCb
+DnsTcpConfigFactory::createFilterFactoryFromProto(const Protobuf::Message& message,
+                                                  Server::Configuration::FactoryContext& context) {
+  auto proto_config =
+      MessageUtil::downcastAndValidate<const envoy::config::filter::listener::udp::DnsConfig&>(
+          message);
+
+  std::shared_ptr<const Config> config = dnsConfig(proto_config, context);
+  Upstream::ClusterManager& cluster_manager = context.clusterManager();
+  std::shared_ptr<Stats::Scope> scope = context.scope().createScope(DnsStatsPrefix);
+  DnsEntriesProviderSharedPtr dns_entries_provider =
+      dnsEntriesProvider(proto_config, config, context, *scope);
+
+  // The connections of a worker share one server, along with its caches and pending queries.
+  // Queries over TCP are not forwarded, as the responses of the upstream are limited to the UDP
+  // payload size.
+  std::shared_ptr<ThreadLocal::Slot> slot = context.threadLocal().allocateSlot();
+  slot->set([config, dns_entries_provider, &cluster_manager,
+             scope](Event::Dispatcher& dispatcher) -> ThreadLocal::ThreadLocalObjectSharedPtr {
+    DnsTcpServer::DnsServerFactory server_factory =
+        [&dispatcher, dns_entries_provider, &cluster_manager, scope](
+            const Config& server_config,
+            const DnsServer::ResolveCallback& callback) -> std::unique_ptr<DnsServer> {
+      return std::make_unique<DnsServerImpl>(
+          callback, server_config, dns_entries_provider->knownNames(),
+          std::make_unique<RecursiveResolverImpl>(dispatcher, server_config.nameServers(),
+                                                  server_config.maxPendingRecursiveQueries()),
+          nullptr, dispatcher, cluster_manager, *scope);
+    };
+
+    return std::make_shared<DnsTcpServer>(config, server_factory, *scope);
+  });
+
+  return [slot](Network::FilterManager& filter_manager) -> void {
+    filter_manager.addReadFilter(std::make_shared<DnsTcpFilter>(slot->getTyped<DnsTcpServer>()));
+  };
+}
+
+ProtobufTypes::MessagePtr DnsTcpConfigFactory::createEmptyConfigProto() {
+  return std::make_unique<envoy::config::filter::listener::udp::DnsConfig>();
+}
+
+std::string DnsTcpConfigFactory::name() { return DnsTcpFilterName; }
+
+/**
+ * Static registration for the dns network filter. @see RegisterFactory.
+ */
+REGISTER_FACTORY(DnsTcpConfigFactory, Server::Configuration::NamedNetworkFilterConfigFactory);
+
 } // namespace Dns
 } // namespace ListenerFilters
 } // namespace Extensions
@@ -21,6 +21,21 @@ public:
   std::string name() override;
 };
 
+/**
+ * Config registration for the dns network filter, which serves DNS over TCP with the same
+ * configuration as the dns filter.
+ */
+class DnsTcpConfigFactory : public Server::Configuration::NamedNetworkFilterConfigFactory {
+public:
+  Network::FilterFactoryCb
+  createFilterFactoryFromProto(const Protobuf::Message& message,
+                               Server::Configuration::FactoryContext& context) override;
+
+  ProtobufTypes::MessagePtr createEmptyConfigProto() override;
+
+  std::string name() override;
+};
+
 } // namespace Dns
 } // namespace ListenerFilters
 } // namespace Extensions
@@ -0,0 +1,40 @@
+#include "src/dns_decode_stats.h"
+
+#include "common/common/assert.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+DnsDecodeStats generateDecodeStats(Stats::Scope& scope) {
+  return {ALL_DNS_DECODE_STATS(POOL_COUNTER(scope))};
+}
+
+Stats::Counter& decodeErrorCounter(DnsDecodeStats& stats, Formats::DecodeStatus status) {
+  switch (status) {
+  case Formats::DecodeStatus::ShortHeader:
+    return stats.decode_short_header_;
+  case Formats::DecodeStatus::NotQuery:
+    return stats.decode_not_query_;
+  case Formats::DecodeStatus::InvalidCounts:
+    return stats.decode_invalid_counts_;
+  case Formats::DecodeStatus::InvalidName:
+    return stats.decode_invalid_name_;
+  case Formats::DecodeStatus::InvalidPointer:
+    return stats.decode_invalid_pointer_;
+  case Formats::DecodeStatus::TruncatedRecord:
+    return stats.decode_truncated_record_;
+  case Formats::DecodeStatus::InvalidOpt:
+    return stats.decode_invalid_opt_;
+  case Formats::DecodeStatus::Ok:
+    break;
+  }
+
+  NOT_REACHED_GCOVR_EXCL_LINE;
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
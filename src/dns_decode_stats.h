@@ -0,0 +1,44 @@
+#pragma once
+
+#include "envoy/stats/scope.h"
+#include "envoy/stats/stats_macros.h"
+
+#include "src/dns_codec.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+/**
+ * The queries dropped as they could not be decoded, over UDP and TCP. @see stats_macros.h
+ */
+// clang-format off
+#define ALL_DNS_DECODE_STATS(COUNTER)                                                              \
+  COUNTER(decode_short_header)                                                                     \
+  COUNTER(decode_not_query)                                                                        \
+  COUNTER(decode_invalid_counts)                                                                   \
+  COUNTER(decode_invalid_name)                                                                     \
+  COUNTER(decode_invalid_pointer)                                                                  \
+  COUNTER(decode_truncated_record)                                                                 \
+  COUNTER(decode_invalid_opt)
+// clang-format on
+
+/**
+ * Struct definition for all dns decode stats. @see stats_macros.h
+ */
+struct DnsDecodeStats {
+  ALL_DNS_DECODE_STATS(GENERATE_COUNTER_STRUCT)
+};
+
+DnsDecodeStats generateDecodeStats(Stats::Scope& scope);
+
+/**
+ * @return the counter of the queries dropped for status, which is not Ok.
+ */
+Stats::Counter& decodeErrorCounter(DnsDecodeStats& stats, Formats::DecodeStatus status);
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,241 @@
+#include "src/dns_entries_provider.h"
+
+#include "common/protobuf/utility.h"
+
+#include "src/dns.pb.h"
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_replace.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+namespace {
+
+// The form of a name that cached answers are keyed on
+std::string cachedName(const std::string& name) {
+  std::string cached_name = absl::AsciiStrToLower(name);
+  if (absl::EndsWith(cached_name, ".")) {
+    cached_name.pop_back();
+  }
+
+  return cached_name;
+}
+
+} // namespace
+
+// Begin ThreadLocalKnownNames
+constexpr size_t ThreadLocalKnownNames::MaxTemplateClusters;
+
+ThreadLocalKnownNames::ThreadLocalKnownNames(DomainNameMatcherConstSharedPtr known_names)
+    : known_names_(std::move(known_names)), template_clusters_(), update_callbacks_() {}
+
+void ThreadLocalKnownNames::update(DomainNameMatcherConstSharedPtr known_names,
+                                   const std::vector<std::string>& changed_names) {
+  known_names_ = std::move(known_names);
+  template_clusters_.clear();
+  update_callbacks_.runCallbacks(changed_names);
+}
+
+DomainNameMatch ThreadLocalKnownNames::matchDomainName(const std::string& input) const {
+  DomainNameMatch match = known_names_->find(input);
+  if (match.cluster_label_.empty()) {
+    return match;
+  }
+
+  auto it = template_clusters_.find(input);
+  if (it == template_clusters_.end()) {
+    if (template_clusters_.size() >= MaxTemplateClusters) {
+      template_clusters_.clear();
+    }
+
+    auto cluster_name = std::make_shared<const std::string>(absl::StrReplaceAll(
+        *match.cluster_name_,
+        {{DomainNameTrie::ClusterLabel, absl::AsciiStrToLower(match.cluster_label_)}}));
+    it = template_clusters_.emplace(input, std::move(cluster_name)).first;
+  }
+
+  match.built_cluster_name_ = it->second;
+  match.cluster_name_ = match.built_cluster_name_.get();
+  return match;
+}
+
+Common::CallbackHandle* ThreadLocalKnownNames::addUpdateCb(UpdateCb callback) {
+  return update_callbacks_.add(callback);
+}
+// End ThreadLocalKnownNames
+
+// Begin DnsEntriesProvider
+DnsEntriesProvider::DnsEntriesProvider(std::shared_ptr<const Config> config,
+                                       ThreadLocal::SlotAllocator& tls,
+                                       Event::Dispatcher& dispatcher, Api::Api& api,
+                                       Stats::Scope& scope)
+    : config_(std::move(config)), api_(api), slot_(tls.allocateSlot()), watcher_(),
+      dns_entries_(), scope_(scope.createScope("")), stats_(generateStats(*scope_)), registry_() {
+  const std::string& dns_snapshot_path = config_->dnsSnapshotPath();
+  const std::string& dns_entries_path = config_->dnsEntriesPath();
+
+  DomainNameMatcherConstSharedPtr known_names;
+  if (!dns_snapshot_path.empty()) {
+    DnsSnapshotConstSharedPtr snapshot = DnsSnapshot::load(dns_snapshot_path);
+    stats_.entries_.set(snapshot->entries());
+    known_names = std::move(snapshot);
+  } else if (dns_entries_path.empty()) {
+    // The config built the known names of its entries when it validated them
+    stats_.entries_.set(config_->dnsEntries().size());
+    known_names = config_->knownNames();
+  } else {
+    dns_entries_ = loadDnsEntries();
+    stats_.entries_.set(dns_entries_.size());
+    known_names = config_->buildKnownNames(dns_entries_);
+  }
+
+  slot_->set([known_names](Event::Dispatcher&) -> ThreadLocal::ThreadLocalObjectSharedPtr {
+    return std::make_shared<ThreadLocalKnownNames>(known_names);
+  });
+
+  // The files are replaced by moving a new one in place, so they are never read half written
+  if (!dns_snapshot_path.empty()) {
+    watcher_ = dispatcher.createFilesystemWatcher();
+    watcher_->addWatch(dns_snapshot_path, Filesystem::Watcher::Events::MovedTo,
+                       [this](uint32_t) -> void { onDnsSnapshotChanged(); });
+  } else if (!dns_entries_path.empty()) {
+    watcher_ = dispatcher.createFilesystemWatcher();
+    watcher_->addWatch(dns_entries_path, Filesystem::Watcher::Events::MovedTo,
+                       [this](uint32_t) -> void { onDnsEntriesFileChanged(); });
+  }
+}
+
+DnsEntriesStats DnsEntriesProvider::generateStats(Stats::Scope& scope) {
+  const std::string prefix = "dns_entries.";
+  return {ALL_DNS_ENTRIES_STATS(POOL_COUNTER_PREFIX(scope, prefix),
+                                POOL_GAUGE_PREFIX(scope, prefix))};
+}
+
+KnownNamesSharedPtr DnsEntriesProvider::knownNames() {
+  return std::dynamic_pointer_cast<ThreadLocalKnownNames>(slot_->get());
+}
+
+DnsEntryMap DnsEntriesProvider::loadDnsEntries() const {
+  envoy::config::filter::listener::udp::DnsEntries dns_entries;
+  MessageUtil::loadFromFile(config_->dnsEntriesPath(), dns_entries, api_);
+
+  return DnsEntryMap(dns_entries.dns_entries().begin(), dns_entries.dns_entries().end());
+}
+
+void DnsEntriesProvider::onDnsEntriesFileChanged() {
+  try {
+    update(loadDnsEntries());
+  } catch (const EnvoyException& e) {
+    ENVOY_LOG(warn, "DnsFilter: rejected the dns entries of {}, keeping the previous ones: {}",
+              config_->dnsEntriesPath(), e.what());
+    stats_.update_rejected_.inc();
+    return;
+  }
+
+  ENVOY_LOG(debug, "DnsFilter: loaded {} dns entries from {}", dns_entries_.size(),
+            config_->dnsEntriesPath());
+  stats_.update_success_.inc();
+}
+
+void DnsEntriesProvider::onDnsSnapshotChanged() {
+  DnsSnapshotConstSharedPtr snapshot;
+  try {
+    snapshot = DnsSnapshot::load(config_->dnsSnapshotPath());
+  } catch (const EnvoyException& e) {
+    ENVOY_LOG(warn, "DnsFilter: rejected the dns snapshot {}, keeping the previous one: {}",
+              config_->dnsSnapshotPath(), e.what());
+    stats_.update_rejected_.inc();
+    return;
+  }
+
+  ENVOY_LOG(debug, "DnsFilter: mapped the dns snapshot {} with {} dns entries",
+            config_->dnsSnapshotPath(), snapshot->entries());
+  stats_.entries_.set(snapshot->entries());
+  stats_.update_success_.inc();
+
+  // The names that changed are not known without walking both snapshots
+  DomainNameMatcherConstSharedPtr known_names = std::move(snapshot);
+  auto changed_names = std::make_shared<const std::vector<std::string>>(
+      1, std::string(DomainNameTrie::WildcardLabel));
+  updateWorkers(known_names, changed_names);
+}
+
+void DnsEntriesProvider::update(DnsEntryMap&& dns_entries) {
+  DomainNameTrieConstSharedPtr known_names = config_->buildKnownNames(dns_entries);
+
+  auto changed_names =
+      std::make_shared<const std::vector<std::string>>(changedNames(dns_entries_, dns_entries));
+  dns_entries_ = std::move(dns_entries);
+  stats_.entries_.set(dns_entries_.size());
+
+  updateWorkers(known_names, changed_names);
+}
+
+void DnsEntriesProvider::updateWorkers(
+    DomainNameMatcherConstSharedPtr known_names,
+    std::shared_ptr<const std::vector<std::string>> changed_names) {
+  // The update can run on a worker after the provider is gone, it only holds on to what it swaps in
+  slot_->runOnAllThreads(
+      [known_names, changed_names](ThreadLocal::ThreadLocalObjectSharedPtr object)
+          -> ThreadLocal::ThreadLocalObjectSharedPtr {
+        std::dynamic_pointer_cast<ThreadLocalKnownNames>(object)->update(known_names,
+                                                                        *changed_names);
+        return object;
+      });
+}
+
+std::vector<std::string> DnsEntriesProvider::changedNames(const DnsEntryMap& previous,
+                                                          const DnsEntryMap& current) {
+  std::vector<std::string> changed_names;
+  for (const auto& entry : current) {
+    auto previous_it = previous.find(entry.first);
+    if (previous_it == previous.end() || previous_it->second != entry.second) {
+      changed_names.push_back(cachedName(entry.first));
+    }
+  }
+
+  for (const auto& entry : previous) {
+    if (current.find(entry.first) == current.end()) {
+      changed_names.push_back(cachedName(entry.first));
+    }
+  }
+
+  return changed_names;
+}
+// End DnsEntriesProvider
+
+// Begin DnsEntriesProviderRegistry
+DnsEntriesProviderSharedPtr DnsEntriesProviderRegistry::getOrCreate(
+    const envoy::config::filter::listener::udp::DnsConfig& proto_config,
+    std::shared_ptr<const Config> config, ThreadLocal::SlotAllocator& tls,
+    Event::Dispatcher& dispatcher, Api::Api& api, Stats::Scope& scope) {
+  // The text format lists the entries of a map in key order, equal settings print the same
+  std::string key;
+  Protobuf::TextFormat::PrintToString(proto_config.server_settings(), &key);
+
+  // The providers of listeners that are gone
+  for (auto it = providers_.begin(); it != providers_.end();) {
+    it = it->second.expired() ? providers_.erase(it) : std::next(it);
+  }
+
+  auto it = providers_.find(key);
+  if (it != providers_.end()) {
+    return it->second.lock();
+  }
+
+  auto provider =
+      std::make_shared<DnsEntriesProvider>(std::move(config), tls, dispatcher, api, scope);
+  provider->registry_ = shared_from_this();
+  providers_.emplace(key, provider);
+  return provider;
+}
+// End DnsEntriesProviderRegistry
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "envoy/api/api.h"
+#include "envoy/event/dispatcher.h"
+#include "envoy/filesystem/watcher.h"
+#include "envoy/singleton/instance.h"
+#include "envoy/stats/scope.h"
+#include "envoy/stats/stats_macros.h"
+#include "envoy/thread_local/thread_local.h"
+
+#include "common/common/callback_impl.h"
+#include "common/common/logger.h"
+
+#include "src/dns_config.h"
+#include "src/dns_snapshot.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+/**
+ * All dns entries stats. @see stats_macros.h
+ */
+// clang-format off
+#define ALL_DNS_ENTRIES_STATS(COUNTER, GAUGE)                                                      \
+  COUNTER(update_success)                                                                          \
+  COUNTER(update_rejected)                                                                         \
+  GAUGE(entries, NeverImport)
+// clang-format on
+
+/**
+ * Struct definition for all dns entries stats. @see stats_macros.h
+ */
+struct DnsEntriesStats {
+  ALL_DNS_ENTRIES_STATS(GENERATE_COUNTER_STRUCT, GENERATE_GAUGE_STRUCT)
+};
+
+/**
+ * The known names of one worker. It is only used on the thread of its worker, so an update swaps
+ * the known names without any locking and lookups never wait for an update.
+ *
+ * The cluster names built for the names matched by {cluster} entries are kept per name, so that
+ * a name only has its cluster name built once.
+ */
+class ThreadLocalKnownNames : public KnownNames, public ThreadLocal::ThreadLocalObject {
+public:
+  ThreadLocalKnownNames(DomainNameMatcherConstSharedPtr known_names);
+
+  /**
+   * Swaps in known_names and runs the update callbacks with the names whose entry changed.
+   */
+  void update(DomainNameMatcherConstSharedPtr known_names,
+              const std::vector<std::string>& changed_names);
+
+  // KnownNames
+  DomainNameMatch matchDomainName(const std::string& input) const override;
+  Common::CallbackHandle* addUpdateCb(UpdateCb callback) override;
+
+  /**
+   * @return the number of names with a cluster name built from a {cluster} entry.
+   */
+  size_t templateClusterCount() const { return template_clusters_.size(); }
+
+  // Names made up by a client can be matched by a {cluster} entry, so the built cluster names are
+  // dropped altogether once there are this many of them
+  static constexpr size_t MaxTemplateClusters = 10000;
+
+private:
+  DomainNameMatcherConstSharedPtr known_names_;
+  // The cluster names built from {cluster} entries, keyed on the name they were built for. Dropped
+  // when the known names are swapped, the matches that hold one keep it.
+  mutable std::unordered_map<std::string, std::shared_ptr<const std::string>> template_clusters_;
+  Common::CallbackManager<const std::vector<std::string>&> update_callbacks_;
+};
+
+/**
+ * Delivers the dns entries of the config to the workers. When the config has a dns_entries_path,
+ * the entries are loaded from that file and loaded again every time a new file is moved in place.
+ * When it has a dns_snapshot_path, the snapshot is mapped in the same way.
+ *
+ * Every set of entries is built once on the main thread into immutable known names, which are
+ * swapped in on the workers through a thread local slot. The filters keep running, along with
+ * their caches and pending queries.
+ */
+class DnsEntriesProvider : Logger::Loggable<Logger::Id::filter> {
+public:
+  /**
+   * Throws an EnvoyException if the dns entries cannot be loaded.
+   * @param dispatcher is the dispatcher of the main thread, which watches the dns entries file.
+   * @param scope is the scope of the filter. The stats are kept in the "dns_entries." scope below
+   * it, in a scope of the provider as it can outlive the listener it was created for.
+   */
+  DnsEntriesProvider(std::shared_ptr<const Config> config, ThreadLocal::SlotAllocator& tls,
+                     Event::Dispatcher& dispatcher, Api::Api& api, Stats::Scope& scope);
+
+  /**
+   * @return the known names of the worker of the calling thread.
+   */
+  KnownNamesSharedPtr knownNames();
+
+  static DnsEntriesStats generateStats(Stats::Scope& scope);
+
+private:
+  DnsEntryMap loadDnsEntries() const;
+  void onDnsEntriesFileChanged();
+  void onDnsSnapshotChanged();
+
+  /**
+   * Pushes the known names built from dns_entries to all the workers.
+   * Throws an EnvoyException if an entry does not belong to any known domain name.
+   */
+  void update(DnsEntryMap&& dns_entries);
+
+  /**
+   * Swaps in known_names on all the workers.
+   */
+  void updateWorkers(DomainNameMatcherConstSharedPtr known_names,
+                     std::shared_ptr<const std::vector<std::string>> changed_names);
+
+  static std::vector<std::string> changedNames(const DnsEntryMap& previous,
+                                               const DnsEntryMap& current);
+
+  friend class DnsEntriesProviderRegistry;
+
+  const std::shared_ptr<const Config> config_;
+  Api::Api& api_;
+  ThreadLocal::SlotPtr slot_;
+  Filesystem::WatcherPtr watcher_;
+  // The entries loaded from dns_entries_path, which the next ones loaded are compared with
+  DnsEntryMap dns_entries_;
+  Stats::ScopePtr scope_;
+  DnsEntriesStats stats_;
+  // The singleton manager only holds the registry weakly, the providers in use keep it alive
+  Singleton::InstanceSharedPtr registry_;
+};
+
+typedef std::shared_ptr<DnsEntriesProvider> DnsEntriesProviderSharedPtr;
+
+/**
+ * The dns entries providers of the listeners, keyed on the server settings of their config. The
+ * UDP and TCP listeners with the same server settings share a provider, so the dns entries are
+ * loaded and watched once and every worker keeps a single copy of the known names.
+ */
+class DnsEntriesProviderRegistry : public Singleton::Instance,
+                                   public std::enable_shared_from_this<DnsEntriesProviderRegistry> {
+public:
+  /**
+   * @return the provider of the listeners with the server settings of proto_config. It is created
+   * from config if there is none, @see DnsEntriesProvider.
+   */
+  DnsEntriesProviderSharedPtr
+  getOrCreate(const envoy::config::filter::listener::udp::DnsConfig& proto_config,
+              std::shared_ptr<const Config> config, ThreadLocal::SlotAllocator& tls,
+              Event::Dispatcher& dispatcher, Api::Api& api, Stats::Scope& scope);
+
+private:
+  std::unordered_map<std::string, std::weak_ptr<DnsEntriesProvider>> providers_;
+};
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
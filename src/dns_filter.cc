@@ -1,10 +1,15 @@
+#include "ares.h"
+#include "ares_dns.h"
 
 #include "src/dns_config.h"
 #include "src/dns_filter.h"
+#include "src/dns_forwarder_impl.h"
+#include "src/dns_recursive_resolver_impl.h"
 #include "src/dns_server_impl.h"
 #include "src/dns_codec_impl.h"
 
 #include "envoy/event/dispatcher.h"
+#include "common/buffer/buffer_impl.h"
 #include "common/common/assert.h"
 
 namespace Envoy {
@@ -12,18 +17,39 @@ namespace Extensions {
 namespace ListenerFilters {
 namespace Dns {
 
-DnsFilter::DnsFilter(std::unique_ptr<Config>&& config, Network::UdpReadFilterCallbacks& callbacks,
-                     Upstream::ClusterManager& cluster_manager)
-    : UdpListenerReadFilter(callbacks), config_(std::move(config)), dns_server_(), decoder_() {
+DnsFilter::DnsFilter(std::shared_ptr<const Config> config, KnownNamesSharedPtr known_names,
+                     Network::UdpReadFilterCallbacks& callbacks,
+                     Upstream::ClusterManager& cluster_manager, Stats::Scope& scope)
+    : UdpListenerReadFilter(callbacks), config_(std::move(config)), dns_server_(), decoder_(),
+      time_source_(callbacks.udpListener().dispatcher().timeSource()), rate_limiter_(),
+      decode_stats_(generateDecodeStats(scope)), stats_(generateStats(scope)) {
 
   DnsServer::ResolveCallback resolve_callback =
-      [this](const Formats::ResponseMessageSharedPtr& dns_response,
-             Buffer::Instance& serialized_response) {
-        this->onResolveComplete(dns_response, serialized_response);
+      [this](const Formats::Message& dns_request, Buffer::Instance& serialized_response) {
+        this->onResolveComplete(dns_request, serialized_response);
       };
 
+  Event::Dispatcher& dispatcher = callbacks.udpListener().dispatcher();
+  ForwarderPtr forwarder;
+  if (config_->forwardingUpstream() != nullptr) {
+    forwarder = std::make_unique<ForwarderImpl>(
+        dispatcher, config_->forwardingUpstream(), config_->recursiveQueryTimeout(),
+        config_->maxPendingRecursiveQueries(), scope);
+  }
+
   dns_server_ = std::make_unique<DnsServerImpl>(
-      resolve_callback, *config_, callbacks.udpListener().dispatcher(), cluster_manager);
+      resolve_callback, *config_, std::move(known_names),
+      std::make_unique<RecursiveResolverImpl>(dispatcher, config_->nameServers(),
+                                              config_->maxPendingRecursiveQueries()),
+      std::move(forwarder), dispatcher, cluster_manager, scope);
+
+  if (config_->responseRateLimit().has_value()) {
+    rate_limiter_ = std::make_unique<ResponseRateLimiter>(config_->responseRateLimit().value());
+  }
+}
+
+DnsFilterStats DnsFilter::generateStats(Stats::Scope& scope) {
+  return {ALL_DNS_FILTER_STATS(POOL_COUNTER(scope))};
 }
 
 void DnsFilter::onData(Network::UdpRecvData& data) {
@@ -43,24 +69,72 @@ void DnsFilter::doDecode(Buffer::Instance& buffer,
     decoder_ = createDecoder();
   }
 
-  try {
-    Formats::RequestMessageConstSharedPtr dns_request = decoder_->decode(buffer, from);
-    dns_server_->resolve(dns_request);
-  } catch (EnvoyException& e) {
+  Formats::DecodeStatus status = decoder_->decodeQuestions(buffer, from);
+  if (status == Formats::DecodeStatus::Ok) {
+    // Queries beyond the response rate are turned away before their records are decoded
+    if (rate_limiter_ != nullptr && rateLimit(decoder_->message())) {
+      return;
+    }
+
+    status = decoder_->decodeRecords();
+  }
+
+  if (status != Formats::DecodeStatus::Ok) {
     // The request could not be decoded into a dns message. We will not be able to send back a
     // response since the question could not be decoded successfully. This can happen if the sender
     // is malicious or if there was a packet corruption.
-    ENVOY_LOG(info, "dns decoding error: {}", e.what());
+    ENVOY_LOG(debug, "DnsFilter: dropping a malformed request of {} bytes from {}",
+              buffer.length(), from->asString());
+    decodeErrorCounter(decode_stats_, status).inc();
+    return;
   }
+
+  dns_server_->resolve(decoder_->message());
 }
 
-void DnsFilter::onResolveComplete(const Formats::ResponseMessageSharedPtr& dns_message,
+void DnsFilter::onResolveComplete(const Formats::Message& dns_request,
                                   Buffer::Instance& serialized_response) {
-  Network::UdpSendData send_data{dns_message->from(), serialized_response};
+  if (rate_limiter_ != nullptr) {
+    unsigned char header[HFIXEDSZ];
+    serialized_response.copyOut(0, HFIXEDSZ, header);
+    rate_limiter_->onResponse(*dns_request.from(), dns_request.questionRecord().qName(),
+                              DNS_HEADER_RCODE(header), time_source_.monotonicTime());
+  }
 
-  read_callbacks_->udpListener().send(send_data);
+  sendResponse(dns_request.from(), serialized_response);
+}
 
-  return;
+bool DnsFilter::rateLimit(const Formats::Message& dns_request) {
+  switch (rate_limiter_->check(*dns_request.from(), dns_request.questionRecord().qName(),
+                               time_source_.monotonicTime())) {
+  case ResponseRateLimiter::Action::Respond:
+    return false;
+  case ResponseRateLimiter::Action::Slip: {
+    ENVOY_LOG(trace, "DnsFilter: answering {} beyond the response rate with a truncated response",
+              dns_request.from()->asString());
+    stats_.response_rate_limit_slipped_.inc();
+
+    Buffer::OwnedImpl serialized_response;
+    dns_request.createResponseMessage({NOERROR, false})->encode(serialized_response);
+    unsigned char* header = static_cast<unsigned char*>(serialized_response.linearize(HFIXEDSZ));
+    DNS_HEADER_SET_TC(header, 1);
+    sendResponse(dns_request.from(), serialized_response);
+    return true;
+  }
+  case ResponseRateLimiter::Action::Drop:
+    ENVOY_LOG(trace, "DnsFilter: dropping a query of {} beyond the response rate",
+              dns_request.from()->asString());
+    stats_.response_rate_limit_dropped_.inc();
+    return true;
+  }
+
+  NOT_REACHED_GCOVR_EXCL_LINE;
+}
+
+void DnsFilter::sendResponse(const Network::Address::InstanceConstSharedPtr& to,
+                             Buffer::Instance& serialized_response) {
+  Network::UdpSendData send_data{to, serialized_response};
+  read_callbacks_->udpListener().send(send_data);
 }
 
 } // namespace Dns
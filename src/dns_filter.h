@@ -6,10 +6,15 @@
 #include "envoy/network/filter.h"
 #include "envoy/network/listener.h"
 #include "envoy/network/dns.h"
+#include "envoy/stats/scope.h"
+#include "envoy/stats/stats_macros.h"
 
 #include "common/common/logger.h"
 
 #include "src/dns_codec.h"
+#include "src/dns_config.h"
+#include "src/dns_decode_stats.h"
+#include "src/dns_rate_limiter.h"
 #include "src/dns_server.h"
 
 namespace Envoy {
@@ -26,15 +31,40 @@ namespace Extensions {
 namespace ListenerFilters {
 namespace Dns {
 
-class Config;
+/**
+ * All dns filter stats. @see stats_macros.h
+ */
+// clang-format off
+#define ALL_DNS_FILTER_STATS(COUNTER)                                                              \
+  COUNTER(response_rate_limit_dropped)                                                             \
+  COUNTER(response_rate_limit_slipped)
+// clang-format on
+
+/**
+ * Struct definition for all dns filter stats. @see stats_macros.h
+ */
+struct DnsFilterStats {
+  ALL_DNS_FILTER_STATS(GENERATE_COUNTER_STRUCT)
+};
 
 /**
  * Implements the Dns filter.
+ *
+ * Responses are sent as soon as they are resolved, each with a send of its own, as the UDP listener
+ * offers no batched send.
+ *
+ * When responses are rate limited, the queries beyond the rate are dropped or answered with a
+ * truncated response as soon as their question is decoded, before they reach the server.
  */
 class DnsFilter : public Network::UdpListenerReadFilter, Logger::Loggable<Logger::Id::filter> {
 public:
-  DnsFilter(std::unique_ptr<Config>&& config, Network::UdpReadFilterCallbacks& callbacks,
-            Upstream::ClusterManager& cluster_manager);
+  /**
+   * @param config is shared read only by the filters of all the workers.
+   * @param known_names are the known names of the worker of the filter.
+   */
+  DnsFilter(std::shared_ptr<const Config> config, KnownNamesSharedPtr known_names,
+            Network::UdpReadFilterCallbacks& callbacks, Upstream::ClusterManager& cluster_manager,
+            Stats::Scope& scope);
 
   virtual DecoderPtr createDecoder() PURE;
 
@@ -44,12 +74,30 @@ public:
 private:
   void doDecode(Buffer::Instance& buffer, Network::Address::InstanceConstSharedPtr const& from);
 
-  void onResolveComplete(const Formats::ResponseMessageSharedPtr& dns_response,
+  void onResolveComplete(const Formats::Message& dns_request,
                          Buffer::Instance& serialized_response);
 
-  std::unique_ptr<Config> config_;
+  /**
+   * @param dns_request has its header and questions decoded, but not its records.
+   * @return true if dns_request is beyond the response rate of its client, in which case it was
+   * dropped or answered with an empty, truncated response.
+   */
+  bool rateLimit(const Formats::Message& dns_request);
+
+  void sendResponse(const Network::Address::InstanceConstSharedPtr& to,
+                    Buffer::Instance& serialized_response);
+
+  static DnsFilterStats generateStats(Stats::Scope& scope);
+
+  // Referenced by dns_server_
+  std::shared_ptr<const Config> config_;
   std::unique_ptr<DnsServer> dns_server_;
   DecoderPtr decoder_;
+  TimeSource& time_source_;
+  // Unset if responses are not rate limited
+  std::unique_ptr<ResponseRateLimiter> rate_limiter_;
+  DnsDecodeStats decode_stats_;
+  DnsFilterStats stats_;
 };
 
 class ProdDnsFilter : public DnsFilter {
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+
+#include "envoy/buffer/buffer.h"
+#include "envoy/common/pure.h"
+
+#include "src/dns_codec.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+/**
+ * Relays queries to an upstream resolver as they were received, and the responses of the upstream
+ * back as they were received. Only the message ID is rewritten, so the records of the response,
+ * their TTLs and the question types the filter does not answer itself reach the client unchanged.
+ */
+class Forwarder {
+public:
+  virtual ~Forwarder() = default;
+
+  /**
+   * Called with the response to a forwarded query.
+   * @param dns_request is a copy of the forwarded request.
+   * @param response is the response of the upstream with the ID of the request, or a SERVFAIL
+   * response if the upstream did not answer in time.
+   */
+  typedef std::function<void(const Formats::Message& dns_request, Buffer::Instance& response)>
+      ResponseCb;
+
+  /**
+   * Forwards the raw bytes of dns_request, which must be a decoded request with a single question.
+   * The callback is never invoked inline.
+   * @return false if the query was not forwarded, since too many are pending or it could not be
+   * sent.
+   */
+  virtual bool forward(const Formats::Message& dns_request, ResponseCb callback) PURE;
+};
+
+typedef std::unique_ptr<Forwarder> ForwarderPtr;
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
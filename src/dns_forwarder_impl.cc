@@ -0,0 +1,296 @@
+#include <arpa/nameser.h>
+#include <arpa/nameser_compat.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "src/dns_forwarder_impl.h"
+
+#include "envoy/common/exception.h"
+
+#include "common/buffer/buffer_impl.h"
+#include "common/common/assert.h"
+#include "common/common/fmt.h"
+
+#include "ares_dns.h"
+#include "openssl/rand.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+namespace {
+
+// Upper bound on the responses read in one wakeup, the others are read on the next one
+constexpr uint32_t MaxReadsPerWakeup = 64;
+
+} // namespace
+
+ForwarderImpl::ForwarderImpl(Event::Dispatcher& dispatcher,
+                             const Network::Address::InstanceConstSharedPtr& upstream,
+                             std::chrono::milliseconds timeout, uint32_t max_pending,
+                             Stats::Scope& scope, uint32_t port_count, uint32_t queries_per_port)
+    : dispatcher_(dispatcher), upstream_(upstream), timeout_(timeout),
+      max_pending_(std::min(max_pending, MaxPendingQueries)), queries_per_port_(queries_per_port),
+      sockets_(), timer_(dispatcher.createTimer([this]() -> void { onTimeout(); })),
+      pending_query_list_(), pending_queries_(), send_buffer_(),
+      receive_buffer_(Formats::MaxTcpMessageSize),
+      stats_({ALL_FORWARDER_STATS(POOL_COUNTER_PREFIX(scope, "forward."),
+                                  POOL_GAUGE_PREFIX(scope, "forward."),
+                                  POOL_HISTOGRAM_PREFIX(scope, "forward."))}) {
+  ASSERT(port_count > 0);
+  for (uint32_t i = 0; i < port_count; i++) {
+    sockets_.push_back(std::make_unique<UpstreamSocket>());
+    if (!connectSocket(*sockets_.back())) {
+      throw EnvoyException(
+          fmt::format("Failed to connect a socket to forward queries to {}", upstream->asString()));
+    }
+  }
+}
+
+ForwarderImpl::~ForwarderImpl() {
+  // The clients of the queries still pending do not get a response, as with a worker going away
+  stats_.query_pending_.sub(pending_query_list_.size());
+}
+
+uint32_t ForwarderImpl::random() {
+  uint32_t value;
+  RELEASE_ASSERT(RAND_bytes(reinterpret_cast<uint8_t*>(&value), sizeof(value)) == 1, "");
+  return value;
+}
+
+bool ForwarderImpl::connectSocket(UpstreamSocket& socket) {
+  // Connecting binds the socket to an ephemeral port, which the kernel picks at random
+  Network::IoHandlePtr io_handle = upstream_->socket(Network::Address::SocketType::Datagram);
+  const Api::SysCallIntResult result = upstream_->connect(io_handle->fd());
+  if (result.rc_ != 0) {
+    ENVOY_LOG(warn, "DnsFilter: failed to connect a socket to forward queries to {}: {}",
+              upstream_->asString(), strerror(result.errno_));
+    return false;
+  }
+
+  UpstreamSocket* upstream_socket = &socket;
+  socket.file_event_ = dispatcher_.createFileEvent(
+      io_handle->fd(), [this, upstream_socket](uint32_t) -> void { onReadReady(*upstream_socket); },
+      Event::FileTriggerType::Level, Event::FileReadyType::Read);
+  socket.io_handle_ = std::move(io_handle);
+  socket.queries_ = 0;
+  return true;
+}
+
+size_t ForwarderImpl::questionLength(absl::string_view query) {
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(query.data());
+  size_t offset = HFIXEDSZ;
+  while (true) {
+    if (offset >= query.size()) {
+      return 0;
+    }
+
+    const unsigned char label_len = data[offset];
+    if ((label_len & INDIR_MASK) == INDIR_MASK) {
+      offset += 2;
+      break;
+    }
+
+    offset += label_len + 1;
+    if (label_len == 0) {
+      break;
+    }
+  }
+
+  // The type and class of the question
+  offset += QFIXEDSZ;
+  return offset <= query.size() ? offset - HFIXEDSZ : 0;
+}
+
+bool ForwarderImpl::forward(const Formats::Message& dns_request, ResponseCb callback) {
+  const absl::string_view query = dns_request.raw();
+  ASSERT(dns_request.header().qdCount() == 1);
+
+  // The decoder checked that the question fits in the request
+  const size_t question_len = questionLength(query);
+  ASSERT(question_len > 0);
+
+  if (pending_query_list_.size() >= max_pending_) {
+    ENVOY_LOG(debug, "DnsFilter: not forwarding a query for {}. Too many pending queries",
+              dns_request.questionRecord().qName());
+    stats_.query_overflow_.inc();
+    return false;
+  }
+
+  UpstreamSocket& socket = pickSocket();
+  const uint16_t id = freeId();
+  send_buffer_.assign(query.data(), query.size());
+  DNS_HEADER_SET_QID(reinterpret_cast<unsigned char*>(&send_buffer_[0]), id);
+
+  Buffer::RawSlice slice{&send_buffer_[0], send_buffer_.size()};
+  const Api::IoCallUint64Result result = socket.io_handle_->writev(&slice, 1);
+  if (!result.ok()) {
+    // i.e. the send buffer of the socket is full, or the ICMP error of an earlier query
+    ENVOY_LOG(debug, "DnsFilter: failed to forward a query for {}: {}",
+              dns_request.questionRecord().qName(), result.err_->getErrorDetails());
+    stats_.send_error_.inc();
+    return false;
+  }
+
+  ENVOY_LOG(trace, "DnsFilter: forwarded query {} for {} as {}", dns_request.header().id(),
+            dns_request.questionRecord().qName(), id);
+
+  if (pending_query_list_.empty()) {
+    timer_->enableTimer(timeout_);
+  }
+
+  // The decoded request is only valid until the next request is decoded. Keep a copy of it until
+  // the query completes.
+  const MonotonicTime now = dispatcher_.timeSource().monotonicTime();
+  auto pending_query =
+      pending_query_list_.emplace(pending_query_list_.end(), socket, id, now, now + timeout_);
+  pending_query->request_ = dns_request.clone();
+  pending_query->question_.assign(query.data() + HFIXEDSZ, question_len);
+  pending_query->callback_ = std::move(callback);
+  pending_queries_.emplace(id, pending_query);
+  socket.queries_++;
+  socket.pending_++;
+  stats_.query_.inc();
+  stats_.query_pending_.inc();
+
+  return true;
+}
+
+ForwarderImpl::UpstreamSocket& ForwarderImpl::pickSocket() {
+  const size_t first = random() % sockets_.size();
+  for (size_t i = 0; i < sockets_.size(); i++) {
+    UpstreamSocket& socket = *sockets_[(first + i) % sockets_.size()];
+    if (socket.queries_ < queries_per_port_) {
+      return socket;
+    }
+
+    // Its responses can no longer arrive on the port it is moved away from
+    if (socket.pending_ == 0 && connectSocket(socket)) {
+      return socket;
+    }
+  }
+
+  // All the sockets wait for their queries to complete before moving to a new port
+  return *sockets_[first];
+}
+
+uint16_t ForwarderImpl::freeId() {
+  ASSERT(pending_queries_.size() < MaxPendingQueries + 1);
+  uint16_t id;
+  do {
+    id = static_cast<uint16_t>(random());
+  } while (pending_queries_.count(id) > 0);
+
+  return id;
+}
+
+void ForwarderImpl::onReadReady(UpstreamSocket& socket) {
+  // The event is level triggered, the datagrams left over are read on the next wakeup
+  for (uint32_t i = 0; i < MaxReadsPerWakeup; i++) {
+    Buffer::RawSlice slice{receive_buffer_.data(), receive_buffer_.size()};
+    const Api::IoCallUint64Result result =
+        socket.io_handle_->readv(receive_buffer_.size(), &slice, 1);
+    if (result.ok()) {
+      onResponse(socket, result.rc_);
+      continue;
+    }
+
+    if (result.err_->getErrorCode() == Api::IoError::IoErrorCode::Again) {
+      return;
+    }
+
+    // i.e. the ICMP error of an earlier query, which is left to time out
+    ENVOY_LOG(debug, "DnsFilter: failed to read a forwarded response: {}",
+              result.err_->getErrorDetails());
+  }
+}
+
+void ForwarderImpl::onResponse(UpstreamSocket& socket, size_t response_len) {
+  unsigned char* response = receive_buffer_.data();
+  if (response_len < HFIXEDSZ || DNS_HEADER_QR(response) == 0) {
+    ENVOY_LOG(debug, "DnsFilter: dropping a forwarded response of {} bytes that is not a response",
+              response_len);
+    stats_.response_dropped_.inc();
+    return;
+  }
+
+  // A late response to a query that timed out finds no query, or the one that took over its ID
+  // after it, with another question
+  auto it = pending_queries_.find(DNS_HEADER_QID(response));
+  if (it == pending_queries_.end()) {
+    ENVOY_LOG(debug, "DnsFilter: dropping a forwarded response {} without a pending query",
+              DNS_HEADER_QID(response));
+    stats_.response_dropped_.inc();
+    return;
+  }
+
+  // The ID of a query sent from another port is only guessed
+  if (&it->second->socket_ != &socket) {
+    ENVOY_LOG(debug, "DnsFilter: dropping a forwarded response {} received on another port",
+              DNS_HEADER_QID(response));
+    stats_.response_dropped_.inc();
+    return;
+  }
+
+  const std::string& question = it->second->question_;
+  if (DNS_HEADER_QDCOUNT(response) != 1 || response_len < HFIXEDSZ + question.size() ||
+      memcmp(response + HFIXEDSZ, question.data(), question.size()) != 0) {
+    ENVOY_LOG(debug, "DnsFilter: dropping a forwarded response {} for another question",
+              DNS_HEADER_QID(response));
+    stats_.response_dropped_.inc();
+    return;
+  }
+
+  PendingQuery query = std::move(*it->second);
+  pending_query_list_.erase(it->second);
+  pending_queries_.erase(it);
+  socket.pending_--;
+
+  // The timer is left armed for an earlier deadline. It is re-armed for the next one once it fires.
+  if (pending_query_list_.empty()) {
+    timer_->disableTimer();
+  }
+
+  stats_.response_.inc();
+  stats_.query_pending_.dec();
+  stats_.query_latency_.recordValue(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                        dispatcher_.timeSource().monotonicTime() - query.issued_)
+                                        .count());
+
+  DNS_HEADER_SET_QID(response, query.request_->header().id());
+  Buffer::OwnedImpl response_buffer(response, response_len);
+  query.callback_(*query.request_, response_buffer);
+}
+
+void ForwarderImpl::onTimeout() {
+  const MonotonicTime now = dispatcher_.timeSource().monotonicTime();
+
+  while (!pending_query_list_.empty() && pending_query_list_.front().deadline_ <= now) {
+    PendingQuery query = std::move(pending_query_list_.front());
+    pending_queries_.erase(query.id_);
+    pending_query_list_.pop_front();
+    query.socket_.pending_--;
+
+    ENVOY_LOG(debug, "DnsFilter: forwarded query for {} timed out",
+              query.request_->questionRecord().qName());
+    stats_.query_timeout_.inc();
+    stats_.query_pending_.dec();
+
+    Buffer::OwnedImpl response_buffer;
+    query.request_->createResponseMessage({SERVFAIL, false})->encode(response_buffer);
+    query.callback_(*query.request_, response_buffer);
+  }
+
+  if (!pending_query_list_.empty()) {
+    // The remaining time is truncated, keep the timer from firing before the deadline
+    const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        pending_query_list_.front().deadline_ - now);
+    timer_->enableTimer(remaining + std::chrono::milliseconds(1));
+  }
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "envoy/common/time.h"
+#include "envoy/event/dispatcher.h"
+#include "envoy/event/file_event.h"
+#include "envoy/event/timer.h"
+#include "envoy/network/address.h"
+#include "envoy/network/io_handle.h"
+#include "envoy/stats/scope.h"
+#include "envoy/stats/stats_macros.h"
+
+#include "common/common/logger.h"
+
+#include "src/dns_forwarder.h"
+
+#include "absl/strings/string_view.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+/**
+ * All forwarder stats, in the "forward." scope below the scope of the filter. @see stats_macros.h
+ */
+// clang-format off
+#define ALL_FORWARDER_STATS(COUNTER, GAUGE, HISTOGRAM)                                             \
+  COUNTER(query)                                                                                   \
+  COUNTER(query_overflow)                                                                          \
+  COUNTER(query_timeout)                                                                           \
+  COUNTER(send_error)                                                                              \
+  COUNTER(response)                                                                                \
+  COUNTER(response_dropped)                                                                        \
+  GAUGE(query_pending, Accumulate)                                                                 \
+  HISTOGRAM(query_latency)
+// clang-format on
+
+/**
+ * Struct definition for all forwarder stats. @see stats_macros.h
+ */
+struct ForwarderStats {
+  ALL_FORWARDER_STATS(GENERATE_COUNTER_STRUCT, GENERATE_GAUGE_STRUCT, GENERATE_HISTOGRAM_STRUCT)
+};
+
+/**
+ * Implementation of Forwarder over UDP sockets connected to the upstream, so that the kernel drops
+ * the datagrams of any other source. Each socket is bound to a port the kernel picks at random.
+ *
+ * Every query is sent from one of the sockets picked at random, with an ID of its own drawn from
+ * a CSPRNG. A response is only taken for the pending query with its ID if it arrives on the socket
+ * the query was sent from and echoes the question of the query. A spoofed response then has to
+ * guess the port along with the ID (RFC 5452 section 9.2), although among port_count ports rather
+ * than among all of them.
+ *
+ * A socket that sent queries_per_port queries is replaced by a socket on a new port once its
+ * queries completed. It is not picked for new queries meanwhile, unless all the sockets are.
+ */
+class ForwarderImpl : public Forwarder, Logger::Loggable<Logger::Id::filter> {
+public:
+  static constexpr uint32_t DefaultPortCount = 16;
+  static constexpr uint32_t DefaultQueriesPerPort = 1024;
+
+  /**
+   * @param timeout is the time after which a query that was not answered gets a SERVFAIL response.
+   * @param max_pending is the maximum number of queries in flight.
+   * @param scope is the scope of the filter.
+   * @param port_count is the number of sockets the queries are spread over.
+   * @param queries_per_port is the number of queries after which a socket moves to a new port.
+   * Throws an EnvoyException if the sockets to the upstream cannot be set up.
+   */
+  ForwarderImpl(Event::Dispatcher& dispatcher,
+                const Network::Address::InstanceConstSharedPtr& upstream,
+                std::chrono::milliseconds timeout, uint32_t max_pending, Stats::Scope& scope,
+                uint32_t port_count = DefaultPortCount,
+                uint32_t queries_per_port = DefaultQueriesPerPort);
+  ~ForwarderImpl();
+
+  // Forwarder
+  bool forward(const Formats::Message& dns_request, ResponseCb callback) override;
+
+  /**
+   * @return the length of the question section of query, which holds a single question, or 0 if
+   * the question runs past the end of query.
+   */
+  static size_t questionLength(absl::string_view query);
+
+private:
+  struct UpstreamSocket {
+    Network::IoHandlePtr io_handle_;
+    // Destroyed before the socket it watches is closed
+    Event::FileEventPtr file_event_;
+    // Queries sent since the socket was connected
+    uint32_t queries_{0};
+    uint32_t pending_{0};
+  };
+
+  struct PendingQuery {
+    PendingQuery(UpstreamSocket& socket, uint16_t id, MonotonicTime issued,
+                 MonotonicTime deadline)
+        : socket_(socket), id_(id), issued_(issued), deadline_(deadline) {}
+
+    // The socket the query was sent from, which is not replaced while the query is pending
+    UpstreamSocket& socket_;
+    // The ID the query was sent upstream with
+    const uint16_t id_;
+    const MonotonicTime issued_;
+    const MonotonicTime deadline_;
+    Formats::RequestMessageConstSharedPtr request_;
+    // The question section of the query, which the response echoes
+    std::string question_;
+    ResponseCb callback_;
+  };
+
+  // All queries share the same timeout, so a list in the order the queries were sent is also
+  // ordered by their deadlines. A single timer armed for the earliest deadline expires them all.
+  typedef std::list<PendingQuery> PendingQueryList;
+
+  // Random IDs are drawn until a free one comes up, which stays cheap as long as most of the IDs
+  // are free
+  static constexpr uint32_t MaxPendingQueries = 32768;
+
+  // A value drawn from the CSPRNG
+  static uint32_t random();
+
+  /**
+   * Connects socket to the upstream from a new port, in place of the port it had.
+   * @return false if a new socket could not be connected, in which case socket is left as it was.
+   */
+  bool connectSocket(UpstreamSocket& socket);
+
+  // The socket to send the next query from
+  UpstreamSocket& pickSocket();
+  uint16_t freeId();
+  void onReadReady(UpstreamSocket& socket);
+  void onResponse(UpstreamSocket& socket, size_t response_len);
+  void onTimeout();
+
+  Event::Dispatcher& dispatcher_;
+  const Network::Address::InstanceConstSharedPtr upstream_;
+  const std::chrono::milliseconds timeout_;
+  const uint32_t max_pending_;
+  const uint32_t queries_per_port_;
+  std::vector<std::unique_ptr<UpstreamSocket>> sockets_;
+  Event::TimerPtr timer_;
+  PendingQueryList pending_query_list_;
+  std::unordered_map<uint16_t, PendingQueryList::iterator> pending_queries_;
+  // Reused for every datagram sent and received
+  std::string send_buffer_;
+  std::vector<unsigned char> receive_buffer_;
+  ForwarderStats stats_;
+};
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
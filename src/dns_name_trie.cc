@@ -0,0 +1,233 @@
+#include <algorithm>
+
+#include "src/dns_name_trie.h"
+
+#include "absl/strings/ascii.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+constexpr absl::string_view DomainNameTrie::WildcardLabel;
+constexpr absl::string_view DomainNameTrie::ClusterLabel;
+
+DomainNameTrie::DomainNameTrie() : nodes_(1) {}
+
+bool DomainNameTrie::isPattern(absl::string_view name) {
+  const absl::string_view first_label = firstLabel(name);
+  return first_label == WildcardLabel || first_label == ClusterLabel;
+}
+
+void DomainNameTrie::addSuffix(absl::string_view suffix) {
+  // Accept suffixes written with a leading dot, i.e ".example.com"
+  if (!suffix.empty() && suffix.front() == '.') {
+    suffix.remove_prefix(1);
+  }
+
+  nodes_[addName(suffix)].suffix_ = true;
+}
+
+void DomainNameTrie::addEntry(absl::string_view name, const std::string& cluster_name) {
+  const uint32_t cluster_index = internClusterName(cluster_name);
+
+  name = trimRoot(name);
+  const absl::string_view first_label = firstLabel(name);
+  const absl::string_view parent =
+      first_label.size() < name.size() ? name.substr(first_label.size() + 1) : absl::string_view();
+
+  if (first_label == WildcardLabel) {
+    nodes_[addName(parent)].wildcard_cluster_index_ = cluster_index;
+  } else if (first_label == ClusterLabel) {
+    nodes_[addName(parent)].template_cluster_index_ = cluster_index;
+  } else {
+    nodes_[addName(name)].cluster_index_ = cluster_index;
+  }
+}
+
+void DomainNameTrie::addRecords(absl::string_view name, std::vector<uint32_t> ipv4,
+                                std::vector<absl::uint128> ipv6) {
+  Node& node = nodes_[addName(name)];
+  if (node.records_index_ == NoRecords) {
+    node.records_index_ = static_cast<uint32_t>(records_.size());
+    records_.emplace_back();
+  }
+
+  Records& records = records_[node.records_index_];
+  records.ipv4_ = std::move(ipv4);
+  records.ipv6_ = std::move(ipv6);
+}
+
+DomainNameMatch DomainNameTrie::find(absl::string_view name) const {
+  DomainNameMatch match;
+  // The cluster of the pattern entry furthest down the name, used if the name has no entry
+  uint32_t pattern_cluster_index = NoCluster;
+  absl::string_view cluster_label;
+
+  name = trimRoot(name);
+
+  const Node* node = &nodes_[0];
+  size_t end = name.size();
+  bool consumed = name.empty();
+
+  while (true) {
+    match.known_suffix_ = match.known_suffix_ || node->suffix_;
+    if (consumed) {
+      break;
+    }
+
+    // Walk the labels from the right most one
+    const size_t dot = (end == 0) ? absl::string_view::npos : name.rfind('.', end - 1);
+    const size_t begin = (dot == absl::string_view::npos) ? 0 : dot + 1;
+
+    // The rest of the name is below node
+    if (node->wildcard_cluster_index_ != NoCluster) {
+      pattern_cluster_index = node->wildcard_cluster_index_;
+      cluster_label = absl::string_view();
+    }
+    if (node->template_cluster_index_ != NoCluster && dot == absl::string_view::npos &&
+        end > begin) {
+      pattern_cluster_index = node->template_cluster_index_;
+      cluster_label = name.substr(begin, end - begin);
+    }
+
+    node = findChild(*node, name.substr(begin, end - begin));
+    if (node == nullptr) {
+      break;
+    }
+
+    consumed = (dot == absl::string_view::npos);
+    end = consumed ? 0 : dot;
+  }
+
+  if (node != nullptr && node->records_index_ != NoRecords) {
+    const Records& records = records_[node->records_index_];
+    match.static_records_ = {records.ipv4_.data(), records.ipv4_.size(), records.ipv6_.data(),
+                             records.ipv6_.size()};
+  }
+
+  if (node != nullptr && node->cluster_index_ != NoCluster) {
+    match.cluster_name_ = &cluster_names_[node->cluster_index_];
+  } else if (pattern_cluster_index != NoCluster) {
+    match.cluster_name_ = &cluster_names_[pattern_cluster_index];
+    match.cluster_label_ = cluster_label;
+  }
+
+  return match;
+}
+
+void DomainNameTrie::shrinkToFit() {
+  for (auto& node : nodes_) {
+    node.children_.shrink_to_fit();
+  }
+
+  nodes_.shrink_to_fit();
+  labels_.shrink_to_fit();
+  cluster_names_.shrink_to_fit();
+  records_.shrink_to_fit();
+}
+
+absl::string_view DomainNameTrie::trimRoot(absl::string_view name) {
+  // A fully qualified name ends with the empty root label
+  if (!name.empty() && name.back() == '.') {
+    name.remove_suffix(1);
+  }
+
+  return name;
+}
+
+absl::string_view DomainNameTrie::firstLabel(absl::string_view name) {
+  return name.substr(0, name.find('.'));
+}
+
+int DomainNameTrie::compareLabel(absl::string_view stored_label, absl::string_view label) {
+  // Stored labels are lower case. Only the label being looked up needs to be folded.
+  const size_t size = std::min(stored_label.size(), label.size());
+  for (size_t i = 0; i < size; i++) {
+    const char c = absl::ascii_tolower(label[i]);
+    if (stored_label[i] != c) {
+      return stored_label[i] < c ? -1 : 1;
+    }
+  }
+
+  if (stored_label.size() == label.size()) {
+    return 0;
+  }
+
+  return stored_label.size() < label.size() ? -1 : 1;
+}
+
+uint32_t DomainNameTrie::addName(absl::string_view name) {
+  name = trimRoot(name);
+
+  uint32_t index = 0;
+  size_t end = name.size();
+  bool consumed = name.empty();
+
+  while (!consumed) {
+    const size_t dot = (end == 0) ? absl::string_view::npos : name.rfind('.', end - 1);
+    const size_t begin = (dot == absl::string_view::npos) ? 0 : dot + 1;
+    const absl::string_view child_label = name.substr(begin, end - begin);
+
+    auto& children = nodes_[index].children_;
+    auto child_it = lowerBound(nodes_[index], child_label);
+
+    if (child_it != children.end() && compareLabel(label(*child_it), child_label) == 0) {
+      index = child_it->node_;
+    } else {
+      const uint32_t child_index = static_cast<uint32_t>(nodes_.size());
+      const uint32_t label_offset = static_cast<uint32_t>(labels_.size());
+      labels_.append(absl::AsciiStrToLower(child_label));
+      children.insert(child_it,
+                      {label_offset, static_cast<uint32_t>(child_label.size()), child_index});
+
+      // Adding the node may reallocate nodes_ and invalidate children
+      nodes_.emplace_back();
+      index = child_index;
+    }
+
+    consumed = (dot == absl::string_view::npos);
+    end = consumed ? 0 : dot;
+  }
+
+  return index;
+}
+
+uint32_t DomainNameTrie::internClusterName(const std::string& cluster_name) {
+  auto it = cluster_indexes_.find(cluster_name);
+  if (it != cluster_indexes_.end()) {
+    return it->second;
+  }
+
+  const uint32_t cluster_index = static_cast<uint32_t>(cluster_names_.size());
+  cluster_names_.push_back(cluster_name);
+  cluster_indexes_.emplace(cluster_name, cluster_index);
+  return cluster_index;
+}
+
+absl::string_view DomainNameTrie::label(const Child& child) const {
+  return absl::string_view(labels_).substr(child.label_offset_, child.label_size_);
+}
+
+std::vector<DomainNameTrie::Child>::const_iterator
+DomainNameTrie::lowerBound(const Node& node, absl::string_view label) const {
+  return std::lower_bound(node.children_.begin(), node.children_.end(), label,
+                          [this](const Child& child, absl::string_view label) -> bool {
+                            return compareLabel(this->label(child), label) < 0;
+                          });
+}
+
+const DomainNameTrie::Node* DomainNameTrie::findChild(const Node& node,
+                                                      absl::string_view label) const {
+  auto child_it = lowerBound(node, label);
+  if (child_it == node.children_.end() || compareLabel(this->label(*child_it), label) != 0) {
+    return nullptr;
+  }
+
+  return &nodes_[child_it->node_];
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
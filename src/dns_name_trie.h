@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "envoy/common/pure.h"
+
+#include "absl/numeric/int128.h"
+#include "absl/strings/string_view.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+/**
+ * The static A and AAAA records of a name, in network byte order as in their RDATA. The addresses
+ * are owned by the known names the name was matched against.
+ */
+struct StaticRecords {
+  const uint32_t* ipv4_{nullptr};
+  size_t ipv4_count_{0};
+  const absl::uint128* ipv6_{nullptr};
+  size_t ipv6_count_{0};
+
+  bool empty() const { return ipv4_count_ == 0 && ipv6_count_ == 0; }
+};
+
+/**
+ * Result of matching a domain name against the known domain name suffixes and dns entries.
+ */
+struct DomainNameMatch {
+  // True if the name is at or below one of the known domain name suffixes
+  bool known_suffix_{false};
+  // The cluster of the dns entry for the name. nullptr if there is no entry for the name.
+  const std::string* cluster_name_{nullptr};
+  // Set if the name was matched by a {cluster} entry, to the label of the name that replaces
+  // {cluster} in cluster_name_
+  absl::string_view cluster_label_;
+  // The static records of the name itself. Patterns do not have static records.
+  StaticRecords static_records_;
+  // Owns cluster_name_ if it was built for the name from a {cluster} entry, so that it stays valid
+  // as long as the match, whatever names are matched meanwhile
+  std::shared_ptr<const std::string> built_cluster_name_;
+};
+
+/**
+ * The known domain name suffixes and dns entries that names are matched against. Lookups do not
+ * modify the known names, so they can be shared by all the workers.
+ */
+class DomainNameMatcher {
+public:
+  virtual ~DomainNameMatcher() = default;
+
+  /**
+   * Matches a dotted domain name against the suffixes and the dns entries. The cluster name of a
+   * {cluster} entry is returned as it was added, along with the label that replaces {cluster}.
+   */
+  virtual DomainNameMatch find(absl::string_view name) const PURE;
+};
+
+typedef std::shared_ptr<const DomainNameMatcher> DomainNameMatcherConstSharedPtr;
+
+/**
+ * A trie of domain names keyed on their labels in reverse order, i.e "a.b.example.com" is stored
+ * as com -> example -> b -> a. Known domain name suffixes and dns entries are kept in the same
+ * trie, so both are matched with a single walk over the labels of a name. The cost of a lookup
+ * depends on the number of labels in the name and not on the number of suffixes or entries.
+ *
+ * Labels are compared case insensitively and only match on label boundaries, so "example.com"
+ * matches "a.example.com" but not "anexample.com".
+ *
+ * The trie is laid out for configs with many entries: the labels are kept back to back in a
+ * single string, and every cluster name is stored once however many entries refer to it. Lookups
+ * do not modify the trie, so a built trie can be shared by all the workers.
+ *
+ * The first label of an entry can be a pattern, which is kept on the node of the rest of the name
+ * and matched during the same walk:
+ * - "*.canary.example.com" matches every name below canary.example.com.
+ * - "{cluster}.svc.example.com" matches the names one label below svc.example.com. The cluster
+ *   name of the entry may refer to that label as {cluster}, i.e. "{cluster}-prod".
+ * An entry for the name itself takes precedence over patterns, and a pattern further down the
+ * name over one further up.
+ */
+class DomainNameTrie : public DomainNameMatcher {
+public:
+  static constexpr absl::string_view WildcardLabel = "*";
+  static constexpr absl::string_view ClusterLabel = "{cluster}";
+
+  DomainNameTrie();
+
+  /**
+   * @return true if the first label of name is a pattern.
+   */
+  static bool isPattern(absl::string_view name);
+
+  /**
+   * Adds a known domain name suffix. Names at or below the suffix belong to the known domain.
+   */
+  void addSuffix(absl::string_view suffix);
+
+  /**
+   * Adds a dns entry for name. An existing entry for the same name is replaced.
+   */
+  void addEntry(absl::string_view name, const std::string& cluster_name);
+
+  /**
+   * Adds static A and AAAA records for name, in network byte order. Existing records for the same
+   * name are replaced.
+   */
+  void addRecords(absl::string_view name, std::vector<uint32_t> ipv4,
+                  std::vector<absl::uint128> ipv6);
+
+  // DomainNameMatcher
+  DomainNameMatch find(absl::string_view name) const override;
+
+  /**
+   * Releases the memory set aside for names that are added later. Called once all the names of
+   * a config were added, names can still be added afterwards.
+   */
+  void shrinkToFit();
+
+private:
+  // Lays the trie out in a snapshot, and walks snapshots the same way
+  friend class DnsSnapshot;
+
+  static constexpr uint32_t NoCluster = UINT32_MAX;
+  static constexpr uint32_t NoRecords = UINT32_MAX;
+
+  struct Child {
+    // The label of the child is label_size_ bytes at label_offset_ of labels_
+    uint32_t label_offset_;
+    uint32_t label_size_;
+    uint32_t node_;
+  };
+
+  struct Node {
+    // Sorted on the label so that children can be binary searched during lookups
+    std::vector<Child> children_;
+    // Index of the cluster of the dns entry for the node in cluster_names_, or NoCluster
+    uint32_t cluster_index_{NoCluster};
+    // The clusters of the "*" and "{cluster}" entries one label below the node, or NoCluster
+    uint32_t wildcard_cluster_index_{NoCluster};
+    uint32_t template_cluster_index_{NoCluster};
+    // Index of the static records of the node in records_, or NoRecords
+    uint32_t records_index_{NoRecords};
+    bool suffix_{false};
+  };
+
+  struct Records {
+    std::vector<uint32_t> ipv4_;
+    std::vector<absl::uint128> ipv6_;
+  };
+
+  static absl::string_view trimRoot(absl::string_view name);
+  static absl::string_view firstLabel(absl::string_view name);
+  static int compareLabel(absl::string_view stored_label, absl::string_view label);
+
+  uint32_t addName(absl::string_view name);
+  uint32_t internClusterName(const std::string& cluster_name);
+  absl::string_view label(const Child& child) const;
+  std::vector<Child>::const_iterator lowerBound(const Node& node, absl::string_view label) const;
+  const Node* findChild(const Node& node, absl::string_view label) const;
+
+  // nodes_[0] is the root of the trie
+  std::vector<Node> nodes_;
+  // The lower case labels of all the nodes
+  std::string labels_;
+  std::vector<std::string> cluster_names_;
+  std::unordered_map<std::string, uint32_t> cluster_indexes_;
+  std::vector<Records> records_;
+};
+
+typedef std::shared_ptr<const DomainNameTrie> DomainNameTrieConstSharedPtr;
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
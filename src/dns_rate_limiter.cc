@@ -0,0 +1,191 @@
+#include "src/dns_rate_limiter.h"
+
+#include <arpa/nameser.h>
+#include <arpa/nameser_compat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "common/common/assert.h"
+
+#include "absl/strings/ascii.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+namespace {
+
+// FNV-1a, 64 bit
+constexpr uint64_t FnvOffsetBasis = 14695981039346656037ULL;
+constexpr uint64_t FnvPrime = 1099511628211ULL;
+
+uint64_t hashByte(uint64_t hash, uint8_t byte) { return (hash ^ byte) * FnvPrime; }
+
+// Hashes the first prefix_length bits of the address in network byte order
+uint64_t hashPrefix(uint64_t hash, const uint8_t* address, uint32_t prefix_length) {
+  const uint32_t full_bytes = prefix_length / 8;
+  for (uint32_t i = 0; i < full_bytes; i++) {
+    hash = hashByte(hash, address[i]);
+  }
+
+  const uint32_t remaining_bits = prefix_length % 8;
+  if (remaining_bits != 0) {
+    const uint8_t mask = static_cast<uint8_t>(0xff << (8 - remaining_bits));
+    hash = hashByte(hash, address[full_bytes] & mask);
+  }
+
+  // Keeps the prefixes of the two families apart
+  return hashByte(hash, static_cast<uint8_t>(prefix_length));
+}
+
+// The tag of the bucket of hash, never 0
+uint32_t bucketTag(uint64_t hash) { return std::max<uint32_t>(hash >> 32, 1); }
+
+// The zone a name is accounted to while it is not answered, its last two labels
+absl::string_view zoneOf(absl::string_view name) {
+  const size_t last_dot = name.rfind('.');
+  if (last_dot == absl::string_view::npos || last_dot == 0) {
+    return name;
+  }
+
+  const size_t zone_dot = name.rfind('.', last_dot - 1);
+  return zone_dot == absl::string_view::npos ? name : name.substr(zone_dot + 1);
+}
+
+uint32_t milliseconds(MonotonicTime time) {
+  return static_cast<uint32_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count());
+}
+
+} // namespace
+
+ResponseRateLimiter::ResponseRateLimiter(const ResponseRateLimitSettings& settings)
+    : slip_(settings.slip_), ipv4_prefix_length_(settings.ipv4_prefix_length_),
+      ipv6_prefix_length_(settings.ipv6_prefix_length_),
+      refill_per_ms_(settings.responses_per_second_),
+      burst_(static_cast<int64_t>(settings.responses_per_second_) * ResponseCost),
+      initial_credit_(std::max(burst_ / 2, int64_t{ResponseCost})),
+      buckets_(settings.table_size_, Bucket{}) {
+  ASSERT((settings.table_size_ & (settings.table_size_ - 1)) == 0);
+}
+
+ResponseRateLimiter::Action ResponseRateLimiter::check(const Network::Address::Instance& client,
+                                                       const std::string& name,
+                                                       MonotonicTime now) {
+  const uint64_t answer_hash = keyHash(client, ResponseClass::Answer, name);
+  if (answer_hash == 0) {
+    return Action::Respond;
+  }
+
+  const uint32_t now_ms = milliseconds(now);
+  Bucket* limited = findBucket(answer_hash);
+  if (limited != nullptr) {
+    refill(*limited, now_ms);
+  } else {
+    limited = &bucket(keyHash(client, ResponseClass::Error, zoneOf(name)), now_ms);
+  }
+
+  if (limited->credit_ >= ResponseCost) {
+    limited->credit_ -= ResponseCost;
+    return Action::Respond;
+  }
+
+  if (slip_ == 0 || ++limited->limited_count_ < slip_) {
+    return Action::Drop;
+  }
+
+  limited->limited_count_ = 0;
+  return Action::Slip;
+}
+
+void ResponseRateLimiter::onResponse(const Network::Address::Instance& client,
+                                     const std::string& name, uint16_t response_code,
+                                     MonotonicTime now) {
+  const uint64_t hash = keyHash(client, ResponseClass::Answer, name);
+  if (hash == 0) {
+    return;
+  }
+
+  if (response_code == NOERROR) {
+    bucket(hash, milliseconds(now));
+    return;
+  }
+
+  // The bucket may have been taken over while the query was resolved
+  Bucket* answered = findBucket(hash);
+  if (answered != nullptr) {
+    answered->tag_ = 0;
+  }
+}
+
+uint64_t ResponseRateLimiter::keyHash(const Network::Address::Instance& client,
+                                      ResponseClass response_class,
+                                      absl::string_view name) const {
+  const Network::Address::Ip* ip = client.ip();
+  if (ip == nullptr) {
+    return 0;
+  }
+
+  uint64_t hash = FnvOffsetBasis;
+  if (ip->ipv4() != nullptr) {
+    const uint32_t address = ip->ipv4()->address();
+    uint8_t bytes[sizeof(address)];
+    memcpy(bytes, &address, sizeof(address));
+    hash = hashPrefix(hash, bytes, ipv4_prefix_length_);
+  } else {
+    const absl::uint128 address = ip->ipv6()->address();
+    uint8_t bytes[sizeof(address)];
+    memcpy(bytes, &address, sizeof(address));
+    hash = hashPrefix(hash, bytes, ipv6_prefix_length_);
+  }
+
+  hash = hashByte(hash, static_cast<uint8_t>(response_class));
+  for (const char c : name) {
+    hash = hashByte(hash, static_cast<uint8_t>(absl::ascii_tolower(c)));
+  }
+
+  return hash == 0 ? 1 : hash;
+}
+
+ResponseRateLimiter::Bucket* ResponseRateLimiter::findBucket(uint64_t hash) {
+  Bucket& found = buckets_[hash & (buckets_.size() - 1)];
+  return found.tag_ == bucketTag(hash) ? &found : nullptr;
+}
+
+ResponseRateLimiter::Bucket& ResponseRateLimiter::bucket(uint64_t hash, uint32_t now_ms) {
+  Bucket& found = buckets_[hash & (buckets_.size() - 1)];
+  const uint32_t tag = bucketTag(hash);
+  if (found.tag_ == tag) {
+    refill(found, now_ms);
+    return found;
+  }
+
+  // Keys that keep taking the bucket from each other share its credit
+  if (found.tag_ != 0) {
+    refill(found, now_ms);
+    found.credit_ = static_cast<int32_t>(std::min<int64_t>(found.credit_, initial_credit_));
+  } else {
+    found.credit_ = static_cast<int32_t>(initial_credit_);
+  }
+
+  found.tag_ = tag;
+  found.last_refill_ms_ = now_ms;
+  found.limited_count_ = 0;
+  return found;
+}
+
+void ResponseRateLimiter::refill(Bucket& bucket, uint32_t now_ms) const {
+  // Wraps around along with the clock
+  const uint32_t elapsed_ms = now_ms - bucket.last_refill_ms_;
+  bucket.last_refill_ms_ = now_ms;
+  const int64_t credit = bucket.credit_ + static_cast<int64_t>(elapsed_ms) * refill_per_ms_;
+  bucket.credit_ = static_cast<int32_t>(std::min(burst_, credit));
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "envoy/common/time.h"
+#include "envoy/network/address.h"
+
+#include "src/dns_config.h"
+
+#include "absl/strings/string_view.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+/**
+ * Per worker response rate limiting. The queries of the clients of a network prefix are accounted
+ * in token buckets, which refill at responses_per_second up to a burst of one second.
+ *
+ * The class of the response is part of the key of a bucket. A name that was last answered with
+ * NOERROR has a bucket of its own, keyed by (prefix, name, answer). The queries for any other name
+ * share the bucket of its zone, the last two labels of the name, keyed by (prefix, zone, error).
+ * A flood of random names of a zone answered with NXDOMAIN, REFUSED or SERVFAIL is then limited
+ * as a whole.
+ *
+ * The buckets live in a table of fixed size that is indexed by the hash of their key, with no
+ * chaining. A bucket takes 16 bytes, so a lookup touches a single cache line. A key that hashes to
+ * the bucket of another one takes the bucket over, along with the credit left in it, up to half a
+ * burst. A key that starts an unused bucket gets half a burst as well, so that neither new keys
+ * nor colliding ones are a way around the rate.
+ */
+class ResponseRateLimiter {
+public:
+  enum class Action {
+    // Resolve the query
+    Respond,
+    // Answer with an empty, truncated response, so that the client retries over TCP
+    Slip,
+    // Drop the query
+    Drop
+  };
+
+  ResponseRateLimiter(const ResponseRateLimitSettings& settings);
+
+  /**
+   * Accounts a query for name from client, as soon as its question is decoded.
+   * @return what to do with the query.
+   */
+  Action check(const Network::Address::Instance& client, const std::string& name,
+               MonotonicTime now);
+
+  /**
+   * Moves name between the buckets of its classes once the response to a query let through by
+   * check() is known. A NOERROR response starts the answer bucket of the name, any other response
+   * code frees it so that the queries for the name are accounted to its zone again.
+   */
+  void onResponse(const Network::Address::Instance& client, const std::string& name,
+                  uint16_t response_code, MonotonicTime now);
+
+private:
+  // Credit is kept in thousandths of a response, so that it refills every millisecond
+  static constexpr int64_t ResponseCost = 1000;
+
+  enum class ResponseClass : uint8_t { Answer = 1, Error = 2 };
+
+  struct Bucket {
+    // The upper half of the hash of the key, never 0. An unused bucket has a tag of 0.
+    uint32_t tag_;
+    // Milliseconds of the monotonic clock, wrapping around every 49 days
+    uint32_t last_refill_ms_;
+    int32_t credit_;
+    // The queries beyond the rate since the last slipped one
+    uint8_t limited_count_;
+    uint8_t unused_[3];
+  };
+
+  static_assert(sizeof(Bucket) == 16, "Buckets must fit four to a cache line");
+
+  // The hash of the network prefix of client, the response class and the lower case name, or 0
+  // if the client does not have an ip address
+  uint64_t keyHash(const Network::Address::Instance& client, ResponseClass response_class,
+                   absl::string_view name) const;
+
+  // The bucket of hash, or nullptr if it is not in use by hash
+  Bucket* findBucket(uint64_t hash);
+
+  // The bucket of hash, taken over by it if it belonged to another key
+  Bucket& bucket(uint64_t hash, uint32_t now_ms);
+  void refill(Bucket& bucket, uint32_t now_ms) const;
+
+  const uint32_t slip_;
+  const uint32_t ipv4_prefix_length_;
+  const uint32_t ipv6_prefix_length_;
+  // Credit gained per millisecond, and the most a bucket holds
+  const int64_t refill_per_ms_;
+  const int64_t burst_;
+  // The most credit a bucket starts with
+  const int64_t initial_credit_;
+  std::vector<Bucket> buckets_;
+};
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,110 @@
+#include <arpa/nameser.h>
+#include <arpa/nameser_compat.h>
+
+#include <algorithm>
+
+#include "src/dns_recursive_cache.h"
+
+#include "common/common/assert.h"
+
+#include "absl/strings/ascii.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+RecursiveCache::RecursiveCache(TimeSource& time_source, std::chrono::seconds min_ttl,
+                               std::chrono::seconds max_ttl, uint32_t max_entries)
+    : time_source_(time_source), min_ttl_(min_ttl), max_ttl_(std::max(min_ttl, max_ttl)),
+      max_entries_(max_entries) {}
+
+const RecursiveResult* RecursiveCache::lookup(const std::string& dns_name, uint16_t q_type,
+                                              std::chrono::seconds& remaining_ttl) {
+  EntryMap& map = entries(q_type);
+  if (map.empty()) {
+    return nullptr;
+  }
+
+  auto it = map.find(key(dns_name));
+  if (it == map.end()) {
+    return nullptr;
+  }
+
+  // Entries are handed out for whole seconds only. Less than a second left counts as expired.
+  const MonotonicTime now = time_source_.monotonicTime();
+  remaining_ttl =
+      std::chrono::duration_cast<std::chrono::seconds>(it->second.expiry_it_->first - now);
+  if (remaining_ttl.count() <= 0) {
+    erase(map, it);
+    return nullptr;
+  }
+
+  return &it->second.result_;
+}
+
+void RecursiveCache::insert(const std::string& dns_name, uint16_t q_type,
+                            const RecursiveResult& result) {
+  if (!result.ttl_.has_value() || max_entries_ == 0) {
+    return;
+  }
+
+  const std::chrono::seconds ttl = clampTtl(result.ttl_.value());
+  if (ttl.count() <= 0) {
+    return;
+  }
+
+  EntryMap& map = entries(q_type);
+  auto it = map.find(key(dns_name));
+  if (it == map.end()) {
+    if (size() >= max_entries_) {
+      evict();
+    }
+
+    it = map.emplace(key_, Entry()).first;
+  } else {
+    expiry_index_.erase(it->second.expiry_it_);
+  }
+
+  Entry& entry = it->second;
+  entry.result_ = result;
+  entry.result_.ttl_ = ttl;
+  entry.expiry_it_ =
+      expiry_index_.emplace(time_source_.monotonicTime() + ttl, ExpiryRef{&map, &it->first});
+}
+
+std::chrono::seconds RecursiveCache::clampTtl(std::chrono::seconds ttl) const {
+  return std::min(std::max(ttl, min_ttl_), max_ttl_);
+}
+
+size_t RecursiveCache::size() const { return expiry_index_.size(); }
+
+RecursiveCache::EntryMap& RecursiveCache::entries(uint16_t q_type) {
+  ASSERT(q_type == T_A || q_type == T_AAAA);
+  return entries_[q_type == T_A ? 0 : 1];
+}
+
+const std::string& RecursiveCache::key(const std::string& dns_name) {
+  key_.assign(dns_name);
+  absl::AsciiStrToLower(&key_);
+  return key_;
+}
+
+void RecursiveCache::erase(EntryMap& map, EntryMap::iterator it) {
+  expiry_index_.erase(it->second.expiry_it_);
+  map.erase(it);
+}
+
+void RecursiveCache::evict() {
+  // Expired entries come first. If all of them are still live, the one closest to its expiry
+  // makes room for the new entry.
+  ASSERT(!expiry_index_.empty());
+  const ExpiryRef& ref = expiry_index_.begin()->second;
+  EntryMap& map = *ref.map_;
+  erase(map, map.find(*ref.key_));
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+#include "envoy/common/time.h"
+
+#include "src/dns_recursive_resolver.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+/**
+ * Per worker cache of recursive query results for A and AAAA questions, keyed on the lower case
+ * question name. Positive results are cached for the smallest TTL of their records, NXDOMAIN and
+ * NODATA results for the negative caching TTL of RFC 2308. Results that carry no TTL are not
+ * cached.
+ *
+ * TTLs are clamped to [min_ttl, max_ttl]. A cached result is handed out with the time it has
+ * left in the cache as its TTL, so downstream caches expire it at the same time as this one.
+ *
+ * The entries are also indexed on their expiry. A full cache makes room by dropping the entry that
+ * expires first, which is an expired one if there is any, in O(log n).
+ */
+class RecursiveCache {
+public:
+  /**
+   * @param max_entries bounds the number of cached results. 0 disables the cache.
+   */
+  RecursiveCache(TimeSource& time_source, std::chrono::seconds min_ttl,
+                 std::chrono::seconds max_ttl, uint32_t max_entries);
+
+  /**
+   * @param remaining_ttl is set to the time the result has left in the cache.
+   * @return the cached result for the question, or nullptr if there is none or it expired. The
+   * result is valid until the next call into the cache.
+   */
+  const RecursiveResult* lookup(const std::string& dns_name, uint16_t q_type,
+                                std::chrono::seconds& remaining_ttl);
+
+  /**
+   * Caches the result of a recursive query, unless its TTL is not set.
+   */
+  void insert(const std::string& dns_name, uint16_t q_type, const RecursiveResult& result);
+
+  /**
+   * @return ttl clamped to [min_ttl, max_ttl].
+   */
+  std::chrono::seconds clampTtl(std::chrono::seconds ttl) const;
+
+  /**
+   * @return the number of cached results, including the ones that expired but were not looked up
+   * since.
+   */
+  size_t size() const;
+
+private:
+  // A and AAAA
+  static constexpr size_t CachedQuestionTypes = 2;
+
+  struct Entry;
+  typedef std::unordered_map<std::string, Entry> EntryMap;
+
+  // Refers to an entry by its map and its key, which stay in place as long as the entry
+  struct ExpiryRef {
+    EntryMap* map_;
+    const std::string* key_;
+  };
+
+  typedef std::multimap<MonotonicTime, ExpiryRef> ExpiryIndex;
+
+  struct Entry {
+    RecursiveResult result_;
+    ExpiryIndex::iterator expiry_it_;
+  };
+
+  EntryMap& entries(uint16_t q_type);
+  const std::string& key(const std::string& dns_name);
+  void erase(EntryMap& map, EntryMap::iterator it);
+  // Drops the entry that expires first
+  void evict();
+
+  TimeSource& time_source_;
+  const std::chrono::seconds min_ttl_;
+  const std::chrono::seconds max_ttl_;
+  const uint32_t max_entries_;
+  std::array<EntryMap, CachedQuestionTypes> entries_;
+  // Every entry of entries_, ordered on expiry
+  ExpiryIndex expiry_index_;
+  // Reused to lower case the question name of each lookup
+  std::string key_;
+};
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
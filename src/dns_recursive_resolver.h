@@ -0,0 +1,61 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+
+#include "envoy/common/pure.h"
+#include "envoy/network/address.h"
+#include "envoy/network/dns.h"
+
+#include "absl/types/optional.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+/**
+ * Result of a recursive query for A or AAAA records.
+ */
+struct RecursiveResult {
+  // NOERROR, NXDOMAIN or SERVFAIL. A NOERROR result without addresses is a NODATA response.
+  uint16_t response_code_;
+  std::list<Network::Address::InstanceConstSharedPtr> addresses_;
+  // The smallest TTL of the answers, or the negative caching TTL of a NXDOMAIN or NODATA response
+  // as described in RFC 2308. Not set if the result must not be cached.
+  absl::optional<std::chrono::seconds> ttl_;
+};
+
+/**
+ * Issues recursive queries for names that are not known to the filter to the name servers in
+ * /etc/resolv.conf. Unlike Network::DnsResolver, the result carries the response code and the TTL
+ * of the upstream records, so that it can be cached.
+ */
+class RecursiveResolver {
+public:
+  virtual ~RecursiveResolver() = default;
+
+  /**
+   * Called when a recursive query completes.
+   */
+  typedef std::function<void(RecursiveResult&& result)> ResolveCb;
+
+  /**
+   * Queries the records of type q_type for dns_name.
+   * @param q_type is T_A or T_AAAA.
+   * @return a handle to cancel the query, or nullptr if the callback was invoked inline. A
+   * cancelled query does not invoke its callback, but implementations may let it run to completion.
+   */
+  virtual Network::ActiveDnsQuery* resolve(const std::string& dns_name, uint16_t q_type,
+                                           ResolveCb callback) PURE;
+};
+
+typedef std::unique_ptr<RecursiveResolver> RecursiveResolverPtr;
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,297 @@
+#include <arpa/nameser.h>
+#include <arpa/nameser_compat.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "src/dns_recursive_resolver_impl.h"
+
+#include "envoy/common/exception.h"
+
+#include "common/common/assert.h"
+#include "common/common/fmt.h"
+#include "common/network/address_impl.h"
+
+#include "absl/strings/str_join.h"
+#include "ares_dns.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+namespace {
+
+// Upper bound on the addresses taken from one response
+constexpr int MaxAddresses = 64;
+
+// Returns the offset just past the name at offset, or 0 if the name runs past the response
+size_t skipName(const unsigned char* response, size_t response_len, size_t offset) {
+  while (offset < response_len) {
+    const unsigned char label_len = response[offset];
+    if ((label_len & INDIR_MASK) == INDIR_MASK) {
+      return offset + 2 <= response_len ? offset + 2 : 0;
+    }
+
+    if (label_len == 0) {
+      return offset + 1;
+    }
+
+    offset += label_len + 1;
+  }
+
+  return 0;
+}
+
+} // namespace
+
+RecursiveResolverImpl::RecursiveResolverImpl(
+    Event::Dispatcher& dispatcher,
+    const std::vector<Network::Address::InstanceConstSharedPtr>& name_servers,
+    uint32_t max_in_flight)
+    : dispatcher_(dispatcher),
+      timer_(dispatcher.createTimer([this] { onEventCallback(ARES_SOCKET_BAD, 0); })),
+      max_in_flight_(max_in_flight) {
+  ares_options options;
+  std::memset(&options, 0, sizeof(options));
+  options.sock_state_cb = [](void* arg, int fd, int read, int write) {
+    static_cast<RecursiveResolverImpl*>(arg)->onAresSocketStateChange(fd, read, write);
+  };
+  options.sock_state_cb_data = this;
+
+  const int result = ares_init_options(&channel_, &options, ARES_OPT_SOCK_STATE_CB);
+  if (result != ARES_SUCCESS) {
+    throw EnvoyException(
+        fmt::format("Failed to initialize the recursive resolver: {}", ares_strerror(result)));
+  }
+
+  if (!name_servers.empty()) {
+    std::vector<std::string> name_server_list;
+    for (const auto& name_server : name_servers) {
+      name_server_list.push_back(name_server->asString());
+    }
+
+    const std::string name_servers_csv = absl::StrJoin(name_server_list, ",");
+    const int servers_result = ares_set_servers_ports_csv(channel_, name_servers_csv.c_str());
+    if (servers_result != ARES_SUCCESS) {
+      ares_destroy(channel_);
+      throw EnvoyException(fmt::format("Failed to set the name servers {}: {}", name_servers_csv,
+                                       ares_strerror(servers_result)));
+    }
+  }
+}
+
+RecursiveResolverImpl::~RecursiveResolverImpl() {
+  timer_->disableTimer();
+  ares_destroy(channel_);
+}
+
+Network::ActiveDnsQuery* RecursiveResolverImpl::resolve(const std::string& dns_name,
+                                                        uint16_t q_type, ResolveCb callback) {
+  ASSERT(q_type == T_A || q_type == T_AAAA);
+
+  // Queries that timed out upstream of the resolver stay in flight until c-ares gives up on them
+  if (in_flight_ >= max_in_flight_) {
+    ENVOY_LOG(debug, "DnsFilter: not resolving {}. {} queries in flight", dns_name, in_flight_);
+    callback(RecursiveResult{SERVFAIL, {}, absl::nullopt});
+    return nullptr;
+  }
+
+  std::unique_ptr<PendingQuery> pending_query(new PendingQuery(*this, q_type, callback));
+  in_flight_++;
+
+  ares_query(channel_, dns_name.c_str(), C_IN, q_type,
+             [](void* arg, int status, int, unsigned char* response, int response_len) {
+               static_cast<PendingQuery*>(arg)->onAresQueryCallback(status, response,
+                                                                    response_len);
+             },
+             pending_query.get());
+
+  // The query can fail inline, i.e. if the name cannot be encoded
+  if (pending_query->completed_) {
+    return nullptr;
+  }
+
+  pending_query->owned_ = true;
+  return pending_query.release();
+}
+
+void RecursiveResolverImpl::PendingQuery::onAresQueryCallback(int status,
+                                                              const unsigned char* response,
+                                                              int response_len) {
+  parent_.in_flight_--;
+
+  // Pending queries complete with ARES_EDESTRUCTION when the channel is destroyed
+  if (status == ARES_EDESTRUCTION) {
+    ASSERT(owned_);
+    delete this;
+    return;
+  }
+
+  completed_ = true;
+
+  if (!cancelled_) {
+    callback_(parseResponse(q_type_, status, response, response_len));
+  }
+
+  if (owned_) {
+    delete this;
+  }
+}
+
+RecursiveResult RecursiveResolverImpl::parseResponse(uint16_t q_type, int status,
+                                                     const unsigned char* response,
+                                                     int response_len) {
+  RecursiveResult result{NOERROR, {}, absl::nullopt};
+
+  switch (status) {
+  case ARES_SUCCESS:
+    break;
+  case ARES_ENODATA:
+    // The name exists, but has no records of the type
+    result.ttl_ = negativeTtl(response, response_len);
+    return result;
+  case ARES_ENOTFOUND:
+    result.response_code_ = NXDOMAIN;
+    result.ttl_ = negativeTtl(response, response_len);
+    return result;
+  default:
+    // Timeouts, refused queries and server failures are not cached
+    ENVOY_LOG(debug, "DnsFilter: recursive query failed: {}", ares_strerror(status));
+    result.response_code_ = SERVFAIL;
+    return result;
+  }
+
+  int address_count = MaxAddresses;
+  uint32_t min_ttl = UINT32_MAX;
+
+  if (q_type == T_A) {
+    ares_addrttl addresses[MaxAddresses];
+    status = ares_parse_a_reply(response, response_len, nullptr, addresses, &address_count);
+    if (status == ARES_SUCCESS) {
+      for (int i = 0; i < address_count; i++) {
+        sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr = addresses[i].ipaddr;
+        result.addresses_.emplace_back(std::make_shared<Network::Address::Ipv4Instance>(&address));
+        min_ttl = std::min(min_ttl, static_cast<uint32_t>(addresses[i].ttl));
+      }
+    }
+  } else {
+    ares_addr6ttl addresses[MaxAddresses];
+    status = ares_parse_aaaa_reply(response, response_len, nullptr, addresses, &address_count);
+    if (status == ARES_SUCCESS) {
+      for (int i = 0; i < address_count; i++) {
+        sockaddr_in6 address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin6_family = AF_INET6;
+        std::memcpy(&address.sin6_addr, &addresses[i].ip6addr, sizeof(address.sin6_addr));
+        result.addresses_.emplace_back(std::make_shared<Network::Address::Ipv6Instance>(address));
+        min_ttl = std::min(min_ttl, static_cast<uint32_t>(addresses[i].ttl));
+      }
+    }
+  }
+
+  if (result.addresses_.empty()) {
+    // Answers of other types only, i.e. a CNAME without the records it points at
+    result.ttl_ = negativeTtl(response, response_len);
+    return result;
+  }
+
+  result.ttl_ = std::chrono::seconds(min_ttl);
+  return result;
+}
+
+absl::optional<std::chrono::seconds>
+RecursiveResolverImpl::negativeTtl(const unsigned char* response, int response_len) {
+  if (response == nullptr || response_len < HFIXEDSZ) {
+    return absl::nullopt;
+  }
+
+  const size_t len = static_cast<size_t>(response_len);
+  size_t offset = HFIXEDSZ;
+
+  for (uint16_t i = 0; i < DNS_HEADER_QDCOUNT(response); i++) {
+    offset = skipName(response, len, offset);
+    if (offset == 0 || offset + QFIXEDSZ > len) {
+      return absl::nullopt;
+    }
+    offset += QFIXEDSZ;
+  }
+
+  // The SOA record is in the authority section, which follows the answers
+  const uint32_t records = DNS_HEADER_ANCOUNT(response) + DNS_HEADER_NSCOUNT(response);
+  for (uint32_t i = 0; i < records; i++) {
+    offset = skipName(response, len, offset);
+    if (offset == 0 || offset + RRFIXEDSZ > len) {
+      return absl::nullopt;
+    }
+
+    const unsigned char* record = response + offset;
+    const size_t rdata_len = DNS_RR_LEN(record);
+    offset += RRFIXEDSZ;
+    if (offset + rdata_len > len) {
+      return absl::nullopt;
+    }
+
+    // The MINIMUM field is the last 4 bytes of the SOA RDATA
+    if (i >= DNS_HEADER_ANCOUNT(response) && DNS_RR_TYPE(record) == T_SOA && rdata_len >= 22) {
+      const uint32_t soa_ttl = static_cast<uint32_t>(DNS_RR_TTL(record));
+      const uint32_t minimum = static_cast<uint32_t>(DNS__32BIT(response + offset + rdata_len - 4));
+      return std::chrono::seconds(std::min(soa_ttl, minimum));
+    }
+
+    offset += rdata_len;
+  }
+
+  return absl::nullopt;
+}
+
+void RecursiveResolverImpl::updateAresTimer() {
+  timeval timeout;
+  timeval* timeout_result = ares_timeout(channel_, nullptr, &timeout);
+  if (timeout_result != nullptr) {
+    timer_->enableTimer(
+        std::chrono::milliseconds(timeout_result->tv_sec * 1000 + timeout_result->tv_usec / 1000));
+  } else {
+    timer_->disableTimer();
+  }
+}
+
+void RecursiveResolverImpl::onEventCallback(int fd, uint32_t events) {
+  const ares_socket_t read_fd = events & Event::FileReadyType::Read ? fd : ARES_SOCKET_BAD;
+  const ares_socket_t write_fd = events & Event::FileReadyType::Write ? fd : ARES_SOCKET_BAD;
+  ares_process_fd(channel_, read_fd, write_fd);
+  updateAresTimer();
+}
+
+void RecursiveResolverImpl::onAresSocketStateChange(int fd, int read, int write) {
+  updateAresTimer();
+  auto it = events_.find(fd);
+
+  // Stop tracking the fd once c-ares is no longer interested in it
+  if (read == 0 && write == 0) {
+    if (it != events_.end()) {
+      events_.erase(it);
+    }
+    return;
+  }
+
+  if (it == events_.end()) {
+    it = events_
+             .emplace(fd, dispatcher_.createFileEvent(
+                              fd, [this, fd](uint32_t events) { onEventCallback(fd, events); },
+                              Event::FileTriggerType::Level,
+                              Event::FileReadyType::Read | Event::FileReadyType::Write))
+             .first;
+  }
+
+  it->second->setEnabled((read ? Event::FileReadyType::Read : 0) |
+                         (write ? Event::FileReadyType::Write : 0));
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
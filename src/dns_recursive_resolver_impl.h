@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "envoy/event/dispatcher.h"
+#include "envoy/event/file_event.h"
+#include "envoy/event/timer.h"
+#include "envoy/network/address.h"
+
+#include "common/common/logger.h"
+
+#include "src/dns_recursive_resolver.h"
+
+#include "ares.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+/**
+ * Implementation of RecursiveResolver on top of c-ares. The c-ares sockets and timeouts are
+ * driven by the dispatcher of the worker, in the same way as Network::DnsResolverImpl. Queries
+ * are sent with ares_query so that the raw response is available to extract the TTLs from.
+ */
+class RecursiveResolverImpl : public RecursiveResolver, Logger::Loggable<Logger::Id::filter> {
+public:
+  /**
+   * @param name_servers are the name servers the queries are sent to. The name servers of
+   * /etc/resolv.conf are used if it is empty.
+   * @param max_in_flight bounds the queries c-ares has in flight, including the cancelled ones that
+   * it did not complete yet. A query beyond it completes inline with SERVFAIL.
+   */
+  RecursiveResolverImpl(Event::Dispatcher& dispatcher,
+                        const std::vector<Network::Address::InstanceConstSharedPtr>& name_servers,
+                        uint32_t max_in_flight);
+  ~RecursiveResolverImpl();
+
+  // RecursiveResolver
+  Network::ActiveDnsQuery* resolve(const std::string& dns_name, uint16_t q_type,
+                                   ResolveCb callback) override;
+
+  /**
+   * Converts the response to a query for q_type records into a result.
+   * @param status is the status c-ares completed the query with.
+   * @param response is the raw response, nullptr if no response was received.
+   */
+  static RecursiveResult parseResponse(uint16_t q_type, int status, const unsigned char* response,
+                                       int response_len);
+
+private:
+  /**
+   * A query handed to c-ares. Cancellation is lazy: c-ares can only cancel all the queries of a
+   * channel, so a cancelled query only skips its callback. It keeps its place in max_in_flight,
+   * and its retransmissions go out, until c-ares completes it or gives up on it.
+   */
+  struct PendingQuery : public Network::ActiveDnsQuery {
+    PendingQuery(RecursiveResolverImpl& parent, uint16_t q_type, ResolveCb callback)
+        : parent_(parent), q_type_(q_type), callback_(callback) {}
+
+    // Network::ActiveDnsQuery
+    void cancel() override { cancelled_ = true; }
+
+    void onAresQueryCallback(int status, const unsigned char* response, int response_len);
+
+    RecursiveResolverImpl& parent_;
+    const uint16_t q_type_;
+    const ResolveCb callback_;
+    // Set once the query completed. If it completed inline, resolve() does not return it.
+    bool completed_{false};
+    // Set once the query was handed out by resolve(), in which case it deletes itself on
+    // completion
+    bool owned_{false};
+    bool cancelled_{false};
+  };
+
+  // Negative caching TTL from the SOA record in the authority section, see RFC 2308 section 5
+  static absl::optional<std::chrono::seconds> negativeTtl(const unsigned char* response,
+                                                          int response_len);
+
+  void onEventCallback(int fd, uint32_t events);
+  void onAresSocketStateChange(int fd, int read, int write);
+  void updateAresTimer();
+
+  Event::Dispatcher& dispatcher_;
+  Event::TimerPtr timer_;
+  ares_channel channel_;
+  const uint32_t max_in_flight_;
+  // The queries handed to c-ares that it did not complete yet, cancelled or not
+  uint32_t in_flight_{0};
+  std::unordered_map<int, Event::FileEventPtr> events_;
+};
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,132 @@
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#include <cstring>
+
+#include "src/dns_response_writer.h"
+
+#include "common/common/assert.h"
+
+#include "absl/strings/ascii.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+ResponseWriter::ResponseWriter(size_t size_hint) : names_size_(0) { data_.reserve(size_hint); }
+
+void ResponseWriter::writeBytes(const void* data, size_t size) {
+  data_.append(static_cast<const char*>(data), size);
+}
+
+void ResponseWriter::write16(uint16_t value) {
+  const uint16_t dns_value = htons(value);
+  writeBytes(&dns_value, sizeof(dns_value));
+}
+
+void ResponseWriter::write32(uint32_t value) {
+  const uint32_t dns_value = htonl(value);
+  writeBytes(&dns_value, sizeof(dns_value));
+}
+
+void ResponseWriter::patch16(size_t offset, uint16_t value) {
+  const uint16_t dns_value = htons(value);
+  patchBytes(offset, &dns_value, sizeof(dns_value));
+}
+
+void ResponseWriter::patchBytes(size_t offset, const void* data, size_t size) {
+  ASSERT(offset + size <= data_.size());
+
+  std::memcpy(&data_[offset], data, size);
+}
+
+void ResponseWriter::truncate(size_t size) {
+  ASSERT(size <= data_.size());
+
+  data_.resize(size);
+
+  // Names are remembered in the order they were written
+  while (names_size_ > 0 && names_[names_size_ - 1].offset_ >= size) {
+    names_size_--;
+  }
+}
+
+void ResponseWriter::writeName(absl::string_view name, bool compress) {
+  // The dot of a fully qualified name is consumed with the last label, leaving the root label
+  while (!name.empty()) {
+    if (compress) {
+      const CompressionName* written = findName(name);
+      if (written != nullptr) {
+        write16((INDIR_MASK << 8) | written->offset_);
+        return;
+      }
+    }
+
+    addName(name, data_.size());
+    name.remove_prefix(writeLabel(name));
+  }
+
+  data_.push_back(0);
+}
+
+size_t ResponseWriter::size() const { return data_.size(); }
+
+absl::string_view ResponseWriter::data() const { return data_; }
+
+void ResponseWriter::addTo(Buffer::Instance& buffer) const {
+  buffer.add(data_.data(), data_.size());
+}
+
+const ResponseWriter::CompressionName* ResponseWriter::findName(absl::string_view name) const {
+  for (size_t i = 0; i < names_size_; i++) {
+    if (names_[i].name_ == name) {
+      return &names_[i];
+    }
+  }
+
+  return nullptr;
+}
+
+void ResponseWriter::addName(absl::string_view name, size_t offset) {
+  if (offset > MaxPointerOffset || names_size_ == MaxCompressionNames) {
+    return;
+  }
+
+  names_[names_size_++] = {name, static_cast<uint16_t>(offset)};
+}
+
+size_t ResponseWriter::writeLabel(absl::string_view name) {
+  const size_t length_offset = data_.size();
+  data_.push_back(0);
+
+  size_t position = 0;
+  while (position < name.size() && name[position] != '.') {
+    char c = name[position++];
+
+    if (c == '\\' && position < name.size()) {
+      if (position + 2 < name.size() && absl::ascii_isdigit(name[position]) &&
+          absl::ascii_isdigit(name[position + 1]) && absl::ascii_isdigit(name[position + 2])) {
+        c = static_cast<char>((name[position] - '0') * 100 + (name[position + 1] - '0') * 10 +
+                              (name[position + 2] - '0'));
+        position += 3;
+      } else {
+        c = name[position++];
+      }
+    }
+
+    data_.push_back(c);
+  }
+
+  const size_t label_len = data_.size() - length_offset - 1;
+  ASSERT(label_len <= MAXLABEL);
+  data_[length_offset] = static_cast<char>(label_len);
+
+  // Skip the dot separating the label from the rest of the name
+  return position < name.size() ? position + 1 : position;
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
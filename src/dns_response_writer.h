@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "envoy/buffer/buffer.h"
+
+#include "absl/strings/string_view.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+/**
+ * Writes a DNS message into one contiguous, pre-sized buffer which is handed to a
+ * Buffer::Instance in a single add.
+ *
+ * Domain names are compressed as described in RFC 1035 section 4.1.4: a name, or the longest
+ * suffix of it, that was already written to the message is replaced with a pointer to the earlier
+ * occurrence. In a response every answer name points back at the question name.
+ */
+class ResponseWriter {
+public:
+  /**
+   * @param size_hint is the expected size of the message. The buffer is reserved up front so
+   * that writing the message does not reallocate.
+   */
+  explicit ResponseWriter(size_t size_hint);
+
+  void writeBytes(const void* data, size_t size);
+
+  /**
+   * Writes the value in network byte order.
+   */
+  void write16(uint16_t value);
+
+  /**
+   * Writes the value in network byte order.
+   */
+  void write32(uint32_t value);
+
+  /**
+   * Overwrites a 16 bit value written earlier, i.e. the RDLENGTH once the RDATA is written.
+   */
+  void patch16(size_t offset, uint16_t value);
+
+  /**
+   * Overwrites bytes written earlier, i.e. the header once the record counts are known.
+   */
+  void patchBytes(size_t offset, const void* data, size_t size);
+
+  /**
+   * Drops everything written after the first size bytes, along with the names that can no longer
+   * be pointed at. Used to take back a record that does not fit into the message.
+   */
+  void truncate(size_t size);
+
+  /**
+   * Writes a dotted domain name as a sequence of labels. Escapes of the form "\." and "\DDD"
+   * produced by the decoder are converted back to the original label bytes.
+   * Every label must be at most 63 bytes. The names of a response are those of its request, which
+   * the decoder checked, and the targets of SRV records, whose first label is an address.
+   * @param name is the dotted name. It must outlive the writer, as later names are compressed
+   * against it.
+   * @param compress is false for names that must be written in full, i.e. the target of an SRV
+   * record. Such names can still be pointed at by later names.
+   */
+  void writeName(absl::string_view name, bool compress = true);
+
+  /**
+   * @return the number of bytes written so far.
+   */
+  size_t size() const;
+
+  /**
+   * @return the bytes written so far.
+   */
+  absl::string_view data() const;
+
+  /**
+   * Adds the message to buffer in one go.
+   */
+  void addTo(Buffer::Instance& buffer) const;
+
+private:
+  // Pointers are 14 bits wide, so only names in the first 16KB of a message can be pointed at
+  static constexpr size_t MaxPointerOffset = 0x3FFF;
+  // Upper bound on the names remembered for compression. Lookups are a linear scan which is
+  // cheaper than hashing for the handful of distinct names in a response.
+  static constexpr size_t MaxCompressionNames = 64;
+
+  struct CompressionName {
+    // The dotted name, or a suffix of it, as passed to writeName
+    absl::string_view name_;
+    uint16_t offset_;
+  };
+
+  const CompressionName* findName(absl::string_view name) const;
+  void addName(absl::string_view name, size_t offset);
+  size_t writeLabel(absl::string_view name);
+
+  std::string data_;
+  CompressionName names_[MaxCompressionNames];
+  size_t names_size_;
+};
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -20,19 +20,20 @@ public:
 
   /**
    * Called when a resolution attempt for IP address is complete.
-   * @param dns_response supplies the response message for the dns query.
+   * @param dns_request supplies the dns query that was resolved.
    * @param serialized_response supplies the buffer with the response serialized.
    */
-  typedef std::function<void(const Formats::ResponseMessageSharedPtr& dns_response,
+  typedef std::function<void(const Formats::Message& dns_request,
                              Buffer::Instance& serialized_response)>
       ResolveCallback;
 
   /**
    * Resolves the dns_name.
    *
-   * @param dns_request to resolve.
+   * @param dns_request to resolve. The request is only guaranteed to be valid for the duration of
+   * the call, requests that cannot be resolved synchronously are cloned.
    */
-  virtual void resolve(const Formats::RequestMessageConstSharedPtr& dns_request) PURE;
+  virtual void resolve(const Formats::Message& dns_request) PURE;
 
 protected:
   DnsServer(const ResolveCallback& resolve_callback) : resolve_callback_(resolve_callback) {}
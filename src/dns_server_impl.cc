@@ -1,9 +1,15 @@
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstring>
+
 #include "ares.h"
 #include "ares_dns.h"
 
-#include "common/network/dns_impl.h"
 #include "common/common/assert.h"
+#include "common/common/fmt.h"
 
+#include "envoy/event/dispatcher.h"
 #include "envoy/upstream/cluster_manager.h"
 #include "envoy/upstream/thread_local_cluster.h"
 #include "envoy/upstream/upstream.h"
@@ -12,42 +18,313 @@
 #include "src/dns_codec_impl.h"
 #include "src/dns_config.h"
 
+#include "absl/strings/ascii.h"
+
 namespace Envoy {
 namespace Extensions {
 namespace ListenerFilters {
 namespace Dns {
 namespace {
-std::string log_dns_headers(const Formats::RequestMessageConstSharedPtr& dns_message) {
-  const Formats::Header& header = dns_message->header();
+std::string log_dns_headers(const Formats::Message& dns_message) {
+  const Formats::Header& header = dns_message.header();
 
   return fmt::format("qr {} rCode {} rd {} qdCount {} anCount {} nsCount {} arCount {}",
                      static_cast<int>(header.qrCode()), header.rCode(), header.rd(),
                      header.qdCount(), header.anCount(), header.nsCount(), header.arCount());
 }
 
-std::string log_dns_question(const Formats::RequestMessageConstSharedPtr& dns_message) {
-  const Formats::QuestionRecord& question = dns_message->questionRecord();
+std::string log_dns_question(const Formats::Message& dns_message) {
+  const Formats::QuestionRecord& question = dns_message.questionRecord();
 
   return fmt::format("qName {} qType {}", question.qName(), question.qType());
 }
 
+// Picks which of the size addresses of a cluster, of one family, answer a question: answers of
+// them from offset on, wrapping around. Answers capped at max_answers start one address further
+// into the cluster than the previous one, so that the clients using the first answer spread evenly
+// over the cluster.
+// Returns true if all the addresses are picked.
+bool pickAnswers(size_t size, uint32_t max_answers, size_t& next_offset, size_t& offset,
+                 size_t& answers) {
+  if (max_answers == 0 || size <= max_answers) {
+    offset = 0;
+    answers = size;
+    return true;
+  }
+
+  offset = next_offset;
+  next_offset = (offset + 1) % size;
+  answers = max_answers;
+  return false;
+}
+
+// Copies the values of the addresses picked by pickAnswers, i.e. the addresses or their endpoints
+template <class Value>
+void copyAnswers(const std::vector<Value>& cluster_values, size_t offset, size_t answers,
+                 std::vector<Value>& answer_values) {
+  if (answers == cluster_values.size()) {
+    answer_values = cluster_values;
+    return;
+  }
+
+  answer_values.reserve(answers);
+  for (size_t i = 0; i < answers; i++) {
+    answer_values.push_back(cluster_values[(offset + i) % cluster_values.size()]);
+  }
+}
+
+// Answers with the static records of a name, capped at max_answers unless it is 0
+template <class Address>
+void pickStaticRecords(const Address* records, size_t record_count, uint32_t max_answers,
+                       std::vector<Address>& answer_addresses) {
+  const size_t answers =
+      (max_answers == 0) ? record_count : std::min<size_t>(record_count, max_answers);
+  answer_addresses.assign(records, records + answers);
+}
+
+// The first label of the target of the SRV record of a host, i.e. "10-0-0-1" for 10.0.0.1
+std::string targetLabel(uint32_t address) {
+  char text[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &address, text, sizeof(text));
+  std::string label(text);
+  std::replace(label.begin(), label.end(), '.', '-');
+  return label;
+}
+
+// The first label of the target of the SRV record of a host, i.e. "fd00-0-0-0-0-0-0-1" for
+// fd00::1. All the groups are written, so that the label cannot be taken for an ipv4 address.
+std::string targetLabel(const absl::uint128& address) {
+  unsigned char bytes[sizeof(address)];
+  memcpy(bytes, &address, sizeof(bytes));
+
+  std::string label;
+  for (size_t i = 0; i < sizeof(bytes); i += 2) {
+    if (i > 0) {
+      label.push_back('-');
+    }
+    label.append(fmt::format("{:x}", (bytes[i] << 8) | bytes[i + 1]));
+  }
+
+  return label;
+}
+
+// Parses the first label of a name written by targetLabel into addresses.
+// Returns false if the label is not the one of an address.
+bool parseTargetLabel(absl::string_view label, PackedAddresses& addresses) {
+  // Long enough for the 8 groups of an ipv6 address. Most labels are turned away by their first
+  // character that is not hexadecimal.
+  char text[INET6_ADDRSTRLEN];
+  if (label.size() >= sizeof(text) ||
+      !std::all_of(label.begin(), label.end(),
+                   [](char c) -> bool { return c == '-' || absl::ascii_isxdigit(c); })) {
+    return false;
+  }
+
+  std::replace_copy(label.begin(), label.end(), text, '-', '.');
+  text[label.size()] = '\0';
+  uint32_t ipv4;
+  if (inet_pton(AF_INET, text, &ipv4) == 1) {
+    addresses.ipv4_.push_back(ipv4);
+    return true;
+  }
+
+  std::replace(text, text + label.size(), '.', ':');
+  absl::uint128 ipv6;
+  if (inet_pton(AF_INET6, text, &ipv6) == 1) {
+    addresses.ipv6_.push_back(ipv6);
+    return true;
+  }
+
+  return false;
+}
+
+void addAddressRecord(Formats::Message& response, const std::string& name, uint32_t ttl,
+                      uint32_t address) {
+  response.addARecord(Formats::ResourceRecordSection::Additional, name, ttl, address);
+}
+
+void addAddressRecord(Formats::Message& response, const std::string& name, uint32_t ttl,
+                      const absl::uint128& address) {
+  response.addAAAARecord(Formats::ResourceRecordSection::Additional, name, ttl, address);
+}
+
+// Length of the dotted name in wire format. An escaped character takes a single byte.
+size_t encodedNameLength(const std::string& name) {
+  if (name.empty()) {
+    return 1;
+  }
+
+  // A length byte for each label takes the place of its dot, plus the root label
+  size_t length = name.size() + 2;
+  for (size_t i = 0; i < name.size(); i++) {
+    if (name[i] != '\\' || i + 1 == name.size()) {
+      continue;
+    }
+
+    const bool decimal = i + 3 < name.size() && absl::ascii_isdigit(name[i + 1]) &&
+                         absl::ascii_isdigit(name[i + 2]) && absl::ascii_isdigit(name[i + 3]);
+    const size_t escape_len = decimal ? 3 : 1;
+    length -= escape_len;
+    i += escape_len;
+  }
+
+  return length;
+}
+
+// Adds an SRV record answering name for each of the addresses of one family, with the address
+// records of their targets in the additional section. The hosts whose target would exceed
+// MAXCDNAME bytes, as the target label adds up to 19 bytes to a long name, are left out.
+template <class Address>
+void addSrvRecords(Formats::Message& response, const std::string& name, uint32_t ttl,
+                   const std::vector<Address>& addresses,
+                   const std::vector<SrvEndpoint>& endpoints) {
+  ASSERT(addresses.size() == endpoints.size());
+  const size_t name_len = encodedNameLength(name);
+  const auto fits = [name_len](const std::string& target_label) -> bool {
+    return target_label.size() + 1 + name_len <= MAXCDNAME;
+  };
+
+  for (size_t i = 0; i < addresses.size(); i++) {
+    const std::string target_label = targetLabel(addresses[i]);
+    if (!fits(target_label)) {
+      continue;
+    }
+
+    const SrvEndpoint& endpoint = endpoints[i];
+    response.addSRVRecord(name, ttl, endpoint.priority_, endpoint.weight_, endpoint.port_,
+                          target_label + "." + name);
+  }
+
+  // A host listening on several ports is the target of several records, its address is added once
+  std::vector<Address> targets = addresses;
+  std::sort(targets.begin(), targets.end());
+  targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+  for (const Address& address : targets) {
+    const std::string target_label = targetLabel(address);
+    if (fits(target_label)) {
+      addAddressRecord(response, target_label + "." + name, ttl, address);
+    }
+  }
+}
+
 } // namespace
 
 DnsServerImpl::DnsServerImpl(const ResolveCallback& resolve_callback, const Config& config,
+                             KnownNamesSharedPtr known_names,
+                             RecursiveResolverPtr&& recursive_resolver, ForwarderPtr&& forwarder,
                              Event::Dispatcher& dispatcher,
-                             Upstream::ClusterManager& cluster_manager)
-    : DnsServer(resolve_callback), config_(config),
-      external_resolver_(dispatcher.createDnsResolver({})), dispatcher_(dispatcher),
-      cluster_manager_(cluster_manager), response_buffer_() {}
+                             Upstream::ClusterManager& cluster_manager, Stats::Scope& scope)
+    : DnsServer(resolve_callback), config_(config), known_names_(std::move(known_names)),
+      known_names_update_handle_(nullptr), recursive_resolver_(std::move(recursive_resolver)),
+      forwarder_(std::move(forwarder)), dispatcher_(dispatcher),
+      answer_cache_(cluster_manager, config.maxCachedAnswers()),
+      recursive_cache_(dispatcher.timeSource(), config.minCacheTtl(), config.maxCacheTtl(),
+                       config.maxCachedResponses()),
+      pending_recursive_query_timer_(
+          dispatcher.createTimer([this]() -> void { onPendingRecursiveQueryTimeout(); })),
+      stats_(generateStats(scope)) {
+  // A cached answer for a name whose entry changed still holds the hosts of the previous cluster
+  known_names_update_handle_ =
+      known_names_->addUpdateCb([this](const std::vector<std::string>& changed_names) -> void {
+        for (const auto& name : changed_names) {
+          // The names matched by a pattern are not known up front
+          if (DomainNameTrie::isPattern(name)) {
+            answer_cache_.clear();
+            return;
+          }
+
+          answer_cache_.drop(name);
+        }
+      });
+}
+
+DnsServerImpl::~DnsServerImpl() {
+  known_names_update_handle_->remove();
+
+  // The queries still pending are dropped with the resolver. The stats outlive the server.
+  stats_.recursive_query_pending_.sub(pending_recursive_query_list_.size());
+}
+
+DnsServerStats DnsServerImpl::generateStats(Stats::Scope& scope) {
+  return {ALL_DNS_SERVER_STATS(POOL_COUNTER(scope), POOL_GAUGE(scope), POOL_HISTOGRAM(scope))
+              generateQueryStats(scope, "known."),
+          generateQueryStats(scope, "recursive."), generateQueryStats(scope, "unsupported.")};
+}
+
+DnsQueryStats DnsServerImpl::generateQueryStats(Stats::Scope& scope, const std::string& prefix) {
+  return {ALL_DNS_QUERY_STATS(POOL_COUNTER_PREFIX(scope, prefix))};
+}
+
+Stats::Counter& DnsServerImpl::questionTypeCounter(DnsQueryStats& query_stats, uint16_t q_type) {
+  switch (q_type) {
+  case T_A:
+    return query_stats.query_a_;
+  case T_AAAA:
+    return query_stats.query_aaaa_;
+  case T_SRV:
+    return query_stats.query_srv_;
+  default:
+    return query_stats.query_other_;
+  }
+}
+
+Stats::Counter& DnsServerImpl::responseCodeCounter(DnsQueryStats& query_stats,
+                                                   uint16_t response_code) {
+  switch (response_code) {
+  case NOERROR:
+    return query_stats.response_noerror_;
+  case FORMERR:
+    return query_stats.response_formerr_;
+  case SERVFAIL:
+    return query_stats.response_servfail_;
+  case NXDOMAIN:
+    return query_stats.response_nxdomain_;
+  case NOTIMP:
+    return query_stats.response_notimp_;
+  case REFUSED:
+    return query_stats.response_refused_;
+  case ns_r_badvers:
+    return query_stats.response_badvers_;
+  default:
+    return query_stats.response_other_;
+  }
+}
 
-void DnsServerImpl::resolve(const Formats::RequestMessageConstSharedPtr& dns_request) {
+void DnsServerImpl::resolve(const Formats::Message& dns_request) {
   ENVOY_LOG(debug, "DNS:resolve Headers: {} Question: {}", log_dns_headers(dns_request),
             log_dns_question(dns_request));
 
-  const Formats::QuestionRecord& question = dns_request->questionRecord();
+  const Formats::QuestionRecord& question = dns_request.questionRecord();
 
   if (!isSupportedQuery(dns_request)) {
-    constructFailedResponseAndInvokeCallback(dns_request, NOTIMP);
+    if (!forward(dns_request, stats_.unsupported_)) {
+      constructFailedResponseAndInvokeCallback(dns_request, NOTIMP, stats_.unsupported_);
+    }
+    return;
+  }
+
+  // Only version 0 of EDNS is implemented, RFC 6891 section 6.1.3
+  if (dns_request.edns().has_value() && dns_request.edns()->version != 0) {
+    ENVOY_LOG(debug, "DNS:NotSupported. EDNS version {}", dns_request.edns()->version);
+    constructFailedResponseAndInvokeCallback(dns_request, ns_r_badvers, stats_.unsupported_);
+    return;
+  }
+
+  if (dns_request.header().qdCount() > 1) {
+    resolveQuestions(dns_request);
+    return;
+  }
+
+  // Repeated questions for known domain names are answered from the bytes of an earlier response
+  Buffer::OwnedImpl response_buffer;
+  if (answer_cache_.lookup(dns_request, response_buffer)) {
+    ENVOY_LOG(debug, "DNS:response from answer cache Question: {} TotalBytes {}",
+              log_dns_question(dns_request), response_buffer.length());
+
+    // Only successful responses built from healthy hosts are cached
+    stats_.answer_cache_hit_.inc();
+    stats_.answer_healthy_.inc();
+    sendResponse(dns_request, response_buffer, NOERROR, stats_.known_);
     return;
   }
 
@@ -60,71 +337,437 @@ void DnsServerImpl::resolve(const Formats::RequestMessageConstSharedPtr& dns_req
   return;
 }
 
-void DnsServerImpl::resolveAorAAAA(const Formats::RequestMessageConstSharedPtr& dns_request) {
-  const std::string& dns_name = dns_request->questionRecord().qName();
+void DnsServerImpl::resolveAorAAAA(const Formats::Message& dns_request) {
+  const std::string& dns_name = dns_request.questionRecord().qName();
 
   // If the domain name is not known, send this request to the external dns resolver, which
   // gets the result from one of the name servers mentioned in /etc/resolv.conf
-  if (!config_.belongsToKnownDomainName(dns_name)) {
+  const DomainNameMatch match = known_names_->matchDomainName(dns_name);
+  if (!match.known_suffix_) {
     this->resolveUnknownAorAAAA(dns_request);
     return;
   }
 
-  std::list<Network::Address::InstanceConstSharedPtr> result_list;
-  uint16_t response_code = findKnownName(dns_name, result_list);
+  PackedAddresses addresses;
+  PackedEndpoints endpoints;
+  KnownCluster known_cluster;
+  uint16_t response_code =
+      findKnownName(dns_request.questionRecord(), match, addresses, endpoints, known_cluster);
 
   Formats::ResponseMessageSharedPtr dns_response =
       constructResponse(dns_request, response_code, true);
 
-  addAnswersAndInvokeCallback(dns_response, Formats::ResourceRecordSection::Answer, result_list);
+  addAnswersAndInvokeCallback(dns_request, dns_response, response_code,
+                              Formats::ResourceRecordSection::Answer, addresses, known_cluster,
+                              static_cast<uint32_t>(config_.ttl().count()), stats_.known_);
+
+  return;
+}
+
+void DnsServerImpl::resolveUnknownAorAAAA(const Formats::Message& dns_request) {
+  // The upstream answers with all the records of the name, they are not cached by the filter
+  if (forward(dns_request, stats_.recursive_)) {
+    return;
+  }
+
+  const std::string& dns_name = dns_request.questionRecord().qName();
+  const uint16_t q_type = dns_request.questionRecord().qType();
+
+  std::chrono::seconds remaining_ttl;
+  const RecursiveResult* cached_result = recursive_cache_.lookup(dns_name, q_type, remaining_ttl);
+  if (cached_result != nullptr) {
+    ENVOY_LOG(debug, "DnsFilter: Unknown domain name {}. Answered from the recursive cache",
+              dns_name);
+    stats_.recursive_cache_hit_.inc();
+    respondWithRecursiveResult(dns_request, *cached_result, remaining_ttl);
+    return;
+  }
+
+  if (!waitForRecursiveQuery(dns_name, q_type, dns_request, nullptr, 0)) {
+    constructFailedResponseAndInvokeCallback(dns_request, SERVFAIL, stats_.recursive_);
+  }
 
   return;
 }
 
-void DnsServerImpl::resolveUnknownAorAAAA(
-    const Formats::RequestMessageConstSharedPtr& dns_request) {
-  const std::string& dns_name = dns_request->questionRecord().qName();
-  bool isIpv6 = (dns_request->questionRecord().qType() == T_AAAA);
+void DnsServerImpl::resolveQuestions(const Formats::Message& dns_request) {
+  const uint16_t question_count = dns_request.header().qdCount();
+
+  MultiQuestionQuerySharedPtr query = std::make_shared<MultiQuestionQuery>();
+  query->request_ = dns_request.clone();
+  query->answers_.resize(question_count);
+  // One more than the number of questions until all of them were looked at, so that questions
+  // answered inline do not complete the query before the last question is looked at
+  query->pending_questions_ = question_count + 1;
+
+  for (uint16_t i = 0; i < question_count; i++) {
+    if (!resolveQuestion(query, i)) {
+      onQuestionAnswered(*query);
+    }
+  }
+
+  onQuestionAnswered(*query);
+}
+
+bool DnsServerImpl::forward(const Formats::Message& dns_request, DnsQueryStats& query_stats) {
+  // The questions of a query with several questions are answered apart, and the requests copied
+  // while they wait no longer hold the bytes they were decoded from
+  if (forwarder_ == nullptr || dns_request.header().qdCount() != 1 || dns_request.raw().empty()) {
+    return false;
+  }
+
+  ENVOY_LOG(debug, "DnsFilter: forwarding a query for {}", dns_request.questionRecord().qName());
+
+  const bool forwarded = forwarder_->forward(
+      dns_request, [this, &query_stats](const Formats::Message& request,
+                                        Buffer::Instance& response) -> void {
+        unsigned char header[HFIXEDSZ];
+        response.copyOut(0, HFIXEDSZ, header);
+        sendResponse(request, response, DNS_HEADER_RCODE(header), query_stats);
+      });
+
+  if (!forwarded) {
+    constructFailedResponseAndInvokeCallback(dns_request, SERVFAIL, query_stats);
+  }
+
+  return true;
+}
+
+bool DnsServerImpl::resolveQuestion(const MultiQuestionQuerySharedPtr& query, uint16_t index) {
+  const Formats::QuestionRecord& question = query->request_->questionRecord(index);
+  const std::string& dns_name = question.qName();
+  QuestionAnswer& answer = query->answers_[index];
+
+  const DomainNameMatch match = known_names_->matchDomainName(dns_name);
+  if (!match.known_suffix_) {
+    // SRV records are only served for known names
+    if (question.qType() == T_SRV) {
+      answer.response_code_ = NXDOMAIN;
+      return false;
+    }
+
+    std::chrono::seconds remaining_ttl;
+    const RecursiveResult* cached_result =
+        recursive_cache_.lookup(dns_name, question.qType(), remaining_ttl);
+    if (cached_result != nullptr) {
+      stats_.recursive_cache_hit_.inc();
+      answer.response_code_ = cached_result->response_code_;
+      answer.addresses_ = cached_result->addresses_;
+      answer.ttl_ = static_cast<uint32_t>(remaining_ttl.count());
+      return false;
+    }
+
+    if (!waitForRecursiveQuery(dns_name, question.qType(), *query->request_, query, index)) {
+      answer.response_code_ = SERVFAIL;
+      return false;
+    }
+
+    return true;
+  }
+
+  KnownCluster known_cluster;
+  answer.authoritative_ = true;
+  answer.ttl_ = static_cast<uint32_t>(config_.ttl().count());
+  answer.response_code_ = findKnownName(question, match, answer.known_addresses_,
+                                        answer.known_endpoints_, known_cluster);
+
+  return false;
+}
+
+void DnsServerImpl::onQuestionAnswered(MultiQuestionQuery& query) {
+  ASSERT(query.pending_questions_ > 0);
+  if (--query.pending_questions_ > 0) {
+    return;
+  }
+
+  // The response code is the one of the first question that failed. The answers to the other
+  // questions are still sent.
+  uint16_t response_code = NOERROR;
+  bool authoritative = true;
+  for (const auto& answer : query.answers_) {
+    if (response_code == NOERROR) {
+      response_code = answer.response_code_;
+    }
+    authoritative = authoritative && answer.authoritative_;
+  }
+
+  Formats::ResponseMessageSharedPtr dns_response =
+      constructResponse(*query.request_, response_code, authoritative);
+
+  for (uint16_t i = 0; i < query.answers_.size(); i++) {
+    const Formats::QuestionRecord& question = query.request_->questionRecord(i);
+    const QuestionAnswer& answer = query.answers_[i];
+    if (answer.response_code_ != NOERROR) {
+      continue;
+    }
+
+    if (question.qType() == T_SRV) {
+      addSrvAnswers(dns_response, question.qName(), answer.known_addresses_,
+                    answer.known_endpoints_, answer.ttl_);
+    } else {
+      addAnswers(dns_response, Formats::ResourceRecordSection::Answer, question.qName(),
+                 answer.addresses_, answer.ttl_);
+      addAnswers(dns_response, Formats::ResourceRecordSection::Answer, question.qName(),
+                 answer.known_addresses_, answer.ttl_);
+    }
+  }
+
+  // The query is known only if none of its questions needed a recursive query
+  serializeAndInvokeCallback(*query.request_, dns_response, response_code, KnownCluster(),
+                             authoritative ? stats_.known_ : stats_.recursive_);
+}
+
+bool DnsServerImpl::waitForRecursiveQuery(const std::string& dns_name, uint16_t q_type,
+                                          const Formats::Message& dns_request,
+                                          const MultiQuestionQuerySharedPtr& query,
+                                          uint16_t question_index) {
+  // Identical questions are resolved by a single query. Names differ in case only if the clients
+  // use 0x20 randomization, they still share the query.
+  PendingRecursiveQueryMap& pending_queries = pendingRecursiveQueries(q_type);
+  const std::string key = absl::AsciiStrToLower(dns_name);
+  auto it = pending_queries.find(key);
+  if (it != pending_queries.end()) {
+    return attachToPendingQuery(dns_request, query, question_index, *it->second);
+  }
+
+  if (pending_recursive_query_list_.size() >= config_.maxPendingRecursiveQueries()) {
+    ENVOY_LOG(debug, "DnsFilter: Unknown domain name {}. Too many pending queries", dns_name);
+    stats_.recursive_query_overflow_.inc();
+    return false;
+  }
 
   ENVOY_LOG(debug, "DnsFilter: Unknown domain name {}. Sending query via client", dns_name);
 
-  // TODO(sumukhs): Cancel returned query after timeout
-  external_resolver_->resolve(
-      dns_name, isIpv6 ? Network::DnsLookupFamily::V6Only : Network::DnsLookupFamily::V4Only,
-      [dns_request,
-       this](const std::list<Network::Address::InstanceConstSharedPtr>&& results) -> void {
-        if (!results.empty()) {
-          Formats::ResponseMessageSharedPtr dns_response =
-              this->constructResponse(dns_request, NOERROR, false);
-
-          // TODO(sumukhs): The TTL for these responses are not known and need to be extracted from
-          // the c-ares response. Currently, the resolve API does not provide this functionality.
-          this->addAnswersAndInvokeCallback(dns_response, Formats::ResourceRecordSection::Answer,
-                                            results);
-          return;
-        }
+  if (pending_recursive_query_list_.empty()) {
+    pending_recursive_query_timer_->enableTimer(config_.recursiveQueryTimeout());
+  }
 
-        ENVOY_LOG(debug, "DnsFilter: dns name {} mapping failed to resolve using client",
-                  dns_request->questionRecord().qName());
+  // The decoded request is only valid until the next request is decoded. Keep a copy of it until
+  // the query completes. The query is tracked before it is issued since it can complete inline.
+  const MonotonicTime now = dispatcher_.timeSource().monotonicTime();
+  auto pending_query = pending_recursive_query_list_.emplace(
+      pending_recursive_query_list_.end(), key, q_type, now, now + config_.recursiveQueryTimeout());
+  pending_query->waiters_.push_back(
+      {query != nullptr ? query->request_ : dns_request.clone(), query, question_index});
+  if (mayBeRetransmitted(dns_request, query)) {
+    pending_query->retransmit_keys_.insert(retransmitKey(dns_request));
+  }
+  pending_queries.emplace(key, pending_query);
+  stats_.recursive_query_.inc();
+  stats_.recursive_query_pending_.inc();
 
-        this->constructFailedResponseAndInvokeCallback(dns_request, SERVFAIL);
+  Network::ActiveDnsQuery* active_query = recursive_resolver_->resolve(
+      dns_name, q_type, [this, key, q_type](RecursiveResult&& result) -> void {
+        this->onRecursiveQueryComplete(key, q_type, std::move(result));
       });
 
-  return;
+  // Queries that completed inline are not handed out and no longer tracked
+  if (active_query != nullptr) {
+    pending_query->active_query_ = active_query;
+  }
+
+  return true;
+}
+
+bool DnsServerImpl::attachToPendingQuery(const Formats::Message& dns_request,
+                                         const MultiQuestionQuerySharedPtr& query,
+                                         uint16_t question_index,
+                                         PendingRecursiveQuery& pending_query) {
+  // A client that did not get an answer in time sends the query again, with the same ID. It is
+  // answered once the pending query completes. The questions of a query with several questions
+  // are not matched against each other, one of them may repeat another.
+  const bool may_be_retransmitted = mayBeRetransmitted(dns_request, query);
+  std::string retransmit_key;
+  if (may_be_retransmitted) {
+    retransmit_key = retransmitKey(dns_request);
+    if (pending_query.retransmit_keys_.count(retransmit_key) > 0) {
+      ENVOY_LOG(debug, "DnsFilter: dropping retransmit of query {} from {}",
+                dns_request.header().id(), dns_request.from()->asString());
+      stats_.recursive_retransmit_dropped_.inc();
+      return true;
+    }
+  }
+
+  if (pending_query.waiters_.size() >= config_.maxWaitersPerRecursiveQuery()) {
+    ENVOY_LOG(debug, "DnsFilter: Unknown domain name {}. Too many requests wait for its query",
+              pending_query.key_);
+    stats_.recursive_waiter_overflow_.inc();
+    return false;
+  }
+
+  ENVOY_LOG(debug, "DnsFilter: Unknown domain name {}. Waiting for the pending query",
+            pending_query.key_);
+  pending_query.waiters_.push_back(
+      {query != nullptr ? query->request_ : dns_request.clone(), query, question_index});
+  if (may_be_retransmitted) {
+    pending_query.retransmit_keys_.insert(std::move(retransmit_key));
+  }
+  stats_.recursive_query_coalesced_.inc();
+  return true;
+}
+
+bool DnsServerImpl::mayBeRetransmitted(const Formats::Message& dns_request,
+                                       const MultiQuestionQuerySharedPtr& query) {
+  // A query over TCP is not lost, a repeated ID is another query pipelined on the connection that
+  // expects a response of its own
+  return query == nullptr && dns_request.transport() == Formats::Transport::Udp;
 }
 
-uint16_t
-DnsServerImpl::findKnownName(const std::string& dns_name,
-                             std::list<Network::Address::InstanceConstSharedPtr>& result_list) {
-  const auto& dns_map_it = config_.dnsMap().find(dns_name);
-  if (dns_map_it == config_.dnsMap().end()) {
+std::string DnsServerImpl::retransmitKey(const Formats::Message& dns_request) {
+  const uint16_t id = dns_request.header().id();
+  std::string key = dns_request.from()->asString();
+  key.push_back(static_cast<char>(id >> 8));
+  key.push_back(static_cast<char>(id & 0xFF));
+  return key;
+}
+
+void DnsServerImpl::onRecursiveQueryComplete(const std::string& key, uint16_t q_type,
+                                             RecursiveResult&& result) {
+  PendingRecursiveQueryMap& pending_queries = pendingRecursiveQueries(q_type);
+  auto it = pending_queries.find(key);
+  ASSERT(it != pending_queries.end());
+
+  stats_.recursive_query_pending_.dec();
+  stats_.recursive_query_latency_.recordValue(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          dispatcher_.timeSource().monotonicTime() - it->second->issued_)
+          .count());
+
+  // Requests for the name that arrive from here on are answered from the cache, or by a new query
+  const std::vector<RecursiveQueryWaiter> waiters = std::move(it->second->waiters_);
+  pending_recursive_query_list_.erase(it->second);
+  pending_queries.erase(it);
+
+  // The timer is left armed for an earlier deadline. It is re-armed for the next one once it fires.
+  if (pending_recursive_query_list_.empty()) {
+    pending_recursive_query_timer_->disableTimer();
+  }
+
+  recursive_cache_.insert(key, q_type, result);
+
+  notifyWaiters(waiters, result,
+                recursive_cache_.clampTtl(result.ttl_.value_or(std::chrono::seconds(0))));
+}
+
+void DnsServerImpl::onPendingRecursiveQueryTimeout() {
+  const MonotonicTime now = dispatcher_.timeSource().monotonicTime();
+  const RecursiveResult timed_out{SERVFAIL, {}, absl::nullopt};
+
+  while (!pending_recursive_query_list_.empty() &&
+         pending_recursive_query_list_.front().deadline_ <= now) {
+    PendingRecursiveQuery& pending_query = pending_recursive_query_list_.front();
+    ENVOY_LOG(debug, "DnsFilter: recursive query for {} timed out", pending_query.key_);
+    stats_.recursive_query_timeout_.inc();
+    stats_.recursive_query_pending_.dec();
+
+    if (pending_query.active_query_ != nullptr) {
+      pending_query.active_query_->cancel();
+    }
+
+    const std::vector<RecursiveQueryWaiter> waiters = std::move(pending_query.waiters_);
+    pendingRecursiveQueries(pending_query.q_type_).erase(pending_query.key_);
+    pending_recursive_query_list_.pop_front();
+
+    notifyWaiters(waiters, timed_out, std::chrono::seconds(0));
+  }
+
+  if (!pending_recursive_query_list_.empty()) {
+    // The remaining time is truncated, keep the timer from firing before the deadline
+    const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        pending_recursive_query_list_.front().deadline_ - now);
+    pending_recursive_query_timer_->enableTimer(remaining + std::chrono::milliseconds(1));
+  }
+}
+
+void DnsServerImpl::notifyWaiters(const std::vector<RecursiveQueryWaiter>& waiters,
+                                  const RecursiveResult& result, std::chrono::seconds ttl) {
+  for (const auto& waiter : waiters) {
+    if (waiter.query_ == nullptr) {
+      respondWithRecursiveResult(*waiter.request_, result, ttl);
+      continue;
+    }
+
+    QuestionAnswer& answer = waiter.query_->answers_[waiter.question_index_];
+    answer.response_code_ = result.response_code_;
+    answer.addresses_ = result.addresses_;
+    answer.ttl_ = static_cast<uint32_t>(ttl.count());
+    onQuestionAnswered(*waiter.query_);
+  }
+}
+
+DnsServerImpl::PendingRecursiveQueryMap& DnsServerImpl::pendingRecursiveQueries(uint16_t q_type) {
+  ASSERT(q_type == T_A || q_type == T_AAAA);
+  return pending_recursive_queries_[q_type == T_A ? 0 : 1];
+}
+
+void DnsServerImpl::respondWithRecursiveResult(const Formats::Message& dns_request,
+                                               const RecursiveResult& result,
+                                               std::chrono::seconds ttl) {
+  if (result.response_code_ != NOERROR) {
+    ENVOY_LOG(debug, "DnsFilter: dns name {} failed to resolve using client. rCode {}",
+              dns_request.questionRecord().qName(), result.response_code_);
+
+    constructFailedResponseAndInvokeCallback(dns_request, result.response_code_,
+                                             stats_.recursive_);
+    return;
+  }
+
+  // A NODATA result has no addresses and is sent back as an empty NOERROR response
+  Formats::ResponseMessageSharedPtr dns_response = constructResponse(dns_request, NOERROR, false);
+  addAnswersAndInvokeCallback(dns_request, dns_response, NOERROR,
+                              Formats::ResourceRecordSection::Answer, result.addresses_,
+                              KnownCluster(), static_cast<uint32_t>(ttl.count()),
+                              stats_.recursive_);
+}
+
+uint16_t DnsServerImpl::findKnownName(const Formats::QuestionRecord& question,
+                                      const DomainNameMatch& match, PackedAddresses& addresses,
+                                      PackedEndpoints& endpoints, KnownCluster& known_cluster) {
+  const std::string& dns_name = question.qName();
+
+  // Static records answer the A and AAAA questions for the name itself, whatever its cluster. They
+  // are not cached, as they are looked up in place.
+  const StaticRecords& static_records = match.static_records_;
+  if (!static_records.empty() && question.qType() != T_SRV) {
+    ENVOY_LOG(debug, "DnsFilter: Found {} ipv4 and {} ipv6 static records for dns name {}",
+              static_records.ipv4_count_, static_records.ipv6_count_, dns_name);
+    stats_.answer_static_.inc();
+
+    if (question.qType() != T_AAAA) {
+      pickStaticRecords(static_records.ipv4_, static_records.ipv4_count_, config_.maxAnswers(),
+                        addresses.ipv4_);
+    }
+    if (question.qType() != T_A) {
+      pickStaticRecords(static_records.ipv6_, static_records.ipv6_count_, config_.maxAnswers(),
+                        addresses.ipv6_);
+    }
+
+    return NOERROR;
+  }
+
+  if (match.cluster_name_ == nullptr) {
+    // The targets of SRV records are below the name of the service. They are only looked for
+    // once the name has no entry, an entry or a pattern matching a target takes precedence.
+    if (question.qType() != T_SRV && findSrvTarget(question, addresses, known_cluster)) {
+      return NOERROR;
+    }
+
     ENVOY_LOG(debug, "DnsFilter: dns name {} mapping does not exist. Returning NXDomain", dns_name);
     return NXDOMAIN;
   }
 
-  const std::string& cluster_name = dns_map_it->second;
-  Upstream::ThreadLocalCluster* cluster = cluster_manager_.get(cluster_name);
-  if (cluster == nullptr) {
+  const std::string& cluster_name = *match.cluster_name_;
+  AnswerCache::ClusterHosts* hosts =
+      answer_cache_.hosts(cluster_name, config_.healthyPanicThreshold());
+  if (hosts == nullptr) {
+    // A name matched by a {cluster} entry can be made up by the client, the cluster built from it
+    // need not exist. A cluster of an explicit entry could be missing for a moment only.
+    if (!match.cluster_label_.empty()) {
+      ENVOY_LOG(debug, "DnsFilter: cluster {} built for dns name {} does not exist", cluster_name,
+                dns_name);
+      return NXDOMAIN;
+    }
+
     ENVOY_LOG(debug,
               "DnsFilter: cluster {} for dns name {} does not exist. Returning Server failure as "
               "this could be transient.",
@@ -132,141 +775,279 @@ DnsServerImpl::findKnownName(const std::string& dns_name,
     return SERVFAIL;
   }
 
-  const std::vector<Upstream::HostSetPtr>& hostSets = cluster->prioritySet().hostSetsPerPriority();
+  ENVOY_LOG(debug,
+            "DnsFilter: Found {} ipv4 and {} ipv6 hosts for cluster {} with dns name {}. Panic: {}",
+            hosts->addresses_.ipv4_.size(), hosts->addresses_.ipv6_.size(), cluster_name, dns_name,
+            hosts->panic_);
+
+  // Answering with hosts known to be down only makes the clients time out
+  if (hosts->empty()) {
+    ENVOY_LOG(debug, "DnsFilter: cluster {} for dns name {} has no healthy hosts", cluster_name,
+              dns_name);
+    stats_.answer_no_healthy_host_.inc();
+    return SERVFAIL;
+  }
 
-  ENVOY_LOG(debug, "DnsFilter: Found {} hostSets for cluster {} with dns name {}", hostSets.size(),
-            cluster_name, dns_name);
+  if (hosts->panic_) {
+    stats_.answer_panic_.inc();
+  } else {
+    stats_.answer_healthy_.inc();
+  }
 
-  for (uint32_t i = 0; i < hostSets.size(); i++) {
-    for (auto& host : hostSets[i]->hosts()) {
-      const Network::Address::InstanceConstSharedPtr& address = host->address();
-      ENVOY_LOG(debug, "DnsFilter: Endpoint {} added for dns name {}", address->asString(),
-                dns_name);
-      result_list.emplace_back(address);
+  // SRV questions are answered with the endpoint of every address, as its port and weight are
+  // those of its host
+  const bool srv = question.qType() == T_SRV;
+  const uint32_t max_answers = config_.maxAnswers();
+  bool all_addresses = true;
+  size_t offset;
+  size_t answers;
+  if (question.qType() != T_AAAA) {
+    all_addresses = pickAnswers(hosts->addresses_.ipv4_.size(), max_answers,
+                                hosts->next_ipv4_offset_, offset, answers) &&
+                    all_addresses;
+    copyAnswers(hosts->addresses_.ipv4_, offset, answers, addresses.ipv4_);
+    if (srv) {
+      copyAnswers(hosts->endpoints_.ipv4_, offset, answers, endpoints.ipv4_);
+    }
+  }
+  if (question.qType() != T_A) {
+    all_addresses = pickAnswers(hosts->addresses_.ipv6_.size(), max_answers,
+                                hosts->next_ipv6_offset_, offset, answers) &&
+                    all_addresses;
+    copyAnswers(hosts->addresses_.ipv6_, offset, answers, addresses.ipv6_);
+    if (srv) {
+      copyAnswers(hosts->endpoints_.ipv6_, offset, answers, endpoints.ipv6_);
     }
   }
 
-  // TODO(sumukhs): Is this a valid assumption?
-  ASSERT(!result_list.empty(), "Host List cannot be empty if the cluster is found");
+  // A response holding all the addresses answers are built from is the same for every query.
+  // Responses built in panic are not cached, so that every one of them is counted.
+  if (all_addresses && !hosts->panic_) {
+    known_cluster.name_ = cluster_name;
+  }
 
   return NOERROR;
 }
 
-void DnsServerImpl::resolveSRV(const Formats::RequestMessageConstSharedPtr& dns_request) {
-  const std::string& dns_name = dns_request->questionRecord().qName();
+void DnsServerImpl::resolveSRV(const Formats::Message& dns_request) {
+  const std::string& dns_name = dns_request.questionRecord().qName();
 
   // If the domain name is not known, fail the request since we cannot serve SRV records if the
   // domain is not well known
-  if (!config_.belongsToKnownDomainName(dns_name)) {
+  const DomainNameMatch match = known_names_->matchDomainName(dns_name);
+  if (!match.known_suffix_) {
+    if (forward(dns_request, stats_.recursive_)) {
+      return;
+    }
+
     ENVOY_LOG(debug, "DnsFilter: dns service name {} not known for SRV request. Returning NXDomain",
               dns_name);
-    constructFailedResponseAndInvokeCallback(dns_request, NXDOMAIN);
+    constructFailedResponseAndInvokeCallback(dns_request, NXDOMAIN, stats_.known_);
     return;
   }
 
-  std::list<Network::Address::InstanceConstSharedPtr> result_list;
-  uint16_t response_code = findKnownName(dns_name, result_list);
+  PackedAddresses addresses;
+  PackedEndpoints endpoints;
+  KnownCluster known_cluster;
+  uint16_t response_code =
+      findKnownName(dns_request.questionRecord(), match, addresses, endpoints, known_cluster);
 
   if (response_code != NOERROR) {
-    constructFailedResponseAndInvokeCallback(dns_request, response_code);
+    constructFailedResponseAndInvokeCallback(dns_request, response_code, stats_.known_);
     return;
   }
 
   Formats::ResponseMessageSharedPtr dns_response =
       constructResponse(dns_request, response_code, true);
 
-  uint16_t first_port = result_list.front()->ip()->port();
-  for (const auto& result : result_list) {
-    uint16_t current_port = result->ip()->port();
-    // Without this guarantee (static ports), there is a possibility that we return port 'X' for SRV
-    // request with target_name "a.b.c", but when a request is made for a.b.c, we return the IP of a
-    // port that is not listening on port 'X' if there are multiple hosts in a service.
-    if (current_port != first_port) {
-      ENVOY_LOG(debug,
-                "DNS Server: Error while adding SRV record for qName {} port {} does not match {}",
-                dns_request->questionRecord().qName(), first_port, current_port);
+  // Each host is the target of its own record, with the address records of the targets in the
+  // additional section. A client that ignores them resolves the targets with A or AAAA questions.
+  addSrvAnswers(dns_response, dns_name, addresses, endpoints,
+                static_cast<uint32_t>(config_.ttl().count()));
 
-      constructFailedResponseAndInvokeCallback(dns_request, SERVFAIL);
-      return;
-    }
+  serializeAndInvokeCallback(dns_request, dns_response, response_code, known_cluster,
+                             stats_.known_);
+
+  return;
+}
+
+bool DnsServerImpl::findSrvTarget(const Formats::QuestionRecord& question,
+                                  PackedAddresses& addresses, KnownCluster& known_cluster) {
+  const std::string& dns_name = question.qName();
+  const size_t dot = dns_name.find('.');
+  PackedAddresses target;
+  if (dot == std::string::npos || !parseTargetLabel(absl::string_view(dns_name).substr(0, dot),
+                                                    target)) {
+    return false;
   }
 
-  // Add the SRV record before populating response and invoking callback
-  // Use the question name in the SRV record answer - if the user ignores the additional records
-  // added below and re-issues a query for the same question with "A" or "AAAA", he will get the
-  // list of IP's.
-  // TODO(sumukhs): Also consider how to pass in priority and weight for srv records
-  dns_response->addSRVRecord(static_cast<uint16_t>(config_.ttl().count()), first_port,
-                             dns_request->questionRecord().qName());
+  const DomainNameMatch match = known_names_->matchDomainName(dns_name.substr(dot + 1));
+  if (match.cluster_name_ == nullptr) {
+    return false;
+  }
 
-  addAnswersAndInvokeCallback(dns_response, Formats::ResourceRecordSection::Additional,
-                              result_list);
+  AnswerCache::ClusterHosts* hosts =
+      answer_cache_.hosts(*match.cluster_name_, config_.healthyPanicThreshold());
+  if (hosts == nullptr) {
+    return false;
+  }
 
-  return;
+  const bool host_of_cluster =
+      target.ipv4_.empty()
+          ? std::find(hosts->addresses_.ipv6_.begin(), hosts->addresses_.ipv6_.end(),
+                      target.ipv6_[0]) != hosts->addresses_.ipv6_.end()
+          : std::find(hosts->addresses_.ipv4_.begin(), hosts->addresses_.ipv4_.end(),
+                      target.ipv4_[0]) != hosts->addresses_.ipv4_.end();
+  if (!host_of_cluster) {
+    return false;
+  }
+
+  ENVOY_LOG(debug, "DnsFilter: dns name {} is the SRV target of a host of cluster {}", dns_name,
+            *match.cluster_name_);
+  stats_.answer_srv_target_.inc();
+
+  // The question for the other family of the host is answered without records
+  if (question.qType() == T_A) {
+    addresses.ipv4_ = std::move(target.ipv4_);
+  } else {
+    addresses.ipv6_ = std::move(target.ipv6_);
+  }
+
+  // The answer holds a single host, it is dropped along with the hosts of the cluster
+  if (!hosts->panic_) {
+    known_cluster.name_ = *match.cluster_name_;
+  }
+
+  return true;
+}
+
+void DnsServerImpl::addSrvAnswers(Formats::ResponseMessageSharedPtr& dns_response,
+                                  const std::string& name, const PackedAddresses& addresses,
+                                  const PackedEndpoints& endpoints, uint32_t ttl) {
+  addSrvRecords(*dns_response, name, ttl, addresses.ipv4_, endpoints.ipv4_);
+  addSrvRecords(*dns_response, name, ttl, addresses.ipv6_, endpoints.ipv6_);
 }
 
 void DnsServerImpl::addAnswersAndInvokeCallback(
-    Formats::ResponseMessageSharedPtr& dns_response, Formats::ResourceRecordSection section,
-    const std::list<Network::Address::InstanceConstSharedPtr>& result_list) {
+    const Formats::Message& dns_request, Formats::ResponseMessageSharedPtr& dns_response,
+    uint16_t response_code, Formats::ResourceRecordSection section,
+    const std::list<Network::Address::InstanceConstSharedPtr>& result_list,
+    const KnownCluster& known_cluster, uint32_t ttl, DnsQueryStats& query_stats) {
+  addAnswers(dns_response, section, dns_request.questionRecord().qName(), result_list, ttl);
+
+  serializeAndInvokeCallback(dns_request, dns_response, response_code, known_cluster, query_stats);
+}
+
+void DnsServerImpl::addAnswersAndInvokeCallback(
+    const Formats::Message& dns_request, Formats::ResponseMessageSharedPtr& dns_response,
+    uint16_t response_code, Formats::ResourceRecordSection section,
+    const PackedAddresses& addresses, const KnownCluster& known_cluster, uint32_t ttl,
+    DnsQueryStats& query_stats) {
+  addAnswers(dns_response, section, dns_request.questionRecord().qName(), addresses, ttl);
+
+  serializeAndInvokeCallback(dns_request, dns_response, response_code, known_cluster, query_stats);
+}
 
-  uint32_t ttl = static_cast<uint32_t>(config_.ttl().count());
+void DnsServerImpl::addAnswers(
+    Formats::ResponseMessageSharedPtr& dns_response, Formats::ResourceRecordSection section,
+    const std::string& name, const std::list<Network::Address::InstanceConstSharedPtr>& result_list,
+    uint32_t ttl) {
+  // Recursive queries are issued per question type, so the addresses are of its family
   for (const auto& address : result_list) {
     ASSERT(address->ip() != nullptr, "DNServer: Resolved address must be an IP");
 
     ENVOY_LOG(debug, "DNS Server: Adding A/AAAA record section {} address {}",
               static_cast<int>(section), address->asString());
 
-    // TODO(sumukhs): If the question is A, should return only AAAA. Similarly, if the question is
-    // AAAA, return only A. People return SOA when there is no response to be sent. Investigate if
-    // that is needed.
     switch (address->ip()->version()) {
     case Network::Address::IpVersion::v4:
-      dns_response->addARecord(section, ttl, address->ip()->ipv4());
+      dns_response->addARecord(section, name, ttl, address->ip()->ipv4()->address());
       break;
     case Network::Address::IpVersion::v6:
-      dns_response->addAAAARecord(section, ttl, address->ip()->ipv6());
+      dns_response->addAAAARecord(section, name, ttl, address->ip()->ipv6()->address());
       break;
     }
   }
+}
+
+void DnsServerImpl::addAnswers(Formats::ResponseMessageSharedPtr& dns_response,
+                               Formats::ResourceRecordSection section, const std::string& name,
+                               const PackedAddresses& addresses, uint32_t ttl) {
+  for (const uint32_t address : addresses.ipv4_) {
+    dns_response->addARecord(section, name, ttl, address);
+  }
 
-  serializeAndInvokeCallback(dns_response);
+  for (const absl::uint128& address : addresses.ipv6_) {
+    dns_response->addAAAARecord(section, name, ttl, address);
+  }
 }
 
-void DnsServerImpl::constructFailedResponseAndInvokeCallback(
-    const Formats::RequestMessageConstSharedPtr& dns_request, uint16_t response_code) {
+void DnsServerImpl::constructFailedResponseAndInvokeCallback(const Formats::Message& dns_request,
+                                                             uint16_t response_code,
+                                                             DnsQueryStats& query_stats) {
 
   Formats::ResponseMessageSharedPtr dns_response =
       constructResponse(dns_request, response_code, false);
 
-  serializeAndInvokeCallback(dns_response);
+  serializeAndInvokeCallback(dns_request, dns_response, response_code, KnownCluster(),
+                             query_stats);
 }
 
 Formats::ResponseMessageSharedPtr
-DnsServerImpl::constructResponse(const Formats::RequestMessageConstSharedPtr& dns_request,
-                                 uint16_t response_code, bool is_authority) {
+DnsServerImpl::constructResponse(const Formats::Message& dns_request, uint16_t response_code,
+                                 bool is_authority) {
   Formats::Message::ResponseOptions response_options{response_code, is_authority};
   Formats::ResponseMessageSharedPtr response_message =
-      dns_request->createResponseMessage(response_options);
+      dns_request.createResponseMessage(response_options);
 
   return response_message;
 }
 
-void DnsServerImpl::serializeAndInvokeCallback(Formats::ResponseMessageSharedPtr& dns_response) {
+void DnsServerImpl::serializeAndInvokeCallback(const Formats::Message& dns_request,
+                                               Formats::ResponseMessageSharedPtr& dns_response,
+                                               uint16_t response_code,
+                                               const KnownCluster& known_cluster,
+                                               DnsQueryStats& query_stats) {
   Buffer::OwnedImpl response_buffer;
   dns_response->encode(response_buffer);
 
-  // TODO(sumukhs): Add EDNS(0) record if the buffer is longer than 512 bytes
+  // The response is truncated to the payload size of the client, and echoes its OPT record
   ENVOY_LOG(debug, "DNS:response Headers: {} Question: {} TotalBytes {}",
-            log_dns_headers(dns_response), log_dns_question(dns_response),
+            log_dns_headers(*dns_response), log_dns_question(*dns_response),
             response_buffer.length());
 
-  resolve_callback_(dns_response, response_buffer);
+  if (!known_cluster.name_.empty()) {
+    answer_cache_.insert(dns_request, known_cluster.name_, response_buffer);
+  }
+
+  sendResponse(dns_request, response_buffer, response_code, query_stats);
 }
 
-bool DnsServerImpl::isSupportedQuery(
-    const Formats::RequestMessageConstSharedPtr& dns_request) const {
+void DnsServerImpl::sendResponse(const Formats::Message& dns_request,
+                                 Buffer::Instance& response_buffer, uint16_t response_code,
+                                 DnsQueryStats& query_stats) {
+  for (uint16_t i = 0; i < dns_request.header().qdCount(); i++) {
+    questionTypeCounter(query_stats, dns_request.questionRecord(i).qType()).inc();
+  }
+  responseCodeCounter(query_stats, response_code).inc();
+
+  // The answer count and the TC bit are only final once the response is encoded
+  if (response_buffer.length() >= HFIXEDSZ) {
+    unsigned char header[HFIXEDSZ];
+    response_buffer.copyOut(0, HFIXEDSZ, header);
+    stats_.response_answers_.recordValue(DNS_HEADER_ANCOUNT(header));
+    if (DNS_HEADER_TC(header)) {
+      stats_.response_truncated_.inc();
+    }
+  }
+  stats_.response_bytes_.recordValue(response_buffer.length());
+
+  resolve_callback_(dns_request, response_buffer);
+}
 
-  const Formats::Header& header = dns_request->header();
+bool DnsServerImpl::isSupportedQuery(const Formats::Message& dns_request) const {
+
+  const Formats::Header& header = dns_request.header();
 
   if (header.qrCode() != Formats::MessageType::Query) {
     // Only query is supported
@@ -280,30 +1061,23 @@ bool DnsServerImpl::isSupportedQuery(
     return false;
   }
 
-  if (header.qdCount() > 1) {
-    // Only 1 Query is supported per query. This is to eliminate the complexity required to handle
-    // resolving domains from external client and domains that are known to the filter.
-    // TODO(sumukhs): We could add support for resolving multiple external/known domains at once
-    // however.
-    ENVOY_LOG(debug, "DNS:NotSupported. Only 1 Question supported");
-    return false;
-  }
-
-  const Formats::QuestionRecord& question = dns_request->questionRecord();
+  for (uint16_t i = 0; i < header.qdCount(); i++) {
+    const Formats::QuestionRecord& question = dns_request.questionRecord(i);
 
-  if (question.qClass() != C_IN) {
-    // Only support standard opcode queries.
-    ENVOY_LOG(debug, "DNS:NotSupported. Only standard query class C_IN supported. qClass = {}",
-              question.qClass());
-    return false;
-  }
+    if (question.qClass() != C_IN) {
+      // Only support standard opcode queries.
+      ENVOY_LOG(debug, "DNS:NotSupported. Only standard query class C_IN supported. qClass = {}",
+                question.qClass());
+      return false;
+    }
 
-  if (question.qType() != T_A && question.qType() != T_AAAA && question.qType() != T_SRV) {
-    // Only these 3 questions are supported.
-    ENVOY_LOG(debug,
-              "DNS:NotSupported. Only T_A|T_AAAA|T_SRV question types are supported. qType = {}",
-              question.qType());
-    return false;
+    if (question.qType() != T_A && question.qType() != T_AAAA && question.qType() != T_SRV) {
+      // Only these 3 questions are supported.
+      ENVOY_LOG(debug,
+                "DNS:NotSupported. Only T_A|T_AAAA|T_SRV question types are supported. qType = {}",
+                question.qType());
+      return false;
+    }
   }
 
   return true;
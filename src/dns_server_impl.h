@@ -1,15 +1,35 @@
 #pragma once
 
+#include <arpa/nameser.h>
+#include <arpa/nameser_compat.h>
+
+#include <array>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 #include "common/buffer/buffer_impl.h"
 #include "common/common/logger.h"
+#include "envoy/common/time.h"
+#include "envoy/event/timer.h"
 #include "envoy/network/dns.h"
+#include "envoy/stats/scope.h"
+#include "envoy/stats/stats_macros.h"
 
+#include "src/dns_answer_cache.h"
+#include "src/dns_config.h"
+#include "src/dns_forwarder.h"
+#include "src/dns_name_trie.h"
+#include "src/dns_recursive_cache.h"
+#include "src/dns_recursive_resolver.h"
 #include "src/dns_server.h"
 
 namespace Envoy {
 
 namespace Upstream {
 class ClusterManager;
+class PrioritySet;
 }
 
 namespace Event {
@@ -20,7 +40,68 @@ namespace Extensions {
 namespace ListenerFilters {
 namespace Dns {
 
-class Config;
+/**
+ * Stats kept apart for each kind of query: answered from the known names, resolved recursively,
+ * or not supported. Every response counts the types of its questions and its response code.
+ * @see stats_macros.h
+ */
+// clang-format off
+#define ALL_DNS_QUERY_STATS(COUNTER)                                                               \
+  COUNTER(query_a)                                                                                 \
+  COUNTER(query_aaaa)                                                                              \
+  COUNTER(query_srv)                                                                               \
+  COUNTER(query_other)                                                                             \
+  COUNTER(response_noerror)                                                                        \
+  COUNTER(response_formerr)                                                                        \
+  COUNTER(response_servfail)                                                                       \
+  COUNTER(response_nxdomain)                                                                       \
+  COUNTER(response_notimp)                                                                         \
+  COUNTER(response_refused)                                                                        \
+  COUNTER(response_badvers)                                                                        \
+  COUNTER(response_other)
+// clang-format on
+
+/**
+ * Struct definition for the stats of a kind of query. @see stats_macros.h
+ */
+struct DnsQueryStats {
+  ALL_DNS_QUERY_STATS(GENERATE_COUNTER_STRUCT)
+};
+
+/**
+ * All dns server stats. @see stats_macros.h
+ */
+// clang-format off
+#define ALL_DNS_SERVER_STATS(COUNTER, GAUGE, HISTOGRAM)                                            \
+  COUNTER(answer_cache_hit)                                                                        \
+  COUNTER(answer_healthy)                                                                          \
+  COUNTER(answer_no_healthy_host)                                                                  \
+  COUNTER(answer_panic)                                                                            \
+  COUNTER(answer_srv_target)                                                                       \
+  COUNTER(answer_static)                                                                           \
+  COUNTER(recursive_cache_hit)                                                                     \
+  COUNTER(recursive_query)                                                                         \
+  COUNTER(recursive_query_coalesced)                                                               \
+  COUNTER(recursive_query_overflow)                                                                \
+  COUNTER(recursive_query_timeout)                                                                 \
+  COUNTER(recursive_retransmit_dropped)                                                            \
+  COUNTER(recursive_waiter_overflow)                                                               \
+  COUNTER(response_truncated)                                                                      \
+  GAUGE(recursive_query_pending, Accumulate)                                                       \
+  HISTOGRAM(recursive_query_latency)                                                               \
+  HISTOGRAM(response_answers)                                                                      \
+  HISTOGRAM(response_bytes)
+// clang-format on
+
+/**
+ * Struct definition for all dns server stats. @see stats_macros.h
+ */
+struct DnsServerStats {
+  ALL_DNS_SERVER_STATS(GENERATE_COUNTER_STRUCT, GENERATE_GAUGE_STRUCT, GENERATE_HISTOGRAM_STRUCT)
+  DnsQueryStats known_;
+  DnsQueryStats recursive_;
+  DnsQueryStats unsupported_;
+};
 
 /**
  * Resolves domain names that are expected to be known to the DNS filter.
@@ -28,48 +109,255 @@ class Config;
  */
 class DnsServerImpl : public DnsServer, protected Logger::Loggable<Logger::Id::filter> {
 public:
+  /**
+   * @param known_names are the known names of the worker of the server. The answers cached for
+   * the names whose entry changed are dropped when the dns entries are replaced.
+   * @param forwarder relays the queries with a single question that are not answered from the
+   * known names, in place of the recursive resolver. nullptr if queries are not forwarded.
+   */
   DnsServerImpl(const ResolveCallback& resolve_callback, const Config& config,
-                Event::Dispatcher& dispatcher, Upstream::ClusterManager& cluster_manager);
+                KnownNamesSharedPtr known_names, RecursiveResolverPtr&& recursive_resolver,
+                ForwarderPtr&& forwarder, Event::Dispatcher& dispatcher,
+                Upstream::ClusterManager& cluster_manager, Stats::Scope& scope);
+  ~DnsServerImpl();
+
+  /**
+   * @param scope is the scope of the filter. The stats of the kinds of queries are kept in the
+   * "known.", "recursive." and "unsupported." scopes below it.
+   */
+  static DnsServerStats generateStats(Stats::Scope& scope);
 
   // DnsServer
-  void resolve(const Formats::RequestMessageConstSharedPtr& dns_request) override;
+  void resolve(const Formats::Message& dns_request) override;
 
 private:
-  bool isSupportedQuery(const Formats::RequestMessageConstSharedPtr& dns_request) const;
+  /**
+   * The cluster backing a known domain name. Responses holding all the answered hosts of the
+   * cluster are cached until the hosts of the cluster or their health change. It is left unset for
+   * responses capped at max_answers, which rotate through the hosts, and for responses built while
+   * the cluster is in panic.
+   */
+  struct KnownCluster {
+    // Empty if the response is not cached. A copy, as the cluster name built for a {cluster} entry
+    // is owned by the match of the name.
+    std::string name_;
+  };
+
+  /**
+   * The answer to one question of a query with several questions.
+   */
+  struct QuestionAnswer {
+    uint16_t response_code_{NOERROR};
+    bool authoritative_{false};
+    // The addresses of an unknown name
+    std::list<Network::Address::InstanceConstSharedPtr> addresses_;
+    // The addresses of a known name
+    PackedAddresses known_addresses_;
+    // The endpoints of the known addresses for SRV questions
+    PackedEndpoints known_endpoints_;
+    uint32_t ttl_{0};
+  };
+
+  /**
+   * A query with several questions. The questions for known names are answered right away, the
+   * ones for unknown names are resolved concurrently. A single response with the answers to all
+   * questions is sent once the last of them is answered.
+   */
+  struct MultiQuestionQuery {
+    Formats::RequestMessageConstSharedPtr request_;
+    std::vector<QuestionAnswer> answers_;
+    size_t pending_questions_{0};
+  };
+
+  typedef std::shared_ptr<MultiQuestionQuery> MultiQuestionQuerySharedPtr;
+
+  /**
+   * A request waiting for the result of a recursive query. If query_ is set, the result answers
+   * the question at question_index_ of that query instead of being sent to the client directly.
+   */
+  struct RecursiveQueryWaiter {
+    Formats::RequestMessageConstSharedPtr request_;
+    MultiQuestionQuerySharedPtr query_;
+    uint16_t question_index_;
+  };
+
+  /**
+   * A recursive query that is in flight, together with all the requests waiting for its result.
+   * Requests for the same question arriving while the query is in flight attach to it instead of
+   * issuing a query of their own.
+   */
+  struct PendingRecursiveQuery {
+    PendingRecursiveQuery(const std::string& key, uint16_t q_type, MonotonicTime issued,
+                          MonotonicTime deadline)
+        : key_(key), q_type_(q_type), issued_(issued), deadline_(deadline) {}
+
+    const std::string key_;
+    const uint16_t q_type_;
+    const MonotonicTime issued_;
+    const MonotonicTime deadline_;
+    // Not set if the query was not handed out by the resolver
+    Network::ActiveDnsQuery* active_query_{};
+    std::vector<RecursiveQueryWaiter> waiters_;
+    // The retransmitKey() of the waiters with a single question received over UDP
+    std::unordered_set<std::string> retransmit_keys_;
+  };
 
-  void resolveAorAAAA(const Formats::RequestMessageConstSharedPtr& dns_request);
+  // All queries share the same timeout, so a list in the order the queries were issued is also
+  // ordered by their deadlines. A single timer armed for the earliest deadline expires them all.
+  typedef std::list<PendingRecursiveQuery> PendingRecursiveQueryList;
 
-  void resolveSRV(const Formats::RequestMessageConstSharedPtr& dns_request);
+  // Keyed on the lower case question name, one map per question type
+  typedef std::unordered_map<std::string, PendingRecursiveQueryList::iterator>
+      PendingRecursiveQueryMap;
 
-  void resolveUnknownAorAAAA(const Formats::RequestMessageConstSharedPtr& dns_request);
+  bool isSupportedQuery(const Formats::Message& dns_request) const;
 
-  uint16_t findKnownName(const std::string& dns_name,
-                         std::list<Network::Address::InstanceConstSharedPtr>& result_list);
+  void resolveAorAAAA(const Formats::Message& dns_request);
 
-  void
-  constructFailedResponseAndInvokeCallback(const Formats::RequestMessageConstSharedPtr& dns_request,
-                                           uint16_t response_code);
+  void resolveSRV(const Formats::Message& dns_request);
 
-  void constructResponseAndInvokeCallback(
-      const Formats::RequestMessageConstSharedPtr& dns_request, uint16_t response_code,
-      Formats::ResourceRecordSection section, bool isAuthority,
-      const std::list<Network::Address::InstanceConstSharedPtr>& result_list);
+  void resolveUnknownAorAAAA(const Formats::Message& dns_request);
 
-  Formats::ResponseMessageSharedPtr
-  constructResponse(const Formats::RequestMessageConstSharedPtr& dns_request,
-                    uint16_t response_code, bool is_authority);
+  void resolveQuestions(const Formats::Message& dns_request);
+
+  /**
+   * Forwards dns_request if there is a forwarder and it has a single question. The response of
+   * the upstream is counted in query_stats. A query that cannot be forwarded is answered with
+   * SERVFAIL.
+   * @return false if dns_request is not for the forwarder.
+   */
+  bool forward(const Formats::Message& dns_request, DnsQueryStats& query_stats);
+
+  /**
+   * Answers the question at index of the query.
+   * @return true if the question waits for a recursive query, false if it was answered.
+   */
+  bool resolveQuestion(const MultiQuestionQuerySharedPtr& query, uint16_t index);
+
+  void onQuestionAnswered(MultiQuestionQuery& query);
+
+  /**
+   * Waits for the result of a recursive query for the question, which is issued unless an
+   * identical one is pending already.
+   * @param query is the query with several questions that dns_name belongs to, nullptr for
+   * requests with a single question.
+   * @return false if no query could be issued since too many are pending, or if too many requests
+   * wait for the pending one.
+   */
+  bool waitForRecursiveQuery(const std::string& dns_name, uint16_t q_type,
+                             const Formats::Message& dns_request,
+                             const MultiQuestionQuerySharedPtr& query, uint16_t question_index);
+
+  /**
+   * @return false if the pending query has too many waiters already.
+   */
+  bool attachToPendingQuery(const Formats::Message& dns_request,
+                            const MultiQuestionQuerySharedPtr& query, uint16_t question_index,
+                            PendingRecursiveQuery& pending_query);
+
+  // Whether a request with the same client and ID is a retransmit of dns_request
+  static bool mayBeRetransmitted(const Formats::Message& dns_request,
+                                 const MultiQuestionQuerySharedPtr& query);
+
+  // Identifies a request by its client and ID, which its retransmits share
+  static std::string retransmitKey(const Formats::Message& dns_request);
+
+  void onRecursiveQueryComplete(const std::string& key, uint16_t q_type, RecursiveResult&& result);
+
+  void onPendingRecursiveQueryTimeout();
+
+  void notifyWaiters(const std::vector<RecursiveQueryWaiter>& waiters,
+                     const RecursiveResult& result, std::chrono::seconds ttl);
+
+  PendingRecursiveQueryMap& pendingRecursiveQueries(uint16_t q_type);
+
+  void respondWithRecursiveResult(const Formats::Message& dns_request,
+                                  const RecursiveResult& result, std::chrono::seconds ttl);
+
+  /**
+   * Picks the addresses of the hosts of the cluster of a known name that answer question. Only
+   * the addresses of the family of an A or AAAA question are picked. SRV questions are answered
+   * with the addresses of both families, along with the endpoints of their hosts.
+   * @param known_cluster is set when the response holding the addresses can be cached.
+   */
+  uint16_t findKnownName(const Formats::QuestionRecord& question, const DomainNameMatch& match,
+                         PackedAddresses& addresses, PackedEndpoints& endpoints,
+                         KnownCluster& known_cluster);
+
+  /**
+   * Answers an A or AAAA question for the target of an SRV record, whose first label is the
+   * address of a host of the cluster of the rest of the name.
+   * @return false if the name is not the target of a host of a known name.
+   */
+  bool findSrvTarget(const Formats::QuestionRecord& question, PackedAddresses& addresses,
+                     KnownCluster& known_cluster);
+
+  /**
+   * Adds an SRV record for each of the addresses, with the port, weight and priority of its
+   * endpoint, and the address records of their targets to the additional section.
+   */
+  void addSrvAnswers(Formats::ResponseMessageSharedPtr& dns_response, const std::string& name,
+                     const PackedAddresses& addresses, const PackedEndpoints& endpoints,
+                     uint32_t ttl);
+
+  void constructFailedResponseAndInvokeCallback(const Formats::Message& dns_request,
+                                                uint16_t response_code,
+                                                DnsQueryStats& query_stats);
+
+  Formats::ResponseMessageSharedPtr constructResponse(const Formats::Message& dns_request,
+                                                      uint16_t response_code, bool is_authority);
 
   void addAnswersAndInvokeCallback(
-      Formats::ResponseMessageSharedPtr& dns_response, Formats::ResourceRecordSection section,
-      const std::list<Network::Address::InstanceConstSharedPtr>& result_list);
+      const Formats::Message& dns_request, Formats::ResponseMessageSharedPtr& dns_response,
+      uint16_t response_code, Formats::ResourceRecordSection section,
+      const std::list<Network::Address::InstanceConstSharedPtr>& result_list,
+      const KnownCluster& known_cluster, uint32_t ttl, DnsQueryStats& query_stats);
+
+  void addAnswersAndInvokeCallback(const Formats::Message& dns_request,
+                                   Formats::ResponseMessageSharedPtr& dns_response,
+                                   uint16_t response_code, Formats::ResourceRecordSection section,
+                                   const PackedAddresses& addresses,
+                                   const KnownCluster& known_cluster, uint32_t ttl,
+                                   DnsQueryStats& query_stats);
+
+  void addAnswers(Formats::ResponseMessageSharedPtr& dns_response,
+                  Formats::ResourceRecordSection section, const std::string& name,
+                  const std::list<Network::Address::InstanceConstSharedPtr>& result_list,
+                  uint32_t ttl);
+
+  void addAnswers(Formats::ResponseMessageSharedPtr& dns_response,
+                  Formats::ResourceRecordSection section, const std::string& name,
+                  const PackedAddresses& addresses, uint32_t ttl);
+
+  void serializeAndInvokeCallback(const Formats::Message& dns_request,
+                                  Formats::ResponseMessageSharedPtr& dns_response,
+                                  uint16_t response_code, const KnownCluster& known_cluster,
+                                  DnsQueryStats& query_stats);
+
+  /**
+   * Counts the response in query_stats and the response histograms, and sends it.
+   */
+  void sendResponse(const Formats::Message& dns_request, Buffer::Instance& response_buffer,
+                    uint16_t response_code, DnsQueryStats& query_stats);
 
-  void serializeAndInvokeCallback(Formats::ResponseMessageSharedPtr& dns_response);
+  static DnsQueryStats generateQueryStats(Stats::Scope& scope, const std::string& prefix);
+  static Stats::Counter& questionTypeCounter(DnsQueryStats& query_stats, uint16_t q_type);
+  static Stats::Counter& responseCodeCounter(DnsQueryStats& query_stats, uint16_t response_code);
 
   const Config& config_;
-  const Network::DnsResolverSharedPtr external_resolver_;
+  const KnownNamesSharedPtr known_names_;
+  Common::CallbackHandle* known_names_update_handle_;
+  const RecursiveResolverPtr recursive_resolver_;
+  const ForwarderPtr forwarder_;
   Event::Dispatcher& dispatcher_;
-  Upstream::ClusterManager& cluster_manager_;
-  Buffer::OwnedImpl response_buffer_;
+  // Looks up the clusters of known names, and keeps their hosts
+  AnswerCache answer_cache_;
+  RecursiveCache recursive_cache_;
+  // A and AAAA
+  std::array<PendingRecursiveQueryMap, 2> pending_recursive_queries_;
+  PendingRecursiveQueryList pending_recursive_query_list_;
+  Event::TimerPtr pending_recursive_query_timer_;
+  DnsServerStats stats_;
 };
 
 } // namespace Dns
@@ -0,0 +1,366 @@
+#include "src/dns_snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "envoy/common/exception.h"
+
+#include "common/common/assert.h"
+#include "common/common/fmt.h"
+#include "common/network/utility.h"
+
+#include "src/dns_config.h"
+
+#include "absl/strings/match.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+namespace {
+
+// Appends count elements of size bytes at data to file, aligned on alignment
+template <class Section>
+Section appendSection(std::string& file, const void* data, size_t count, size_t size,
+                      size_t alignment) {
+  file.append((alignment - file.size() % alignment) % alignment, '\0');
+  const Section section{file.size(), count};
+  if (count > 0) {
+    file.append(static_cast<const char*>(data), count * size);
+  }
+
+  return section;
+}
+
+} // namespace
+
+constexpr uint32_t DnsSnapshot::Version;
+constexpr char DnsSnapshot::Magic[8];
+
+DnsSnapshot::DnsSnapshot(const void* data, size_t size)
+    : data_(data), size_(size), entries_(0), nodes_(nullptr), node_count_(0), children_(nullptr),
+      child_count_(0), labels_(), ipv4_(nullptr), ipv4_count_(0), ipv6_(nullptr), ipv6_count_(0),
+      cluster_names_() {}
+
+DnsSnapshot::~DnsSnapshot() { munmap(const_cast<void*>(data_), size_); }
+
+std::string
+DnsSnapshot::compile(const envoy::config::filter::listener::udp::DnsSnapshotSource& source) {
+  // The entries are validated against the suffixes as the entries of a config are
+  envoy::config::filter::listener::udp::DnsConfig config;
+  *config.mutable_server_settings()->mutable_known_domainname_suffixes() =
+      source.known_domainname_suffixes();
+  const ConfigImpl config_impl(config);
+  DomainNameTrie known_names = *config_impl.buildKnownNames(
+      DnsEntryMap(source.dns_entries().begin(), source.dns_entries().end()));
+
+  for (const auto& static_record : source.static_records()) {
+    const std::string& name = static_record.first;
+    if (!config_impl.belongsToKnownDomainName(name)) {
+      throw EnvoyException(fmt::format(
+          "Static records of {} do not belong to any known domain name specified", name));
+    }
+
+    if (absl::StrContains(name, DomainNameTrie::WildcardLabel) ||
+        absl::StrContains(name, DomainNameTrie::ClusterLabel)) {
+      throw EnvoyException(fmt::format("Static records of {} cannot be for a pattern", name));
+    }
+
+    std::vector<uint32_t> ipv4;
+    std::vector<absl::uint128> ipv6;
+    for (const auto& address : static_record.second.addresses()) {
+      // Throws an EnvoyException for an address that is not an ip address
+      const Network::Address::InstanceConstSharedPtr ip_address =
+          Network::Utility::parseInternetAddress(address);
+      if (ip_address->ip()->version() == Network::Address::IpVersion::v4) {
+        ipv4.push_back(ip_address->ip()->ipv4()->address());
+      } else {
+        ipv6.push_back(ip_address->ip()->ipv6()->address());
+      }
+    }
+
+    known_names.addRecords(name, std::move(ipv4), std::move(ipv6));
+  }
+
+  return serialize(known_names, source.dns_entries().size());
+}
+
+std::string DnsSnapshot::serialize(const DomainNameTrie& known_names, uint64_t entries) {
+  std::vector<Node> nodes;
+  std::vector<Child> children;
+  std::vector<uint32_t> ipv4;
+  std::vector<absl::uint128> ipv6;
+  nodes.reserve(known_names.nodes_.size());
+
+  // The nodes keep their index in the trie, and their children are laid out back to back
+  for (const auto& trie_node : known_names.nodes_) {
+    Node node{};
+    node.first_child_ = static_cast<uint32_t>(children.size());
+    node.child_count_ = static_cast<uint32_t>(trie_node.children_.size());
+    children.insert(children.end(), trie_node.children_.begin(), trie_node.children_.end());
+
+    node.cluster_index_ = trie_node.cluster_index_;
+    node.wildcard_cluster_index_ = trie_node.wildcard_cluster_index_;
+    node.template_cluster_index_ = trie_node.template_cluster_index_;
+
+    if (trie_node.records_index_ != DomainNameTrie::NoRecords) {
+      const DomainNameTrie::Records& records = known_names.records_[trie_node.records_index_];
+      node.first_ipv4_ = static_cast<uint32_t>(ipv4.size());
+      node.ipv4_count_ = static_cast<uint32_t>(records.ipv4_.size());
+      ipv4.insert(ipv4.end(), records.ipv4_.begin(), records.ipv4_.end());
+      node.first_ipv6_ = static_cast<uint32_t>(ipv6.size());
+      node.ipv6_count_ = static_cast<uint32_t>(records.ipv6_.size());
+      ipv6.insert(ipv6.end(), records.ipv6_.begin(), records.ipv6_.end());
+    }
+
+    node.suffix_ = trie_node.suffix_ ? 1 : 0;
+    nodes.push_back(node);
+  }
+
+  std::vector<StringRef> cluster_names;
+  std::string strings;
+  for (const auto& cluster_name : known_names.cluster_names_) {
+    cluster_names.push_back(
+        {static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(cluster_name.size())});
+    strings.append(cluster_name);
+  }
+
+  Header header{};
+  memcpy(header.magic_, Magic, sizeof(Magic));
+  header.version_ = Version;
+  header.byte_order_ = ByteOrderMark;
+  header.entries_ = entries;
+
+  // The header is written once the offsets of the sections are known
+  std::string file(sizeof(Header), '\0');
+  header.nodes_ = appendSection<Section>(file, nodes.data(), nodes.size(), sizeof(Node),
+                                         SectionAlignment);
+  header.children_ = appendSection<Section>(file, children.data(), children.size(), sizeof(Child),
+                                            SectionAlignment);
+  header.labels_ = appendSection<Section>(file, known_names.labels_.data(),
+                                          known_names.labels_.size(), 1, SectionAlignment);
+  header.cluster_names_ = appendSection<Section>(file, cluster_names.data(), cluster_names.size(),
+                                                 sizeof(StringRef), SectionAlignment);
+  header.strings_ =
+      appendSection<Section>(file, strings.data(), strings.size(), 1, SectionAlignment);
+  header.ipv4_ = appendSection<Section>(file, ipv4.data(), ipv4.size(), sizeof(uint32_t),
+                                        SectionAlignment);
+  header.ipv6_ = appendSection<Section>(file, ipv6.data(), ipv6.size(), sizeof(absl::uint128),
+                                        SectionAlignment);
+  header.size_ = file.size();
+
+  memcpy(&file[0], &header, sizeof(Header));
+  return file;
+}
+
+DnsSnapshotConstSharedPtr DnsSnapshot::load(const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw EnvoyException(
+        fmt::format("Dns snapshot {} cannot be opened: {}", path, strerror(errno)));
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    const int error = errno;
+    close(fd);
+    throw EnvoyException(fmt::format("Dns snapshot {} cannot be read: {}", path, strerror(error)));
+  }
+
+  const size_t size = static_cast<size_t>(file_stat.st_size);
+  if (size < sizeof(Header)) {
+    close(fd);
+    throw EnvoyException(fmt::format("Dns snapshot {} is too short to be a dns snapshot", path));
+  }
+
+  // The mapping keeps the file, even once it is replaced by a newer snapshot
+  void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  const int error = errno;
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw EnvoyException(
+        fmt::format("Dns snapshot {} cannot be mapped: {}", path, strerror(error)));
+  }
+
+  // The mapping is released if the snapshot is rejected
+  std::shared_ptr<DnsSnapshot> snapshot(new DnsSnapshot(data, size));
+  snapshot->index(path);
+  return snapshot;
+}
+
+void DnsSnapshot::index(const std::string& path) {
+  Header header;
+  memcpy(&header, data_, sizeof(Header));
+
+  if (memcmp(header.magic_, Magic, sizeof(Magic)) != 0) {
+    throw EnvoyException(fmt::format("Dns snapshot {} is not a dns snapshot", path));
+  }
+
+  if (header.version_ != Version || header.byte_order_ != ByteOrderMark) {
+    throw EnvoyException(fmt::format(
+        "Dns snapshot {} was not compiled for version {} of the filter on a host of its byte order",
+        path, Version));
+  }
+
+  if (header.size_ != size_) {
+    throw EnvoyException(fmt::format("Dns snapshot {} is {} bytes instead of {}", path, size_,
+                                     header.size_));
+  }
+
+  nodes_ = section<Node>(header.nodes_);
+  node_count_ = header.nodes_.count_;
+  children_ = section<Child>(header.children_);
+  child_count_ = header.children_.count_;
+  const char* labels = section<char>(header.labels_);
+  const StringRef* cluster_names = section<StringRef>(header.cluster_names_);
+  const char* strings = section<char>(header.strings_);
+  ipv4_ = section<uint32_t>(header.ipv4_);
+  ipv4_count_ = header.ipv4_.count_;
+  ipv6_ = section<absl::uint128>(header.ipv6_);
+  ipv6_count_ = header.ipv6_.count_;
+
+  // The root node is the only one a lookup does not reach through a checked index
+  if (nodes_ == nullptr || node_count_ == 0 || children_ == nullptr || labels == nullptr ||
+      cluster_names == nullptr || strings == nullptr || ipv4_ == nullptr || ipv6_ == nullptr) {
+    throw EnvoyException(fmt::format("Dns snapshot {} has a section outside of the file", path));
+  }
+
+  labels_ = absl::string_view(labels, header.labels_.count_);
+
+  cluster_names_.reserve(header.cluster_names_.count_);
+  for (uint64_t i = 0; i < header.cluster_names_.count_; i++) {
+    const StringRef& cluster_name = cluster_names[i];
+    if (static_cast<uint64_t>(cluster_name.offset_) + cluster_name.size_ > header.strings_.count_) {
+      throw EnvoyException(
+          fmt::format("Dns snapshot {} has a cluster name outside of the file", path));
+    }
+
+    cluster_names_.emplace_back(strings + cluster_name.offset_, cluster_name.size_);
+  }
+
+  entries_ = header.entries_;
+}
+
+DomainNameMatch DnsSnapshot::find(absl::string_view name) const {
+  // The same walk as DomainNameTrie::find, over the nodes of the mapping
+  DomainNameMatch match;
+  const std::string* pattern_cluster_name = nullptr;
+  absl::string_view cluster_label;
+
+  name = DomainNameTrie::trimRoot(name);
+
+  const Node* node = &nodes_[0];
+  size_t end = name.size();
+  bool consumed = name.empty();
+
+  while (true) {
+    match.known_suffix_ = match.known_suffix_ || node->suffix_ != 0;
+    if (consumed) {
+      break;
+    }
+
+    const size_t dot = (end == 0) ? absl::string_view::npos : name.rfind('.', end - 1);
+    const size_t begin = (dot == absl::string_view::npos) ? 0 : dot + 1;
+
+    const std::string* wildcard_cluster_name = clusterName(node->wildcard_cluster_index_);
+    if (wildcard_cluster_name != nullptr) {
+      pattern_cluster_name = wildcard_cluster_name;
+      cluster_label = absl::string_view();
+    }
+    const std::string* template_cluster_name = clusterName(node->template_cluster_index_);
+    if (template_cluster_name != nullptr && dot == absl::string_view::npos && end > begin) {
+      pattern_cluster_name = template_cluster_name;
+      cluster_label = name.substr(begin, end - begin);
+    }
+
+    node = findChild(*node, name.substr(begin, end - begin));
+    if (node == nullptr) {
+      break;
+    }
+
+    consumed = (dot == absl::string_view::npos);
+    end = consumed ? 0 : dot;
+  }
+
+  if (node != nullptr) {
+    match.cluster_name_ = clusterName(node->cluster_index_);
+    match.static_records_ = staticRecords(*node);
+  }
+
+  if (match.cluster_name_ == nullptr && pattern_cluster_name != nullptr) {
+    match.cluster_name_ = pattern_cluster_name;
+    match.cluster_label_ = cluster_label;
+  }
+
+  return match;
+}
+
+template <class T> const T* DnsSnapshot::section(const Section& section) const {
+  if (section.offset_ > size_ || section.offset_ % alignof(T) != 0 ||
+      section.count_ > (size_ - section.offset_) / sizeof(T)) {
+    return nullptr;
+  }
+
+  return reinterpret_cast<const T*>(static_cast<const char*>(data_) + section.offset_);
+}
+
+const DnsSnapshot::Node* DnsSnapshot::node(uint32_t index) const {
+  return index < node_count_ ? &nodes_[index] : nullptr;
+}
+
+const DnsSnapshot::Node* DnsSnapshot::findChild(const Node& node, absl::string_view label) const {
+  if (static_cast<uint64_t>(node.first_child_) + node.child_count_ > child_count_) {
+    return nullptr;
+  }
+
+  auto child_label = [this](const Child& child) -> absl::string_view {
+    return child.label_offset_ <= labels_.size()
+               ? labels_.substr(child.label_offset_, child.label_size_)
+               : absl::string_view();
+  };
+
+  const Child* first = children_ + node.first_child_;
+  const Child* last = first + node.child_count_;
+  const Child* child = std::lower_bound(
+      first, last, label, [&child_label](const Child& child, absl::string_view label) -> bool {
+        return DomainNameTrie::compareLabel(child_label(child), label) < 0;
+      });
+  if (child == last || DomainNameTrie::compareLabel(child_label(*child), label) != 0) {
+    return nullptr;
+  }
+
+  return this->node(child->node_);
+}
+
+const std::string* DnsSnapshot::clusterName(uint32_t index) const {
+  return index < cluster_names_.size() ? &cluster_names_[index] : nullptr;
+}
+
+StaticRecords DnsSnapshot::staticRecords(const Node& node) const {
+  StaticRecords records;
+  if (node.ipv4_count_ > 0 && static_cast<uint64_t>(node.first_ipv4_) + node.ipv4_count_ <=
+                                  ipv4_count_) {
+    records.ipv4_ = ipv4_ + node.first_ipv4_;
+    records.ipv4_count_ = node.ipv4_count_;
+  }
+
+  if (node.ipv6_count_ > 0 && static_cast<uint64_t>(node.first_ipv6_) + node.ipv6_count_ <=
+                                  ipv6_count_) {
+    records.ipv6_ = ipv6_ + node.first_ipv6_;
+    records.ipv6_count_ = node.ipv6_count_;
+  }
+
+  return records;
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
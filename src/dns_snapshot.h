@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "src/dns.pb.h"
+#include "src/dns_name_trie.h"
+
+#include "absl/numeric/int128.h"
+#include "absl/strings/string_view.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+class DnsSnapshot;
+typedef std::shared_ptr<const DnsSnapshot> DnsSnapshotConstSharedPtr;
+
+/**
+ * The known domain names, dns entries and static records of a DnsSnapshotSource, compiled into a
+ * file that is mapped read-only and queried in place.
+ *
+ * The file holds the nodes of a DomainNameTrie in arrays that refer to each other by index, and
+ * to the file by offsets from its start, so it can be mapped at any address. Loading a snapshot
+ * only checks its header and copies its cluster names, whatever the number of names it holds.
+ * The pages of the file are read on demand and shared by every process that maps it.
+ *
+ * Lookups check every index and offset they follow against the bounds of the file, so a corrupt
+ * snapshot can give wrong answers but never reads outside of the mapping.
+ */
+class DnsSnapshot : public DomainNameMatcher {
+public:
+  // Snapshots of another version are rejected, they are compiled again from their source
+  static constexpr uint32_t Version = 1;
+
+  ~DnsSnapshot();
+
+  /**
+   * Compiles source into the bytes of a snapshot file. Throws an EnvoyException if an entry or a
+   * static record does not belong to any known domain name, or an address is not an ip address.
+   */
+  static std::string
+  compile(const envoy::config::filter::listener::udp::DnsSnapshotSource& source);
+
+  /**
+   * Maps the snapshot at path. Throws an EnvoyException if the file cannot be mapped or is not a
+   * snapshot of this version.
+   */
+  static DnsSnapshotConstSharedPtr load(const std::string& path);
+
+  /**
+   * @return the number of dns entries compiled into the snapshot.
+   */
+  uint64_t entries() const { return entries_; }
+
+  // DomainNameMatcher
+  DomainNameMatch find(absl::string_view name) const override;
+
+private:
+  struct Section {
+    // Offset of the first element from the start of the file
+    uint64_t offset_;
+    uint64_t count_;
+  };
+
+  struct Header {
+    char magic_[8];
+    uint32_t version_;
+    // ByteOrderMark as written on the host that compiled the snapshot
+    uint32_t byte_order_;
+    uint64_t size_;
+    uint64_t entries_;
+    Section nodes_;
+    Section children_;
+    // The lower case labels of all the nodes, back to back
+    Section labels_;
+    Section cluster_names_;
+    // The characters of the cluster names, back to back
+    Section strings_;
+    Section ipv4_;
+    Section ipv6_;
+  };
+
+  struct Node {
+    // The children of the node are child_count_ elements of the children section from
+    // first_child_, sorted on their label
+    uint32_t first_child_;
+    uint32_t child_count_;
+    // Indexes in the cluster names section, or DomainNameTrie::NoCluster
+    uint32_t cluster_index_;
+    uint32_t wildcard_cluster_index_;
+    uint32_t template_cluster_index_;
+    // The static records of the node are elements of the ipv4 and ipv6 sections
+    uint32_t first_ipv4_;
+    uint32_t ipv4_count_;
+    uint32_t first_ipv6_;
+    uint32_t ipv6_count_;
+    uint32_t suffix_;
+  };
+
+  struct StringRef {
+    // Offset of the string in the strings section
+    uint32_t offset_;
+    uint32_t size_;
+  };
+
+  typedef DomainNameTrie::Child Child;
+
+  static constexpr char Magic[8] = {'D', 'N', 'S', 'S', 'N', 'A', 'P', '\0'};
+  static constexpr uint32_t ByteOrderMark = 0x01020304;
+  // Sections start on this boundary, so that their elements are aligned in the mapping
+  static constexpr size_t SectionAlignment = 16;
+
+  static_assert(sizeof(Header) == 144, "The header is part of the file format");
+  static_assert(sizeof(Node) == 40, "Nodes are part of the file format");
+  static_assert(sizeof(Child) == 12, "Children are part of the file format");
+  static_assert(sizeof(absl::uint128) == 16, "Ipv6 addresses are part of the file format");
+
+  // Takes over the mapping of size bytes at data
+  DnsSnapshot(const void* data, size_t size);
+
+  // Checks the header of the mapping of path and points the sections into it. Throws an
+  // EnvoyException if the mapping is not a snapshot of this version.
+  void index(const std::string& path);
+
+  static std::string serialize(const DomainNameTrie& known_names, uint64_t entries);
+
+  template <class T> const T* section(const Section& section) const;
+  const Node* node(uint32_t index) const;
+  const Node* findChild(const Node& node, absl::string_view label) const;
+  const std::string* clusterName(uint32_t index) const;
+  StaticRecords staticRecords(const Node& node) const;
+
+  const void* data_;
+  size_t size_;
+  uint64_t entries_;
+  const Node* nodes_;
+  uint64_t node_count_;
+  const Child* children_;
+  uint64_t child_count_;
+  absl::string_view labels_;
+  const uint32_t* ipv4_;
+  uint64_t ipv4_count_;
+  const absl::uint128* ipv6_;
+  uint64_t ipv6_count_;
+  // Copied out of the mapping, as answers are built from clusters looked up by name
+  std::vector<std::string> cluster_names_;
+};
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
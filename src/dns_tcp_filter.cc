@@ -0,0 +1,175 @@
+#include <arpa/inet.h>
+
+#include "src/dns_tcp_filter.h"
+#include "src/dns_codec_impl.h"
+
+#include "envoy/event/dispatcher.h"
+
+#include "common/common/assert.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+// Begin DnsTcpServer
+DnsTcpServer::DnsTcpServer(std::shared_ptr<const Config> config,
+                           const DnsServerFactory& server_factory, Stats::Scope& scope)
+    : config_(std::move(config)), dns_server_(),
+      decoder_(std::make_unique<DecoderImpl>(Formats::Transport::Tcp)), connections_(),
+      decode_stats_(generateDecodeStats(scope)) {
+  dns_server_ = server_factory(
+      *config_, [this](const Formats::Message& dns_request, Buffer::Instance& serialized_response) {
+        this->onResolveComplete(dns_request, serialized_response);
+      });
+}
+
+bool DnsTcpServer::resolve(DnsTcpFilter& filter, Buffer::Instance& query) {
+  const Formats::DecodeStatus status = decoder_->decode(query, filter.remoteAddress());
+  if (status != Formats::DecodeStatus::Ok) {
+    // The framing is intact, so the following queries on the connection are still served
+    ENVOY_LOG(debug, "DnsTcpFilter: dropping a malformed query of {} bytes from {}, status {}",
+              query.length(), filter.remoteAddress()->asString(), static_cast<int>(status));
+    decodeErrorCounter(decode_stats_, status).inc();
+    return false;
+  }
+
+  dns_server_->resolve(decoder_->message());
+  return true;
+}
+
+void DnsTcpServer::addConnection(DnsTcpFilter& filter) {
+  connections_[filter.remoteAddress().get()] = &filter;
+}
+
+void DnsTcpServer::removeConnection(DnsTcpFilter& filter) {
+  auto it = connections_.find(filter.remoteAddress().get());
+  if (it != connections_.end() && it->second == &filter) {
+    connections_.erase(it);
+  }
+}
+
+void DnsTcpServer::onResolveComplete(const Formats::Message& dns_request,
+                                     Buffer::Instance& serialized_response) {
+  auto it = connections_.find(dns_request.from().get());
+  if (it == connections_.end()) {
+    ENVOY_LOG(debug, "DnsTcpFilter: connection from {} closed before the response to {} was ready",
+              dns_request.from()->asString(), dns_request.header().id());
+    return;
+  }
+
+  it->second->sendResponse(serialized_response);
+}
+// End DnsTcpServer
+
+// Begin DnsTcpFilter
+DnsTcpFilter::DnsTcpFilter(DnsTcpServer& server)
+    : server_(server), read_callbacks_(nullptr), request_buffer_(), outstanding_queries_(0),
+      read_disabled_(false) {}
+
+Network::FilterStatus DnsTcpFilter::onNewConnection() { return Network::FilterStatus::Continue; }
+
+void DnsTcpFilter::initializeReadFilterCallbacks(Network::ReadFilterCallbacks& callbacks) {
+  read_callbacks_ = &callbacks;
+  read_callbacks_->connection().addConnectionCallbacks(*this);
+
+  Event::Dispatcher& dispatcher = read_callbacks_->connection().dispatcher();
+  idle_timer_ = dispatcher.createTimer([this]() -> void { onIdleTimeout(); });
+  idle_timer_->enableTimer(server_.config().tcpIdleTimeout());
+  // A timer without delay fires once the events of the current wakeup were handled
+  resume_timer_ = dispatcher.createTimer([this]() -> void { resolveQueries(); });
+
+  server_.addConnection(*this);
+}
+
+Network::FilterStatus DnsTcpFilter::onData(Buffer::Instance& data, bool) {
+  idle_timer_->enableTimer(server_.config().tcpIdleTimeout());
+  request_buffer_.move(data);
+  resolveQueries();
+
+  return Network::FilterStatus::StopIteration;
+}
+
+void DnsTcpFilter::resolveQueries() {
+  // Every complete query in the buffer is resolved, the responses to earlier queries need not be
+  // written before the next one is read
+  const uint32_t max_outstanding_queries = server_.config().maxOutstandingQueriesPerConnection();
+  uint16_t length;
+  while (request_buffer_.length() >= sizeof(length) &&
+         read_callbacks_->connection().state() == Network::Connection::State::Open) {
+    if (outstanding_queries_ >= max_outstanding_queries) {
+      if (!read_disabled_) {
+        ENVOY_LOG(debug, "DnsTcpFilter: {} has {} queries outstanding, not reading from it",
+                  remoteAddress()->asString(), outstanding_queries_);
+        read_callbacks_->connection().readDisable(true);
+        read_disabled_ = true;
+      }
+
+      return;
+    }
+
+    request_buffer_.copyOut(0, sizeof(length), &length);
+    length = ntohs(length);
+
+    if (request_buffer_.length() < sizeof(length) + length) {
+      break;
+    }
+
+    request_buffer_.drain(sizeof(length));
+    Buffer::OwnedImpl query;
+    query.move(request_buffer_, length);
+
+    // Counted before it is resolved, as the response can be sent inline
+    outstanding_queries_++;
+    if (!server_.resolve(*this, query)) {
+      outstanding_queries_--;
+    }
+  }
+
+  if (read_disabled_ && read_callbacks_->connection().state() == Network::Connection::State::Open) {
+    read_callbacks_->connection().readDisable(false);
+    read_disabled_ = false;
+  }
+}
+
+void DnsTcpFilter::onEvent(Network::ConnectionEvent event) {
+  if (event == Network::ConnectionEvent::RemoteClose ||
+      event == Network::ConnectionEvent::LocalClose) {
+    idle_timer_->disableTimer();
+    resume_timer_->disableTimer();
+    server_.removeConnection(*this);
+  }
+}
+
+void DnsTcpFilter::onIdleTimeout() {
+  ENVOY_LOG(debug, "DnsTcpFilter: closing idle connection from {}", remoteAddress()->asString());
+  read_callbacks_->connection().close(Network::ConnectionCloseType::NoFlush);
+}
+
+const Network::Address::InstanceConstSharedPtr& DnsTcpFilter::remoteAddress() const {
+  return read_callbacks_->connection().remoteAddress();
+}
+
+void DnsTcpFilter::sendResponse(Buffer::Instance& serialized_response) {
+  ASSERT(serialized_response.length() <= Formats::MaxTcpMessageSize);
+
+  const uint16_t length = htons(static_cast<uint16_t>(serialized_response.length()));
+  Buffer::OwnedImpl response;
+  response.add(&length, sizeof(length));
+  response.move(serialized_response);
+
+  read_callbacks_->connection().write(response, false);
+  idle_timer_->enableTimer(server_.config().tcpIdleTimeout());
+
+  ASSERT(outstanding_queries_ > 0);
+  outstanding_queries_--;
+  if (read_disabled_) {
+    resume_timer_->enableTimer(std::chrono::milliseconds(0));
+  }
+}
+// End DnsTcpFilter
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
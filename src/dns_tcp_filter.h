@@ -0,0 +1,128 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+#include "envoy/event/timer.h"
+#include "envoy/network/connection.h"
+#include "envoy/network/filter.h"
+#include "envoy/thread_local/thread_local.h"
+
+#include "common/buffer/buffer_impl.h"
+#include "common/common/logger.h"
+
+#include "src/dns_codec.h"
+#include "src/dns_config.h"
+#include "src/dns_decode_stats.h"
+#include "src/dns_server.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+class DnsTcpFilter;
+
+/**
+ * Per worker DNS server shared by the TCP connections of a listener. Every query is decoded with
+ * the remote address of its connection, which routes the response back to that connection once
+ * it is resolved.
+ */
+class DnsTcpServer : public ThreadLocal::ThreadLocalObject, Logger::Loggable<Logger::Id::filter> {
+public:
+  typedef std::function<std::unique_ptr<DnsServer>(const Config& config,
+                                                   const DnsServer::ResolveCallback& callback)>
+      DnsServerFactory;
+
+  /**
+   * @param scope is where the queries that cannot be decoded are counted, along with those received
+   * over UDP.
+   */
+  DnsTcpServer(std::shared_ptr<const Config> config, const DnsServerFactory& server_factory,
+               Stats::Scope& scope);
+
+  /**
+   * Decodes and resolves one query received on the connection of filter. A query that cannot be
+   * decoded is counted and dropped.
+   * @return false if the query was dropped, so no response is sent for it.
+   */
+  bool resolve(DnsTcpFilter& filter, Buffer::Instance& query);
+
+  const Config& config() const { return *config_; }
+
+  void addConnection(DnsTcpFilter& filter);
+  void removeConnection(DnsTcpFilter& filter);
+
+private:
+  void onResolveComplete(const Formats::Message& dns_request,
+                         Buffer::Instance& serialized_response);
+
+  // Referenced by dns_server_
+  std::shared_ptr<const Config> config_;
+  std::unique_ptr<DnsServer> dns_server_;
+  DecoderPtr decoder_;
+  // The open connections, keyed on their remote address. A pending query holds the address,
+  // so it cannot be reused by another connection before the query is answered.
+  std::unordered_map<const Network::Address::Instance*, DnsTcpFilter*> connections_;
+  DnsDecodeStats decode_stats_;
+};
+
+/**
+ * Serves DNS over TCP, RFC 7766. Queries are framed by a 2 byte length and may be pipelined. The
+ * responses are written as soon as they are resolved, which is not necessarily in query order.
+ *
+ * A connection stops being read from while max_outstanding_queries_per_connection of its queries
+ * wait for their response, and the queries it already received are only resolved once one of
+ * them is answered. A connection that neither received nor was sent anything for tcp_idle_timeout
+ * is closed.
+ */
+class DnsTcpFilter : public Network::ReadFilter,
+                     public Network::ConnectionCallbacks,
+                     Logger::Loggable<Logger::Id::filter> {
+public:
+  DnsTcpFilter(DnsTcpServer& server);
+
+  // Network::ReadFilter
+  Network::FilterStatus onData(Buffer::Instance& data, bool end_stream) override;
+  Network::FilterStatus onNewConnection() override;
+  void initializeReadFilterCallbacks(Network::ReadFilterCallbacks& callbacks) override;
+
+  // Network::ConnectionCallbacks
+  void onEvent(Network::ConnectionEvent event) override;
+  void onAboveWriteBufferHighWatermark() override {}
+  void onBelowWriteBufferLowWatermark() override {}
+
+  const Network::Address::InstanceConstSharedPtr& remoteAddress() const;
+
+  /**
+   * Writes the response prefixed with its length.
+   */
+  void sendResponse(Buffer::Instance& serialized_response);
+
+private:
+  /**
+   * Resolves the complete queries in request_buffer_, until the connection has
+   * max_outstanding_queries_per_connection of them outstanding.
+   */
+  void resolveQueries();
+
+  void onIdleTimeout();
+
+  DnsTcpServer& server_;
+  Network::ReadFilterCallbacks* read_callbacks_;
+  // Holds the part of a query that has not been received completely, and the queries that wait
+  // for an outstanding one to be answered
+  Buffer::OwnedImpl request_buffer_;
+  // The queries that were resolved and not answered yet
+  uint32_t outstanding_queries_;
+  bool read_disabled_;
+  Event::TimerPtr idle_timer_;
+  // Resolves the queries held back by the limit once the event that answered one was handled
+  Event::TimerPtr resume_timer_;
+};
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,432 @@
+// Measures the cost of the paths taken by every query: decoding it, matching its name against the
+// known domain names, resolving it from the hosts of a cluster and encoding the response.
+//
+// bazel run -c opt //test:dns_benchmark
+//
+// Besides the time per iteration, every benchmark reports allocs_per_op, the number of heap
+// allocations made per iteration.
+
+#include <arpa/nameser.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "src/dns_codec_impl.h"
+#include "src/dns_config.h"
+#include "src/dns_entries_provider.h"
+#include "src/dns_server_impl.h"
+#include "src/dns_snapshot.h"
+
+#include "common/buffer/buffer_impl.h"
+#include "common/network/address_impl.h"
+#include "common/stats/isolated_store_impl.h"
+
+#include "test/common/upstream/utility.h"
+#include "test/mocks/event/mocks.h"
+#include "test/mocks/upstream/mocks.h"
+#include "test/test_common/environment.h"
+
+#include "test/mocks.h"
+
+#include "benchmark/benchmark.h"
+
+// Counts the allocations of the whole binary. Only the allocations between two reads of the count
+// are attributed to a benchmark.
+static std::atomic<uint64_t> Allocations{0};
+
+void* operator new(size_t size) {
+  Allocations.fetch_add(1, std::memory_order_relaxed);
+  void* memory = std::malloc(size);
+  if (memory == nullptr) {
+    throw std::bad_alloc();
+  }
+
+  return memory;
+}
+
+void operator delete(void* memory) noexcept { std::free(memory); }
+
+void operator delete(void* memory, size_t) noexcept { std::free(memory); }
+
+using testing::_;
+using testing::NiceMock;
+using testing::ReturnNew;
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+// A query for A www.example.com
+static const std::string Query("\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00"
+                               "\x03www\x07\x65xample\x03\x63om\x00\x00\x01\x00\x01",
+                               33);
+
+static uint64_t allocationCount() { return Allocations.load(std::memory_order_relaxed); }
+
+static void reportAllocations(benchmark::State& state, uint64_t start) {
+  state.counters["allocs_per_op"] = benchmark::Counter(
+      static_cast<double>(allocationCount() - start), benchmark::Counter::kAvgIterations);
+}
+
+// The query a stub resolver sends: one question, and an OPT record offering 1232 bytes
+static std::string realisticQuery() {
+  std::string query(Query);
+  query[11] = 1;
+  query.append("\x00\x00\x29\x04\xd0\x00\x00\x00\x00\x00\x00", 11);
+  return query;
+}
+
+// The query of at most 512 bytes that is the most expensive to decode. The first question has a
+// name of the maximum length, made of single character labels. Every other question has a name
+// that is a compression pointer to it, which expands to the full name again.
+static std::string worstCaseQuery() {
+  std::string query("\x12\x34\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00", HFIXEDSZ);
+  for (int i = 0; i < (MAXCDNAME - 1) / 2; i++) {
+    query.append("\x01\x61", 2);
+  }
+  query.append("\x00\x00\x01\x00\x01", 5);
+
+  uint16_t questions = 1;
+  while (query.size() + 2 + QFIXEDSZ <= Formats::MaxUdpPayloadSizeWithoutEdns) {
+    query.append("\xc0\x0c\x00\x01\x00\x01", 2 + QFIXEDSZ);
+    questions++;
+  }
+
+  query[4] = static_cast<char>(questions >> 8);
+  query[5] = static_cast<char>(questions & 0xFF);
+  return query;
+}
+
+// Decodes the realistic query for state.range(0) 0, and the worst case query for 1
+static void BM_DecodeQuery(benchmark::State& state) {
+  const bool worst_case = state.range(0) != 0;
+  state.SetLabel(worst_case ? "worst_case" : "realistic");
+
+  DecoderImpl decoder;
+  Buffer::OwnedImpl query(worst_case ? worstCaseQuery() : realisticQuery());
+
+  // The first decode sets aside the storage for the questions, which is reused from then on
+  decoder.decode(query, nullptr);
+
+  const uint64_t allocations = allocationCount();
+  for (auto _ : state) {
+    Formats::DecodeStatus status = decoder.decode(query, nullptr);
+    benchmark::DoNotOptimize(status);
+  }
+
+  reportAllocations(state, allocations);
+  state.SetBytesProcessed(state.iterations() * query.length());
+}
+BENCHMARK(BM_DecodeQuery)->Arg(0)->Arg(1);
+
+// A query for a name of 127 single character labels, which is cut short by the given bytes
+static std::string longNameQuery(const std::string& name_end) {
+  std::string query(Query.substr(0, HFIXEDSZ));
+  for (int i = 0; i < (MAXCDNAME - 1) / 2; i++) {
+    query.append("\x01\x61", 2);
+  }
+
+  return query + name_end + std::string("\x00\x01\x00\x01", QFIXEDSZ);
+}
+
+// Rejects a malformed query, for state.range(0):
+// 0 - a response, which is turned away by the header checks
+// 1 - a name of 254 bytes that ends in a compression pointer to itself
+// 2 - a name that exceeds 255 bytes with its last label
+static void BM_RejectMalformedQuery(benchmark::State& state) {
+  std::string packet;
+  switch (state.range(0)) {
+  case 0:
+    state.SetLabel("not_query");
+    packet = Query;
+    packet[2] |= 0x80;
+    break;
+  case 1:
+    state.SetLabel("pointer_loop");
+    // The pointer follows the 254 bytes of labels at offset 266
+    packet = longNameQuery(std::string("\xc1\x0a", 2));
+    break;
+  default:
+    state.SetLabel("name_too_long");
+    packet = longNameQuery(std::string("\x01\x61\x00", 3));
+    break;
+  }
+
+  DecoderImpl decoder;
+  Buffer::OwnedImpl query(packet);
+  if (decoder.decode(query, nullptr) == Formats::DecodeStatus::Ok) {
+    state.SkipWithError("The query was decoded");
+    return;
+  }
+
+  const uint64_t allocations = allocationCount();
+  for (auto _ : state) {
+    Formats::DecodeStatus status = decoder.decode(query, nullptr);
+    benchmark::DoNotOptimize(status);
+  }
+
+  reportAllocations(state, allocations);
+}
+BENCHMARK(BM_RejectMalformedQuery)->Arg(0)->Arg(1)->Arg(2);
+
+// Encodes a response with state.range(0) A or AAAA records for the same name. Each compressed
+// answer takes 16 or 28 bytes, where an uncompressed one would repeat the 17 byte name. The query
+// is decoded as received over TCP, so that none of the responses is truncated.
+static void encodeAddressResponse(benchmark::State& state, Network::Address::IpVersion version) {
+  const size_t answers = state.range(0);
+
+  DecoderImpl decoder(Formats::Transport::Tcp);
+  Buffer::OwnedImpl query(Query);
+  decoder.decode(query, nullptr);
+  Formats::ResponseMessageSharedPtr response =
+      decoder.message().createResponseMessage({NOERROR, true});
+
+  std::vector<Network::Address::InstanceConstSharedPtr> addresses;
+  for (size_t i = 0; i < answers; i++) {
+    if (version == Network::Address::IpVersion::v4) {
+      addresses.emplace_back(std::make_shared<Network::Address::Ipv4Instance>(
+          fmt::format("10.0.{}.{}", i / 256, i % 256), 0));
+      response->addARecord(Formats::ResourceRecordSection::Answer, "www.example.com", 30,
+                           addresses.back()->ip()->ipv4()->address());
+    } else {
+      addresses.emplace_back(std::make_shared<Network::Address::Ipv6Instance>(
+          fmt::format("fd00::{:x}", i + 1), 0));
+      response->addAAAARecord(Formats::ResourceRecordSection::Answer, "www.example.com", 30,
+                              addresses.back()->ip()->ipv6()->address());
+    }
+  }
+
+  size_t bytes = 0;
+  const uint64_t allocations = allocationCount();
+  for (auto _ : state) {
+    Buffer::OwnedImpl buffer;
+    response->encode(buffer);
+    bytes = buffer.length();
+    benchmark::DoNotOptimize(bytes);
+  }
+
+  reportAllocations(state, allocations);
+  state.counters["bytes_per_response"] = bytes;
+  state.counters["ns_per_record"] = benchmark::Counter(
+      static_cast<double>(state.iterations() * answers),
+      benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+
+static void BM_EncodeAResponse(benchmark::State& state) {
+  encodeAddressResponse(state, Network::Address::IpVersion::v4);
+}
+BENCHMARK(BM_EncodeAResponse)->Arg(1)->Arg(8)->Arg(30)->Arg(100)->Arg(500);
+
+static void BM_EncodeAAAAResponse(benchmark::State& state) {
+  encodeAddressResponse(state, Network::Address::IpVersion::v6);
+}
+BENCHMARK(BM_EncodeAAAAResponse)->Arg(1)->Arg(8)->Arg(30)->Arg(100)->Arg(500);
+
+// Encodes a response with state.range(0) SRV records, whose targets are never compressed.
+static void BM_EncodeSrvResponse(benchmark::State& state) {
+  const size_t answers = state.range(0);
+
+  DecoderImpl decoder(Formats::Transport::Tcp);
+  Buffer::OwnedImpl query(Query);
+  decoder.decode(query, nullptr);
+  Formats::ResponseMessageSharedPtr response =
+      decoder.message().createResponseMessage({NOERROR, true});
+
+  for (size_t i = 0; i < answers; i++) {
+    response->addSRVRecord("www.example.com", 30, 0, 1, static_cast<uint16_t>(8000 + i),
+                           "www.example.com");
+  }
+
+  size_t bytes = 0;
+  const uint64_t allocations = allocationCount();
+  for (auto _ : state) {
+    Buffer::OwnedImpl buffer;
+    response->encode(buffer);
+    bytes = buffer.length();
+    benchmark::DoNotOptimize(bytes);
+  }
+
+  reportAllocations(state, allocations);
+  state.counters["bytes_per_response"] = bytes;
+  state.counters["ns_per_record"] = benchmark::Counter(
+      static_cast<double>(state.iterations() * answers),
+      benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+BENCHMARK(BM_EncodeSrvResponse)->Arg(1)->Arg(8)->Arg(30);
+
+// Matches names against state.range(0) known domain name suffixes. Half of the names are below one
+// of the suffixes, the other half differ from a suffix in its last label.
+static void BM_BelongsToKnownDomainName(benchmark::State& state) {
+  const size_t suffixes = state.range(0);
+
+  envoy::config::filter::listener::udp::DnsConfig proto_config;
+  for (size_t i = 0; i < suffixes; i++) {
+    proto_config.mutable_server_settings()->add_known_domainname_suffixes(
+        fmt::format("service{}.namespace{}.svc.cluster.local", i, i % 16));
+  }
+  const ConfigImpl config(proto_config);
+
+  std::vector<std::string> names;
+  for (size_t i = 0; i < 64; i++) {
+    const size_t suffix = (i * 7919) % suffixes;
+    const std::string name =
+        fmt::format("www.service{}.namespace{}.svc.cluster", suffix, suffix % 16);
+    names.push_back(name + ".local");
+    names.push_back(name + ".remote");
+  }
+
+  size_t index = 0;
+  size_t known = 0;
+  const uint64_t allocations = allocationCount();
+  for (auto _ : state) {
+    known += config.belongsToKnownDomainName(names[index]);
+    index = (index + 1) % names.size();
+  }
+
+  reportAllocations(state, allocations);
+  benchmark::DoNotOptimize(known);
+}
+BENCHMARK(BM_BelongsToKnownDomainName)->RangeMultiplier(10)->Range(10, 10000);
+
+// A snapshot source of entries dns entries, spread over 1000 clusters
+static envoy::config::filter::listener::udp::DnsSnapshotSource snapshotSource(size_t entries) {
+  envoy::config::filter::listener::udp::DnsSnapshotSource source;
+  source.add_known_domainname_suffixes("svc.cluster.local");
+  for (size_t i = 0; i < entries; i++) {
+    (*source.mutable_dns_entries())[fmt::format("service{}.namespace{}.svc.cluster.local", i,
+                                                i % 16)] = fmt::format("cluster{}", i % 1000);
+  }
+
+  return source;
+}
+
+static std::string writeSnapshot(size_t entries) {
+  return TestEnvironment::writeStringToFileForTest(
+      "dns_benchmark.snapshot", DnsSnapshot::compile(snapshotSource(entries)));
+}
+
+// Maps a snapshot of state.range(0) dns entries, as when the filter starts or a new snapshot is
+// moved in place. The pages of the snapshot are only read by lookups.
+static void BM_LoadDnsSnapshot(benchmark::State& state) {
+  const std::string path = writeSnapshot(state.range(0));
+
+  const uint64_t allocations = allocationCount();
+  for (auto _ : state) {
+    DnsSnapshotConstSharedPtr snapshot = DnsSnapshot::load(path);
+    benchmark::DoNotOptimize(snapshot);
+  }
+
+  reportAllocations(state, allocations);
+}
+BENCHMARK(BM_LoadDnsSnapshot)->Arg(1000)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMicrosecond);
+
+// Matches names against 100000 dns entries, built into a trie (0) or mapped from a snapshot (1).
+// Half of the names have an entry.
+static void BM_FindDnsEntry(benchmark::State& state) {
+  const size_t entries = 100000;
+  DomainNameMatcherConstSharedPtr known_names;
+  if (state.range(0) == 0) {
+    envoy::config::filter::listener::udp::DnsConfig proto_config;
+    proto_config.mutable_server_settings()->add_known_domainname_suffixes("svc.cluster.local");
+    const ConfigImpl config(proto_config);
+    const auto source = snapshotSource(entries);
+    known_names = config.buildKnownNames(
+        DnsEntryMap(source.dns_entries().begin(), source.dns_entries().end()));
+  } else {
+    known_names = DnsSnapshot::load(writeSnapshot(entries));
+  }
+
+  std::vector<std::string> names;
+  for (size_t i = 0; i < 64; i++) {
+    const size_t entry = (i * 7919) % entries;
+    names.push_back(fmt::format("service{}.namespace{}.svc.cluster.local", entry, entry % 16));
+    names.push_back(fmt::format("service{}.namespace{}.svc.cluster.local", entry, 16));
+  }
+
+  size_t index = 0;
+  size_t found = 0;
+  const uint64_t allocations = allocationCount();
+  for (auto _ : state) {
+    found += known_names->find(names[index]).cluster_name_ != nullptr;
+    index = (index + 1) % names.size();
+  }
+
+  reportAllocations(state, allocations);
+  benchmark::DoNotOptimize(found);
+}
+BENCHMARK(BM_FindDnsEntry)->Arg(0)->Arg(1);
+
+// Resolves A www.example.com, which is backed by a cluster of state.range(0) hosts. Responses
+// that fit into the 512 bytes of a query without EDNS(0) are answered from the answer cache after
+// the first iteration, larger ones are truncated and built from the hosts every time.
+static void resolveKnownName(benchmark::State& state, bool invalidate_answer_cache) {
+  const size_t hosts = state.range(0);
+
+  envoy::config::filter::listener::udp::DnsConfig proto_config;
+  proto_config.mutable_server_settings()->add_known_domainname_suffixes("example.com");
+  (*proto_config.mutable_server_settings()->mutable_dns_entries())["www.example.com"] =
+      "cluster0";
+  const ConfigImpl config(proto_config);
+
+  NiceMock<Upstream::MockClusterManager> cluster_manager;
+  Upstream::MockCluster& cluster = cluster_manager.thread_local_cluster_.cluster_;
+  auto host_set = std::make_unique<NiceMock<Upstream::MockHostSet>>();
+  for (size_t i = 0; i < hosts; i++) {
+    host_set->hosts_.push_back(Upstream::makeTestHost(
+        cluster.info_, fmt::format("tcp://10.{}.{}.{}:80", i / 65536, i / 256 % 256, i % 256)));
+  }
+  host_set->healthy_hosts_ = host_set->hosts_;
+  cluster.priority_set_.host_sets_.push_back(std::move(host_set));
+
+  NiceMock<Event::MockDispatcher> dispatcher;
+  ON_CALL(dispatcher, createTimer_(_)).WillByDefault(ReturnNew<NiceMock<Event::MockTimer>>());
+  Stats::IsolatedStoreImpl store;
+
+  size_t bytes = 0;
+  DnsServerImpl server(
+      [&bytes](const Formats::Message&, Buffer::Instance& response) -> void {
+        bytes = response.length();
+      },
+      config, std::make_shared<ThreadLocalKnownNames>(config.knownNames()),
+      std::make_unique<NiceMock<MockRecursiveResolver>>(), nullptr, dispatcher, cluster_manager,
+      store);
+
+  DecoderImpl decoder;
+  Buffer::OwnedImpl query(Query);
+  decoder.decode(query, nullptr);
+  const Formats::Message& dns_request = decoder.message();
+
+  const uint64_t allocations = allocationCount();
+  for (auto _ : state) {
+    if (invalidate_answer_cache) {
+      cluster.priority_set_.runUpdateCallbacks(0, {}, {});
+    }
+
+    server.resolve(dns_request);
+  }
+
+  reportAllocations(state, allocations);
+  state.counters["bytes_per_response"] = bytes;
+  state.counters["answer_cache_hits_per_op"] =
+      benchmark::Counter(static_cast<double>(store.counter("answer_cache_hit").value()),
+                         benchmark::Counter::kAvgIterations);
+}
+
+static void BM_ResolveKnownName(benchmark::State& state) { resolveKnownName(state, false); }
+BENCHMARK(BM_ResolveKnownName)->RangeMultiplier(10)->Range(1, 10000);
+
+// Same as BM_ResolveKnownName, with a membership update of the cluster before every query, so
+// that all the responses are built from the hosts.
+static void BM_ResolveKnownNameAfterUpdate(benchmark::State& state) {
+  resolveKnownName(state, true);
+}
+BENCHMARK(BM_ResolveKnownNameAfterUpdate)->RangeMultiplier(10)->Range(1, 10000);
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
+
+BENCHMARK_MAIN();
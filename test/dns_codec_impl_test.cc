@@ -0,0 +1,401 @@
+#include <arpa/nameser.h>
+#include <arpa/nameser_compat.h>
+
+#include "src/dns_codec_impl.h"
+
+#include "common/buffer/buffer_impl.h"
+#include "common/network/address_impl.h"
+
+#include "ares_dns.h"
+#include "gtest/gtest.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+class DecoderImplTest : public ::testing::Test {
+public:
+  // A standard query for A www.example.com with the RD bit set
+  static std::string header(uint16_t qd_count = 1) {
+    return std::string("\x12\x34\x01\x00", 4) + std::string(1, '\0') +
+           std::string(1, static_cast<char>(qd_count)) + std::string(6, '\0');
+  }
+
+  static std::string question(const std::string& name) {
+    return name + std::string("\x00\x01\x00\x01", 4);
+  }
+
+  // An OPT record without options. The header arCount has to account for it.
+  static std::string optRecord(uint16_t udp_payload_size, uint8_t version = 0) {
+    return std::string("\x00\x00\x29", 3) + static_cast<char>(udp_payload_size >> 8) +
+           static_cast<char>(udp_payload_size & 0xFF) + std::string(1, '\0') +
+           static_cast<char>(version) + std::string(4, '\0');
+  }
+
+  static std::string headerWithOpt() {
+    std::string packet = header();
+    packet[11] = 1;
+    return packet;
+  }
+
+  // Encodes a response to query with count A answers for a.com
+  static std::string encodeAnswers(const Formats::Message& query, int count) {
+    Formats::ResponseMessageSharedPtr response = query.createResponseMessage({NOERROR, true});
+    for (int i = 0; i < count; i++) {
+      Network::Address::Ipv4Instance address(fmt::format("10.0.{}.{}", i / 256, i % 256), 0);
+      response->addARecord(Formats::ResourceRecordSection::Answer, "a.com", 30,
+                           address.ip()->ipv4()->address());
+    }
+
+    Buffer::OwnedImpl buffer;
+    response->encode(buffer);
+    return buffer.toString();
+  }
+
+  static uint16_t answerCount(const std::string& encoded) {
+    return DNS_HEADER_ANCOUNT(reinterpret_cast<const unsigned char*>(encoded.data()));
+  }
+
+  static bool truncated(const std::string& encoded) {
+    return DNS_HEADER_TC(reinterpret_cast<const unsigned char*>(encoded.data()));
+  }
+
+  const Formats::Message& decode(const std::string& packet) {
+    EXPECT_EQ(Formats::DecodeStatus::Ok, decodeStatus(packet));
+    return decoder_.message();
+  }
+
+  Formats::DecodeStatus decodeStatus(const std::string& packet) {
+    Buffer::OwnedImpl buffer(packet);
+    return decoder_.decode(buffer, from_);
+  }
+
+  DecoderImpl decoder_;
+  Network::Address::InstanceConstSharedPtr from_;
+};
+
+TEST_F(DecoderImplTest, decodeQuery) {
+  const Formats::Message& message =
+      decode(header() + question(std::string("\x03www\x07\x65xample\x03\x63om\x00", 17)));
+
+  EXPECT_EQ(0x1234, message.header().id());
+  EXPECT_TRUE(message.header().rd());
+  EXPECT_EQ(1, message.header().qdCount());
+  EXPECT_EQ("www.example.com", message.questionRecord().qName());
+  EXPECT_EQ(T_A, message.questionRecord().qType());
+  EXPECT_EQ(C_IN, message.questionRecord().qClass());
+}
+
+TEST_F(DecoderImplTest, decodeReusesMessageAndCloneOwnsContents) {
+  Formats::RequestMessageConstSharedPtr first =
+      decode(header() + question(std::string("\x01\x61\x03\x63om\x00", 7))).clone();
+  const Formats::Message& second = decode(header() + question(std::string("\x01\x62\x00", 3)));
+
+  EXPECT_EQ("b", second.questionRecord().qName());
+  EXPECT_EQ("a.com", first->questionRecord().qName());
+}
+
+TEST_F(DecoderImplTest, decodeEscapesLabelContents) {
+  const Formats::Message& message =
+      decode(header() + question(std::string("\x03\x61.\x01\x03\x63om\x00", 9)));
+
+  EXPECT_EQ("a\\.\\001.com", message.questionRecord().qName());
+}
+
+TEST_F(DecoderImplTest, decodeCompressedName) {
+  // The question name points back at a name stored in the flags and the high byte of the
+  // question count, which is 0
+  std::string packet = header();
+  packet.replace(2, 3, std::string("\x01\x61\x00", 3));
+
+  const Formats::Message& message = decode(packet + question(std::string("\x01x\xc0\x02", 4)));
+  EXPECT_EQ("x.a", message.questionRecord().qName());
+}
+
+TEST_F(DecoderImplTest, decodeMultipleQuestions) {
+  // The second question name is compressed against the first
+  const Formats::Message& message =
+      decode(header(2) + question(std::string("\x01\x61\x03\x63om\x00", 7)) +
+             std::string("\x01\x62\xc0\x0e\x00\x1c\x00\x01", 8));
+
+  EXPECT_EQ(2, message.header().qdCount());
+  EXPECT_EQ("a.com", message.questionRecord(0).qName());
+  EXPECT_EQ(T_A, message.questionRecord(0).qType());
+  EXPECT_EQ("b.com", message.questionRecord(1).qName());
+  EXPECT_EQ(T_AAAA, message.questionRecord(1).qType());
+
+  // Both questions are copied and encoded into the response, followed by the answers
+  Formats::ResponseMessageSharedPtr response =
+      message.clone()->createResponseMessage({NOERROR, true});
+  Network::Address::Ipv4Instance address("10.0.0.1", 0);
+  response->addARecord(Formats::ResourceRecordSection::Answer, "a.com", 30,
+                       address.ip()->ipv4()->address());
+
+  Buffer::OwnedImpl buffer;
+  response->encode(buffer);
+  const std::string encoded = buffer.toString();
+
+  ASSERT_EQ(HFIXEDSZ + 11 + 8 + 16, encoded.size());
+  EXPECT_EQ(2, DNS_HEADER_QDCOUNT(reinterpret_cast<const unsigned char*>(encoded.data())));
+  EXPECT_EQ(std::string("\x01\x62\xc0\x0e\x00\x1c\x00\x01", 8),
+            encoded.substr(HFIXEDSZ + 11, 8));
+  EXPECT_EQ(std::string("\xc0\x0c", 2), encoded.substr(HFIXEDSZ + 19, 2));
+}
+
+TEST_F(DecoderImplTest, rejectQuestionCount) {
+  const std::string one_question = question(std::string("\x01\x61\x00", 3));
+  EXPECT_EQ(Formats::DecodeStatus::InvalidCounts, decodeStatus(header(0) + one_question));
+
+  // More questions than fit into the message, and a second question that is cut short
+  EXPECT_EQ(Formats::DecodeStatus::InvalidCounts, decodeStatus(header(3) + one_question));
+  EXPECT_EQ(
+      Formats::DecodeStatus::TruncatedRecord,
+      decodeStatus(header(2) + one_question + std::string("\x03\x61\x62\x63\x00", 5)));
+}
+
+TEST_F(DecoderImplTest, decodeEdns) {
+  const std::string name("\x01\x61\x03\x63om\x00", 7);
+
+  const Formats::Message& without_edns = decode(header() + question(name));
+  EXPECT_FALSE(without_edns.edns().has_value());
+  EXPECT_EQ(512, without_edns.maxResponseSize());
+
+  const Formats::Message& message = decode(headerWithOpt() + question(name) + optRecord(1232));
+  ASSERT_TRUE(message.edns().has_value());
+  EXPECT_EQ(1232, message.edns()->udp_payload_size);
+  EXPECT_EQ(0, message.edns()->version);
+  EXPECT_EQ(1232, message.maxResponseSize());
+
+  // Payload sizes are limited to the range of 512 to MaxUdpPayloadSize bytes
+  EXPECT_EQ(512, decode(headerWithOpt() + question(name) + optRecord(100)).maxResponseSize());
+  EXPECT_EQ(Formats::MaxUdpPayloadSize,
+            decode(headerWithOpt() + question(name) + optRecord(65535)).maxResponseSize());
+}
+
+TEST_F(DecoderImplTest, decodeEdnsAfterOtherRecords) {
+  // An authority record and a TSIG like additional record with RDATA precede the OPT record
+  std::string packet = header();
+  packet[9] = 1;
+  packet[11] = 2;
+  const std::string record("\x01\x62\x00\x00\x01\x00\x01\x00\x00\x00\x1e\x00\x04\x0a\x00\x00\x01",
+                           17);
+
+  const Formats::Message& message = decode(packet + question(std::string("\x01\x61\x00", 3)) +
+                                           record + record + optRecord(4096, 1));
+  ASSERT_TRUE(message.edns().has_value());
+  EXPECT_EQ(1, message.edns()->version);
+}
+
+TEST_F(DecoderImplTest, decodeQuestionsBeforeRecords) {
+  const std::string name("\x01\x61\x03\x63om\x00", 7);
+  Buffer::OwnedImpl buffer(headerWithOpt() + question(name) + optRecord(1232));
+
+  // The OPT record is only picked up by decodeRecords
+  ASSERT_EQ(Formats::DecodeStatus::Ok, decoder_.decodeQuestions(buffer, from_));
+  EXPECT_EQ("a.com", decoder_.message().questionRecord().qName());
+  EXPECT_FALSE(decoder_.message().edns().has_value());
+
+  ASSERT_EQ(Formats::DecodeStatus::Ok, decoder_.decodeRecords());
+  ASSERT_TRUE(decoder_.message().edns().has_value());
+  EXPECT_EQ(1232, decoder_.message().edns()->udp_payload_size);
+
+  Buffer::OwnedImpl truncated(headerWithOpt() + question(name) + optRecord(1232).substr(0, 10));
+  ASSERT_EQ(Formats::DecodeStatus::Ok, decoder_.decodeQuestions(truncated, from_));
+  EXPECT_EQ(Formats::DecodeStatus::TruncatedRecord, decoder_.decodeRecords());
+}
+
+TEST_F(DecoderImplTest, rejectInvalidOpt) {
+  const std::string name("\x01\x61\x00", 3);
+  std::string two_records = header();
+  two_records[11] = 2;
+
+  EXPECT_EQ(Formats::DecodeStatus::InvalidOpt,
+            decodeStatus(two_records + question(name) + optRecord(4096) + optRecord(4096)));
+  EXPECT_EQ(Formats::DecodeStatus::InvalidOpt,
+            decodeStatus(headerWithOpt() + question(name) + "\x01\x61" + optRecord(4096)));
+  EXPECT_EQ(Formats::DecodeStatus::TruncatedRecord,
+            decodeStatus(headerWithOpt() + question(name) + optRecord(4096).substr(0, 10)));
+}
+
+TEST_F(DecoderImplTest, encodeTruncatedWithoutEdns) {
+  const std::string query = header() + question(std::string("\x01\x61\x03\x63om\x00", 7));
+
+  // Each answer takes 16 bytes after the 23 bytes of header and question
+  const std::string fits = encodeAnswers(decode(query), (512 - 23) / 16);
+  EXPECT_FALSE(truncated(fits));
+  EXPECT_EQ((512 - 23) / 16, answerCount(fits));
+
+  const std::string encoded = encodeAnswers(decode(query), 100);
+  EXPECT_TRUE(truncated(encoded));
+  EXPECT_EQ((512 - 23) / 16, answerCount(encoded));
+  EXPECT_EQ(23 + answerCount(encoded) * 16, encoded.size());
+}
+
+TEST_F(DecoderImplTest, encodeEchoesOpt) {
+  const std::string query =
+      headerWithOpt() + question(std::string("\x01\x61\x03\x63om\x00", 7)) + optRecord(1232);
+
+  const std::string encoded = encodeAnswers(decode(query), 60);
+  EXPECT_FALSE(truncated(encoded));
+  EXPECT_EQ(60, answerCount(encoded));
+  EXPECT_EQ(1, DNS_HEADER_ARCOUNT(reinterpret_cast<const unsigned char*>(encoded.data())));
+  EXPECT_EQ(std::string("\x00\x00\x29\x10\x00\x00\x00\x00\x00\x00\x00", 11),
+            encoded.substr(encoded.size() - 11));
+
+  // Room is kept for the OPT record when the answers are truncated
+  const std::string truncated_encoded = encodeAnswers(decode(query), 100);
+  EXPECT_TRUE(truncated(truncated_encoded));
+  EXPECT_EQ((1232 - 23 - 11) / 16, answerCount(truncated_encoded));
+  EXPECT_GE(1232, truncated_encoded.size());
+}
+
+TEST_F(DecoderImplTest, encodeNotTruncatedOverTcp) {
+  DecoderImpl tcp_decoder(Formats::Transport::Tcp);
+  Buffer::OwnedImpl buffer(header() + question(std::string("\x01\x61\x03\x63om\x00", 7)));
+  ASSERT_EQ(Formats::DecodeStatus::Ok, tcp_decoder.decode(buffer, from_));
+  const Formats::Message& query = tcp_decoder.message();
+  EXPECT_EQ(Formats::MaxTcpMessageSize, query.maxResponseSize());
+
+  const std::string encoded = encodeAnswers(query, 1000);
+  EXPECT_FALSE(truncated(encoded));
+  EXPECT_EQ(1000, answerCount(encoded));
+}
+
+TEST_F(DecoderImplTest, encodeExtendedResponseCode) {
+  const std::string query =
+      headerWithOpt() + question(std::string("\x01\x61\x00", 3)) + optRecord(1232, 1);
+  Formats::ResponseMessageSharedPtr response =
+      decode(query).createResponseMessage({ns_r_badvers, false});
+
+  Buffer::OwnedImpl buffer;
+  response->encode(buffer);
+  const std::string encoded = buffer.toString();
+
+  EXPECT_EQ(0, DNS_HEADER_RCODE(reinterpret_cast<const unsigned char*>(encoded.data())));
+  EXPECT_EQ(std::string("\x00\x00\x29\x10\x00\x01\x00\x00\x00\x00\x00", 11),
+            encoded.substr(encoded.size() - 11));
+}
+
+TEST_F(DecoderImplTest, encodeAdditionalDroppedWithoutTruncation) {
+  const std::string query = header() + question(std::string("\x01\x61\x03\x63om\x00", 7));
+  Formats::ResponseMessageSharedPtr response =
+      decode(query).createResponseMessage({NOERROR, true});
+
+  response->addSRVRecord("a.com", 30, 0, 0, 443, "a.com");
+  Network::Address::Ipv6Instance address("::1", 0);
+  for (int i = 0; i < 30; i++) {
+    response->addAAAARecord(Formats::ResourceRecordSection::Additional, "a.com", 30,
+                            address.ip()->ipv6()->address());
+  }
+
+  Buffer::OwnedImpl buffer;
+  response->encode(buffer);
+  const std::string encoded = buffer.toString();
+  const unsigned char* encoded_header = reinterpret_cast<const unsigned char*>(encoded.data());
+
+  // The answer fits, only some of the additional records do
+  EXPECT_FALSE(truncated(encoded));
+  EXPECT_EQ(1, answerCount(encoded));
+  EXPECT_EQ((512 - 23 - 25) / 28, DNS_HEADER_ARCOUNT(encoded_header));
+}
+
+TEST_F(DecoderImplTest, rejectShortHeader) {
+  EXPECT_EQ(Formats::DecodeStatus::ShortHeader, decodeStatus(std::string("\x12\x34", 2)));
+}
+
+TEST_F(DecoderImplTest, rejectResponse) {
+  const std::string one_question = question(std::string("\x01\x61\x00", 3));
+
+  std::string response = header();
+  response[2] |= 0x80;
+  EXPECT_EQ(Formats::DecodeStatus::NotQuery, decodeStatus(response + one_question));
+
+  // The server answers the other opcodes with NOTIMP
+  std::string notify = header();
+  notify[2] |= 4 << 3;
+  EXPECT_EQ(Formats::DecodeStatus::Ok, decodeStatus(notify + one_question));
+}
+
+TEST_F(DecoderImplTest, rejectMoreRecordsThanFit) {
+  // Each record takes at least 11 bytes, the message has room for a single one
+  std::string packet = header();
+  packet[7] = 1;
+  packet[9] = 1;
+  EXPECT_EQ(Formats::DecodeStatus::InvalidCounts,
+            decodeStatus(packet + question(std::string("\x01\x61\x00", 3)) + optRecord(4096)));
+}
+
+TEST_F(DecoderImplTest, rejectTruncatedQuestion) {
+  EXPECT_EQ(Formats::DecodeStatus::InvalidCounts,
+            decodeStatus(header() + std::string("\x03www", 4)));
+  EXPECT_EQ(Formats::DecodeStatus::TruncatedRecord,
+            decodeStatus(header() + std::string("\x01\x61\x00\x00\x01", 5)));
+}
+
+TEST_F(DecoderImplTest, rejectCompressionPointerLoop) {
+  // A pointer to itself and a pointer forward past the end of the name
+  EXPECT_EQ(Formats::DecodeStatus::InvalidPointer,
+            decodeStatus(header() + question(std::string("\xc0\x0c", 2))));
+  EXPECT_EQ(Formats::DecodeStatus::InvalidPointer,
+            decodeStatus(header() + question(std::string("\x01\x61\xc0\x20", 4))));
+}
+
+TEST_F(DecoderImplTest, rejectNameLongerThanMaximum) {
+  std::string name;
+  for (int i = 0; i < 5; i++) {
+    name += std::string(1, 63) + std::string(63, 'a');
+  }
+
+  EXPECT_EQ(Formats::DecodeStatus::InvalidName,
+            decodeStatus(header() + question(name + std::string(1, '\0'))));
+}
+
+TEST_F(DecoderImplTest, encodeAnswersWithCompressedNames) {
+  const std::string query =
+      header() + question(std::string("\x03www\x07\x65xample\x03\x63om\x00", 17));
+  Formats::ResponseMessageSharedPtr response =
+      decode(query).createResponseMessage({NOERROR, true});
+
+  Network::Address::Ipv4Instance address_0("10.0.0.1", 0);
+  Network::Address::Ipv4Instance address_1("10.0.0.2", 0);
+  response->addARecord(Formats::ResourceRecordSection::Answer, "www.example.com", 30,
+                       address_0.ip()->ipv4()->address());
+  response->addARecord(Formats::ResourceRecordSection::Answer, "www.example.com", 30,
+                       address_1.ip()->ipv4()->address());
+
+  Buffer::OwnedImpl buffer;
+  response->encode(buffer);
+  const std::string encoded = buffer.toString();
+
+  // Every answer name is a pointer back to the question name at offset 12
+  const std::string answer_prefix("\xc0\x0c\x00\x01\x00\x01\x00\x00\x00\x1e\x00\x04", 12);
+  ASSERT_EQ(query.size() + 2 * 16, encoded.size());
+  EXPECT_EQ(query.substr(HFIXEDSZ), encoded.substr(HFIXEDSZ, query.size() - HFIXEDSZ));
+  EXPECT_EQ(answer_prefix + std::string("\x0a\x00\x00\x01", 4),
+            encoded.substr(query.size(), 16));
+  EXPECT_EQ(answer_prefix + std::string("\x0a\x00\x00\x02", 4),
+            encoded.substr(query.size() + 16, 16));
+}
+
+TEST_F(DecoderImplTest, encodeSrvTargetUncompressed) {
+  const std::string query = header() + question(std::string("\x01\x61\x03\x63om\x00", 7));
+  Formats::ResponseMessageSharedPtr response =
+      decode(query).createResponseMessage({NOERROR, true});
+  response->addSRVRecord("a.com", 30, 1, 10, 443, "a.com");
+
+  Buffer::OwnedImpl buffer;
+  response->encode(buffer);
+  const std::string encoded = buffer.toString();
+
+  // The owner name is compressed, the target is written in full as RFC 2782 requires
+  const std::string rdata =
+      std::string("\x00\x01\x00\x0a\x01\xbb", 6) + std::string("\x01\x61\x03\x63om\x00", 7);
+  EXPECT_EQ(std::string("\xc0\x0c\x00\x21\x00\x01\x00\x00\x00\x1e\x00\x0d", 12) + rdata,
+            encoded.substr(query.size()));
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
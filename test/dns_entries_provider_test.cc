@@ -0,0 +1,347 @@
+#include <cstdio>
+
+#include "src/dns_config.h"
+#include "src/dns_entries_provider.h"
+#include "src/dns_snapshot.h"
+
+#include "common/stats/isolated_store_impl.h"
+
+#include "test/mocks/event/mocks.h"
+#include "test/mocks/filesystem/mocks.h"
+#include "test/mocks/thread_local/mocks.h"
+#include "test/test_common/environment.h"
+#include "test/test_common/utility.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using testing::_;
+using testing::NiceMock;
+using testing::Return;
+using testing::SaveArg;
+using testing::UnorderedElementsAre;
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+class DnsEntriesProviderTest : public ::testing::Test {
+public:
+  DnsEntriesProviderTest() : api_(Api::createApiForTest()) {
+    proto_config_.mutable_server_settings()->add_known_domainname_suffixes("example.com");
+    (*proto_config_.mutable_server_settings()->mutable_dns_entries())["www.example.com"] =
+        "cluster_0";
+  }
+
+  // Loads the dns entries from a file holding json, which is watched for updates
+  void useDnsEntriesFile(const std::string& json) {
+    const std::string path = TestEnvironment::writeStringToFileForTest("dns_entries.json", json);
+    proto_config_.mutable_server_settings()->set_dns_entries_path(path);
+
+    watcher_ = new Filesystem::MockWatcher();
+    EXPECT_CALL(dispatcher_, createFilesystemWatcher_()).WillOnce(Return(watcher_));
+    EXPECT_CALL(*watcher_, addWatch(path, Filesystem::Watcher::Events::MovedTo, _))
+        .WillOnce(SaveArg<2>(&on_dns_entries_changed_));
+  }
+
+  // Moves a file holding json in place of the dns entries file
+  void updateDnsEntriesFile(const std::string& json) {
+    TestEnvironment::writeStringToFileForTest("dns_entries.json", json);
+    on_dns_entries_changed_(Filesystem::Watcher::Events::MovedTo);
+  }
+
+  // Maps a snapshot of the names of source, which is watched for updates
+  void useDnsSnapshot(const envoy::config::filter::listener::udp::DnsSnapshotSource& source) {
+    auto* server_settings = proto_config_.mutable_server_settings();
+    server_settings->clear_known_domainname_suffixes();
+    server_settings->clear_dns_entries();
+    const std::string path = writeDnsSnapshot(DnsSnapshot::compile(source));
+    server_settings->set_dns_snapshot_path(path);
+
+    watcher_ = new Filesystem::MockWatcher();
+    EXPECT_CALL(dispatcher_, createFilesystemWatcher_()).WillOnce(Return(watcher_));
+    EXPECT_CALL(*watcher_, addWatch(path, Filesystem::Watcher::Events::MovedTo, _))
+        .WillOnce(SaveArg<2>(&on_dns_entries_changed_));
+  }
+
+  // Moves a file holding snapshot in place of the dns snapshot
+  std::string writeDnsSnapshot(const std::string& snapshot) {
+    const std::string path = TestEnvironment::temporaryPath("dns.snapshot");
+    const std::string temporary_path =
+        TestEnvironment::writeStringToFileForTest("dns.snapshot.tmp", snapshot);
+    EXPECT_EQ(0, rename(temporary_path.c_str(), path.c_str()));
+    return path;
+  }
+
+  static envoy::config::filter::listener::udp::DnsSnapshotSource
+  snapshotSource(const std::string& cluster_name) {
+    envoy::config::filter::listener::udp::DnsSnapshotSource source;
+    source.add_known_domainname_suffixes("example.com");
+    (*source.mutable_dns_entries())["api.example.com"] = cluster_name;
+    return source;
+  }
+
+  void createProvider() {
+    provider_ = std::make_unique<DnsEntriesProvider>(std::make_shared<ConfigImpl>(proto_config_),
+                                                     tls_, dispatcher_, *api_, store_);
+  }
+
+  const std::string* clusterName(const std::string& name) {
+    return provider_->knownNames()->matchDomainName(name).cluster_name_;
+  }
+
+  uint64_t counter(const std::string& name) {
+    return store_.counter("dns_entries." + name).value();
+  }
+
+  uint64_t entries() {
+    return store_.gauge("dns_entries.entries", Stats::Gauge::ImportMode::NeverImport).value();
+  }
+
+  envoy::config::filter::listener::udp::DnsConfig proto_config_;
+  Api::ApiPtr api_;
+  Stats::IsolatedStoreImpl store_;
+  NiceMock<ThreadLocal::MockInstance> tls_;
+  NiceMock<Event::MockDispatcher> dispatcher_;
+  // Owned by provider_
+  Filesystem::MockWatcher* watcher_{};
+  Filesystem::Watcher::OnChangedCb on_dns_entries_changed_;
+  std::unique_ptr<DnsEntriesProvider> provider_;
+};
+
+TEST_F(DnsEntriesProviderTest, inlineDnsEntries) {
+  EXPECT_CALL(dispatcher_, createFilesystemWatcher_()).Times(0);
+  createProvider();
+
+  ASSERT_NE(clusterName("www.example.com"), nullptr);
+  EXPECT_EQ(*clusterName("www.example.com"), "cluster_0");
+  EXPECT_EQ(1, entries());
+}
+
+TEST_F(DnsEntriesProviderTest, dnsEntriesFileReplacesInlineEntries) {
+  useDnsEntriesFile(R"EOF({"dns_entries": {"api.example.com": "cluster_1"}})EOF");
+  createProvider();
+
+  EXPECT_EQ(clusterName("www.example.com"), nullptr);
+  ASSERT_NE(clusterName("api.example.com"), nullptr);
+  EXPECT_EQ(*clusterName("api.example.com"), "cluster_1");
+  EXPECT_EQ(1, entries());
+}
+
+TEST_F(DnsEntriesProviderTest, invalidDnsEntriesFileRejectsConfig) {
+  proto_config_.mutable_server_settings()->set_dns_entries_path(
+      TestEnvironment::writeStringToFileForTest(
+          "dns_entries.json", R"EOF({"dns_entries": {"api.example.org": "cluster_1"}})EOF"));
+  EXPECT_CALL(dispatcher_, createFilesystemWatcher_()).Times(0);
+
+  EXPECT_THROW_WITH_MESSAGE(
+      createProvider(), EnvoyException,
+      "Dns Entry api.example.org does not belong to any known domain name specified");
+}
+
+TEST_F(DnsEntriesProviderTest, updateSwapsKnownNames) {
+  useDnsEntriesFile(R"EOF({"dns_entries": {"api.example.com": "cluster_1",
+                                           "old.example.com": "cluster_1",
+                                           "same.example.com": "cluster_1"}})EOF");
+  createProvider();
+
+  // The known names of a worker are updated in place, servers keep the same object
+  KnownNamesSharedPtr known_names = provider_->knownNames();
+  std::vector<std::string> changed_names;
+  Common::CallbackHandle* handle = known_names->addUpdateCb(
+      [&changed_names](const std::vector<std::string>& names) -> void { changed_names = names; });
+
+  updateDnsEntriesFile(R"EOF({"dns_entries": {"api.example.com": "cluster_2",
+                                              "New.Example.com.": "cluster_1",
+                                              "same.example.com": "cluster_1"}})EOF");
+
+  EXPECT_THAT(changed_names,
+              UnorderedElementsAre("api.example.com", "new.example.com", "old.example.com"));
+  ASSERT_NE(known_names->matchDomainName("api.example.com").cluster_name_, nullptr);
+  EXPECT_EQ(*known_names->matchDomainName("api.example.com").cluster_name_, "cluster_2");
+  ASSERT_NE(known_names->matchDomainName("new.example.com").cluster_name_, nullptr);
+  EXPECT_EQ(*known_names->matchDomainName("new.example.com").cluster_name_, "cluster_1");
+  EXPECT_EQ(known_names->matchDomainName("old.example.com").cluster_name_, nullptr);
+
+  EXPECT_EQ(1, counter("update_success"));
+  EXPECT_EQ(0, counter("update_rejected"));
+  EXPECT_EQ(3, entries());
+
+  handle->remove();
+}
+
+TEST_F(DnsEntriesProviderTest, rejectedUpdateKeepsDnsEntries) {
+  useDnsEntriesFile(R"EOF({"dns_entries": {"api.example.com": "cluster_1"}})EOF");
+  createProvider();
+
+  bool updated = false;
+  Common::CallbackHandle* handle = provider_->knownNames()->addUpdateCb(
+      [&updated](const std::vector<std::string>&) -> void { updated = true; });
+
+  // An entry outside of the known domain names, and a file that is not a DnsEntries message
+  updateDnsEntriesFile(R"EOF({"dns_entries": {"api.example.org": "cluster_2"}})EOF");
+  updateDnsEntriesFile(R"EOF({"dns_entries": [)EOF");
+
+  EXPECT_FALSE(updated);
+  ASSERT_NE(clusterName("api.example.com"), nullptr);
+  EXPECT_EQ(*clusterName("api.example.com"), "cluster_1");
+
+  EXPECT_EQ(0, counter("update_success"));
+  EXPECT_EQ(2, counter("update_rejected"));
+  EXPECT_EQ(1, entries());
+
+  handle->remove();
+}
+
+TEST_F(DnsEntriesProviderTest, clusterTemplateBuiltOncePerName) {
+  useDnsEntriesFile(R"EOF({"dns_entries": {"{cluster}.svc.example.com": "{cluster}-prod"}})EOF");
+  createProvider();
+
+  auto known_names = std::dynamic_pointer_cast<ThreadLocalKnownNames>(provider_->knownNames());
+  const std::string* cluster_name =
+      known_names->matchDomainName("Payments.svc.example.com").cluster_name_;
+  ASSERT_NE(cluster_name, nullptr);
+  EXPECT_EQ(*cluster_name, "payments-prod");
+  EXPECT_EQ(cluster_name, known_names->matchDomainName("Payments.svc.example.com").cluster_name_);
+  EXPECT_EQ(1, known_names->templateClusterCount());
+
+  // The built cluster names are dropped along with the entries they were built from
+  updateDnsEntriesFile(R"EOF({"dns_entries": {"{cluster}.svc.example.com": "{cluster}"}})EOF");
+  EXPECT_EQ(0, known_names->templateClusterCount());
+  EXPECT_EQ(*known_names->matchDomainName("Payments.svc.example.com").cluster_name_, "payments");
+}
+
+TEST_F(DnsEntriesProviderTest, templateClustersBounded) {
+  useDnsEntriesFile(R"EOF({"dns_entries": {"{cluster}.svc.example.com": "{cluster}"}})EOF");
+  createProvider();
+
+  auto known_names = std::dynamic_pointer_cast<ThreadLocalKnownNames>(provider_->knownNames());
+  for (size_t i = 0; i < ThreadLocalKnownNames::MaxTemplateClusters; i++) {
+    known_names->matchDomainName(fmt::format("s{}.svc.example.com", i));
+  }
+  EXPECT_EQ(ThreadLocalKnownNames::MaxTemplateClusters, known_names->templateClusterCount());
+
+  known_names->matchDomainName("one_more.svc.example.com");
+  EXPECT_EQ(1, known_names->templateClusterCount());
+}
+
+TEST_F(DnsEntriesProviderTest, templateClusterOwnedByMatch) {
+  useDnsEntriesFile(R"EOF({"dns_entries": {"{cluster}.svc.example.com": "{cluster}"}})EOF");
+  createProvider();
+
+  auto known_names = std::dynamic_pointer_cast<ThreadLocalKnownNames>(provider_->knownNames());
+  const DomainNameMatch match = known_names->matchDomainName("payments.svc.example.com");
+
+  // The built cluster names are dropped while the match is still in use
+  for (size_t i = 0; i < ThreadLocalKnownNames::MaxTemplateClusters; i++) {
+    known_names->matchDomainName(fmt::format("s{}.svc.example.com", i));
+  }
+  EXPECT_EQ(1, known_names->templateClusterCount());
+
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(*match.cluster_name_, "payments");
+}
+
+TEST_F(DnsEntriesProviderTest, patternOutsideFirstLabelRejectsConfig) {
+  (*proto_config_.mutable_server_settings()->mutable_dns_entries())["a.*.example.com"] =
+      "cluster_1";
+
+  EXPECT_THROW_WITH_MESSAGE(createProvider(), EnvoyException,
+                            "Dns Entry a.*.example.com has a pattern in a label other than the "
+                            "first one");
+}
+
+TEST_F(DnsEntriesProviderTest, clusterLabelOutsideTemplateRejectsConfig) {
+  (*proto_config_.mutable_server_settings()->mutable_dns_entries())["*.example.com"] =
+      "{cluster}";
+
+  EXPECT_THROW_WITH_MESSAGE(createProvider(), EnvoyException,
+                            "Dns Entry *.example.com refers to {cluster} in its cluster name "
+                            "{cluster}");
+}
+
+TEST_F(DnsEntriesProviderTest, dnsSnapshotSwappedWithAllNamesChanged) {
+  useDnsSnapshot(snapshotSource("cluster_1"));
+  createProvider();
+
+  ASSERT_NE(clusterName("api.example.com"), nullptr);
+  EXPECT_EQ(*clusterName("api.example.com"), "cluster_1");
+  EXPECT_EQ(clusterName("www.example.com"), nullptr);
+  EXPECT_EQ(1, entries());
+
+  std::vector<std::string> changed_names;
+  Common::CallbackHandle* handle = provider_->knownNames()->addUpdateCb(
+      [&changed_names](const std::vector<std::string>& names) -> void { changed_names = names; });
+
+  writeDnsSnapshot(DnsSnapshot::compile(snapshotSource("cluster_2")));
+  on_dns_entries_changed_(Filesystem::Watcher::Events::MovedTo);
+
+  EXPECT_THAT(changed_names, UnorderedElementsAre("*"));
+  ASSERT_NE(clusterName("api.example.com"), nullptr);
+  EXPECT_EQ(*clusterName("api.example.com"), "cluster_2");
+
+  // A file that is not a snapshot keeps the mapped one
+  writeDnsSnapshot("not a snapshot");
+  on_dns_entries_changed_(Filesystem::Watcher::Events::MovedTo);
+  EXPECT_EQ(*clusterName("api.example.com"), "cluster_2");
+
+  EXPECT_EQ(1, counter("update_success"));
+  EXPECT_EQ(1, counter("update_rejected"));
+
+  handle->remove();
+}
+
+TEST_F(DnsEntriesProviderTest, dnsSnapshotExcludesInlineNames) {
+  proto_config_.mutable_server_settings()->set_dns_snapshot_path("/dns.snapshot");
+
+  EXPECT_THROW_WITH_MESSAGE(createProvider(), EnvoyException,
+                            "dns_snapshot_path /dns.snapshot cannot be combined with "
+                            "known_domainname_suffixes, dns_entries or dns_entries_path");
+}
+
+TEST_F(DnsEntriesProviderTest, registrySharesProviderOfSameServerSettings) {
+  auto registry = std::make_shared<DnsEntriesProviderRegistry>();
+  auto getOrCreate = [&]() -> DnsEntriesProviderSharedPtr {
+    return registry->getOrCreate(proto_config_, std::make_shared<ConfigImpl>(proto_config_), tls_,
+                                 dispatcher_, *api_, store_);
+  };
+
+  // The UDP and TCP listeners of the same settings
+  DnsEntriesProviderSharedPtr udp_provider = getOrCreate();
+  DnsEntriesProviderSharedPtr tcp_provider = getOrCreate();
+  EXPECT_EQ(udp_provider, tcp_provider);
+
+  (*proto_config_.mutable_server_settings()->mutable_dns_entries())["api.example.com"] =
+      "cluster_1";
+  DnsEntriesProviderSharedPtr other_provider = getOrCreate();
+  EXPECT_NE(udp_provider, other_provider);
+
+  // A provider is created again once the listeners that used it are gone
+  other_provider.reset();
+  EXPECT_NE(nullptr, getOrCreate());
+}
+
+TEST_F(DnsEntriesProviderTest, registrySharesConfigOfSameProto) {
+  auto registry = std::make_shared<ConfigRegistry>();
+
+  // The UDP and TCP listeners of the same config share its known names
+  std::shared_ptr<const Config> udp_config = registry->getOrCreate(proto_config_);
+  std::shared_ptr<const Config> tcp_config = registry->getOrCreate(proto_config_);
+  EXPECT_EQ(udp_config, tcp_config);
+  EXPECT_NE(nullptr, udp_config->knownNames());
+
+  proto_config_.mutable_client_settings()->mutable_max_cached_responses()->set_value(1);
+  std::shared_ptr<const Config> other_config = registry->getOrCreate(proto_config_);
+  EXPECT_NE(udp_config, other_config);
+  EXPECT_EQ(1, other_config->maxCachedResponses());
+
+  // A config is created again once the listeners that used it are gone
+  other_config.reset();
+  EXPECT_NE(nullptr, registry->getOrCreate(proto_config_));
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,125 @@
+#include <arpa/nameser.h>
+#include <arpa/nameser_compat.h>
+
+#include "src/dns_filter.h"
+
+#include "common/buffer/buffer_impl.h"
+#include "common/network/address_impl.h"
+#include "common/stats/isolated_store_impl.h"
+
+#include "test/mocks/event/mocks.h"
+#include "test/mocks/network/mocks.h"
+#include "test/mocks/upstream/mocks.h"
+
+#include "test/mocks.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using testing::_;
+using testing::Invoke;
+using testing::NiceMock;
+using testing::ReturnRef;
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+class DnsFilterTest : public ::testing::Test {
+public:
+  DnsFilterTest()
+      : config_(std::make_shared<NiceMock<MockConfig>>()),
+        known_names_(std::make_shared<NiceMock<MockKnownNames>>()),
+        from_(std::make_shared<Network::Address::Ipv4Instance>("10.0.0.1", 5353)) {
+    ON_CALL(callbacks_, udpListener()).WillByDefault(ReturnRef(listener_));
+    ON_CALL(listener_, dispatcher()).WillByDefault(ReturnRef(dispatcher_));
+    ON_CALL(listener_, send(_))
+        .WillByDefault(Invoke([this](const Network::UdpSendData& data) -> Api::IoCallUint64Result {
+          sent_.push_back(data.buffer_.toString());
+          sent_ids_.push_back((static_cast<uint8_t>(sent_.back()[0]) << 8) |
+                              static_cast<uint8_t>(sent_.back()[1]));
+          return Api::IoCallUint64Result(data.buffer_.length(),
+                                         Api::IoErrorPtr(nullptr, [](Api::IoError*) {}));
+        }));
+  }
+
+  void setup() {
+    filter_ = std::make_unique<ProdDnsFilter>(config_, known_names_, callbacks_, cluster_manager_,
+                                              store_);
+  }
+
+  // Receives a query for the MX records of a.com, which is answered inline with NOTIMP
+  void onQuery(uint16_t id) {
+    std::string query("\x00\x00\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00", HFIXEDSZ);
+    query[0] = static_cast<char>(id >> 8);
+    query[1] = static_cast<char>(id & 0xFF);
+    query += std::string("\x01\x61\x03\x63om\x00\x00\x0f\x00\x01", 11);
+
+    Network::UdpRecvData data;
+    data.peer_address_ = from_;
+    data.buffer_ = std::make_unique<Buffer::OwnedImpl>(query);
+    filter_->onData(data);
+  }
+
+  // Header fields of the response sent at index
+  uint16_t responseCode(size_t index) const { return sent_[index][3] & 0xF; }
+  bool responseTruncated(size_t index) const { return sent_[index][2] & 0x2; }
+
+  std::shared_ptr<NiceMock<MockConfig>> config_;
+  std::shared_ptr<NiceMock<MockKnownNames>> known_names_;
+  Network::Address::InstanceConstSharedPtr from_;
+  NiceMock<Event::MockDispatcher> dispatcher_;
+  NiceMock<Network::MockUdpListener> listener_;
+  NiceMock<Network::MockUdpReadFilterCallbacks> callbacks_;
+  NiceMock<Upstream::MockClusterManager> cluster_manager_;
+  Stats::IsolatedStoreImpl store_;
+  std::vector<std::string> sent_;
+  std::vector<uint16_t> sent_ids_;
+  std::unique_ptr<DnsFilter> filter_;
+};
+
+TEST_F(DnsFilterTest, queriesBeyondResponseRateSlippedOrDropped) {
+  // One response per second, every second query beyond it is slipped
+  config_->response_rate_limit_ = ResponseRateLimitSettings{1, 2, 24, 56, 1024};
+  setup();
+
+  onQuery(1);
+  onQuery(2);
+  onQuery(3);
+
+  // The second query is dropped, the third one is answered with an empty, truncated response
+  // without reaching the server
+  ASSERT_EQ(std::vector<uint16_t>({1, 3}), sent_ids_);
+  EXPECT_EQ(NOTIMP, responseCode(0));
+  EXPECT_FALSE(responseTruncated(0));
+  EXPECT_EQ(NOERROR, responseCode(1));
+  EXPECT_TRUE(responseTruncated(1));
+  EXPECT_EQ(1, store_.counter("response_rate_limit_dropped").value());
+  EXPECT_EQ(1, store_.counter("response_rate_limit_slipped").value());
+  EXPECT_EQ(1, store_.counter("unsupported.response_notimp").value());
+}
+
+TEST_F(DnsFilterTest, queryBeyondResponseRateNotDecodedPastQuestion) {
+  config_->response_rate_limit_ = ResponseRateLimitSettings{1, 0, 24, 56, 1024};
+  setup();
+  onQuery(1);
+
+  // The OPT record the header announces is truncated, which is not found for a dropped query
+  std::string query("\x00\x02\x01\x00\x00\x01\x00\x00\x00\x00\x00\x01", HFIXEDSZ);
+  query += std::string("\x01\x61\x03\x63om\x00\x00\x0f\x00\x01", 11);
+  query += std::string("\x00\x00\x29\x10\x00", 5);
+  Network::UdpRecvData data;
+  data.peer_address_ = from_;
+  data.buffer_ = std::make_unique<Buffer::OwnedImpl>(query);
+  filter_->onData(data);
+
+  EXPECT_EQ(std::vector<uint16_t>({1}), sent_ids_);
+  EXPECT_EQ(1, store_.counter("response_rate_limit_dropped").value());
+  EXPECT_EQ(0, store_.counter("decode_truncated_record").value());
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,356 @@
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <arpa/nameser_compat.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <map>
+
+#include "src/dns_codec_impl.h"
+#include "src/dns_forwarder_impl.h"
+
+#include "common/buffer/buffer_impl.h"
+#include "common/network/address_impl.h"
+#include "common/stats/isolated_store_impl.h"
+
+#include "test/mocks/event/mocks.h"
+#include "test/test_common/simulated_time_system.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using testing::_;
+using testing::Invoke;
+using testing::NiceMock;
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+// The forwarder talks to a stub resolver on a socket of the test, which reads the forwarded queries
+// and answers them with whatever the test sends back
+class ForwarderImplTest : public ::testing::Test {
+public:
+  ForwarderImplTest() {
+    stub_fd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    EXPECT_EQ(0, ::bind(stub_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)));
+    socklen_t address_len = sizeof(address);
+    EXPECT_EQ(0, ::getsockname(stub_fd_, reinterpret_cast<sockaddr*>(&address), &address_len));
+    upstream_ =
+        std::make_shared<Network::Address::Ipv4Instance>("127.0.0.1", ntohs(address.sin_port));
+
+    // Keep a broken forwarder from hanging the test
+    timeval receive_timeout{1, 0};
+    setsockopt(stub_fd_, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
+  }
+
+  ~ForwarderImplTest() { ::close(stub_fd_); }
+
+  // A socket of the forwarder, with the callback of its file event
+  struct ForwarderSocket {
+    int fd_;
+    Event::FileReadyCb file_ready_cb_;
+  };
+
+  void setup(uint32_t max_pending = 100, uint32_t port_count = ForwarderImpl::DefaultPortCount,
+             uint32_t queries_per_port = ForwarderImpl::DefaultQueriesPerPort) {
+    timer_ = new NiceMock<Event::MockTimer>(&dispatcher_);
+    EXPECT_CALL(dispatcher_, createFileEvent_(_, _, Event::FileTriggerType::Level,
+                                              Event::FileReadyType::Read))
+        .Times(testing::AtLeast(port_count))
+        .WillRepeatedly(
+            Invoke([this](int fd, Event::FileReadyCb cb, Event::FileTriggerType,
+                          uint32_t) -> Event::FileEvent* {
+              forwarder_sockets_.push_back({fd, cb});
+              return new NiceMock<Event::MockFileEvent>();
+            }));
+    forwarder_ = std::make_unique<ForwarderImpl>(dispatcher_, upstream_, timeout_, max_pending,
+                                                  store_, port_count, queries_per_port);
+  }
+
+  static uint16_t localPort(int fd) {
+    sockaddr_in address;
+    socklen_t address_len = sizeof(address);
+    if (::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &address_len) != 0) {
+      return 0;
+    }
+    return ntohs(address.sin_port);
+  }
+
+  // The latest socket of the forwarder on port, as a closed socket may have left its fd to it
+  ForwarderSocket& socketOnPort(uint16_t port) {
+    for (auto it = forwarder_sockets_.rbegin(); it != forwarder_sockets_.rend(); ++it) {
+      if (localPort(it->fd_) == port) {
+        return *it;
+      }
+    }
+
+    ADD_FAILURE() << "no forwarder socket on port " << port;
+    return forwarder_sockets_.front();
+  }
+
+  // Decodes a query with ID 0x1234 for www.example.com, with an OPT record
+  const Formats::Message& decodeQuery(uint16_t q_type = T_A) {
+    std::string packet("\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x01", 12);
+    packet.append("\x03www\x07"
+                  "example\x03"
+                  "com\x00",
+                  17);
+    packet.append({'\0', static_cast<char>(q_type), '\0', '\1'});
+    packet.append("\x00\x00\x29\x10\x00\x00\x00\x00\x00\x00\x00", 11);
+
+    query_buffer_.drain(query_buffer_.length());
+    query_buffer_.add(packet);
+    EXPECT_EQ(Formats::DecodeStatus::Ok, decoder_.decode(query_buffer_, client_));
+    return decoder_.message();
+  }
+
+  void forward(const Formats::Message& dns_request) {
+    EXPECT_TRUE(forwarder_->forward(
+        dns_request, [this](const Formats::Message& request, Buffer::Instance& response) -> void {
+          EXPECT_EQ(client_, request.from());
+          responses_.push_back(response.toString());
+        }));
+  }
+
+  // Reads a query the forwarder sent to the stub, and notes the port it came from
+  std::string receiveQuery() {
+    char query[4096];
+    sockaddr_in address;
+    socklen_t address_len = sizeof(address);
+    const ssize_t rc = ::recvfrom(stub_fd_, query, sizeof(query), 0,
+                                  reinterpret_cast<sockaddr*>(&address), &address_len);
+    EXPECT_LT(0, rc);
+    last_query_port_ = ntohs(address.sin_port);
+    if (rc >= 2) {
+      query_ports_[std::string(query, 2)] = last_query_port_;
+    }
+    return std::string(query, rc > 0 ? rc : 0);
+  }
+
+  // Sends response from the stub to the port of the query with its ID, or of the last query if
+  // there is none, and lets the forwarder read it
+  void respond(const std::string& response) {
+    auto it = query_ports_.find(response.substr(0, 2));
+    respondOnPort(it != query_ports_.end() ? it->second : last_query_port_, response);
+  }
+
+  void respondOnPort(uint16_t port, const std::string& response) {
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    EXPECT_EQ(static_cast<ssize_t>(response.size()),
+              ::sendto(stub_fd_, response.data(), response.size(), 0,
+                       reinterpret_cast<sockaddr*>(&address), sizeof(address)));
+
+    ForwarderSocket& socket = socketOnPort(port);
+    pollfd ready{socket.fd_, POLLIN, 0};
+    EXPECT_EQ(1, ::poll(&ready, 1, 1000));
+    socket.file_ready_cb_(Event::FileReadyType::Read);
+  }
+
+  // The response of the stub to query, with an answer the filter never builds itself
+  static std::string upstreamResponse(const std::string& query) {
+    std::string response = query.substr(0, query.size() - 11);
+    response[2] = static_cast<char>(response[2] | 0x80);
+    response[7] = 1;
+    response[11] = 0;
+    response.append("\xc0\x0c\x00\x05\x00\x01\x00\x00\x01\x2c\x00\x06\x03"
+                    "cdn\xc0\x10",
+                    18);
+    return response;
+  }
+
+  uint64_t counter(const std::string& name) { return store_.counter("forward." + name).value(); }
+  uint64_t gauge(const std::string& name) {
+    return store_.gauge("forward." + name, Stats::Gauge::ImportMode::Accumulate).value();
+  }
+
+  int stub_fd_;
+  // The port each query was received from, by its ID
+  std::map<std::string, uint16_t> query_ports_;
+  uint16_t last_query_port_{0};
+  Network::Address::InstanceConstSharedPtr upstream_;
+  Network::Address::InstanceConstSharedPtr client_{
+      std::make_shared<Network::Address::Ipv4Instance>("10.0.0.1", 5353)};
+  const std::chrono::milliseconds timeout_{2000};
+  Buffer::OwnedImpl query_buffer_;
+  DecoderImpl decoder_;
+  std::vector<std::string> responses_;
+  Stats::IsolatedStoreImpl store_;
+  Event::SimulatedTimeSystem time_system_;
+  Event::MockDispatcher dispatcher_;
+  // Owned by forwarder_
+  NiceMock<Event::MockTimer>* timer_;
+  std::vector<ForwarderSocket> forwarder_sockets_;
+  std::unique_ptr<ForwarderImpl> forwarder_;
+};
+
+TEST_F(ForwarderImplTest, questionLength) {
+  const std::string query =
+      std::string(12, '\0') + std::string("\x03www\x03org\x00\x00\x01\x00\x01", 13);
+  EXPECT_EQ(13, ForwarderImpl::questionLength(query));
+  EXPECT_EQ(0, ForwarderImpl::questionLength(query.substr(0, query.size() - 1)));
+  EXPECT_EQ(0, ForwarderImpl::questionLength(query.substr(0, 14)));
+
+  // A question name that is only a compression pointer
+  EXPECT_EQ(6, ForwarderImpl::questionLength(std::string(12, '\0') +
+                                             std::string("\xc0\x0c\x00\x01\x00\x01", 6)));
+}
+
+TEST_F(ForwarderImplTest, relaysResponseWithIdOfClient) {
+  setup();
+  EXPECT_CALL(*timer_, enableTimer(timeout_));
+  forward(decodeQuery());
+
+  // The query goes out as it was received, apart from its ID
+  const std::string query = receiveQuery();
+  ASSERT_EQ(query_buffer_.length(), query.size());
+  EXPECT_EQ(query_buffer_.toString().substr(2), query.substr(2));
+  EXPECT_EQ(1, gauge("query_pending"));
+
+  const std::string response = upstreamResponse(query);
+  EXPECT_CALL(*timer_, disableTimer());
+  respond(response);
+
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ("\x12\x34", responses_[0].substr(0, 2));
+  EXPECT_EQ(response.substr(2), responses_[0].substr(2));
+  EXPECT_EQ(1, counter("query"));
+  EXPECT_EQ(1, counter("response"));
+  EXPECT_EQ(0, gauge("query_pending"));
+}
+
+TEST_F(ForwarderImplTest, queriesSentWithDistinctIds) {
+  setup();
+  forward(decodeQuery(T_A));
+  const std::string a_query = receiveQuery();
+  forward(decodeQuery(T_AAAA));
+  const std::string aaaa_query = receiveQuery();
+  EXPECT_NE(a_query.substr(0, 2), aaaa_query.substr(0, 2));
+
+  // Answered in the other order
+  respond(upstreamResponse(aaaa_query));
+  respond(upstreamResponse(a_query));
+  ASSERT_EQ(2, responses_.size());
+  EXPECT_EQ(T_AAAA, static_cast<uint8_t>(responses_[0][30]));
+  EXPECT_EQ(T_A, static_cast<uint8_t>(responses_[1][30]));
+}
+
+TEST_F(ForwarderImplTest, responsesNotMatchingQueryDropped) {
+  setup();
+  forward(decodeQuery());
+  const std::string query = receiveQuery();
+  const std::string response = upstreamResponse(query);
+
+  std::string other_id = response;
+  other_id[1] = static_cast<char>(other_id[1] ^ 1);
+  respond(other_id);
+
+  std::string other_question = response;
+  other_question[13] = 'W';
+  respond(other_question);
+
+  std::string not_response = response;
+  not_response[2] = static_cast<char>(not_response[2] & 0x7f);
+  respond(not_response);
+
+  respond(response.substr(0, 11));
+
+  EXPECT_TRUE(responses_.empty());
+  EXPECT_EQ(4, counter("response_dropped"));
+
+  respond(response);
+  EXPECT_EQ(1, responses_.size());
+}
+
+TEST_F(ForwarderImplTest, responseOnOtherPortDropped) {
+  setup(100, 2);
+  forward(decodeQuery());
+  const std::string query = receiveQuery();
+
+  const uint16_t other_port = localPort(forwarder_sockets_[0].fd_) == last_query_port_
+                                  ? localPort(forwarder_sockets_[1].fd_)
+                                  : localPort(forwarder_sockets_[0].fd_);
+  respondOnPort(other_port, upstreamResponse(query));
+  EXPECT_TRUE(responses_.empty());
+  EXPECT_EQ(1, counter("response_dropped"));
+
+  respond(upstreamResponse(query));
+  EXPECT_EQ(1, responses_.size());
+}
+
+TEST_F(ForwarderImplTest, portReplacedOnceItsQueriesComplete) {
+  setup(100, 1, 2);
+  forward(decodeQuery(T_A));
+  const std::string a_query = receiveQuery();
+  const uint16_t first_port = last_query_port_;
+  forward(decodeQuery(T_AAAA));
+  const std::string aaaa_query = receiveQuery();
+  EXPECT_EQ(first_port, last_query_port_);
+
+  // The port stays in use while queries sent from it are pending
+  forward(decodeQuery(T_MX));
+  const std::string mx_query = receiveQuery();
+  EXPECT_EQ(first_port, last_query_port_);
+  respond(upstreamResponse(a_query));
+  respond(upstreamResponse(aaaa_query));
+  respond(upstreamResponse(mx_query));
+  EXPECT_EQ(3, responses_.size());
+
+  // The new socket is connected before the old one is closed, so it gets another port
+  forward(decodeQuery(T_TXT));
+  const std::string txt_query = receiveQuery();
+  EXPECT_NE(first_port, last_query_port_);
+  EXPECT_EQ(2, forwarder_sockets_.size());
+  respond(upstreamResponse(txt_query));
+  EXPECT_EQ(4, responses_.size());
+}
+
+TEST_F(ForwarderImplTest, timeoutAnsweredWithServfail) {
+  setup();
+  forward(decodeQuery());
+  time_system_.sleep(std::chrono::milliseconds(500));
+  forward(decodeQuery(T_AAAA));
+  const std::string query = receiveQuery();
+  receiveQuery();
+
+  // Only the first query is expired, the timer is armed again for the deadline of the second
+  time_system_.sleep(std::chrono::milliseconds(1500));
+  EXPECT_CALL(*timer_, enableTimer(std::chrono::milliseconds(501)));
+  timer_->callback_();
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ("\x12\x34", responses_[0].substr(0, 2));
+  EXPECT_EQ(SERVFAIL, responses_[0][3] & 0xf);
+  EXPECT_EQ(1, counter("query_timeout"));
+  EXPECT_EQ(1, gauge("query_pending"));
+
+  // A late response finds no query
+  respond(upstreamResponse(query));
+  EXPECT_EQ(1, responses_.size());
+  EXPECT_EQ(1, counter("response_dropped"));
+}
+
+TEST_F(ForwarderImplTest, pendingLimit) {
+  setup(1);
+  forward(decodeQuery());
+  EXPECT_FALSE(forwarder_->forward(
+      decodeQuery(), [](const Formats::Message&, Buffer::Instance&) -> void { FAIL(); }));
+  EXPECT_EQ(1, counter("query"));
+  EXPECT_EQ(1, counter("query_overflow"));
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
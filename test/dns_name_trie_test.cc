@@ -0,0 +1,162 @@
+#include "src/dns_name_trie.h"
+
+#include "gtest/gtest.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+class DomainNameTrieTest : public ::testing::Test {
+public:
+  void SetUp() override {
+    trie_.addSuffix("github.com");
+    trie_.addSuffix(".microsoft.com");
+    trie_.addEntry("a.b.c.microsoft.com", "cluster_0");
+    trie_.addEntry("x.y.z.github.com", "cluster_0");
+    trie_.addEntry("_service._tcp.a.b.microsoft.com", "cluster_1");
+  }
+
+  DomainNameTrie trie_;
+};
+
+TEST_F(DomainNameTrieTest, suffixMatchesOnLabelBoundaries) {
+  EXPECT_TRUE(trie_.find("github.com").known_suffix_);
+  EXPECT_TRUE(trie_.find("www.github.com").known_suffix_);
+  EXPECT_TRUE(trie_.find("a.b.microsoft.com").known_suffix_);
+
+  EXPECT_FALSE(trie_.find("notgithub.com").known_suffix_);
+  EXPECT_FALSE(trie_.find("com").known_suffix_);
+  EXPECT_FALSE(trie_.find("github.org").known_suffix_);
+  EXPECT_FALSE(trie_.find("").known_suffix_);
+}
+
+TEST_F(DomainNameTrieTest, entryMatchesExactName) {
+  DomainNameMatch match = trie_.find("a.b.c.microsoft.com");
+  EXPECT_TRUE(match.known_suffix_);
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(*match.cluster_name_, "cluster_0");
+
+  match = trie_.find("_service._tcp.a.b.microsoft.com");
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(*match.cluster_name_, "cluster_1");
+
+  // Names above or below an entry are known but have no entry
+  match = trie_.find("b.c.microsoft.com");
+  EXPECT_TRUE(match.known_suffix_);
+  EXPECT_EQ(match.cluster_name_, nullptr);
+
+  match = trie_.find("w.a.b.c.microsoft.com");
+  EXPECT_TRUE(match.known_suffix_);
+  EXPECT_EQ(match.cluster_name_, nullptr);
+}
+
+TEST_F(DomainNameTrieTest, caseInsensitiveAndFullyQualified) {
+  DomainNameMatch match = trie_.find("X.Y.Z.GitHub.COM.");
+  EXPECT_TRUE(match.known_suffix_);
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(*match.cluster_name_, "cluster_0");
+}
+
+TEST_F(DomainNameTrieTest, emptyLabelsDoNotMatch) {
+  EXPECT_EQ(trie_.find("x.y..z.github.com").cluster_name_, nullptr);
+  EXPECT_EQ(trie_.find(".x.y.z.github.com").cluster_name_, nullptr);
+}
+
+TEST_F(DomainNameTrieTest, entriesShareClusterName) {
+  const DomainNameMatch first = trie_.find("a.b.c.microsoft.com");
+  const DomainNameMatch second = trie_.find("x.y.z.github.com");
+  ASSERT_NE(first.cluster_name_, nullptr);
+  EXPECT_EQ(first.cluster_name_, second.cluster_name_);
+}
+
+TEST_F(DomainNameTrieTest, namesAddedAfterShrinkToFit) {
+  trie_.shrinkToFit();
+  trie_.addEntry("w.x.y.z.github.com", "cluster_1");
+  trie_.addEntry("v.x.y.z.github.com", "cluster_2");
+
+  DomainNameMatch match = trie_.find("W.x.y.z.github.com");
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(*match.cluster_name_, "cluster_1");
+
+  match = trie_.find("v.x.y.z.github.com");
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(*match.cluster_name_, "cluster_2");
+
+  match = trie_.find("x.y.z.github.com");
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(*match.cluster_name_, "cluster_0");
+}
+
+TEST_F(DomainNameTrieTest, duplicateEntryReplacesCluster) {
+  trie_.addEntry("x.y.z.github.com", "cluster_2");
+
+  DomainNameMatch match = trie_.find("x.y.z.github.com");
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(*match.cluster_name_, "cluster_2");
+}
+
+TEST_F(DomainNameTrieTest, wildcardMatchesNamesBelowIt) {
+  trie_.addEntry("*.canary.github.com", "cluster_2");
+
+  for (const std::string name : {"a.canary.github.com", "a.b.Canary.github.com."}) {
+    DomainNameMatch match = trie_.find(name);
+    ASSERT_NE(match.cluster_name_, nullptr) << name;
+    EXPECT_EQ(*match.cluster_name_, "cluster_2");
+    EXPECT_TRUE(match.cluster_label_.empty());
+  }
+
+  EXPECT_EQ(trie_.find("canary.github.com").cluster_name_, nullptr);
+  EXPECT_TRUE(DomainNameTrie::isPattern("*.canary.github.com"));
+  EXPECT_FALSE(DomainNameTrie::isPattern("a.canary.github.com"));
+}
+
+TEST_F(DomainNameTrieTest, clusterTemplateMatchesOneLabel) {
+  trie_.addEntry("{cluster}.svc.github.com", "{cluster}-prod");
+
+  DomainNameMatch match = trie_.find("Payments.svc.github.com");
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(*match.cluster_name_, "{cluster}-prod");
+  EXPECT_EQ(match.cluster_label_, "Payments");
+
+  EXPECT_EQ(trie_.find("svc.github.com").cluster_name_, nullptr);
+  EXPECT_EQ(trie_.find("a.payments.svc.github.com").cluster_name_, nullptr);
+}
+
+TEST_F(DomainNameTrieTest, entryTakesPrecedenceOverPatterns) {
+  trie_.addEntry("*.github.com", "cluster_2");
+  trie_.addEntry("*.z.github.com", "cluster_3");
+  trie_.addEntry("{cluster}.z.github.com", "{cluster}");
+
+  // The entry for the name, then the template and the wildcard further down the name
+  EXPECT_EQ(*trie_.find("x.y.z.github.com").cluster_name_, "cluster_0");
+  EXPECT_EQ(trie_.find("y.z.github.com").cluster_label_, "y");
+  EXPECT_EQ(*trie_.find("w.y.z.github.com").cluster_name_, "cluster_3");
+  EXPECT_EQ(*trie_.find("w.github.com").cluster_name_, "cluster_2");
+}
+
+TEST_F(DomainNameTrieTest, staticRecordsOfExactName) {
+  trie_.addRecords("www.github.com", {0x0100000a}, {});
+  trie_.addRecords("x.y.z.github.com", {0x0100000a}, {absl::uint128(1)});
+  trie_.addRecords("x.y.z.github.com", {}, {absl::uint128(2)});
+
+  DomainNameMatch match = trie_.find("WWW.github.com.");
+  EXPECT_EQ(match.cluster_name_, nullptr);
+  ASSERT_EQ(1, match.static_records_.ipv4_count_);
+  EXPECT_EQ(0x0100000a, match.static_records_.ipv4_[0]);
+  EXPECT_EQ(0, match.static_records_.ipv6_count_);
+
+  // Records replace the earlier ones of the name, and keep its entry
+  match = trie_.find("x.y.z.github.com");
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(0, match.static_records_.ipv4_count_);
+  ASSERT_EQ(1, match.static_records_.ipv6_count_);
+  EXPECT_EQ(absl::uint128(2), match.static_records_.ipv6_[0]);
+
+  EXPECT_TRUE(trie_.find("a.www.github.com").static_records_.empty());
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
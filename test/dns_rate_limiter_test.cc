@@ -0,0 +1,152 @@
+#include <arpa/nameser.h>
+#include <arpa/nameser_compat.h>
+
+#include "src/dns_rate_limiter.h"
+
+#include "common/common/fmt.h"
+#include "common/network/address_impl.h"
+
+#include "gtest/gtest.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+class ResponseRateLimiterTest : public ::testing::Test {
+public:
+  ResponseRateLimiterTest() : settings_{5, 2, 24, 56, 1024} {}
+
+  ResponseRateLimiter::Action check(const std::string& address, const std::string& name) {
+    return limiter_->check(*addressOf(address), name, now_);
+  }
+
+  // Checks count queries and returns how many of them were let through
+  uint32_t respondedOf(uint32_t count, const std::string& address, const std::string& name) {
+    uint32_t responded = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      responded += check(address, name) == ResponseRateLimiter::Action::Respond ? 1 : 0;
+    }
+
+    return responded;
+  }
+
+  static Network::Address::InstanceConstSharedPtr addressOf(const std::string& address) {
+    if (address.find(':') != std::string::npos) {
+      return std::make_shared<Network::Address::Ipv6Instance>(address, 53);
+    }
+
+    return std::make_shared<Network::Address::Ipv4Instance>(address, 53);
+  }
+
+  void createLimiter() { limiter_ = std::make_unique<ResponseRateLimiter>(settings_); }
+
+  ResponseRateLimitSettings settings_;
+  MonotonicTime now_{std::chrono::seconds(1000)};
+  std::unique_ptr<ResponseRateLimiter> limiter_;
+};
+
+TEST_F(ResponseRateLimiterTest, limitsToBurstAndRefills) {
+  createLimiter();
+
+  // A new bucket starts with half a burst
+  EXPECT_EQ(2, respondedOf(10, "10.0.0.1", "www.example.com"));
+
+  // A fifth of a second refills one response
+  now_ += std::chrono::milliseconds(200);
+  EXPECT_EQ(1, respondedOf(10, "10.0.0.1", "www.example.com"));
+
+  // The credit of an idle bucket is capped at the burst
+  now_ += std::chrono::seconds(10);
+  EXPECT_EQ(5, respondedOf(10, "10.0.0.1", "www.example.com"));
+}
+
+TEST_F(ResponseRateLimiterTest, slipsEverySlipthLimitedQuery) {
+  createLimiter();
+  EXPECT_EQ(2, respondedOf(2, "10.0.0.1", "www.example.com"));
+
+  EXPECT_EQ(ResponseRateLimiter::Action::Drop, check("10.0.0.1", "www.example.com"));
+  EXPECT_EQ(ResponseRateLimiter::Action::Slip, check("10.0.0.1", "www.example.com"));
+  EXPECT_EQ(ResponseRateLimiter::Action::Drop, check("10.0.0.1", "www.example.com"));
+  EXPECT_EQ(ResponseRateLimiter::Action::Slip, check("10.0.0.1", "www.example.com"));
+}
+
+TEST_F(ResponseRateLimiterTest, slipOfZeroDropsAllLimitedQueries) {
+  settings_.slip_ = 0;
+  createLimiter();
+  EXPECT_EQ(2, respondedOf(2, "10.0.0.1", "www.example.com"));
+
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(ResponseRateLimiter::Action::Drop, check("10.0.0.1", "www.example.com"));
+  }
+}
+
+TEST_F(ResponseRateLimiterTest, accountsPerPrefixAndZone) {
+  createLimiter();
+  EXPECT_EQ(2, respondedOf(10, "10.0.0.1", "www.example.com"));
+
+  // Same /24 and zone, in any case
+  EXPECT_EQ(0, respondedOf(10, "10.0.0.200", "WWW.Example.com"));
+  EXPECT_EQ(0, respondedOf(10, "10.0.0.1", "api.example.com"));
+  // Another /24, or another zone
+  EXPECT_EQ(2, respondedOf(10, "10.0.1.1", "www.example.com"));
+  EXPECT_EQ(2, respondedOf(10, "10.0.0.1", "www.example.org"));
+
+  EXPECT_EQ(2, respondedOf(10, "2001:db8:0:100::1", "www.example.com"));
+  // Same /56
+  EXPECT_EQ(0, respondedOf(10, "2001:db8:0:1ff::2", "www.example.com"));
+  // Another /56
+  EXPECT_EQ(2, respondedOf(10, "2001:db8:0:200::1", "www.example.com"));
+}
+
+TEST_F(ResponseRateLimiterTest, randomNamesOfZoneLimitedTogether) {
+  createLimiter();
+  Network::Address::InstanceConstSharedPtr client = addressOf("10.0.0.1");
+
+  // Every name is answered with NXDOMAIN
+  uint32_t responded = 0;
+  for (int i = 0; i < 100; i++) {
+    const std::string name = fmt::format("r{}.example.com", i);
+    if (check("10.0.0.1", name) == ResponseRateLimiter::Action::Respond) {
+      responded++;
+      limiter_->onResponse(*client, name, NXDOMAIN, now_);
+    }
+  }
+  EXPECT_EQ(2, responded);
+}
+
+TEST_F(ResponseRateLimiterTest, answeredNameAccountedApartFromZone) {
+  createLimiter();
+  Network::Address::InstanceConstSharedPtr client = addressOf("10.0.0.1");
+  EXPECT_EQ(2, respondedOf(2, "10.0.0.1", "www.example.com"));
+
+  // The answer starts the bucket of the name, while the zone stays limited
+  limiter_->onResponse(*client, "www.example.com", NOERROR, now_);
+  EXPECT_EQ(2, respondedOf(10, "10.0.0.1", "www.example.com"));
+  EXPECT_EQ(0, respondedOf(10, "10.0.0.1", "api.example.com"));
+
+  // An error frees the bucket of the name, which is accounted to its zone again
+  now_ += std::chrono::seconds(1);
+  limiter_->onResponse(*client, "www.example.com", SERVFAIL, now_);
+  EXPECT_EQ(5, respondedOf(10, "10.0.0.1", "www.example.com"));
+  EXPECT_EQ(0, respondedOf(10, "10.0.0.1", "api.example.com"));
+}
+
+TEST_F(ResponseRateLimiterTest, collidingKeysShareBucketCredit) {
+  settings_.table_size_ = 1;
+  createLimiter();
+  EXPECT_EQ(2, respondedOf(10, "10.0.0.1", "www.example.com"));
+
+  // Every key shares the only bucket, and takes it over with the credit left in it
+  EXPECT_EQ(0, respondedOf(10, "10.0.1.1", "www.example.com"));
+  EXPECT_EQ(0, respondedOf(10, "10.0.0.1", "www.example.com"));
+
+  // Up to half a burst
+  now_ += std::chrono::seconds(10);
+  EXPECT_EQ(2, respondedOf(10, "10.0.1.1", "www.example.com"));
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
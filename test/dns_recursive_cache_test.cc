@@ -0,0 +1,127 @@
+#include <arpa/nameser.h>
+#include <arpa/nameser_compat.h>
+
+#include "src/dns_recursive_cache.h"
+
+#include "common/network/address_impl.h"
+
+#include "test/test_common/simulated_time_system.h"
+
+#include "gtest/gtest.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+class RecursiveCacheTest : public ::testing::Test {
+public:
+  static RecursiveResult result(std::chrono::seconds ttl) {
+    return {NOERROR, {std::make_shared<Network::Address::Ipv4Instance>("10.0.0.1", 0)}, ttl};
+  }
+
+  Event::SimulatedTimeSystem time_system_;
+  std::chrono::seconds remaining_ttl_;
+};
+
+TEST_F(RecursiveCacheTest, lookupDecrementsTtlUntilExpiry) {
+  RecursiveCache cache(time_system_, std::chrono::seconds(0), std::chrono::seconds(3600), 10);
+  cache.insert("www.example.com", T_A, result(std::chrono::seconds(30)));
+
+  const RecursiveResult* cached = cache.lookup("www.example.com", T_A, remaining_ttl_);
+  ASSERT_NE(cached, nullptr);
+  EXPECT_EQ(1, cached->addresses_.size());
+  EXPECT_EQ(30, remaining_ttl_.count());
+
+  time_system_.sleep(std::chrono::seconds(29));
+  ASSERT_NE(cache.lookup("www.example.com", T_A, remaining_ttl_), nullptr);
+  EXPECT_EQ(1, remaining_ttl_.count());
+
+  time_system_.sleep(std::chrono::milliseconds(500));
+  EXPECT_EQ(cache.lookup("www.example.com", T_A, remaining_ttl_), nullptr);
+  EXPECT_EQ(0, cache.size());
+}
+
+TEST_F(RecursiveCacheTest, keyedOnLowerCaseNameAndType) {
+  RecursiveCache cache(time_system_, std::chrono::seconds(0), std::chrono::seconds(3600), 10);
+  cache.insert("WWW.Example.com", T_A, result(std::chrono::seconds(30)));
+
+  EXPECT_NE(cache.lookup("www.example.COM", T_A, remaining_ttl_), nullptr);
+  EXPECT_EQ(cache.lookup("www.example.com", T_AAAA, remaining_ttl_), nullptr);
+}
+
+TEST_F(RecursiveCacheTest, ttlClamped) {
+  RecursiveCache cache(time_system_, std::chrono::seconds(60), std::chrono::seconds(120), 10);
+  cache.insert("a.example.com", T_A, result(std::chrono::seconds(0)));
+  cache.insert("b.example.com", T_A, result(std::chrono::seconds(86400)));
+
+  ASSERT_NE(cache.lookup("a.example.com", T_A, remaining_ttl_), nullptr);
+  EXPECT_EQ(60, remaining_ttl_.count());
+  ASSERT_NE(cache.lookup("b.example.com", T_A, remaining_ttl_), nullptr);
+  EXPECT_EQ(120, remaining_ttl_.count());
+}
+
+TEST_F(RecursiveCacheTest, negativeResultCached) {
+  RecursiveCache cache(time_system_, std::chrono::seconds(0), std::chrono::seconds(3600), 10);
+  cache.insert("nx.example.com", T_A, {NXDOMAIN, {}, std::chrono::seconds(30)});
+
+  const RecursiveResult* cached = cache.lookup("nx.example.com", T_A, remaining_ttl_);
+  ASSERT_NE(cached, nullptr);
+  EXPECT_EQ(NXDOMAIN, cached->response_code_);
+}
+
+TEST_F(RecursiveCacheTest, resultWithoutTtlNotCached) {
+  RecursiveCache cache(time_system_, std::chrono::seconds(60), std::chrono::seconds(3600), 10);
+  cache.insert("www.example.com", T_A, {SERVFAIL, {}, absl::nullopt});
+  cache.insert("www.example.com", T_AAAA, {NOERROR, {}, absl::nullopt});
+
+  EXPECT_EQ(0, cache.size());
+}
+
+TEST_F(RecursiveCacheTest, expiredEntriesEvictedFirst) {
+  RecursiveCache cache(time_system_, std::chrono::seconds(0), std::chrono::seconds(3600), 2);
+  cache.insert("a.example.com", T_A, result(std::chrono::seconds(10)));
+  cache.insert("b.example.com", T_A, result(std::chrono::seconds(60)));
+
+  time_system_.sleep(std::chrono::seconds(20));
+  cache.insert("c.example.com", T_A, result(std::chrono::seconds(60)));
+
+  EXPECT_EQ(2, cache.size());
+  EXPECT_NE(cache.lookup("b.example.com", T_A, remaining_ttl_), nullptr);
+  EXPECT_NE(cache.lookup("c.example.com", T_A, remaining_ttl_), nullptr);
+
+  // All entries are live, the one that expires first makes room for the new one
+  cache.insert("d.example.com", T_A, result(std::chrono::seconds(60)));
+  EXPECT_EQ(2, cache.size());
+  EXPECT_EQ(cache.lookup("b.example.com", T_A, remaining_ttl_), nullptr);
+  EXPECT_NE(cache.lookup("c.example.com", T_A, remaining_ttl_), nullptr);
+  EXPECT_NE(cache.lookup("d.example.com", T_A, remaining_ttl_), nullptr);
+}
+
+TEST_F(RecursiveCacheTest, reinsertedEntryMovesItsExpiry) {
+  RecursiveCache cache(time_system_, std::chrono::seconds(0), std::chrono::seconds(3600), 2);
+  cache.insert("a.example.com", T_A, result(std::chrono::seconds(10)));
+  cache.insert("b.example.com", T_AAAA, result(std::chrono::seconds(30)));
+
+  // Replacing an entry does not take room of its own
+  cache.insert("A.example.com", T_A, result(std::chrono::seconds(60)));
+  EXPECT_EQ(2, cache.size());
+
+  cache.insert("c.example.com", T_A, result(std::chrono::seconds(60)));
+  EXPECT_EQ(2, cache.size());
+  EXPECT_EQ(cache.lookup("b.example.com", T_AAAA, remaining_ttl_), nullptr);
+  ASSERT_NE(cache.lookup("a.example.com", T_A, remaining_ttl_), nullptr);
+  EXPECT_EQ(60, remaining_ttl_.count());
+}
+
+TEST_F(RecursiveCacheTest, disabled) {
+  RecursiveCache cache(time_system_, std::chrono::seconds(0), std::chrono::seconds(3600), 0);
+  cache.insert("www.example.com", T_A, result(std::chrono::seconds(30)));
+
+  EXPECT_EQ(0, cache.size());
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,147 @@
+#include <arpa/nameser.h>
+#include <arpa/nameser_compat.h>
+
+#include "src/dns_recursive_resolver_impl.h"
+#include "src/dns_response_writer.h"
+
+#include "common/network/utility.h"
+
+#include "test/mocks/event/mocks.h"
+
+#include "gtest/gtest.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+class RecursiveResolverImplTest : public ::testing::Test {
+public:
+  RecursiveResolverImplTest() : writer_(512) {}
+
+  // Writes the header and the question for www.example.com
+  void writeQuery(uint16_t rcode, uint16_t q_type, uint16_t an_count, uint16_t ns_count) {
+    writer_.write16(0x1234);
+    writer_.write16(0x8180 | rcode);
+    writer_.write16(1);
+    writer_.write16(an_count);
+    writer_.write16(ns_count);
+    writer_.write16(0);
+    writer_.writeName("www.example.com");
+    writer_.write16(q_type);
+    writer_.write16(C_IN);
+  }
+
+  void writeA(uint32_t ttl, const std::string& address) {
+    writer_.writeName("www.example.com");
+    writer_.write16(T_A);
+    writer_.write16(C_IN);
+    writer_.write32(ttl);
+    writer_.write16(4);
+    writer_.writeBytes(address.data(), 4);
+  }
+
+  void writeSoa(uint32_t ttl, uint32_t minimum) {
+    writer_.writeName("example.com");
+    writer_.write16(T_SOA);
+    writer_.write16(C_IN);
+    writer_.write32(ttl);
+    const size_t rdlength_offset = writer_.size();
+    writer_.write16(0);
+    writer_.writeName("ns.example.com");
+    writer_.writeName("admin.example.com");
+    for (uint32_t value : {1, 7200, 3600, 1209600}) {
+      writer_.write32(value);
+    }
+    writer_.write32(minimum);
+    writer_.patch16(rdlength_offset, writer_.size() - rdlength_offset - 2);
+  }
+
+  RecursiveResult parse(int status, uint16_t q_type = T_A) {
+    return RecursiveResolverImpl::parseResponse(
+        q_type, status, reinterpret_cast<const unsigned char*>(writer_.data().data()),
+        writer_.size());
+  }
+
+  ResponseWriter writer_;
+};
+
+TEST_F(RecursiveResolverImplTest, answersWithSmallestTtl) {
+  writeQuery(NOERROR, T_A, 2, 0);
+  writeA(300, std::string("\x0a\x00\x00\x01", 4));
+  writeA(60, std::string("\x0a\x00\x00\x02", 4));
+
+  const RecursiveResult result = parse(ARES_SUCCESS);
+  EXPECT_EQ(NOERROR, result.response_code_);
+  ASSERT_EQ(2, result.addresses_.size());
+  EXPECT_EQ("10.0.0.1", result.addresses_.front()->ip()->addressAsString());
+  EXPECT_EQ("10.0.0.2", result.addresses_.back()->ip()->addressAsString());
+  ASSERT_TRUE(result.ttl_.has_value());
+  EXPECT_EQ(60, result.ttl_->count());
+}
+
+TEST_F(RecursiveResolverImplTest, nxdomainWithNegativeTtl) {
+  writeQuery(NXDOMAIN, T_A, 0, 1);
+  writeSoa(3600, 300);
+
+  const RecursiveResult result = parse(ARES_ENOTFOUND);
+  EXPECT_EQ(NXDOMAIN, result.response_code_);
+  EXPECT_TRUE(result.addresses_.empty());
+  ASSERT_TRUE(result.ttl_.has_value());
+  EXPECT_EQ(300, result.ttl_->count());
+}
+
+TEST_F(RecursiveResolverImplTest, nodataWithNegativeTtl) {
+  // The TTL of the SOA record is smaller than its MINIMUM field
+  writeQuery(NOERROR, T_AAAA, 0, 1);
+  writeSoa(30, 300);
+
+  const RecursiveResult result = parse(ARES_ENODATA, T_AAAA);
+  EXPECT_EQ(NOERROR, result.response_code_);
+  EXPECT_TRUE(result.addresses_.empty());
+  ASSERT_TRUE(result.ttl_.has_value());
+  EXPECT_EQ(30, result.ttl_->count());
+}
+
+TEST_F(RecursiveResolverImplTest, negativeWithoutSoaNotCached) {
+  writeQuery(NXDOMAIN, T_A, 0, 0);
+
+  const RecursiveResult result = parse(ARES_ENOTFOUND);
+  EXPECT_EQ(NXDOMAIN, result.response_code_);
+  EXPECT_FALSE(result.ttl_.has_value());
+}
+
+TEST_F(RecursiveResolverImplTest, failureNotCached) {
+  const RecursiveResult result =
+      RecursiveResolverImpl::parseResponse(T_A, ARES_ETIMEOUT, nullptr, 0);
+  EXPECT_EQ(SERVFAIL, result.response_code_);
+  EXPECT_FALSE(result.ttl_.has_value());
+}
+
+TEST_F(RecursiveResolverImplTest, truncatedAuthorityIgnored) {
+  writeQuery(NXDOMAIN, T_A, 0, 1);
+  writeSoa(3600, 300);
+
+  const RecursiveResult result = RecursiveResolverImpl::parseResponse(
+      T_A, ARES_ENOTFOUND, reinterpret_cast<const unsigned char*>(writer_.data().data()),
+      writer_.size() - 10);
+  EXPECT_FALSE(result.ttl_.has_value());
+}
+
+TEST(RecursiveResolverImplLimitTest, queriesBeyondInFlightLimitFailInline) {
+  testing::NiceMock<Event::MockDispatcher> dispatcher;
+  RecursiveResolverImpl resolver(
+      dispatcher, {Network::Utility::parseInternetAddressAndPort("127.0.0.1:53")}, 0);
+
+  absl::optional<RecursiveResult> result;
+  EXPECT_EQ(nullptr, resolver.resolve("www.example.com", T_A,
+                                      [&result](RecursiveResult&& r) { result = std::move(r); }));
+  ASSERT_TRUE(result.has_value());
+  EXPECT_EQ(SERVFAIL, result->response_code_);
+  EXPECT_FALSE(result->ttl_.has_value());
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
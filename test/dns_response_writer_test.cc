@@ -0,0 +1,100 @@
+#include "src/dns_response_writer.h"
+
+#include "common/buffer/buffer_impl.h"
+
+#include "gtest/gtest.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+TEST(ResponseWriterTest, writeIntegersInNetworkOrder) {
+  ResponseWriter writer(8);
+  writer.write16(0x1234);
+  writer.write32(0x56789abc);
+  writer.patch16(0, 0xdef0);
+
+  EXPECT_EQ(std::string("\xde\xf0\x56\x78\x9a\xbc", 6), std::string(writer.data()));
+}
+
+TEST(ResponseWriterTest, writeNameAsLabels) {
+  ResponseWriter writer(32);
+  writer.writeName("www.example.com");
+
+  EXPECT_EQ(std::string("\x03www\x07\x65xample\x03\x63om\x00", 17), std::string(writer.data()));
+}
+
+TEST(ResponseWriterTest, writeFullyQualifiedName) {
+  ResponseWriter writer(32);
+  writer.writeName("example.com.");
+
+  EXPECT_EQ(std::string("\x07\x65xample\x03\x63om\x00", 13), std::string(writer.data()));
+}
+
+TEST(ResponseWriterTest, writeRepeatedNameAsPointer) {
+  ResponseWriter writer(64);
+  writer.writeBytes("0123456789ab", 12);
+  writer.writeName("www.example.com");
+  writer.writeName("www.example.com");
+
+  EXPECT_EQ(12 + 17 + 2, writer.size());
+  EXPECT_EQ(std::string("\xc0\x0c", 2), std::string(writer.data().substr(29)));
+}
+
+TEST(ResponseWriterTest, writeSharedSuffixAsPointer) {
+  ResponseWriter writer(64);
+  writer.writeName("www.example.com");
+  writer.writeName("api.example.com");
+
+  // The second name is its first label followed by a pointer to "example.com" at offset 4
+  EXPECT_EQ(std::string("\x03\x61pi\xc0\x04", 6), std::string(writer.data().substr(17)));
+}
+
+TEST(ResponseWriterTest, uncompressedNameCanBePointedAt) {
+  ResponseWriter writer(64);
+  writer.writeName("example.com");
+  writer.writeName("example.com", false);
+  writer.writeName("example.com");
+
+  EXPECT_EQ(13 + 13 + 2, writer.size());
+  EXPECT_EQ(std::string("\xc0\x00", 2), std::string(writer.data().substr(26)));
+}
+
+TEST(ResponseWriterTest, writeEscapedLabels) {
+  ResponseWriter writer(32);
+  writer.writeName("a\\.\\001.com");
+
+  EXPECT_EQ(std::string("\x03\x61.\x01\x03\x63om\x00", 9), std::string(writer.data()));
+}
+
+TEST(ResponseWriterTest, rejectLongLabel) {
+  ResponseWriter writer(128);
+  EXPECT_THROW(writer.writeName(std::string(64, 'a') + ".com"), EnvoyException);
+}
+
+TEST(ResponseWriterTest, truncateForgetsLaterNames) {
+  ResponseWriter writer(64);
+  writer.writeName("example.com");
+  writer.writeName("www.example.com");
+  writer.truncate(13);
+  writer.writeName("www.example.com");
+
+  // "www" is written again in full, and still points at the name kept before the truncation
+  EXPECT_EQ(13 + 6, writer.size());
+  EXPECT_EQ(std::string("\x03www\xc0\x00", 6), std::string(writer.data().substr(13)));
+}
+
+TEST(ResponseWriterTest, addToBuffer) {
+  ResponseWriter writer(32);
+  writer.writeName("a.com");
+
+  Buffer::OwnedImpl buffer;
+  writer.addTo(buffer);
+  EXPECT_EQ(std::string("\x01\x61\x03\x63om\x00", 7), buffer.toString());
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -2,14 +2,18 @@
 #include <arpa/nameser.h>
 #include <arpa/nameser_compat.h>
 
+#include "src/dns_codec_impl.h"
 #include "src/dns_server_impl.h"
 
 #include "common/network/address_impl.h"
+#include "common/network/utility.h"
+#include "common/stats/isolated_store_impl.h"
 
 #include "test/mocks/event/mocks.h"
 #include "test/mocks/upstream/mocks.h"
 #include "test/mocks/upstream/host.h"
 #include "test/mocks/network/mocks.h"
+#include "test/test_common/simulated_time_system.h"
 
 #include "test/mocks.h"
 
@@ -17,12 +21,16 @@
 #include "gtest/gtest.h"
 
 using testing::_;
+using testing::DoAll;
+using testing::ElementsAre;
 using testing::InSequence;
 using testing::Invoke;
 using testing::InvokeWithoutArgs;
 using testing::Return;
 using testing::ReturnRef;
 using testing::ReturnRefOfCopy;
+using testing::SaveArg;
+using testing::UnorderedElementsAre;
 
 namespace Envoy {
 namespace Extensions {
@@ -31,6 +39,9 @@ namespace Dns {
 
 class ServerImplTest : public ::testing::Test {
 public:
+  // The server holds callbacks registered on the mocked cluster manager
+  void TearDown() override { server_.reset(); }
+
   bool isDnsMessageSupported() const {
     bool question_type_supported =
         question_type_ == T_A || question_type_ == T_AAAA || question_type_ == T_SRV;
@@ -39,52 +50,237 @@ public:
 
     bool header_opcode_supported = opCode_ == 0;
 
-    bool header_qcount_supported = question_count_ <= 1;
-
-    return question_type_supported && question_class_supported && header_opcode_supported &&
-           header_qcount_supported;
+    return question_type_supported && question_class_supported && header_opcode_supported;
   }
 
   void setup(const std::string qName) {
-    dns_resolver_ = std::make_shared<Network::MockDnsResolver>();
+    recursive_resolver_ = new MockRecursiveResolver();
     Network::Address::InstanceConstSharedPtr from =
         std::make_shared<Network::Address::Ipv4Instance>("1.1.1.0", 0);
-    EXPECT_CALL(dispatcher_, createDnsResolver(_)).WillOnce(Return(dns_resolver_));
 
-    dns_request_ = std::make_shared<NiceMock<Formats::MockMessage>>(from);
+    dns_request_ = createRequest(from, qName);
     dns_response_ = std::make_shared<NiceMock<Formats::MockMessage>>(from);
 
-    EXPECT_CALL(dns_request_->header_, qrCode())
+    callback_ = [this](const Formats::Message&, Buffer::Instance& response) {
+      responses_.push_back(response.toString());
+    };
+
+    ForwarderPtr forwarder;
+    if (forwarding_) {
+      forwarder_ = new MockForwarder();
+      forwarder.reset(forwarder_);
+    }
+
+    timer_ = new NiceMock<Event::MockTimer>(&dispatcher_);
+    server_ = std::make_unique<DnsServerImpl>(
+        callback_, config_, known_names_, RecursiveResolverPtr{recursive_resolver_},
+        std::move(forwarder), dispatcher_, cluster_manager_, *scope_);
+  }
+
+  std::shared_ptr<NiceMock<Formats::MockMessage>>
+  createRequest(Network::Address::InstanceConstSharedPtr from, const std::string& qName) {
+    auto dns_request = std::make_shared<NiceMock<Formats::MockMessage>>(from);
+
+    EXPECT_CALL(dns_request->header_, qrCode())
         .WillRepeatedly(Return(Formats::MessageType::Query));
-    EXPECT_CALL(dns_request_->header_, opCode()).WillRepeatedly(Return(opCode_));
-    EXPECT_CALL(dns_request_->header_, qdCount()).WillRepeatedly(Return(question_count_));
-    EXPECT_CALL(dns_request_->question_, qName()).WillRepeatedly(ReturnRefOfCopy(qName));
-    EXPECT_CALL(dns_request_->question_, qType()).WillRepeatedly(Return(question_type_));
-    EXPECT_CALL(dns_request_->question_, qClass()).WillRepeatedly(Return(question_class_));
+    EXPECT_CALL(dns_request->header_, opCode()).WillRepeatedly(Return(opCode_));
+    EXPECT_CALL(dns_request->header_, qdCount()).WillRepeatedly(Return(question_count_));
+    EXPECT_CALL(dns_request->question_, qName()).WillRepeatedly(ReturnRefOfCopy(qName));
+    EXPECT_CALL(dns_request->question_, qType()).WillRepeatedly(Return(question_type_));
+    EXPECT_CALL(dns_request->question_, qClass()).WillRepeatedly(Return(question_class_));
+
+    return dns_request;
+  }
+
+  // Decodes a query with a question for each of the (name, type) pairs, and an OPT record if
+  // udp_payload_size is set
+  const Formats::Message&
+  decodeQuery(const std::vector<std::pair<std::string, uint16_t>>& questions,
+              absl::optional<uint16_t> udp_payload_size = absl::nullopt,
+              uint8_t edns_version = 0) {
+    std::string packet("\x12\x34", 2);
+    packet.append(query_flags_);
+    packet.push_back('\0');
+    packet.push_back(static_cast<char>(questions.size()));
+    packet.append(5, '\0');
+    packet.push_back(udp_payload_size.has_value() ? 1 : 0);
+
+    for (const auto& question : questions) {
+      size_t label_start = 0;
+      while (label_start <= question.first.size()) {
+        size_t label_end = question.first.find('.', label_start);
+        label_end = label_end == std::string::npos ? question.first.size() : label_end;
+        packet.push_back(static_cast<char>(label_end - label_start));
+        packet.append(question.first, label_start, label_end - label_start);
+        label_start = label_end + 1;
+      }
+
+      packet.append({'\0', '\0', static_cast<char>(question.second), '\0', '\1'});
+    }
+
+    if (udp_payload_size.has_value()) {
+      packet.append({'\0', '\0', static_cast<char>(T_OPT),
+                     static_cast<char>(*udp_payload_size >> 8),
+                     static_cast<char>(*udp_payload_size & 0xFF), '\0',
+                     static_cast<char>(edns_version), '\0', '\0', '\0', '\0'});
+    }
+
+    // The decoded message refers to the bytes of the query until the next one is decoded
+    query_buffer_.drain(query_buffer_.length());
+    query_buffer_.add(packet);
+    EXPECT_EQ(Formats::DecodeStatus::Ok, decoder_.decode(query_buffer_, dns_request_->from_));
+    return decoder_.message();
+  }
+
+  // Header fields of the response at index
+  uint16_t responseCode(size_t index) const { return responses_[index][3] & 0xF; }
+  bool responseAuthoritative(size_t index) const { return responses_[index][2] & 0x4; }
+  bool responseTruncated(size_t index) const { return responses_[index][2] & 0x2; }
+  uint16_t responseAnswerCount(size_t index) const {
+    return (static_cast<uint8_t>(responses_[index][6]) << 8) |
+           static_cast<uint8_t>(responses_[index][7]);
+  }
+  uint16_t responseAdditionalCount(size_t index) const {
+    return (static_cast<uint8_t>(responses_[index][10]) << 8) |
+           static_cast<uint8_t>(responses_[index][11]);
+  }
+
+  // Adds a priority to the cluster with hosts of the addresses. The first healthy of them are
+  // healthy.
+  void addHostSet(const std::vector<std::string>& addresses, size_t healthy) {
+    auto host_set = std::make_unique<NiceMock<Upstream::MockHostSet>>();
+    for (const std::string& address : addresses) {
+      auto host = std::make_shared<NiceMock<Upstream::MockHost>>();
+      ON_CALL(*host, address())
+          .WillByDefault(Return(Network::Utility::parseInternetAddress(address, 80)));
+
+      host_set->hosts_.push_back(host);
+      if (host_set->healthy_hosts_.size() < healthy) {
+        host_set->healthy_hosts_.push_back(host);
+      }
+    }
+
+    cluster_manager_.thread_local_cluster_.cluster_.priority_set_.host_sets_.push_back(
+        std::move(host_set));
+  }
+
+  // Adds a priority to the cluster with a healthy host for each of the "address:port" endpoints
+  // and their weights, followed by unhealthy hosts
+  void addEndpoints(uint32_t priority,
+                    const std::vector<std::pair<std::string, uint32_t>>& endpoints,
+                    size_t unhealthy = 0) {
+    auto host_set = std::make_unique<NiceMock<Upstream::MockHostSet>>(priority);
+    for (const auto& endpoint : endpoints) {
+      auto host = std::make_shared<NiceMock<Upstream::MockHost>>();
+      ON_CALL(*host, address())
+          .WillByDefault(Return(Network::Utility::parseInternetAddressAndPort(endpoint.first)));
+      ON_CALL(*host, weight()).WillByDefault(Return(endpoint.second));
+      host_set->hosts_.push_back(host);
+      host_set->healthy_hosts_.push_back(host);
+    }
+
+    for (size_t i = 0; i < unhealthy; i++) {
+      auto host = std::make_shared<NiceMock<Upstream::MockHost>>();
+      ON_CALL(*host, address())
+          .WillByDefault(Return(Network::Utility::parseInternetAddress("10.255.0.1")));
+      host_set->hosts_.push_back(host);
+    }
+
+    cluster_manager_.thread_local_cluster_.cluster_.priority_set_.host_sets_.push_back(
+        std::move(host_set));
+  }
 
-    callback_ = [](const Formats::ResponseMessageSharedPtr&, Buffer::Instance&) {};
+  // Sends queries for the q_type records of www.known.com, which belongs to cluster0. The name is
+  // not matched for queries answered from the answer cache.
+  void resolveKnownQueries(int queries, uint16_t q_type = T_A) {
+    static const std::string cluster_name = "cluster0";
+    EXPECT_CALL(*known_names_, matchDomainName("www.known.com"))
+        .WillRepeatedly(Return(DomainNameMatch{true, &cluster_name}));
+    EXPECT_CALL(config_, ttl()).WillRepeatedly(Return(std::chrono::seconds(5)));
+    EXPECT_CALL(*recursive_resolver_, resolve(_, _, _)).Times(0);
 
-    server_ = std::make_unique<DnsServerImpl>(callback_, config_, dispatcher_, cluster_manager_);
+    for (int i = 0; i < queries; i++) {
+      server_->resolve(decodeQuery({{"www.known.com", q_type}}));
+    }
+  }
+
+  // The addresses of the A and AAAA records of the response at index to a question for name
+  std::vector<std::string> answerAddresses(size_t index,
+                                           const std::string& name = "www.known.com") const {
+    // The answers follow the question, each with a compressed name
+    const unsigned char* answer = reinterpret_cast<const unsigned char*>(responses_[index].data()) +
+                                  HFIXEDSZ + name.size() + 2 + QFIXEDSZ;
+
+    std::vector<std::string> addresses;
+    for (uint16_t i = 0; i < responseAnswerCount(index); i++) {
+      // RDLENGTH is the last field before the RDATA
+      const uint16_t rd_length = (answer[2 + RRFIXEDSZ - 2] << 8) | answer[2 + RRFIXEDSZ - 1];
+      char address[INET6_ADDRSTRLEN];
+      inet_ntop(rd_length == sizeof(in_addr) ? AF_INET : AF_INET6, answer + 2 + RRFIXEDSZ, address,
+                sizeof(address));
+      addresses.push_back(address);
+      answer += 2 + RRFIXEDSZ + rd_length;
+    }
+
+    return addresses;
+  }
+
+  // The SRV records of the response at index to a question for name, as
+  // "priority weight port target"
+  std::vector<std::string> srvRecords(size_t index,
+                                      const std::string& name = "www.known.com") const {
+    const unsigned char* answer = reinterpret_cast<const unsigned char*>(responses_[index].data()) +
+                                  HFIXEDSZ + name.size() + 2 + QFIXEDSZ;
+
+    std::vector<std::string> records;
+    for (uint16_t i = 0; i < responseAnswerCount(index); i++) {
+      const uint16_t rd_length = (answer[2 + RRFIXEDSZ - 2] << 8) | answer[2 + RRFIXEDSZ - 1];
+      const unsigned char* rdata = answer + 2 + RRFIXEDSZ;
+
+      // The target is not compressed
+      std::string target;
+      for (const unsigned char* label = rdata + 6; *label != 0; label += *label + 1) {
+        target.append(target.empty() ? "" : ".");
+        target.append(reinterpret_cast<const char*>(label) + 1, *label);
+      }
+
+      records.push_back(fmt::format("{} {} {} {}", (rdata[0] << 8) | rdata[1],
+                                    (rdata[2] << 8) | rdata[3], (rdata[4] << 8) | rdata[5],
+                                    target));
+      answer += 2 + RRFIXEDSZ + rd_length;
+    }
+
+    return records;
+  }
+
+  uint64_t counter(const std::string& name) {
+    return store_.counter("dns_filter." + name).value();
+  }
+
+  uint64_t gauge(const std::string& name) {
+    return store_.gauge("dns_filter." + name, Stats::Gauge::ImportMode::Accumulate).value();
   }
 
-  void addExpectCallsForClusterManagerResult() {
+  // The cluster is looked up once and kept until it is updated or removed. Its hosts are collected
+  // again every time the answer cache dropped them.
+  void addExpectCallsForClusterManagerResult(int host_lookups = 1) {
     EXPECT_CALL(cluster_manager_, get(_)).Times(1);
     EXPECT_CALL(cluster_manager_.thread_local_cluster_, prioritySet()).Times(1);
 
-    Upstream::MockHostSet* host_set = new Upstream::MockHostSet();
+    Upstream::MockHostSet* host_set = new NiceMock<Upstream::MockHostSet>();
     std::shared_ptr<Upstream::MockHost> host = std::make_shared<Upstream::MockHost>();
 
     host_set->hosts_.push_back(host);
-    EXPECT_CALL(*host_set, hosts()).Times(1);
+    host_set->healthy_hosts_.push_back(host);
 
-    Network::Address::InstanceConstSharedPtr address;
     if (question_type_ == T_A || question_type_ == T_SRV) {
-      address = std::make_shared<Network::Address::Ipv4Instance>("1.1.1.1", 1);
+      host_address_ = std::make_shared<Network::Address::Ipv4Instance>("1.1.1.1", 1);
     } else if (question_type_ == T_AAAA) {
-      address = std::make_shared<Network::Address::Ipv6Instance>("::1", 0);
+      host_address_ = std::make_shared<Network::Address::Ipv6Instance>("::1", 0);
     }
 
-    EXPECT_CALL(*host, address()).WillOnce(Return(address));
+    EXPECT_CALL(*host, address()).Times(host_lookups).WillRepeatedly(Return(host_address_));
+    EXPECT_CALL(*host, weight()).Times(host_lookups).WillRepeatedly(Return(1));
 
     Upstream::HostSetPtr host_set_ptr(host_set);
     cluster_manager_.thread_local_cluster_.cluster_.priority_set_.host_sets_.push_back(
@@ -95,12 +291,12 @@ public:
     setup("www.known.com");
     bool dns_query_supported = isDnsMessageSupported();
 
-    EXPECT_CALL(*dns_resolver_, resolve(_, _, _)).Times(0);
-    std::unordered_map<std::string, std::string> dns_map = {{"www.known.com", "cluster0"}};
+    EXPECT_CALL(*recursive_resolver_, resolve(_, _, _)).Times(0);
+    const std::string cluster_name = "cluster0";
 
     if (dns_query_supported) {
-      EXPECT_CALL(config_, belongsToKnownDomainName(_)).WillOnce(Return(true));
-      EXPECT_CALL(config_, dnsMap()).WillRepeatedly((ReturnRef(dns_map)));
+      EXPECT_CALL(*known_names_, matchDomainName(_))
+          .WillOnce(Return(DomainNameMatch{true, &cluster_name}));
       addExpectCallsForClusterManagerResult();
     }
 
@@ -122,34 +318,36 @@ public:
       switch (question_type_) {
       case T_A:
         EXPECT_CALL(config_, ttl()).WillRepeatedly(Return(result_ttl_));
-        EXPECT_CALL(*dns_response_, addARecord(_, _, _))
-            .WillOnce(Invoke([&](Formats::ResourceRecordSection section, uint32_t ttl,
-                                 const Network::Address::Ipv4* address) -> void {
+        EXPECT_CALL(*dns_response_, addARecord(_, _, _, _))
+            .WillOnce(Invoke([&](Formats::ResourceRecordSection section, const std::string&,
+                                 uint32_t ttl, uint32_t address) -> void {
               EXPECT_EQ(static_cast<uint32_t>(result_ttl_.count()), ttl);
               EXPECT_EQ(section, Formats::ResourceRecordSection::Answer);
-              EXPECT_EQ(address != nullptr, true);
+              EXPECT_EQ(host_address_->ip()->ipv4()->address(), address);
             }));
         break;
       case T_AAAA:
         EXPECT_CALL(config_, ttl()).WillRepeatedly(Return(result_ttl_));
-        EXPECT_CALL(*dns_response_, addAAAARecord(_, _, _))
-            .WillOnce(Invoke([&](Formats::ResourceRecordSection section, uint32_t ttl,
-                                 const Network::Address::Ipv6* address) -> void {
+        EXPECT_CALL(*dns_response_, addAAAARecord(_, _, _, _))
+            .WillOnce(Invoke([&](Formats::ResourceRecordSection section, const std::string&,
+                                 uint32_t ttl, absl::uint128 address) -> void {
               EXPECT_EQ(static_cast<uint32_t>(result_ttl_.count()), ttl);
               EXPECT_EQ(section, Formats::ResourceRecordSection::Answer);
-              EXPECT_EQ(address != nullptr, true);
+              EXPECT_EQ(host_address_->ip()->ipv6()->address(), address);
             }));
         break;
       case T_SRV:
         EXPECT_CALL(config_, ttl()).WillRepeatedly(Return(result_ttl_));
-        EXPECT_CALL(*dns_response_, addARecord(_, _, _))
-            .WillOnce(Invoke([&](Formats::ResourceRecordSection section, uint32_t ttl,
-                                 const Network::Address::Ipv4* address) -> void {
+        EXPECT_CALL(*dns_response_, addARecord(_, _, _, _))
+            .WillOnce(Invoke([&](Formats::ResourceRecordSection section, const std::string&,
+                                 uint32_t ttl, uint32_t address) -> void {
               EXPECT_EQ(static_cast<uint32_t>(result_ttl_.count()), ttl);
               EXPECT_EQ(section, Formats::ResourceRecordSection::Additional);
-              EXPECT_EQ(address != nullptr, true);
+              EXPECT_EQ(host_address_->ip()->ipv4()->address(), address);
             }));
-        EXPECT_CALL(*dns_response_, addSRVRecord(_, _, _)).Times(1);
+        EXPECT_CALL(*dns_response_,
+                    addSRVRecord("www.known.com", _, 0, 1, 1, "1-1-1-1.www.known.com"))
+            .Times(1);
         break;
       default:
         GTEST_FATAL_FAILURE_("Unexpected qType in TestKnownDNSQuerySuccess");
@@ -158,19 +356,87 @@ public:
 
     EXPECT_CALL(*dns_response_, encode(_)).Times(1);
 
-    server_->resolve(dns_request_);
+    server_->resolve(*dns_request_);
   }
 
-  // Empty result_list simulates failure to resolve
-  void testUnKnownDomainDNSQuery(std::list<Network::Address::InstanceConstSharedPtr> result_list) {
+  // What happens between the two queries of testKnownDomainAnswerCache
+  enum class BetweenQueries { Nothing, MembershipUpdate, EntryChanged, OtherEntryChanged };
+
+  // Resolves the same known A question twice. The second query is answered from the answer cache
+  // unless the membership of the cluster or the entry for the name changes in between.
+  void testKnownDomainAnswerCache(BetweenQueries between_queries) {
+    setup("www.known.com");
+    const bool invalidated = between_queries == BetweenQueries::MembershipUpdate ||
+                             between_queries == BetweenQueries::EntryChanged;
+    const int lookups = invalidated ? 2 : 1;
+
+    const std::string cluster_name = "cluster0";
+    EXPECT_CALL(*known_names_, matchDomainName(_))
+        .Times(lookups)
+        .WillRepeatedly(Return(DomainNameMatch{true, &cluster_name}));
+    EXPECT_CALL(config_, ttl()).WillRepeatedly(Return(result_ttl_));
+    addExpectCallsForClusterManagerResult(between_queries == BetweenQueries::MembershipUpdate ? 2
+                                                                                             : 1);
+
+    EXPECT_CALL(*dns_request_, createResponseMessage(_))
+        .Times(lookups)
+        .WillRepeatedly(Return(dns_response_));
+    EXPECT_CALL(*dns_response_, addARecord(_, _, _, _)).Times(lookups);
+    EXPECT_CALL(*dns_response_, encode(_))
+        .Times(lookups)
+        .WillRepeatedly(Invoke([](Buffer::Instance& response) -> void {
+          // A zeroed header followed by the question and answer bytes
+          response.add(std::string(HFIXEDSZ, '\0'));
+          response.add("question-and-answers");
+        }));
+
+    EXPECT_CALL(dns_request_->header_, id()).WillRepeatedly(Return(0xABCD));
+    EXPECT_CALL(dns_request_->header_, rd()).WillRepeatedly(Return(true));
+
+    server_->resolve(*dns_request_);
+
+    switch (between_queries) {
+    case BetweenQueries::Nothing:
+      break;
+    case BetweenQueries::MembershipUpdate:
+      cluster_manager_.thread_local_cluster_.cluster_.priority_set_.runUpdateCallbacks(0, {}, {});
+      break;
+    case BetweenQueries::EntryChanged:
+      known_names_->update_cb_helper_.runCallbacks({"www.other.com", "www.known.com"});
+      break;
+    case BetweenQueries::OtherEntryChanged:
+      known_names_->update_cb_helper_.runCallbacks({"www.other.com"});
+      break;
+    }
+
+    server_->resolve(*dns_request_);
+
+    ASSERT_EQ(responses_.size(), 2);
+    EXPECT_EQ(responses_[0].size(), responses_[1].size());
+    EXPECT_EQ(responses_[0].substr(HFIXEDSZ), responses_[1].substr(HFIXEDSZ));
+
+    if (!invalidated) {
+      // The ID and RD bit of the cached response are taken from the query
+      EXPECT_EQ(0xAB, static_cast<uint8_t>(responses_[1][0]));
+      EXPECT_EQ(0xCD, static_cast<uint8_t>(responses_[1][1]));
+      EXPECT_EQ(1, responses_[1][2] & 0x1);
+    }
+  }
+
+  // Resolves www.unknown.com through the recursive resolver, which completes with result. The
+  // answers are expected to carry the TTL answer_ttl.
+  void testUnKnownDomainDNSQuery(const RecursiveResult& result, uint32_t answer_ttl = 0) {
     setup("www.unknown.com");
 
-    EXPECT_CALL(config_, belongsToKnownDomainName(_)).WillOnce(Return(false));
+    EXPECT_CALL(*known_names_, matchDomainName(_))
+        .WillOnce(Return(DomainNameMatch{false, nullptr}));
 
-    EXPECT_CALL(*dns_resolver_, resolve(_, _, _))
-        .WillOnce(Invoke([&](const std::string&, Network::DnsLookupFamily,
-                             Network::DnsResolver::ResolveCb callback) {
-          std::list<Network::Address::InstanceConstSharedPtr> copy = result_list;
+    // The request has to outlive the decoder while the query is pending
+    EXPECT_CALL(*dns_request_, clone()).WillOnce(Return(dns_request_));
+
+    EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_A, _))
+        .WillOnce(Invoke([&](const std::string&, uint16_t, RecursiveResolver::ResolveCb callback) {
+          RecursiveResult copy = result;
           callback(std::move(copy));
           return nullptr;
         }));
@@ -184,22 +450,60 @@ public:
           return this->dns_response_;
         }));
 
-    if (!result_list.empty()) {
-      EXPECT_CALL(config_, ttl()).WillOnce(Return(result_ttl_));
-      EXPECT_CALL(*dns_response_, addARecord(_, _, _))
-          .WillOnce(Invoke([&](Formats::ResourceRecordSection section, uint32_t ttl,
-                               const Network::Address::Ipv4* address) -> void {
-            EXPECT_EQ(static_cast<uint32_t>(result_ttl_.count()), ttl);
-            EXPECT_EQ(section, Formats::ResourceRecordSection::Answer);
-            EXPECT_EQ(address != nullptr, true);
-          }));
+    EXPECT_CALL(*dns_response_, addARecord(_, _, _, _))
+        .Times(result.addresses_.size())
+        .WillRepeatedly(Invoke([&](Formats::ResourceRecordSection section, const std::string&,
+                                   uint32_t ttl, uint32_t) -> void {
+          EXPECT_EQ(answer_ttl, ttl);
+          EXPECT_EQ(section, Formats::ResourceRecordSection::Answer);
+        }));
+
+    EXPECT_CALL(*dns_response_, addAAAARecord(_, _, _, _)).Times(0);
+    EXPECT_CALL(*dns_response_, addSRVRecord(_, _, _, _, _, _)).Times(0);
+    EXPECT_CALL(*dns_response_, encode(_)).Times(1);
+
+    server_->resolve(*dns_request_);
+  }
+
+  // Resolves www.unknown.com again after testUnKnownDomainDNSQuery, sleep seconds later. The
+  // result is expected from the recursive cache with the TTL answer_ttl, unless answer_ttl is 0.
+  void testUnKnownDomainDNSQueryAgain(const RecursiveResult& result, std::chrono::seconds sleep,
+                                      uint32_t answer_ttl) {
+    testing::Mock::VerifyAndClearExpectations(recursive_resolver_);
+    testing::Mock::VerifyAndClearExpectations(dns_request_.get());
+    testing::Mock::VerifyAndClearExpectations(dns_response_.get());
+    time_system_.sleep(sleep);
+
+    EXPECT_CALL(*known_names_, matchDomainName(_))
+        .WillOnce(Return(DomainNameMatch{false, nullptr}));
+
+    if (answer_ttl == 0) {
+      EXPECT_CALL(*dns_request_, clone()).WillOnce(Return(dns_request_));
+      EXPECT_CALL(*recursive_resolver_, resolve(_, _, _))
+          .WillOnce(
+              Invoke([&](const std::string&, uint16_t, RecursiveResolver::ResolveCb callback) {
+                RecursiveResult copy = result;
+                callback(std::move(copy));
+                return nullptr;
+              }));
+    } else {
+      EXPECT_CALL(*dns_request_, clone()).Times(0);
+      EXPECT_CALL(*recursive_resolver_, resolve(_, _, _)).Times(0);
     }
 
-    EXPECT_CALL(*dns_response_, addAAAARecord(_, _, _)).Times(0);
-    EXPECT_CALL(*dns_response_, addSRVRecord(_, _, _)).Times(0);
+    EXPECT_CALL(*dns_request_, createResponseMessage(_))
+        .WillOnce(Invoke([&](const Formats::Message::ResponseOptions& response_options)
+                             -> Formats::ResponseMessageSharedPtr {
+          EXPECT_EQ(response_options.response_code, response_code_);
+          return this->dns_response_;
+        }));
+
+    if (answer_ttl != 0) {
+      EXPECT_CALL(*dns_response_, addARecord(_, _, answer_ttl, _)).Times(result.addresses_.size());
+    }
     EXPECT_CALL(*dns_response_, encode(_)).Times(1);
 
-    server_->resolve(dns_request_);
+    server_->resolve(*dns_request_);
   }
 
   // Request
@@ -209,30 +513,307 @@ public:
   uint16_t question_class_ = C_IN;
   uint16_t question_type_ = T_A;
   uint16_t response_code_ = NOERROR;
+  // The third and fourth byte of the header of the queries of decodeQuery
+  std::string query_flags_{"\x01\x00", 2};
 
   // Response
   std::shared_ptr<NiceMock<Formats::MockMessage>> dns_response_;
   std::chrono::seconds result_ttl_;
+  // The address of the host of the cluster of www.known.com
+  Network::Address::InstanceConstSharedPtr host_address_;
 
   // Common vars needed by server
   std::unique_ptr<DnsServerImpl> server_;
   DnsServer::ResolveCallback callback_;
+  std::vector<std::string> responses_;
+  Buffer::OwnedImpl query_buffer_;
+  DecoderImpl decoder_;
+  Stats::IsolatedStoreImpl store_;
+  Stats::ScopePtr scope_{store_.createScope("dns_filter.")};
+  Event::SimulatedTimeSystem time_system_;
   Event::MockDispatcher dispatcher_;
   Upstream::MockClusterManager cluster_manager_;
-  std::shared_ptr<Network::MockDnsResolver> dns_resolver_;
+  // Owned by server_
+  MockRecursiveResolver* recursive_resolver_;
+  // Set up by setup() if forwarding_ is set
+  bool forwarding_{false};
+  MockForwarder* forwarder_{};
+  NiceMock<Event::MockTimer>* timer_;
   MockConfig config_;
+  std::shared_ptr<NiceMock<MockKnownNames>> known_names_{
+      std::make_shared<NiceMock<MockKnownNames>>()};
 }; // namespace Dns
 
 TEST_F(ServerImplTest, externalDnsQuerySuccess) {
   Network::Address::InstanceConstSharedPtr result =
       std::make_shared<Network::Address::Ipv4Instance>("1.1.1.1", 1);
 
-  testUnKnownDomainDNSQuery({result});
+  testUnKnownDomainDNSQuery({NOERROR, {result}, std::chrono::seconds(30)}, 30);
 }
 
 TEST_F(ServerImplTest, externalDnsQueryFail) {
   response_code_ = SERVFAIL;
-  testUnKnownDomainDNSQuery({});
+  testUnKnownDomainDNSQuery({SERVFAIL, {}, absl::nullopt});
+
+  // Failures are not cached
+  testUnKnownDomainDNSQueryAgain({SERVFAIL, {}, absl::nullopt}, std::chrono::seconds(0), 0);
+}
+
+TEST_F(ServerImplTest, externalDnsQueryCachedWithDecreasingTtl) {
+  const RecursiveResult result{
+      NOERROR,
+      {std::make_shared<Network::Address::Ipv4Instance>("1.1.1.1", 0),
+       std::make_shared<Network::Address::Ipv4Instance>("1.1.1.2", 0)},
+      std::chrono::seconds(30)};
+
+  testUnKnownDomainDNSQuery(result, 30);
+  testUnKnownDomainDNSQueryAgain(result, std::chrono::seconds(10), 20);
+
+  // Queried again once the TTL passed
+  testUnKnownDomainDNSQueryAgain(result, std::chrono::seconds(20), 0);
+}
+
+TEST_F(ServerImplTest, externalDnsQueryTtlClamped) {
+  EXPECT_CALL(config_, minCacheTtl()).WillRepeatedly(Return(std::chrono::seconds(60)));
+  EXPECT_CALL(config_, maxCacheTtl()).WillRepeatedly(Return(std::chrono::seconds(120)));
+
+  const RecursiveResult result{NOERROR,
+                               {std::make_shared<Network::Address::Ipv4Instance>("1.1.1.1", 0)},
+                               std::chrono::seconds(1)};
+
+  testUnKnownDomainDNSQuery(result, 60);
+  testUnKnownDomainDNSQueryAgain(result, std::chrono::seconds(30), 30);
+}
+
+TEST_F(ServerImplTest, externalDnsQueryNxdomainCached) {
+  response_code_ = NXDOMAIN;
+  const RecursiveResult result{NXDOMAIN, {}, std::chrono::seconds(30)};
+
+  testUnKnownDomainDNSQuery(result);
+  testUnKnownDomainDNSQueryAgain(result, std::chrono::seconds(10), 20);
+}
+
+TEST_F(ServerImplTest, externalDnsQueryCoalesced) {
+  setup("www.unknown.com");
+  auto other_request = createRequest(
+      std::make_shared<Network::Address::Ipv4Instance>("1.1.1.2", 0), "WWW.Unknown.com");
+
+  EXPECT_CALL(*known_names_, matchDomainName(_))
+      .Times(5)
+      .WillRepeatedly(Return(DomainNameMatch{false, nullptr}));
+  EXPECT_CALL(*dns_request_, clone()).WillOnce(Return(dns_request_));
+  EXPECT_CALL(*other_request, clone()).WillOnce(Return(other_request));
+
+  RecursiveResolver::ResolveCb resolve_callback;
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_A, _))
+      .WillOnce(DoAll(SaveArg<2>(&resolve_callback), Return(nullptr)));
+
+  // The second client attaches to the pending query, the retransmits of both are dropped
+  server_->resolve(*dns_request_);
+  server_->resolve(*other_request);
+  server_->resolve(*dns_request_);
+  server_->resolve(*other_request);
+
+  EXPECT_TRUE(responses_.empty());
+  EXPECT_EQ(1, counter("recursive_query"));
+  EXPECT_EQ(1, counter("recursive_query_coalesced"));
+  EXPECT_EQ(2, counter("recursive_retransmit_dropped"));
+
+  EXPECT_CALL(*dns_request_, createResponseMessage(_)).WillOnce(Return(dns_response_));
+  EXPECT_CALL(*other_request, createResponseMessage(_)).WillOnce(Return(dns_response_));
+  EXPECT_CALL(*dns_response_, addARecord(_, _, 30, _)).Times(2);
+  EXPECT_CALL(*dns_response_, encode(_)).Times(2);
+
+  resolve_callback(
+      {NOERROR, {std::make_shared<Network::Address::Ipv4Instance>("1.1.1.1", 0)},
+       std::chrono::seconds(30)});
+  EXPECT_EQ(2, responses_.size());
+
+  // The result is cached under the lower case name
+  EXPECT_CALL(*other_request, createResponseMessage(_)).WillOnce(Return(dns_response_));
+  EXPECT_CALL(*dns_response_, addARecord(_, _, 30, _));
+  EXPECT_CALL(*dns_response_, encode(_));
+  server_->resolve(*other_request);
+  EXPECT_EQ(1, counter("recursive_query"));
+}
+
+TEST_F(ServerImplTest, externalDnsQueryOverTcpWithSameIdNotDropped) {
+  setup("www.unknown.com");
+  EXPECT_CALL(*dns_request_, transport()).WillRepeatedly(Return(Formats::Transport::Tcp));
+
+  EXPECT_CALL(*known_names_, matchDomainName(_))
+      .Times(2)
+      .WillRepeatedly(Return(DomainNameMatch{false, nullptr}));
+  EXPECT_CALL(*dns_request_, clone()).Times(2).WillRepeatedly(Return(dns_request_));
+
+  RecursiveResolver::ResolveCb resolve_callback;
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_A, _))
+      .WillOnce(DoAll(SaveArg<2>(&resolve_callback), Return(nullptr)));
+
+  // Queries pipelined on a connection are not retransmits, each of them gets a response
+  server_->resolve(*dns_request_);
+  server_->resolve(*dns_request_);
+  EXPECT_EQ(1, counter("recursive_query_coalesced"));
+  EXPECT_EQ(0, counter("recursive_retransmit_dropped"));
+
+  EXPECT_CALL(*dns_request_, createResponseMessage(_))
+      .Times(2)
+      .WillRepeatedly(Return(dns_response_));
+  resolve_callback(
+      {NOERROR, {std::make_shared<Network::Address::Ipv4Instance>("1.1.1.1", 0)},
+       std::chrono::seconds(30)});
+  EXPECT_EQ(2, responses_.size());
+}
+
+TEST_F(ServerImplTest, externalDnsQueryNotCoalescedAcrossTypes) {
+  setup("www.unknown.com");
+  question_type_ = T_AAAA;
+  auto aaaa_request = createRequest(dns_request_->from_, "www.unknown.com");
+
+  EXPECT_CALL(*known_names_, matchDomainName(_))
+      .Times(2)
+      .WillRepeatedly(Return(DomainNameMatch{false, nullptr}));
+  EXPECT_CALL(*dns_request_, clone()).WillOnce(Return(dns_request_));
+  EXPECT_CALL(*aaaa_request, clone()).WillOnce(Return(aaaa_request));
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_A, _)).WillOnce(Return(nullptr));
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_AAAA, _))
+      .WillOnce(Return(nullptr));
+
+  server_->resolve(*dns_request_);
+  server_->resolve(*aaaa_request);
+
+  EXPECT_EQ(2, counter("recursive_query"));
+  EXPECT_EQ(0, counter("recursive_query_coalesced"));
+}
+
+TEST_F(ServerImplTest, externalDnsQueryTimeout) {
+  EXPECT_CALL(config_, recursiveQueryTimeout())
+      .WillRepeatedly(Return(std::chrono::milliseconds(2000)));
+  setup("www.unknown.com");
+  auto other_request = createRequest(
+      std::make_shared<Network::Address::Ipv4Instance>("1.1.1.2", 0), "www.other.com");
+
+  EXPECT_CALL(*known_names_, matchDomainName(_))
+      .Times(2)
+      .WillRepeatedly(Return(DomainNameMatch{false, nullptr}));
+  EXPECT_CALL(*dns_request_, clone()).WillOnce(Return(dns_request_));
+  EXPECT_CALL(*other_request, clone()).WillOnce(Return(other_request));
+
+  Network::MockActiveDnsQuery active_query;
+  Network::MockActiveDnsQuery other_active_query;
+  RecursiveResolver::ResolveCb other_callback;
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_A, _))
+      .WillOnce(Return(&active_query));
+  EXPECT_CALL(*recursive_resolver_, resolve("www.other.com", T_A, _))
+      .WillOnce(DoAll(SaveArg<2>(&other_callback), Return(&other_active_query)));
+
+  // The timer is armed for the first query only
+  EXPECT_CALL(*timer_, enableTimer(std::chrono::milliseconds(2000)));
+  server_->resolve(*dns_request_);
+  time_system_.sleep(std::chrono::milliseconds(500));
+  server_->resolve(*other_request);
+
+  // The first query is cancelled and answered with SERVFAIL, the timer is armed for the second
+  time_system_.sleep(std::chrono::milliseconds(1500));
+  EXPECT_CALL(active_query, cancel());
+  EXPECT_CALL(other_active_query, cancel()).Times(0);
+  EXPECT_CALL(*dns_request_, createResponseMessage(_))
+      .WillOnce(Invoke([&](const Formats::Message::ResponseOptions& response_options)
+                           -> Formats::ResponseMessageSharedPtr {
+        EXPECT_EQ(response_options.response_code, SERVFAIL);
+        return this->dns_response_;
+      }));
+  EXPECT_CALL(*timer_, enableTimer(std::chrono::milliseconds(501)));
+  timer_->callback_();
+
+  EXPECT_EQ(1, responses_.size());
+  EXPECT_EQ(1, counter("recursive_query_timeout"));
+
+  // The second query completes in time, which leaves nothing to time out
+  EXPECT_CALL(*other_request, createResponseMessage(_)).WillOnce(Return(dns_response_));
+  EXPECT_CALL(*timer_, disableTimer());
+  other_callback({NXDOMAIN, {}, absl::nullopt});
+
+  EXPECT_EQ(2, responses_.size());
+  EXPECT_EQ(1, counter("recursive_query_timeout"));
+}
+
+TEST_F(ServerImplTest, externalDnsQueryPendingLimit) {
+  EXPECT_CALL(config_, maxPendingRecursiveQueries()).WillRepeatedly(Return(1));
+  setup("www.unknown.com");
+  auto other_request = createRequest(dns_request_->from_, "www.other.com");
+
+  EXPECT_CALL(*known_names_, matchDomainName(_))
+      .Times(2)
+      .WillRepeatedly(Return(DomainNameMatch{false, nullptr}));
+  EXPECT_CALL(*dns_request_, clone()).WillOnce(Return(dns_request_));
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_A, _)).WillOnce(Return(nullptr));
+
+  server_->resolve(*dns_request_);
+
+  EXPECT_CALL(*other_request, clone()).Times(0);
+  EXPECT_CALL(*other_request, createResponseMessage(_))
+      .WillOnce(Invoke([&](const Formats::Message::ResponseOptions& response_options)
+                           -> Formats::ResponseMessageSharedPtr {
+        EXPECT_EQ(response_options.response_code, SERVFAIL);
+        return this->dns_response_;
+      }));
+  server_->resolve(*other_request);
+
+  EXPECT_EQ(1, responses_.size());
+  EXPECT_EQ(1, counter("recursive_query"));
+  EXPECT_EQ(1, counter("recursive_query_overflow"));
+}
+
+TEST_F(ServerImplTest, externalDnsQueryWaiterLimit) {
+  EXPECT_CALL(config_, maxWaitersPerRecursiveQuery()).WillRepeatedly(Return(1));
+  setup("www.unknown.com");
+  auto other_request = createRequest(
+      std::make_shared<Network::Address::Ipv4Instance>("1.1.1.2", 0), "www.unknown.com");
+
+  EXPECT_CALL(*known_names_, matchDomainName(_))
+      .Times(3)
+      .WillRepeatedly(Return(DomainNameMatch{false, nullptr}));
+  EXPECT_CALL(*dns_request_, clone()).WillOnce(Return(dns_request_));
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_A, _)).WillOnce(Return(nullptr));
+
+  server_->resolve(*dns_request_);
+
+  // The retransmit of the waiter is still dropped at the limit
+  server_->resolve(*dns_request_);
+  EXPECT_TRUE(responses_.empty());
+  EXPECT_EQ(1, counter("recursive_retransmit_dropped"));
+
+  EXPECT_CALL(*other_request, clone()).Times(0);
+  EXPECT_CALL(*other_request, createResponseMessage(_))
+      .WillOnce(Invoke([&](const Formats::Message::ResponseOptions& response_options)
+                           -> Formats::ResponseMessageSharedPtr {
+        EXPECT_EQ(response_options.response_code, SERVFAIL);
+        return this->dns_response_;
+      }));
+  server_->resolve(*other_request);
+
+  EXPECT_EQ(1, responses_.size());
+  EXPECT_EQ(1, counter("recursive_query"));
+  EXPECT_EQ(0, counter("recursive_query_coalesced"));
+  EXPECT_EQ(1, counter("recursive_waiter_overflow"));
+}
+
+TEST_F(ServerImplTest, externalDnsQueryPendingAtDestruction) {
+  setup("www.unknown.com");
+
+  EXPECT_CALL(*known_names_, matchDomainName(_)).WillOnce(Return(DomainNameMatch{false, nullptr}));
+  EXPECT_CALL(*dns_request_, clone()).WillOnce(Return(dns_request_));
+  Network::MockActiveDnsQuery active_query;
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_A, _))
+      .WillOnce(Return(&active_query));
+
+  server_->resolve(*dns_request_);
+  EXPECT_EQ(1, gauge("recursive_query_pending"));
+
+  server_.reset();
+  EXPECT_EQ(0, gauge("recursive_query_pending"));
+  EXPECT_TRUE(responses_.empty());
 }
 
 TEST_F(ServerImplTest, knownDnsQueryA) { testKnownDomainDNSQuerySuccess(); }
@@ -241,6 +822,22 @@ TEST_F(ServerImplTest, knownDnsQueryAAAA) { testKnownDomainDNSQuerySuccess(); }
 
 TEST_F(ServerImplTest, knownDnsQuerySRV) { testKnownDomainDNSQuerySuccess(); }
 
+TEST_F(ServerImplTest, knownDnsQueryAnswerCacheHit) {
+  testKnownDomainAnswerCache(BetweenQueries::Nothing);
+}
+
+TEST_F(ServerImplTest, knownDnsQueryAnswerCacheMembershipUpdate) {
+  testKnownDomainAnswerCache(BetweenQueries::MembershipUpdate);
+}
+
+TEST_F(ServerImplTest, knownDnsQueryAnswerCacheEntryChanged) {
+  testKnownDomainAnswerCache(BetweenQueries::EntryChanged);
+}
+
+TEST_F(ServerImplTest, knownDnsQueryAnswerCacheOtherEntryChanged) {
+  testKnownDomainAnswerCache(BetweenQueries::OtherEntryChanged);
+}
+
 TEST_F(ServerImplTest, notSupportedQuestionType) {
   response_code_ = NOTIMP;
   question_type_ = T_SOA;
@@ -259,13 +856,636 @@ TEST_F(ServerImplTest, notSupportedHeaderopCode) {
   testKnownDomainDNSQuerySuccess();
 }
 
-TEST_F(ServerImplTest, notSupportedHeaderqdCount) {
-  response_code_ = NOTIMP;
-  question_count_ = 2;
-  testKnownDomainDNSQuerySuccess();
+TEST_F(ServerImplTest, notSupportedOpcodeOfDecodedQuery) {
+  setup("www.known.com");
+  EXPECT_CALL(*known_names_, matchDomainName(_)).Times(0);
+
+  // NOTIFY, which the response echoes
+  query_flags_ = std::string("\x20\x00", 2);
+  server_->resolve(decodeQuery({{"www.known.com", T_A}}));
+
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ(NOTIMP, responseCode(0));
+  EXPECT_EQ(0xA0, static_cast<uint8_t>(responses_[0][2]));
+  EXPECT_EQ(1, counter("unsupported.response_notimp"));
+}
+
+TEST_F(ServerImplTest, ednsVersionNotSupported) {
+  setup("www.known.com");
+  EXPECT_CALL(*known_names_, matchDomainName(_)).Times(0);
+
+  server_->resolve(decodeQuery({{"www.known.com", T_A}}, 4096, 1));
+
+  // BADVERS is 16, the upper bits are sent in the OPT record
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ(0, responseCode(0));
+  EXPECT_EQ(1, static_cast<uint8_t>(responses_[0][responses_[0].size() - 6]));
+  EXPECT_EQ(1, counter("unsupported.query_a"));
+  EXPECT_EQ(1, counter("unsupported.response_badvers"));
+}
+
+TEST_F(ServerImplTest, externalDnsQueryTruncatedWithoutEdns) {
+  setup("www.unknown.com");
+  EXPECT_CALL(*known_names_, matchDomainName("www.unknown.com"))
+      .Times(2)
+      .WillRepeatedly(Return(DomainNameMatch{false, nullptr}));
+
+  // 40 answers of 16 bytes do not fit into 512 bytes
+  std::list<Network::Address::InstanceConstSharedPtr> addresses;
+  for (int i = 0; i < 40; i++) {
+    addresses.push_back(
+        std::make_shared<Network::Address::Ipv4Instance>(fmt::format("10.0.0.{}", i), 0));
+  }
+
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_A, _))
+      .WillOnce(Invoke([&](const std::string&, uint16_t,
+                           RecursiveResolver::ResolveCb callback) -> Network::ActiveDnsQuery* {
+        callback({NOERROR, addresses, std::chrono::seconds(30)});
+        return nullptr;
+      }));
+
+  server_->resolve(decodeQuery({{"www.unknown.com", T_A}}));
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_TRUE(responseTruncated(0));
+  EXPECT_GE(512, responses_[0].size());
+  EXPECT_EQ((512 - 33) / 16, responseAnswerCount(0));
+  EXPECT_EQ(1, counter("response_truncated"));
+
+  // A client with a larger payload size gets all of them from the recursive cache
+  server_->resolve(decodeQuery({{"www.unknown.com", T_A}}, 1232));
+  ASSERT_EQ(2, responses_.size());
+  EXPECT_FALSE(responseTruncated(1));
+  EXPECT_EQ(40, responseAnswerCount(1));
+  EXPECT_EQ(1, counter("response_truncated"));
+  EXPECT_EQ(1, counter("recursive_cache_hit"));
+  EXPECT_EQ(2, counter("recursive.response_noerror"));
+}
+
+TEST_F(ServerImplTest, forwardedQueryRelaysUpstreamResponse) {
+  forwarding_ = true;
+  setup("www.unknown.com");
+  EXPECT_CALL(*known_names_, matchDomainName("www.unknown.com"))
+      .Times(2)
+      .WillRepeatedly(Return(DomainNameMatch{false, nullptr}));
+  EXPECT_CALL(*recursive_resolver_, resolve(_, _, _)).Times(0);
+
+  // The bytes the query was decoded from are forwarded
+  std::vector<Forwarder::ResponseCb> callbacks;
+  EXPECT_CALL(*forwarder_, forward(_, _))
+      .Times(2)
+      .WillRepeatedly(
+          Invoke([&](const Formats::Message& request, Forwarder::ResponseCb callback) -> bool {
+            EXPECT_EQ(std::string("\x12\x34\x01\x00\x00\x01", 6), request.raw().substr(0, 6));
+            callbacks.push_back(callback);
+            return true;
+          }));
+
+  // The responses are not cached, every query is forwarded
+  server_->resolve(decodeQuery({{"www.unknown.com", T_A}}));
+  server_->resolve(decodeQuery({{"www.unknown.com", T_A}}));
+  ASSERT_EQ(2, callbacks.size());
+  EXPECT_TRUE(responses_.empty());
+
+  // An NXDOMAIN response with a record the filter never builds is relayed as it is
+  const std::string upstream_response("\x12\x34\x81\x83\x00\x01\x00\x00\x00\x01\x00\x00"
+                                      "upstream records",
+                                      28);
+  Buffer::OwnedImpl response_buffer(upstream_response);
+  callbacks[0](decodeQuery({{"www.unknown.com", T_A}}), response_buffer);
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ(upstream_response, responses_[0]);
+  EXPECT_EQ(1, counter("recursive.query_a"));
+  EXPECT_EQ(1, counter("recursive.response_nxdomain"));
+  EXPECT_EQ(0, counter("recursive_query"));
+}
+
+TEST_F(ServerImplTest, forwardedUnsupportedQueries) {
+  forwarding_ = true;
+  setup("www.unknown.com");
+  EXPECT_CALL(*known_names_, matchDomainName("www.unknown.com"))
+      .WillRepeatedly(Return(DomainNameMatch{false, nullptr}));
+
+  // Question types the filter does not answer, and SRV questions for unknown names
+  EXPECT_CALL(*forwarder_, forward(_, _)).Times(2).WillRepeatedly(Return(true));
+  server_->resolve(decodeQuery({{"www.known.com", T_SOA}}));
+  server_->resolve(decodeQuery({{"www.unknown.com", T_SRV}}));
+  EXPECT_TRUE(responses_.empty());
+
+  // The questions of a query with several questions are resolved recursively, and the SRV
+  // question for the unknown name fails as without forwarding
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_A, _))
+      .WillOnce(Invoke([&](const std::string&, uint16_t,
+                           RecursiveResolver::ResolveCb callback) -> Network::ActiveDnsQuery* {
+        callback({NOERROR, {}, std::chrono::seconds(30)});
+        return nullptr;
+      }));
+  server_->resolve(decodeQuery({{"www.unknown.com", T_A}, {"www.unknown.com", T_SRV}}));
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ(NXDOMAIN, responseCode(0));
+}
+
+TEST_F(ServerImplTest, forwardedQueryOverflow) {
+  forwarding_ = true;
+  setup("www.unknown.com");
+  EXPECT_CALL(*known_names_, matchDomainName("www.unknown.com"))
+      .WillOnce(Return(DomainNameMatch{false, nullptr}));
+  EXPECT_CALL(*forwarder_, forward(_, _)).WillOnce(Return(false));
+
+  server_->resolve(decodeQuery({{"www.unknown.com", T_AAAA}}));
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ(SERVFAIL, responseCode(0));
+  EXPECT_EQ(1, counter("recursive.response_servfail"));
+}
+
+TEST_F(ServerImplTest, multipleQuestionsCombinedResponse) {
+  setup("www.known.com");
+  const std::string cluster_name = "cluster0";
+  EXPECT_CALL(*known_names_, matchDomainName("www.known.com"))
+      .WillOnce(Return(DomainNameMatch{true, &cluster_name}));
+  EXPECT_CALL(*known_names_, matchDomainName("www.unknown.com"))
+      .Times(2)
+      .WillRepeatedly(Return(DomainNameMatch{false, nullptr}));
+  EXPECT_CALL(config_, ttl()).WillRepeatedly(Return(std::chrono::seconds(5)));
+  addExpectCallsForClusterManagerResult();
+
+  // The unknown questions are resolved concurrently
+  RecursiveResolver::ResolveCb a_callback;
+  RecursiveResolver::ResolveCb aaaa_callback;
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_A, _))
+      .WillOnce(DoAll(SaveArg<2>(&a_callback), Return(nullptr)));
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_AAAA, _))
+      .WillOnce(DoAll(SaveArg<2>(&aaaa_callback), Return(nullptr)));
+
+  server_->resolve(decodeQuery(
+      {{"www.known.com", T_A}, {"www.unknown.com", T_A}, {"www.unknown.com", T_AAAA}}));
+  EXPECT_EQ(2, counter("recursive_query"));
+  EXPECT_EQ(2, gauge("recursive_query_pending"));
+
+  a_callback({NOERROR,
+              {std::make_shared<Network::Address::Ipv4Instance>("10.0.0.1", 0),
+               std::make_shared<Network::Address::Ipv4Instance>("10.0.0.2", 0)},
+              std::chrono::seconds(30)});
+  EXPECT_TRUE(responses_.empty());
+  EXPECT_EQ(1, gauge("recursive_query_pending"));
+
+  // NODATA for the last question completes the query
+  aaaa_callback({NOERROR, {}, std::chrono::seconds(30)});
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ(NOERROR, responseCode(0));
+  EXPECT_FALSE(responseAuthoritative(0));
+  EXPECT_EQ(3, responseAnswerCount(0));
+  EXPECT_EQ(0, gauge("recursive_query_pending"));
+
+  // A query with a recursive question is counted once, with the types of all of its questions
+  EXPECT_EQ(2, counter("recursive.query_a"));
+  EXPECT_EQ(1, counter("recursive.query_aaaa"));
+  EXPECT_EQ(1, counter("recursive.response_noerror"));
+  EXPECT_EQ(0, counter("known.response_noerror"));
+}
+
+TEST_F(ServerImplTest, multipleKnownQuestionsAnsweredInline) {
+  setup("www.known.com");
+  const std::string cluster_name = "cluster0";
+  EXPECT_CALL(*known_names_, matchDomainName("www.known.com"))
+      .WillOnce(Return(DomainNameMatch{true, &cluster_name}));
+  EXPECT_CALL(*known_names_, matchDomainName("missing.known.com"))
+      .WillOnce(Return(DomainNameMatch{true, nullptr}));
+  EXPECT_CALL(config_, ttl()).WillRepeatedly(Return(std::chrono::seconds(5)));
+  EXPECT_CALL(*recursive_resolver_, resolve(_, _, _)).Times(0);
+  addExpectCallsForClusterManagerResult();
+
+  server_->resolve(decodeQuery({{"www.known.com", T_A}, {"missing.known.com", T_A}}));
+
+  // The response code is the one of the question that failed, with the answers to the other
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ(NXDOMAIN, responseCode(0));
+  EXPECT_TRUE(responseAuthoritative(0));
+  EXPECT_EQ(1, responseAnswerCount(0));
+  EXPECT_EQ(2, counter("known.query_a"));
+  EXPECT_EQ(1, counter("known.response_nxdomain"));
+}
+
+TEST_F(ServerImplTest, multipleQuestionsWithTimeout) {
+  setup("www.known.com");
+  const std::string cluster_name = "cluster0";
+  EXPECT_CALL(*known_names_, matchDomainName("www.known.com"))
+      .WillOnce(Return(DomainNameMatch{true, &cluster_name}));
+  EXPECT_CALL(*known_names_, matchDomainName("www.unknown.com"))
+      .WillOnce(Return(DomainNameMatch{false, nullptr}));
+  EXPECT_CALL(config_, ttl()).WillRepeatedly(Return(std::chrono::seconds(5)));
+  addExpectCallsForClusterManagerResult();
+
+  Network::MockActiveDnsQuery active_query;
+  EXPECT_CALL(*recursive_resolver_, resolve("www.unknown.com", T_A, _))
+      .WillOnce(Return(&active_query));
+
+  server_->resolve(decodeQuery({{"www.unknown.com", T_A}, {"www.known.com", T_A}}));
+  EXPECT_TRUE(responses_.empty());
+
+  time_system_.sleep(std::chrono::seconds(5));
+  EXPECT_CALL(active_query, cancel());
+  timer_->callback_();
+
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ(SERVFAIL, responseCode(0));
+  EXPECT_EQ(1, responseAnswerCount(0));
+  EXPECT_EQ(0, gauge("recursive_query_pending"));
+  EXPECT_EQ(1, counter("recursive.response_servfail"));
+}
+
+TEST_F(ServerImplTest, knownQueryStats) {
+  setup("www.known.com");
+  const std::string cluster_name = "cluster0";
+  EXPECT_CALL(*known_names_, matchDomainName("www.known.com"))
+      .WillOnce(Return(DomainNameMatch{true, &cluster_name}));
+  EXPECT_CALL(config_, ttl()).WillRepeatedly(Return(std::chrono::seconds(5)));
+  EXPECT_CALL(*recursive_resolver_, resolve(_, _, _)).Times(0);
+  addExpectCallsForClusterManagerResult();
+
+  // The repeated query is answered from the answer cache, and counted the same way
+  server_->resolve(decodeQuery({{"www.known.com", T_A}}));
+  server_->resolve(decodeQuery({{"www.known.com", T_A}}));
+  ASSERT_EQ(2, responses_.size());
+  EXPECT_EQ(1, counter("answer_cache_hit"));
+  EXPECT_EQ(2, counter("known.query_a"));
+  EXPECT_EQ(2, counter("known.response_noerror"));
+  EXPECT_EQ(0, counter("recursive.query_a"));
+  EXPECT_EQ(0, counter("unsupported.query_a"));
+}
+
+TEST_F(ServerImplTest, knownQueryFlagsOfQueryNotEchoed) {
+  setup("www.known.com");
+  addHostSet({"10.0.0.1"}, 1);
+
+  // AA, RD, Z and a response code of NXDOMAIN set by the client, followed by a clean query that is
+  // answered from the answer cache
+  query_flags_ = std::string("\x05\x43", 2);
+  resolveKnownQueries(1);
+  query_flags_ = std::string("\x01\x00", 2);
+  resolveKnownQueries(1);
+
+  ASSERT_EQ(2, responses_.size());
+  EXPECT_EQ(1, counter("answer_cache_hit"));
+  for (size_t i = 0; i < responses_.size(); i++) {
+    EXPECT_EQ(NOERROR, responseCode(i));
+    EXPECT_TRUE(responseAuthoritative(i));
+    EXPECT_FALSE(responseTruncated(i));
+    // QR, AA, RD and RA only
+    EXPECT_EQ(0x85, static_cast<uint8_t>(responses_[i][2]));
+    EXPECT_EQ(0x80, static_cast<uint8_t>(responses_[i][3]));
+  }
+}
+
+TEST_F(ServerImplTest, knownQueryAnswerCacheEvictsLeastRecentlyUsed) {
+  EXPECT_CALL(config_, maxCachedAnswers()).WillRepeatedly(Return(2));
+  setup("www.known.com");
+  addHostSet({"10.0.0.1"}, 1);
+  const std::string cluster_name = "cluster0";
+  EXPECT_CALL(*known_names_, matchDomainName(_))
+      .WillRepeatedly(Return(DomainNameMatch{true, &cluster_name}));
+  EXPECT_CALL(config_, ttl()).WillRepeatedly(Return(std::chrono::seconds(5)));
+
+  // The lookup of a.known.com makes b.known.com the least recently used
+  server_->resolve(decodeQuery({{"a.known.com", T_A}}));
+  server_->resolve(decodeQuery({{"b.known.com", T_A}}));
+  server_->resolve(decodeQuery({{"a.known.com", T_A}}));
+  EXPECT_EQ(1, counter("answer_cache_hit"));
+
+  server_->resolve(decodeQuery({{"c.known.com", T_A}}));
+  server_->resolve(decodeQuery({{"a.known.com", T_A}}));
+  server_->resolve(decodeQuery({{"c.known.com", T_A}}));
+  EXPECT_EQ(3, counter("answer_cache_hit"));
+
+  server_->resolve(decodeQuery({{"b.known.com", T_A}}));
+  EXPECT_EQ(3, counter("answer_cache_hit"));
+  ASSERT_EQ(7, responses_.size());
+  for (size_t i = 0; i < responses_.size(); i++) {
+    // The names are of the same length
+    EXPECT_THAT(answerAddresses(i, "a.known.com"), ElementsAre("10.0.0.1"));
+  }
+}
+
+TEST_F(ServerImplTest, knownQueryMaxAnswersRotates) {
+  setup("www.known.com");
+  EXPECT_CALL(config_, maxAnswers()).WillRepeatedly(Return(2));
+  addHostSet({"10.0.0.1", "10.0.0.2", "10.0.0.3"}, 3);
+
+  resolveKnownQueries(4);
+
+  // Every response starts one host further into the cluster
+  ASSERT_EQ(4, responses_.size());
+  EXPECT_THAT(answerAddresses(0), ElementsAre("10.0.0.1", "10.0.0.2"));
+  EXPECT_THAT(answerAddresses(1), ElementsAre("10.0.0.2", "10.0.0.3"));
+  EXPECT_THAT(answerAddresses(2), ElementsAre("10.0.0.3", "10.0.0.1"));
+  EXPECT_THAT(answerAddresses(3), ElementsAre("10.0.0.1", "10.0.0.2"));
+  EXPECT_EQ(0, counter("answer_cache_hit"));
+}
+
+TEST_F(ServerImplTest, knownQueryAnswersHealthyHostsOfLoadedPriorities) {
+  setup("www.known.com");
+  // 2 of 3 healthy hosts, scaled by the overprovisioning factor of 1.4, make priority 0 93% healthy
+  addHostSet({"10.0.0.1", "10.0.0.2", "10.0.0.3"}, 2);
+  addHostSet({"10.0.1.1", "10.0.1.2"}, 2);
+  addHostSet({"10.0.2.1"}, 1);
+
+  resolveKnownQueries(2);
+
+  ASSERT_EQ(2, responses_.size());
+  EXPECT_THAT(answerAddresses(0), ElementsAre("10.0.0.1", "10.0.0.2", "10.0.1.1", "10.0.1.2"));
+  EXPECT_EQ(responses_[0], responses_[1]);
+  EXPECT_EQ(2, counter("answer_healthy"));
+  EXPECT_EQ(1, counter("answer_cache_hit"));
+  EXPECT_EQ(0, counter("answer_panic"));
+}
+
+TEST_F(ServerImplTest, knownQueryAnswersAllHostsInPanic) {
+  setup("www.known.com");
+  // 1 of 4 healthy hosts make the cluster 35% healthy, below the panic threshold of 50%
+  addHostSet({"10.0.0.1", "10.0.0.2", "10.0.0.3", "10.0.0.4"}, 1);
+
+  resolveKnownQueries(2);
+
+  // Responses built in panic are not cached
+  ASSERT_EQ(2, responses_.size());
+  EXPECT_THAT(answerAddresses(0), ElementsAre("10.0.0.1", "10.0.0.2", "10.0.0.3", "10.0.0.4"));
+  EXPECT_THAT(answerAddresses(1), ElementsAre("10.0.0.1", "10.0.0.2", "10.0.0.3", "10.0.0.4"));
+  EXPECT_EQ(2, counter("answer_panic"));
+  EXPECT_EQ(0, counter("answer_cache_hit"));
+  EXPECT_EQ(0, counter("answer_healthy"));
+}
+
+TEST_F(ServerImplTest, knownQueryWithoutHealthyHostsFails) {
+  setup("www.known.com");
+  EXPECT_CALL(config_, healthyPanicThreshold()).WillRepeatedly(Return(0));
+  addHostSet({"10.0.0.1", "10.0.0.2"}, 0);
+
+  resolveKnownQueries(1);
+
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ(SERVFAIL, responseCode(0));
+  EXPECT_EQ(1, counter("answer_no_healthy_host"));
+  EXPECT_EQ(0, counter("answer_panic"));
+}
+
+TEST_F(ServerImplTest, knownQueryWithoutHealthyHostsKeptUntilHealthChange) {
+  setup("www.known.com");
+  EXPECT_CALL(config_, healthyPanicThreshold()).WillRepeatedly(Return(0));
+  addHostSet({"10.0.0.1", "10.0.0.2"}, 0);
+
+  resolveKnownQueries(1);
+
+  // The hosts are only collected again once the priority set reports the update
+  Upstream::MockPrioritySet& priority_set =
+      cluster_manager_.thread_local_cluster_.cluster_.priority_set_;
+  auto& host_set = dynamic_cast<Upstream::MockHostSet&>(*priority_set.host_sets_[0]);
+  host_set.healthy_hosts_.push_back(host_set.hosts_[0]);
+  resolveKnownQueries(1);
+
+  priority_set.runUpdateCallbacks(0, {}, {});
+  resolveKnownQueries(1);
+
+  ASSERT_EQ(3, responses_.size());
+  EXPECT_EQ(SERVFAIL, responseCode(0));
+  EXPECT_EQ(SERVFAIL, responseCode(1));
+  EXPECT_EQ(NOERROR, responseCode(2));
+  EXPECT_THAT(answerAddresses(2), ElementsAre("10.0.0.1"));
+  EXPECT_EQ(2, counter("answer_no_healthy_host"));
+}
+
+TEST_F(ServerImplTest, knownQueryHealthChangeDropsCachedAnswers) {
+  setup("www.known.com");
+  addHostSet({"10.0.0.1", "10.0.0.2"}, 2);
+
+  resolveKnownQueries(1);
+
+  // An outlier ejection only updates the healthy hosts, without any membership change
+  Upstream::MockPrioritySet& priority_set =
+      cluster_manager_.thread_local_cluster_.cluster_.priority_set_;
+  auto& host_set = dynamic_cast<Upstream::MockHostSet&>(*priority_set.host_sets_[0]);
+  host_set.healthy_hosts_.erase(host_set.healthy_hosts_.begin());
+  priority_set.runUpdateCallbacks(0, {}, {});
+
+  resolveKnownQueries(1);
+
+  ASSERT_EQ(2, responses_.size());
+  EXPECT_THAT(answerAddresses(0), ElementsAre("10.0.0.1", "10.0.0.2"));
+  EXPECT_THAT(answerAddresses(1), ElementsAre("10.0.0.2"));
+  EXPECT_EQ(0, counter("answer_cache_hit"));
+}
+
+TEST_F(ServerImplTest, knownQueryAnswersAddressesOfQuestionFamily) {
+  setup("www.known.com");
+  addHostSet({"10.0.0.1", "fd00::1", "10.0.0.2"}, 3);
+
+  resolveKnownQueries(1, T_A);
+  resolveKnownQueries(1, T_AAAA);
+
+  ASSERT_EQ(2, responses_.size());
+  EXPECT_THAT(answerAddresses(0), ElementsAre("10.0.0.1", "10.0.0.2"));
+  EXPECT_THAT(answerAddresses(1), ElementsAre("fd00::1"));
+}
+
+TEST_F(ServerImplTest, knownQueryWithoutAddressOfQuestionFamily) {
+  setup("www.known.com");
+  addHostSet({"10.0.0.1"}, 1);
+
+  resolveKnownQueries(1, T_AAAA);
+
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ(NOERROR, responseCode(0));
+  EXPECT_EQ(0, responseAnswerCount(0));
+}
+
+TEST_F(ServerImplTest, knownQueryAnsweredFromStaticRecords) {
+  setup("www.known.com");
+  const std::string cluster_name = "cluster0";
+  const std::vector<uint32_t> ipv4{htonl(0x0a000101), htonl(0x0a000102)};
+  const std::vector<absl::uint128> ipv6{
+      Network::Address::Ipv6Instance("fd00::1").ip()->ipv6()->address()};
+  DomainNameMatch match{true, &cluster_name};
+  match.static_records_ = {ipv4.data(), ipv4.size(), ipv6.data(), ipv6.size()};
+  EXPECT_CALL(*known_names_, matchDomainName("www.known.com")).WillRepeatedly(Return(match));
+  EXPECT_CALL(config_, ttl()).WillRepeatedly(Return(std::chrono::seconds(5)));
+  EXPECT_CALL(config_, maxAnswers()).WillRepeatedly(Return(1));
+  // The cluster of the name is not looked up
+  EXPECT_CALL(cluster_manager_, get(_)).Times(0);
+
+  server_->resolve(decodeQuery({{"www.known.com", T_A}}));
+  server_->resolve(decodeQuery({{"www.known.com", T_AAAA}}));
+
+  // Static records are capped at max_answers without rotating, and are not cached
+  ASSERT_EQ(2, responses_.size());
+  EXPECT_THAT(answerAddresses(0), ElementsAre("10.0.1.1"));
+  EXPECT_THAT(answerAddresses(1), ElementsAre("fd00::1"));
+  EXPECT_TRUE(responseAuthoritative(0));
+  EXPECT_EQ(2, counter("answer_static"));
+  EXPECT_EQ(0, counter("answer_healthy"));
+  EXPECT_EQ(0, counter("answer_cache_hit"));
+}
+
+TEST_F(ServerImplTest, knownQuerySrvAnswersEveryEndpoint) {
+  setup("www.known.com");
+  // 2 of 3 healthy hosts make priority 0 93% healthy, so priority 1 takes load as well
+  addEndpoints(0, {{"10.0.0.1:8080", 10}, {"10.0.0.2:9090", 20}}, 1);
+  addEndpoints(1, {{"[fd00::1]:7070", 30}, {"10.0.0.1:8081", 40}});
+
+  resolveKnownQueries(2, T_SRV);
+
+  // The hosts keep their own port, weight and priority. A host on two ports gets a single address
+  // record.
+  ASSERT_EQ(2, responses_.size());
+  EXPECT_EQ(NOERROR, responseCode(0));
+  EXPECT_THAT(srvRecords(0), ElementsAre("0 10 8080 10-0-0-1.www.known.com",
+                                         "0 20 9090 10-0-0-2.www.known.com",
+                                         "1 40 8081 10-0-0-1.www.known.com",
+                                         "1 30 7070 fd00-0-0-0-0-0-0-1.www.known.com"));
+  EXPECT_EQ(3, responseAdditionalCount(0));
+  EXPECT_EQ(responses_[0].substr(HFIXEDSZ), responses_[1].substr(HFIXEDSZ));
+  EXPECT_EQ(1, counter("answer_cache_hit"));
+}
+
+TEST_F(ServerImplTest, knownQuerySrvCappedAtMaxAnswers) {
+  setup("www.known.com");
+  EXPECT_CALL(config_, maxAnswers()).WillRepeatedly(Return(1));
+  addEndpoints(0, {{"10.0.0.1:8080", 1}, {"10.0.0.2:9090", 1}});
+
+  resolveKnownQueries(2, T_SRV);
+
+  // The endpoints rotate along with the addresses
+  ASSERT_EQ(2, responses_.size());
+  EXPECT_THAT(srvRecords(0), ElementsAre("0 1 8080 10-0-0-1.www.known.com"));
+  EXPECT_THAT(srvRecords(1), ElementsAre("0 1 9090 10-0-0-2.www.known.com"));
+  EXPECT_EQ(0, counter("answer_cache_hit"));
+}
+
+TEST_F(ServerImplTest, knownQuerySrvTargetTooLongLeftOut) {
+  // 240 bytes in wire format, leaving room for the target label of an ipv4 host only
+  const std::string name = std::string(63, 'a') + "." + std::string(63, 'b') + "." +
+                           std::string(63, 'c') + "." + std::string(36, 'd') + ".known.com";
+  setup(name);
+  addEndpoints(0, {{"10.0.0.1:8080", 1}, {"[fd00::1]:7070", 1}});
+  const std::string cluster_name = "cluster0";
+  EXPECT_CALL(*known_names_, matchDomainName(name))
+      .WillRepeatedly(Return(DomainNameMatch{true, &cluster_name}));
+
+  // The response does not fit into 512 bytes
+  server_->resolve(decodeQuery({{name, T_SRV}}, 4096));
+
+  // The address record of the target is followed by the OPT record
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_EQ(NOERROR, responseCode(0));
+  EXPECT_THAT(srvRecords(0, name), ElementsAre("0 1 8080 10-0-0-1." + name));
+  EXPECT_EQ(2, responseAdditionalCount(0));
+}
+
+TEST_F(ServerImplTest, knownQuerySrvTargetResolved) {
+  setup("www.known.com");
+  addEndpoints(0, {{"10.0.0.1:8080", 1}, {"[fd00::1]:7070", 1}});
+  EXPECT_CALL(*known_names_, matchDomainName("10-0-0-1.www.known.com"))
+      .WillRepeatedly(Return(DomainNameMatch{true, nullptr}));
+  EXPECT_CALL(*known_names_, matchDomainName("fd00-0-0-0-0-0-0-1.www.known.com"))
+      .WillRepeatedly(Return(DomainNameMatch{true, nullptr}));
+  EXPECT_CALL(*known_names_, matchDomainName("10-0-0-9.www.known.com"))
+      .WillRepeatedly(Return(DomainNameMatch{true, nullptr}));
+  const std::string cluster_name = "cluster0";
+  EXPECT_CALL(*known_names_, matchDomainName("www.known.com"))
+      .WillRepeatedly(Return(DomainNameMatch{true, &cluster_name}));
+
+  server_->resolve(decodeQuery({{"10-0-0-1.www.known.com", T_A}}));
+  server_->resolve(decodeQuery({{"fd00-0-0-0-0-0-0-1.www.known.com", T_AAAA}}));
+  server_->resolve(decodeQuery({{"10-0-0-1.www.known.com", T_AAAA}}));
+  server_->resolve(decodeQuery({{"10-0-0-9.www.known.com", T_A}}));
+  server_->resolve(decodeQuery({{"10-0-0-1.www.known.com", T_A}}));
+
+  // A target answers with the address of its host only, and no records for the other family
+  ASSERT_EQ(5, responses_.size());
+  EXPECT_THAT(answerAddresses(0, "10-0-0-1.www.known.com"), ElementsAre("10.0.0.1"));
+  EXPECT_TRUE(responseAuthoritative(0));
+  EXPECT_THAT(answerAddresses(1, "fd00-0-0-0-0-0-0-1.www.known.com"), ElementsAre("fd00::1"));
+  EXPECT_EQ(NOERROR, responseCode(2));
+  EXPECT_EQ(0, responseAnswerCount(2));
+
+  // An address that is not a host of the cluster is not a target
+  EXPECT_EQ(NXDOMAIN, responseCode(3));
+
+  EXPECT_EQ(responses_[0].substr(HFIXEDSZ), responses_[4].substr(HFIXEDSZ));
+  EXPECT_EQ(3, counter("answer_srv_target"));
+  EXPECT_EQ(1, counter("answer_cache_hit"));
+}
+
+TEST_F(ServerImplTest, knownQuerySrvTargetWithEntryAnsweredByEntry) {
+  setup("www.known.com");
+  addEndpoints(0, {{"10.0.0.1:8080", 1}, {"10.0.0.2:8080", 1}});
+  const std::string cluster_name = "cluster0";
+  EXPECT_CALL(*known_names_, matchDomainName("10-0-0-1.www.known.com"))
+      .WillOnce(Return(DomainNameMatch{true, &cluster_name}));
+  EXPECT_CALL(*known_names_, matchDomainName("www.known.com")).Times(0);
+
+  // The entry of the name answers with all the hosts of its cluster, the target is not looked for
+  server_->resolve(decodeQuery({{"10-0-0-1.www.known.com", T_A}}));
+
+  ASSERT_EQ(1, responses_.size());
+  EXPECT_THAT(answerAddresses(0, "10-0-0-1.www.known.com"),
+              UnorderedElementsAre("10.0.0.1", "10.0.0.2"));
+  EXPECT_EQ(0, counter("answer_srv_target"));
+}
+
+TEST_F(ServerImplTest, knownClusterKeptUntilClusterUpdate) {
+  Upstream::ClusterUpdateCallbacks* cluster_update_callbacks = nullptr;
+  EXPECT_CALL(cluster_manager_, addThreadLocalClusterUpdateCallbacks_(_))
+      .WillOnce(Invoke([&](Upstream::ClusterUpdateCallbacks& callbacks)
+                           -> Upstream::ClusterUpdateCallbacksHandle* {
+        cluster_update_callbacks = &callbacks;
+        return nullptr;
+      }));
+  setup("www.known.com");
+  Upstream::MockThreadLocalCluster& cluster = cluster_manager_.thread_local_cluster_;
+  cluster.cluster_.info_->name_ = "cluster0";
+  addHostSet({"10.0.0.1"}, 1);
+
+  // The hosts are collected again after a membership update, without looking up the cluster
+  EXPECT_CALL(cluster_manager_, get("cluster0")).Times(1);
+  resolveKnownQueries(1);
+  cluster.cluster_.priority_set_.runUpdateCallbacks(0, {}, {});
+  resolveKnownQueries(1);
+
+  testing::Mock::VerifyAndClearExpectations(&cluster_manager_);
+  EXPECT_CALL(cluster_manager_, get("cluster0")).Times(1);
+  cluster_update_callbacks->onClusterAddOrUpdate(cluster);
+  resolveKnownQueries(1);
+
+  testing::Mock::VerifyAndClearExpectations(&cluster_manager_);
+  EXPECT_CALL(cluster_manager_, get("cluster0")).WillOnce(Return(nullptr));
+  cluster_update_callbacks->onClusterRemoval("cluster0");
+  resolveKnownQueries(1);
+
+  ASSERT_EQ(4, responses_.size());
+  EXPECT_EQ(0, counter("answer_cache_hit"));
+  EXPECT_THAT(answerAddresses(2), ElementsAre("10.0.0.1"));
+  EXPECT_EQ(SERVFAIL, responseCode(3));
+}
+
+TEST_F(ServerImplTest, knownQueryMissingTemplateClusterNxdomain) {
+  setup("www.known.com");
+  const std::string cluster_name = "payments";
+  DomainNameMatch template_match{true, &cluster_name};
+  template_match.cluster_label_ = "payments";
+  EXPECT_CALL(*known_names_, matchDomainName("payments.svc.known.com"))
+      .WillOnce(Return(template_match));
+  EXPECT_CALL(*known_names_, matchDomainName("www.known.com"))
+      .WillOnce(Return(DomainNameMatch{true, &cluster_name}));
+  EXPECT_CALL(cluster_manager_, get("payments")).WillRepeatedly(Return(nullptr));
+
+  // A name made up by a client does not exist, a cluster of an explicit entry may be coming up
+  server_->resolve(decodeQuery({{"payments.svc.known.com", T_A}}));
+  server_->resolve(decodeQuery({{"www.known.com", T_A}}));
+
+  ASSERT_EQ(2, responses_.size());
+  EXPECT_EQ(NXDOMAIN, responseCode(0));
+  EXPECT_EQ(SERVFAIL, responseCode(1));
 }
 
 } // namespace Dns
 } // namespace ListenerFilters
 } // namespace Extensions
-} // namespace Envoy
\ No newline at end of file
+} // namespace Envoy
@@ -0,0 +1,168 @@
+#include <arpa/inet.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include "src/dns_snapshot.h"
+
+#include "test/test_common/environment.h"
+#include "test/test_common/utility.h"
+
+#include "gtest/gtest.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+class DnsSnapshotTest : public ::testing::Test {
+public:
+  DnsSnapshotTest() {
+    source_.add_known_domainname_suffixes("github.com");
+    source_.add_known_domainname_suffixes(".microsoft.com");
+    (*source_.mutable_dns_entries())["a.b.c.microsoft.com"] = "cluster_0";
+    (*source_.mutable_dns_entries())["x.y.z.github.com"] = "cluster_0";
+    (*source_.mutable_dns_entries())["*.canary.github.com"] = "canary";
+    (*source_.mutable_dns_entries())["{cluster}.svc.github.com"] = "{cluster}-prod";
+  }
+
+  DnsSnapshotConstSharedPtr load() {
+    return DnsSnapshot::load(write(DnsSnapshot::compile(source_)));
+  }
+
+  // Moves a file holding snapshot in place, as the snapshot compiler does
+  static std::string write(const std::string& snapshot) {
+    const std::string path = TestEnvironment::temporaryPath("dns.snapshot");
+    const std::string temporary_path =
+        TestEnvironment::writeStringToFileForTest("dns.snapshot.tmp", snapshot);
+    EXPECT_EQ(0, rename(temporary_path.c_str(), path.c_str()));
+    return path;
+  }
+
+  static void addRecords(envoy::config::filter::listener::udp::DnsSnapshotSource& source,
+                         const std::string& name, const std::vector<std::string>& addresses) {
+    for (const auto& address : addresses) {
+      (*source.mutable_static_records())[name].add_addresses(address);
+    }
+  }
+
+  envoy::config::filter::listener::udp::DnsSnapshotSource source_;
+};
+
+TEST_F(DnsSnapshotTest, matchesAsTheTrie) {
+  DnsSnapshotConstSharedPtr snapshot = load();
+  EXPECT_EQ(4, snapshot->entries());
+
+  EXPECT_TRUE(snapshot->find("www.github.com").known_suffix_);
+  EXPECT_TRUE(snapshot->find("microsoft.com").known_suffix_);
+  EXPECT_FALSE(snapshot->find("notgithub.com").known_suffix_);
+  EXPECT_FALSE(snapshot->find("").known_suffix_);
+
+  DomainNameMatch match = snapshot->find("X.Y.Z.GitHub.COM.");
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(*match.cluster_name_, "cluster_0");
+  EXPECT_EQ(snapshot->find("y.z.github.com").cluster_name_, nullptr);
+
+  match = snapshot->find("a.b.canary.github.com");
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(*match.cluster_name_, "canary");
+  EXPECT_EQ(snapshot->find("canary.github.com").cluster_name_, nullptr);
+
+  match = snapshot->find("Payments.svc.github.com");
+  ASSERT_NE(match.cluster_name_, nullptr);
+  EXPECT_EQ(*match.cluster_name_, "{cluster}-prod");
+  EXPECT_EQ(match.cluster_label_, "Payments");
+  EXPECT_EQ(snapshot->find("a.payments.svc.github.com").cluster_name_, nullptr);
+}
+
+TEST_F(DnsSnapshotTest, staticRecords) {
+  addRecords(source_, "x.y.z.github.com", {"10.0.0.1", "10.0.0.2", "2001:db8::1"});
+  addRecords(source_, "static.microsoft.com", {"2001:db8::2"});
+  DnsSnapshotConstSharedPtr snapshot = load();
+
+  // A name keeps its dns entry along with its static records
+  DomainNameMatch match = snapshot->find("x.y.z.github.com");
+  ASSERT_NE(match.cluster_name_, nullptr);
+  ASSERT_EQ(2, match.static_records_.ipv4_count_);
+  EXPECT_EQ(htonl(0x0a000001), match.static_records_.ipv4_[0]);
+  EXPECT_EQ(htonl(0x0a000002), match.static_records_.ipv4_[1]);
+  ASSERT_EQ(1, match.static_records_.ipv6_count_);
+  in6_addr address;
+  memcpy(&address, &match.static_records_.ipv6_[0], sizeof(address));
+  char text[INET6_ADDRSTRLEN];
+  EXPECT_STREQ("2001:db8::1", inet_ntop(AF_INET6, &address, text, sizeof(text)));
+
+  match = snapshot->find("static.microsoft.com");
+  EXPECT_EQ(match.cluster_name_, nullptr);
+  EXPECT_EQ(0, match.static_records_.ipv4_count_);
+  EXPECT_EQ(1, match.static_records_.ipv6_count_);
+
+  EXPECT_TRUE(snapshot->find("a.b.c.microsoft.com").static_records_.empty());
+}
+
+TEST_F(DnsSnapshotTest, invalidSourceRejected) {
+  (*source_.mutable_dns_entries())["api.github.org"] = "cluster_1";
+  EXPECT_THROW_WITH_MESSAGE(
+      DnsSnapshot::compile(source_), EnvoyException,
+      "Dns Entry api.github.org does not belong to any known domain name specified");
+  source_.mutable_dns_entries()->erase("api.github.org");
+
+  envoy::config::filter::listener::udp::DnsSnapshotSource source = source_;
+  addRecords(source, "www.github.org", {"10.0.0.1"});
+  EXPECT_THROW_WITH_MESSAGE(
+      DnsSnapshot::compile(source), EnvoyException,
+      "Static records of www.github.org do not belong to any known domain name specified");
+
+  source = source_;
+  addRecords(source, "*.github.com", {"10.0.0.1"});
+  EXPECT_THROW_WITH_MESSAGE(DnsSnapshot::compile(source), EnvoyException,
+                            "Static records of *.github.com cannot be for a pattern");
+
+  source = source_;
+  addRecords(source, "www.github.com", {"www.github.com"});
+  EXPECT_THROW(DnsSnapshot::compile(source), EnvoyException);
+}
+
+TEST_F(DnsSnapshotTest, invalidFileRejected) {
+  EXPECT_THROW(DnsSnapshot::load(TestEnvironment::temporaryPath("missing.snapshot")),
+               EnvoyException);
+
+  const std::string snapshot = DnsSnapshot::compile(source_);
+  EXPECT_THROW_WITH_REGEX(DnsSnapshot::load(write(snapshot.substr(0, 64))), EnvoyException,
+                          "too short");
+  EXPECT_THROW_WITH_REGEX(DnsSnapshot::load(write(snapshot.substr(0, snapshot.size() - 1))),
+                          EnvoyException, "bytes instead of");
+
+  std::string corrupt = snapshot;
+  corrupt[0] = 'X';
+  EXPECT_THROW_WITH_REGEX(DnsSnapshot::load(write(corrupt)), EnvoyException,
+                          "is not a dns snapshot");
+
+  // The version follows the 8 bytes of magic
+  corrupt = snapshot;
+  corrupt[8] = 2;
+  EXPECT_THROW_WITH_REGEX(DnsSnapshot::load(write(corrupt)), EnvoyException,
+                          "was not compiled for version 1");
+
+  // The offset of the nodes follows the magic, version, byte order, size and entries
+  corrupt = snapshot;
+  const uint64_t offset = snapshot.size();
+  memcpy(&corrupt[32], &offset, sizeof(offset));
+  EXPECT_THROW_WITH_REGEX(DnsSnapshot::load(write(corrupt)), EnvoyException,
+                          "has a section outside of the file");
+}
+
+TEST_F(DnsSnapshotTest, mappingOutlivesReplacedFile) {
+  DnsSnapshotConstSharedPtr snapshot = load();
+
+  source_.mutable_dns_entries()->clear();
+  DnsSnapshotConstSharedPtr replaced = load();
+
+  ASSERT_NE(snapshot->find("x.y.z.github.com").cluster_name_, nullptr);
+  EXPECT_EQ(replaced->find("x.y.z.github.com").cluster_name_, nullptr);
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
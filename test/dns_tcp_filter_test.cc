@@ -0,0 +1,255 @@
+#include <arpa/nameser.h>
+
+#include "src/dns_tcp_filter.h"
+
+#include "common/buffer/buffer_impl.h"
+#include "common/network/address_impl.h"
+#include "common/stats/isolated_store_impl.h"
+
+#include "test/mocks/event/mocks.h"
+#include "test/mocks/network/mocks.h"
+
+#include "test/mocks.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using testing::_;
+using testing::Invoke;
+using testing::NiceMock;
+using testing::Return;
+using testing::ReturnRef;
+
+namespace Envoy {
+namespace Extensions {
+namespace ListenerFilters {
+namespace Dns {
+
+class DnsTcpFilterTest : public ::testing::Test {
+public:
+  struct Connection {
+    Connection(DnsTcpServer& server, const std::string& address) : filter_(server) {
+      callbacks_.connection_.remote_address_ =
+          std::make_shared<Network::Address::Ipv4Instance>(address, 5353);
+      ON_CALL(callbacks_.connection_, remoteAddress())
+          .WillByDefault(ReturnRef(callbacks_.connection_.remote_address_));
+      ON_CALL(callbacks_, connection()).WillByDefault(ReturnRef(callbacks_.connection_));
+      ON_CALL(callbacks_.connection_, write(_, _))
+          .WillByDefault(Invoke([this](Buffer::Instance& data, bool) -> void {
+            written_ += data.toString();
+            data.drain(data.length());
+          }));
+
+      // The filter creates the idle timer first, the latest expectation is matched first
+      resume_timer_ = new NiceMock<Event::MockTimer>(&callbacks_.connection_.dispatcher_);
+      idle_timer_ = new NiceMock<Event::MockTimer>(&callbacks_.connection_.dispatcher_);
+      filter_.initializeReadFilterCallbacks(callbacks_);
+    }
+
+    NiceMock<Network::MockReadFilterCallbacks> callbacks_;
+    DnsTcpFilter filter_;
+    Event::MockTimer* idle_timer_;
+    Event::MockTimer* resume_timer_;
+    std::string written_;
+  };
+
+  DnsTcpFilterTest()
+      : config_(std::make_shared<NiceMock<MockConfig>>()),
+        server_(config_,
+                [this](const Config&, const DnsServer::ResolveCallback& callback)
+                    -> std::unique_ptr<DnsServer> {
+                  dns_server_ = new MockDnsServer(callback);
+                  return std::unique_ptr<DnsServer>(dns_server_);
+                },
+                store_) {}
+
+  // A query for a.com with the id, prefixed with its length
+  static std::string framedQuery(uint16_t id) {
+    std::string query("\x00\x00\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00", HFIXEDSZ);
+    query[0] = static_cast<char>(id >> 8);
+    query[1] = static_cast<char>(id & 0xFF);
+    query += std::string("\x01\x61\x03\x63om\x00\x00\x01\x00\x01", 11);
+
+    return std::string(1, '\0') + static_cast<char>(query.size()) + query;
+  }
+
+  void onData(Connection& connection, const std::string& data) {
+    Buffer::OwnedImpl buffer(data);
+    EXPECT_EQ(Network::FilterStatus::StopIteration, connection.filter_.onData(buffer, false));
+  }
+
+  // Answers the query with a response holding only the id
+  void respond(const Formats::Message& dns_request) {
+    const uint16_t id = dns_request.header().id();
+    Buffer::OwnedImpl response(std::string{static_cast<char>(id >> 8), static_cast<char>(id)});
+    dns_server_->resolveCallback()(dns_request, response);
+  }
+
+  std::shared_ptr<NiceMock<MockConfig>> config_;
+  Stats::IsolatedStoreImpl store_;
+  MockDnsServer* dns_server_;
+  DnsTcpServer server_;
+};
+
+TEST_F(DnsTcpFilterTest, pipelinedQueriesSplitAcrossReads) {
+  Connection connection(server_, "10.0.0.1");
+
+  std::vector<uint16_t> ids;
+  EXPECT_CALL(*dns_server_, resolve(_))
+      .Times(3)
+      .WillRepeatedly(Invoke([&](const Formats::Message& dns_request) -> void {
+        EXPECT_EQ(connection.callbacks_.connection_.remote_address_, dns_request.from());
+        ids.push_back(dns_request.header().id());
+      }));
+
+  const std::string queries = framedQuery(1) + framedQuery(2) + framedQuery(3);
+  onData(connection, queries.substr(0, 1));
+  EXPECT_TRUE(ids.empty());
+
+  // The first two queries are complete, the third one only once the rest arrives
+  onData(connection, queries.substr(1, 2 * framedQuery(1).size() + 5));
+  EXPECT_EQ(std::vector<uint16_t>({1, 2}), ids);
+
+  onData(connection, queries.substr(2 * framedQuery(1).size() + 6));
+  EXPECT_EQ(std::vector<uint16_t>({1, 2, 3}), ids);
+}
+
+TEST_F(DnsTcpFilterTest, responseWrittenWithLength) {
+  Connection connection(server_, "10.0.0.1");
+  EXPECT_CALL(*dns_server_, resolve(_))
+      .WillOnce(Invoke([this](const Formats::Message& dns_request) -> void {
+        respond(dns_request);
+      }));
+
+  onData(connection, framedQuery(0x1234));
+  EXPECT_EQ(std::string("\x00\x02\x12\x34", 4), connection.written_);
+}
+
+TEST_F(DnsTcpFilterTest, responsesRoutedToTheirConnection) {
+  Connection first(server_, "10.0.0.1");
+  Connection second(server_, "10.0.0.2");
+
+  std::vector<Formats::RequestMessageConstSharedPtr> pending;
+  EXPECT_CALL(*dns_server_, resolve(_))
+      .Times(3)
+      .WillRepeatedly(Invoke([&](const Formats::Message& dns_request) -> void {
+        pending.push_back(dns_request.clone());
+      }));
+
+  onData(first, framedQuery(1));
+  onData(second, framedQuery(2));
+  onData(second, framedQuery(3));
+
+  // Answered out of order
+  respond(*pending[2]);
+  respond(*pending[0]);
+  EXPECT_EQ(std::string("\x00\x02\x00\x01", 4), first.written_);
+  EXPECT_EQ(std::string("\x00\x02\x00\x03", 4), second.written_);
+
+  // The response for a closed connection is dropped
+  second.filter_.onEvent(Network::ConnectionEvent::RemoteClose);
+  EXPECT_CALL(second.callbacks_.connection_, write(_, _)).Times(0);
+  respond(*pending[1]);
+}
+
+TEST_F(DnsTcpFilterTest, malformedQuerySkipped) {
+  Connection connection(server_, "10.0.0.1");
+  EXPECT_CALL(*dns_server_, resolve(_))
+      .WillOnce(Invoke([](const Formats::Message& dns_request) -> void {
+        EXPECT_EQ(2, dns_request.header().id());
+      }));
+
+  // A frame too short for a header is followed by a valid query
+  onData(connection, std::string("\x00\x03\x00\x01\x00", 5) + framedQuery(2));
+  EXPECT_EQ(1, store_.counter("decode_short_header").value());
+}
+
+TEST_F(DnsTcpFilterTest, outstandingQueriesLimitDisablesReading) {
+  EXPECT_CALL(*config_, maxOutstandingQueriesPerConnection()).WillRepeatedly(Return(2));
+  Connection connection(server_, "10.0.0.1");
+
+  std::vector<Formats::RequestMessageConstSharedPtr> pending;
+  EXPECT_CALL(*dns_server_, resolve(_))
+      .Times(3)
+      .WillRepeatedly(Invoke([&](const Formats::Message& dns_request) -> void {
+        pending.push_back(dns_request.clone());
+      }));
+
+  // The third query waits until one of the first two is answered
+  EXPECT_CALL(connection.callbacks_.connection_, readDisable(true));
+  onData(connection, framedQuery(1) + framedQuery(2) + framedQuery(3));
+  EXPECT_EQ(2, pending.size());
+
+  // It is resolved once the event that answered the first one was handled
+  EXPECT_CALL(*connection.resume_timer_, enableTimer(std::chrono::milliseconds(0)));
+  respond(*pending[0]);
+  EXPECT_EQ(2, pending.size());
+
+  EXPECT_CALL(connection.callbacks_.connection_, readDisable(false));
+  connection.resume_timer_->callback_();
+  ASSERT_EQ(3, pending.size());
+  EXPECT_EQ(3, pending[2]->header().id());
+}
+
+TEST_F(DnsTcpFilterTest, pipelinedQueriesWithSameIdOutstanding) {
+  EXPECT_CALL(*config_, maxOutstandingQueriesPerConnection()).WillRepeatedly(Return(2));
+  Connection connection(server_, "10.0.0.1");
+
+  std::vector<Formats::RequestMessageConstSharedPtr> pending;
+  EXPECT_CALL(*dns_server_, resolve(_))
+      .Times(3)
+      .WillRepeatedly(Invoke([&](const Formats::Message& dns_request) -> void {
+        EXPECT_EQ(Formats::Transport::Tcp, dns_request.transport());
+        pending.push_back(dns_request.clone());
+      }));
+
+  // The server answers each of the queries, a repeated ID is not taken for a retransmit
+  EXPECT_CALL(connection.callbacks_.connection_, readDisable(true));
+  onData(connection, framedQuery(1) + framedQuery(1) + framedQuery(2));
+  ASSERT_EQ(2, pending.size());
+
+  respond(*pending[0]);
+  respond(*pending[1]);
+  EXPECT_EQ(std::string("\x00\x02\x00\x01\x00\x02\x00\x01", 8), connection.written_);
+
+  // Neither of them is outstanding any longer
+  EXPECT_CALL(connection.callbacks_.connection_, readDisable(false));
+  connection.resume_timer_->callback_();
+  ASSERT_EQ(3, pending.size());
+  EXPECT_EQ(2, pending[2]->header().id());
+}
+
+TEST_F(DnsTcpFilterTest, queriesAnsweredInlineNotOutstanding) {
+  EXPECT_CALL(*config_, maxOutstandingQueriesPerConnection()).WillRepeatedly(Return(1));
+  Connection connection(server_, "10.0.0.1");
+  EXPECT_CALL(*dns_server_, resolve(_))
+      .Times(3)
+      .WillRepeatedly(Invoke([this](const Formats::Message& dns_request) -> void {
+        respond(dns_request);
+      }));
+
+  EXPECT_CALL(connection.callbacks_.connection_, readDisable(_)).Times(0);
+  onData(connection, framedQuery(1) + framedQuery(2) + framedQuery(3));
+  EXPECT_EQ(3 * 4, connection.written_.size());
+}
+
+TEST_F(DnsTcpFilterTest, idleConnectionClosed) {
+  EXPECT_CALL(*config_, tcpIdleTimeout()).WillRepeatedly(Return(std::chrono::milliseconds(3000)));
+  Connection connection(server_, "10.0.0.1");
+  EXPECT_CALL(*dns_server_, resolve(_))
+      .WillOnce(Invoke([this](const Formats::Message& dns_request) -> void {
+        respond(dns_request);
+      }));
+
+  // Receiving the query and sending its response both restart the timer
+  EXPECT_CALL(*connection.idle_timer_, enableTimer(std::chrono::milliseconds(3000))).Times(2);
+  onData(connection, framedQuery(1));
+
+  EXPECT_CALL(connection.callbacks_.connection_, close(Network::ConnectionCloseType::NoFlush));
+  connection.idle_timer_->callback_();
+}
+
+} // namespace Dns
+} // namespace ListenerFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -15,10 +15,51 @@ namespace Extensions {
 namespace ListenerFilters {
 namespace Dns {
 
-MockConfig::MockConfig() {}
+MockConfig::MockConfig() {
+  ON_CALL(*this, recursiveQueryTimeout()).WillByDefault(Return(std::chrono::milliseconds(5000)));
+  ON_CALL(*this, maxPendingRecursiveQueries()).WillByDefault(Return(10000));
+  ON_CALL(*this, maxWaitersPerRecursiveQuery()).WillByDefault(Return(1024));
+  ON_CALL(*this, minCacheTtl()).WillByDefault(Return(std::chrono::seconds(0)));
+  ON_CALL(*this, maxCacheTtl()).WillByDefault(Return(std::chrono::seconds(3600)));
+  ON_CALL(*this, maxCachedResponses()).WillByDefault(Return(10000));
+  ON_CALL(*this, nameServers()).WillByDefault(ReturnRef(name_servers_));
+  ON_CALL(*this, forwardingUpstream()).WillByDefault(ReturnRef(forwarding_upstream_));
+  ON_CALL(*this, maxAnswers()).WillByDefault(Return(0));
+  ON_CALL(*this, healthyPanicThreshold()).WillByDefault(Return(50));
+  ON_CALL(*this, maxCachedAnswers()).WillByDefault(Return(10000));
+  ON_CALL(*this, maxOutstandingQueriesPerConnection()).WillByDefault(Return(100));
+  ON_CALL(*this, tcpIdleTimeout()).WillByDefault(Return(std::chrono::milliseconds(10000)));
+  ON_CALL(*this, responseRateLimit()).WillByDefault(ReturnRef(response_rate_limit_));
+  ON_CALL(*this, dnsEntries()).WillByDefault(ReturnRef(dns_entries_));
+  ON_CALL(*this, dnsEntriesPath()).WillByDefault(ReturnRef(dns_entries_path_));
+  ON_CALL(*this, dnsSnapshotPath()).WillByDefault(ReturnRef(dns_snapshot_path_));
+  ON_CALL(*this, knownNames()).WillByDefault(ReturnRef(known_names_));
+}
 
 MockConfig::~MockConfig() {}
 
+MockKnownNames::MockKnownNames() {
+  ON_CALL(*this, addUpdateCb(_))
+      .WillByDefault(Invoke([this](UpdateCb callback) -> Common::CallbackHandle* {
+        return update_cb_helper_.add(callback);
+      }));
+}
+
+MockKnownNames::~MockKnownNames() {}
+
+MockRecursiveResolver::MockRecursiveResolver() {}
+
+MockRecursiveResolver::~MockRecursiveResolver() {}
+
+MockForwarder::MockForwarder() {}
+
+MockForwarder::~MockForwarder() {}
+
+MockDnsServer::MockDnsServer(const ResolveCallback& resolve_callback)
+    : DnsServer(resolve_callback) {}
+
+MockDnsServer::~MockDnsServer() {}
+
 namespace Formats {
 
 MockHeader::MockHeader() {}
@@ -30,10 +71,14 @@ MockQuestionRecord::MockQuestionRecord() {}
 MockQuestionRecord::~MockQuestionRecord() {}
 
 MockMessage::MockMessage(Network::Address::InstanceConstSharedPtr& from)
-    : header_(), question_(), from_(from) {
+    : header_(), question_(), edns_(), from_(from) {
   ON_CALL(*this, from()).WillByDefault(ReturnRef(from_));
+  ON_CALL(*this, transport()).WillByDefault(Return(Transport::Udp));
   ON_CALL(*this, header()).WillByDefault(ReturnRef(header_));
   ON_CALL(*this, questionRecord()).WillByDefault(ReturnRef(question_));
+  ON_CALL(*this, questionRecord(_)).WillByDefault(ReturnRef(question_));
+  ON_CALL(*this, edns()).WillByDefault(ReturnRef(edns_));
+  ON_CALL(*this, maxResponseSize()).WillByDefault(Return(MaxUdpPayloadSizeWithoutEdns));
 }
 
 MockMessage::~MockMessage() {}
@@ -1,7 +1,12 @@
 #pragma once
 
+#include "common/common/callback_impl.h"
+
 #include "src/dns_config.h"
 #include "src/dns_codec.h"
+#include "src/dns_forwarder.h"
+#include "src/dns_recursive_resolver.h"
+#include "src/dns_server.h"
 
 #include "gmock/gmock.h"
 
@@ -16,12 +21,78 @@ public:
   ~MockConfig();
 
   // Client Config
-  MOCK_CONST_METHOD0(recursiveQueryTimeout, std::chrono::seconds());
+  MOCK_CONST_METHOD0(recursiveQueryTimeout, std::chrono::milliseconds());
+  MOCK_CONST_METHOD0(maxPendingRecursiveQueries, uint32_t());
+  MOCK_CONST_METHOD0(maxWaitersPerRecursiveQuery, uint32_t());
+  MOCK_CONST_METHOD0(minCacheTtl, std::chrono::seconds());
+  MOCK_CONST_METHOD0(maxCacheTtl, std::chrono::seconds());
+  MOCK_CONST_METHOD0(maxCachedResponses, uint32_t());
+  MOCK_CONST_METHOD0(nameServers, const std::vector<Network::Address::InstanceConstSharedPtr>&());
+  MOCK_CONST_METHOD0(forwardingUpstream, const Network::Address::InstanceConstSharedPtr&());
 
   // Server Config
   MOCK_CONST_METHOD1(belongsToKnownDomainName, bool(const std::string&));
   MOCK_CONST_METHOD0(ttl, std::chrono::seconds());
-  MOCK_CONST_METHOD0(dnsMap, std::unordered_map<std::string, std::string>&());
+  MOCK_CONST_METHOD0(maxAnswers, uint32_t());
+  MOCK_CONST_METHOD0(healthyPanicThreshold, uint32_t());
+  MOCK_CONST_METHOD0(maxCachedAnswers, uint32_t());
+  MOCK_CONST_METHOD0(maxOutstandingQueriesPerConnection, uint32_t());
+  MOCK_CONST_METHOD0(tcpIdleTimeout, std::chrono::milliseconds());
+  MOCK_CONST_METHOD0(responseRateLimit, const absl::optional<ResponseRateLimitSettings>&());
+  MOCK_CONST_METHOD0(dnsEntries, const DnsEntryMap&());
+  MOCK_CONST_METHOD0(dnsEntriesPath, const std::string&());
+  MOCK_CONST_METHOD0(dnsSnapshotPath, const std::string&());
+  MOCK_CONST_METHOD0(knownNames, const DomainNameTrieConstSharedPtr&());
+  MOCK_CONST_METHOD1(buildKnownNames, DomainNameTrieConstSharedPtr(const DnsEntryMap&));
+
+  std::vector<Network::Address::InstanceConstSharedPtr> name_servers_;
+  Network::Address::InstanceConstSharedPtr forwarding_upstream_;
+  DnsEntryMap dns_entries_;
+  std::string dns_entries_path_;
+  std::string dns_snapshot_path_;
+  DomainNameTrieConstSharedPtr known_names_;
+  absl::optional<ResponseRateLimitSettings> response_rate_limit_;
+};
+
+class MockKnownNames : public KnownNames {
+public:
+  MockKnownNames();
+  ~MockKnownNames();
+
+  // KnownNames
+  MOCK_CONST_METHOD1(matchDomainName, DomainNameMatch(const std::string&));
+  MOCK_METHOD1(addUpdateCb, Common::CallbackHandle*(UpdateCb));
+
+  Common::CallbackManager<const std::vector<std::string>&> update_cb_helper_;
+};
+
+class MockRecursiveResolver : public RecursiveResolver {
+public:
+  MockRecursiveResolver();
+  ~MockRecursiveResolver();
+
+  // RecursiveResolver
+  MOCK_METHOD3(resolve, Network::ActiveDnsQuery*(const std::string&, uint16_t, ResolveCb));
+};
+
+class MockForwarder : public Forwarder {
+public:
+  MockForwarder();
+  ~MockForwarder();
+
+  // Forwarder
+  MOCK_METHOD2(forward, bool(const Formats::Message&, ResponseCb));
+};
+
+class MockDnsServer : public DnsServer {
+public:
+  MockDnsServer(const ResolveCallback& resolve_callback);
+  ~MockDnsServer();
+
+  // DnsServer
+  MOCK_METHOD1(resolve, void(const Formats::Message&));
+
+  const ResolveCallback& resolveCallback() const { return resolve_callback_; }
 };
 
 namespace Formats {
@@ -32,6 +103,7 @@ public:
   ~MockHeader();
 
   // Formats::Header
+  MOCK_CONST_METHOD0(id, uint16_t());
   MOCK_CONST_METHOD0(qrCode, MessageType());
   MOCK_CONST_METHOD0(rCode, uint16_t());
   MOCK_CONST_METHOD0(rd, bool());
@@ -60,17 +132,26 @@ public:
 
   // Formats::Message
   MOCK_CONST_METHOD0(from, Network::Address::InstanceConstSharedPtr&());
+  MOCK_CONST_METHOD0(transport, Transport());
   MOCK_CONST_METHOD0(header, Formats::Header&());
   MOCK_CONST_METHOD0(questionRecord, Formats::QuestionRecord&());
-  MOCK_METHOD3(addARecord, void(ResourceRecordSection, uint32_t, const Network::Address::Ipv4*));
-  MOCK_METHOD3(addAAAARecord, void(ResourceRecordSection, uint32_t, const Network::Address::Ipv6*));
-  MOCK_METHOD3(addSRVRecord, void(uint32_t, uint16_t, const std::string&));
+  MOCK_CONST_METHOD1(questionRecord, Formats::QuestionRecord&(uint16_t));
+  MOCK_CONST_METHOD0(edns, absl::optional<EdnsOptions>&());
+  MOCK_CONST_METHOD0(maxResponseSize, uint16_t());
+  MOCK_CONST_METHOD0(raw, absl::string_view());
+  MOCK_METHOD4(addARecord, void(ResourceRecordSection, const std::string&, uint32_t, uint32_t));
+  MOCK_METHOD4(addAAAARecord,
+               void(ResourceRecordSection, const std::string&, uint32_t, absl::uint128));
+  MOCK_METHOD6(addSRVRecord, void(const std::string&, uint32_t, uint16_t, uint16_t, uint16_t,
+                                  const std::string&));
   MOCK_CONST_METHOD1(createResponseMessage, ResponseMessageSharedPtr(const ResponseOptions&));
+  MOCK_CONST_METHOD0(clone, RequestMessageConstSharedPtr());
 
   MOCK_CONST_METHOD1(encode, void(Buffer::Instance&));
 
   MockHeader header_;
   MockQuestionRecord question_;
+  absl::optional<EdnsOptions> edns_;
   Network::Address::InstanceConstSharedPtr from_;
 };
 
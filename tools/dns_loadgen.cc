@@ -0,0 +1,447 @@
+// Replays a corpus of DNS queries against a server over UDP, and reports the achieved rate, the
+// loss and the latency percentiles.
+//
+// bazel run //tools:dns_loadgen -- --server 127.0.0.1:10053 --corpus $PWD/tools/query_corpus.txt
+//     --duration 10 --rate 50000
+//
+// The corpus holds one query per line, "<type> <name>" with type A, AAAA or SRV. Empty lines and
+// lines starting with # are skipped. The queries are sent in corpus order, over and over.
+//
+// With --rate, queries are sent at that rate whether or not the responses keep up (open loop).
+// Without it, --outstanding queries are kept in flight, and a new one is sent for every response
+// or timeout (closed loop).
+//
+// The queries are spread over --sockets source ports. Each of them has its own 16 bit ID space,
+// and lets the kernel spread the queries over the workers of a server that uses several sockets.
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+  std::string server_{"127.0.0.1:10053"};
+  std::string corpus_;
+  // Queries per second, 0 for a closed loop
+  uint64_t rate_{0};
+  uint32_t outstanding_{100};
+  uint32_t sockets_{16};
+  // Stops after this many queries if not 0, or once the duration is over
+  uint64_t count_{0};
+  std::chrono::milliseconds duration_{std::chrono::seconds(10)};
+  std::chrono::milliseconds timeout_{std::chrono::seconds(2)};
+};
+
+struct Stats {
+  uint64_t sent_{0};
+  uint64_t send_errors_{0};
+  uint64_t received_{0};
+  uint64_t lost_{0};
+  uint64_t unexpected_{0};
+  uint64_t truncated_{0};
+  uint64_t noerror_{0};
+  uint64_t nxdomain_{0};
+  uint64_t servfail_{0};
+  uint64_t other_rcode_{0};
+  std::vector<uint64_t> latencies_us_;
+};
+
+// A query that was sent and is not answered yet
+struct InFlightQuery {
+  uint32_t socket_;
+  uint16_t id_;
+  Clock::time_point sent_;
+};
+
+[[noreturn]] void usage(const std::string& error) {
+  std::cerr << "error: " << error << "\n\n"
+            << "usage: dns_loadgen --corpus <file> [--server ip:port] [--rate qps]\n"
+            << "                   [--outstanding n] [--sockets n] [--count n]\n"
+            << "                   [--duration seconds] [--timeout ms]\n";
+  exit(2);
+}
+
+Options parseOptions(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    const std::string name = argv[i];
+    if (i + 1 >= argc) {
+      usage("missing value for " + name);
+    }
+
+    const std::string value = argv[++i];
+    if (name == "--server") {
+      options.server_ = value;
+    } else if (name == "--corpus") {
+      options.corpus_ = value;
+    } else if (name == "--rate") {
+      options.rate_ = std::stoull(value);
+    } else if (name == "--outstanding") {
+      options.outstanding_ = std::stoul(value);
+    } else if (name == "--sockets") {
+      options.sockets_ = std::stoul(value);
+    } else if (name == "--count") {
+      options.count_ = std::stoull(value);
+    } else if (name == "--duration") {
+      options.duration_ = std::chrono::milliseconds(
+          static_cast<int64_t>(std::stod(value) * 1000));
+    } else if (name == "--timeout") {
+      options.timeout_ = std::chrono::milliseconds(std::stoul(value));
+    } else {
+      usage("unknown option " + name);
+    }
+  }
+
+  if (options.corpus_.empty()) {
+    usage("--corpus is required");
+  }
+  if (options.sockets_ == 0 || options.outstanding_ == 0) {
+    usage("--sockets and --outstanding must be at least 1");
+  }
+
+  return options;
+}
+
+sockaddr_storage parseAddress(const std::string& address, socklen_t& length) {
+  sockaddr_storage storage;
+  std::memset(&storage, 0, sizeof(storage));
+
+  const size_t colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    usage("invalid address " + address);
+  }
+
+  std::string ip = address.substr(0, colon);
+  const uint16_t port = static_cast<uint16_t>(std::stoul(address.substr(colon + 1)));
+  if (ip.size() > 2 && ip.front() == '[' && ip.back() == ']') {
+    ip = ip.substr(1, ip.size() - 2);
+    sockaddr_in6* v6 = reinterpret_cast<sockaddr_in6*>(&storage);
+    v6->sin6_family = AF_INET6;
+    v6->sin6_port = htons(port);
+    if (inet_pton(AF_INET6, ip.c_str(), &v6->sin6_addr) != 1) {
+      usage("invalid address " + address);
+    }
+    length = sizeof(sockaddr_in6);
+  } else {
+    sockaddr_in* v4 = reinterpret_cast<sockaddr_in*>(&storage);
+    v4->sin_family = AF_INET;
+    v4->sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &v4->sin_addr) != 1) {
+      usage("invalid address " + address);
+    }
+    length = sizeof(sockaddr_in);
+  }
+
+  return storage;
+}
+
+// Encodes a query with the RD bit set and a zero ID, which is patched before every send
+std::string encodeQuery(const std::string& type, const std::string& name) {
+  uint16_t q_type;
+  if (type == "A") {
+    q_type = ns_t_a;
+  } else if (type == "AAAA") {
+    q_type = ns_t_aaaa;
+  } else if (type == "SRV") {
+    q_type = ns_t_srv;
+  } else {
+    usage("unsupported query type " + type);
+  }
+
+  std::string query("\x00\x00\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00", HFIXEDSZ);
+  std::istringstream labels(name);
+  std::string label;
+  while (std::getline(labels, label, '.')) {
+    if (label.empty() || label.size() > 63) {
+      usage("invalid name " + name);
+    }
+    query.push_back(static_cast<char>(label.size()));
+    query += label;
+  }
+
+  query.push_back('\0');
+  query.push_back(static_cast<char>(q_type >> 8));
+  query.push_back(static_cast<char>(q_type & 0xFF));
+  query.push_back('\0');
+  query.push_back(static_cast<char>(ns_c_in));
+  return query;
+}
+
+std::vector<std::string> loadCorpus(const std::string& path) {
+  std::ifstream file(path);
+  if (!file) {
+    usage("cannot open " + path);
+  }
+
+  std::vector<std::string> queries;
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string type;
+    std::string name;
+    if (!(fields >> type) || type[0] == '#') {
+      continue;
+    }
+    if (!(fields >> name)) {
+      usage("missing name in corpus line: " + line);
+    }
+
+    queries.push_back(encodeQuery(type, name));
+  }
+
+  if (queries.empty()) {
+    usage(path + " holds no queries");
+  }
+
+  return queries;
+}
+
+uint64_t percentile(const std::vector<uint64_t>& sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0;
+  }
+
+  const size_t rank = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+  return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+class LoadGenerator {
+public:
+  LoadGenerator(const Options& options, std::vector<std::string>&& queries)
+      : options_(options), queries_(std::move(queries)), sent_at_(options.sockets_),
+        next_ids_(options.sockets_, 0) {
+    socklen_t length;
+    const sockaddr_storage server = parseAddress(options_.server_, length);
+
+    for (uint32_t i = 0; i < options_.sockets_; i++) {
+      const int fd = socket(server.ss_family, SOCK_DGRAM, 0);
+      if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr*>(&server), length) != 0 ||
+          fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+        std::perror("socket");
+        exit(1);
+      }
+
+      fds_.push_back({fd, POLLIN, 0});
+      sent_at_[i].resize(1 << 16);
+    }
+  }
+
+  ~LoadGenerator() {
+    for (const auto& fd : fds_) {
+      close(fd.fd);
+    }
+  }
+
+  const Stats& run() {
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point end = start + options_.duration_;
+    const std::chrono::nanoseconds interval(options_.rate_ > 0 ? 1000000000 / options_.rate_ : 0);
+
+    Clock::time_point now = start;
+    while (now < end && (options_.count_ == 0 || stats_.sent_ < options_.count_)) {
+      // In the open loop every query that is due is sent, in the closed loop the queries in flight
+      // are topped up
+      if (options_.rate_ > 0) {
+        while (now >= start + interval * attempts_ && !sendLimitReached()) {
+          send(now);
+        }
+      } else {
+        while (in_flight_.size() - answered_ < options_.outstanding_ && !sendLimitReached()) {
+          send(now);
+        }
+      }
+
+      const int wait_ms = options_.rate_ > 0 ? 0 : 1;
+      receive(wait_ms);
+      now = Clock::now();
+      expire(now);
+    }
+
+    send_window_ = now - start;
+
+    // The queries still in flight get until their timeout to be answered
+    while (in_flight_.size() > answered_) {
+      receive(1);
+      now = Clock::now();
+      expire(now);
+    }
+
+    std::sort(stats_.latencies_us_.begin(), stats_.latencies_us_.end());
+    return stats_;
+  }
+
+  std::chrono::nanoseconds sendWindow() const { return send_window_; }
+
+private:
+  bool sendLimitReached() const { return options_.count_ != 0 && stats_.sent_ >= options_.count_; }
+
+  void send(Clock::time_point now) {
+    const uint32_t socket = attempts_ % options_.sockets_;
+    std::string& query = queries_[attempts_ % queries_.size()];
+    attempts_++;
+
+    // An ID is only reused once the earlier query with it was answered or timed out
+    const uint16_t id = next_ids_[socket]++;
+    if (sent_at_[socket][id] != Clock::time_point()) {
+      stats_.send_errors_++;
+      return;
+    }
+
+    query[0] = static_cast<char>(id >> 8);
+    query[1] = static_cast<char>(id & 0xFF);
+    if (::send(fds_[socket].fd, query.data(), query.size(), 0) < 0) {
+      stats_.send_errors_++;
+      return;
+    }
+
+    stats_.sent_++;
+    sent_at_[socket][id] = now;
+    in_flight_.push_back({socket, id, now});
+  }
+
+  void receive(int wait_ms) {
+    if (poll(fds_.data(), fds_.size(), wait_ms) <= 0) {
+      return;
+    }
+
+    const Clock::time_point now = Clock::now();
+    unsigned char response[65536];
+    for (uint32_t socket = 0; socket < fds_.size(); socket++) {
+      if ((fds_[socket].revents & POLLIN) == 0) {
+        continue;
+      }
+
+      ssize_t length;
+      while ((length = recv(fds_[socket].fd, response, sizeof(response), 0)) >= 0) {
+        onResponse(socket, response, static_cast<size_t>(length), now);
+      }
+    }
+  }
+
+  void onResponse(uint32_t socket, const unsigned char* response, size_t length,
+                  Clock::time_point now) {
+    if (length < HFIXEDSZ) {
+      stats_.unexpected_++;
+      return;
+    }
+
+    // Responses that arrive after the timeout were already counted as lost
+    const uint16_t id = static_cast<uint16_t>((response[0] << 8) | response[1]);
+    Clock::time_point& sent = sent_at_[socket][id];
+    if (sent == Clock::time_point()) {
+      stats_.unexpected_++;
+      return;
+    }
+
+    stats_.received_++;
+    stats_.latencies_us_.push_back(
+        std::chrono::duration_cast<std::chrono::microseconds>(now - sent).count());
+    sent = Clock::time_point();
+    answered_++;
+
+    if (response[2] & 0x02) {
+      stats_.truncated_++;
+    }
+
+    switch (response[3] & 0x0F) {
+    case ns_r_noerror:
+      stats_.noerror_++;
+      break;
+    case ns_r_nxdomain:
+      stats_.nxdomain_++;
+      break;
+    case ns_r_servfail:
+      stats_.servfail_++;
+      break;
+    default:
+      stats_.other_rcode_++;
+      break;
+    }
+  }
+
+  // Drops the queries from the front that were answered, or that timed out
+  void expire(Clock::time_point now) {
+    while (!in_flight_.empty()) {
+      const InFlightQuery& query = in_flight_.front();
+      Clock::time_point& sent = sent_at_[query.socket_][query.id_];
+      if (sent == query.sent_) {
+        if (now - query.sent_ < options_.timeout_) {
+          return;
+        }
+
+        stats_.lost_++;
+        sent = Clock::time_point();
+      } else {
+        answered_--;
+      }
+
+      in_flight_.pop_front();
+    }
+  }
+
+  const Options& options_;
+  std::vector<std::string> queries_;
+  std::vector<pollfd> fds_;
+  // The time each ID of each socket was sent at, the epoch if it is not in flight
+  std::vector<std::vector<Clock::time_point>> sent_at_;
+  std::vector<uint16_t> next_ids_;
+  // In send order. Answered queries stay until they reach the front, answered_ counts them.
+  std::deque<InFlightQuery> in_flight_;
+  uint64_t answered_{0};
+  uint64_t attempts_{0};
+  std::chrono::nanoseconds send_window_{0};
+  Stats stats_;
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+  const Options options = parseOptions(argc, argv);
+  LoadGenerator generator(options, loadCorpus(options.corpus_));
+  const Stats& stats = generator.run();
+
+  const double seconds = std::chrono::duration<double>(generator.sendWindow()).count();
+  const double loss =
+      stats.sent_ > 0 ? 100.0 * static_cast<double>(stats.lost_) / stats.sent_ : 0.0;
+
+  std::printf("sent %" PRIu64 ", received %" PRIu64 ", lost %" PRIu64 " (%.3f%%), "
+              "send errors %" PRIu64 ", unexpected %" PRIu64 "\n",
+              stats.sent_, stats.received_, stats.lost_, loss, stats.send_errors_,
+              stats.unexpected_);
+  std::printf("rcodes noerror %" PRIu64 ", nxdomain %" PRIu64 ", servfail %" PRIu64
+              ", other %" PRIu64 ", truncated %" PRIu64 "\n",
+              stats.noerror_, stats.nxdomain_, stats.servfail_, stats.other_rcode_,
+              stats.truncated_);
+
+  // A single line that scripts can parse
+  std::printf("qps=%.0f loss_pct=%.3f p50_us=%" PRIu64 " p99_us=%" PRIu64 " p999_us=%" PRIu64
+              "\n",
+              seconds > 0 ? stats.received_ / seconds : 0.0, loss,
+              percentile(stats.latencies_us_, 0.5), percentile(stats.latencies_us_, 0.99),
+              percentile(stats.latencies_us_, 0.999));
+
+  return stats.received_ > 0 ? 0 : 1;
+}
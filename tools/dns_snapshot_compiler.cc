@@ -0,0 +1,118 @@
+// Compiles a DnsSnapshotSource into the snapshot that ServerSettings.dns_snapshot_path maps.
+//
+// bazel run //tools:dns_snapshot_compiler -- --source $PWD/names.yaml --output /etc/envoy/dns.snap
+//
+// The source is read as YAML if its path ends in ".yaml" and as JSON otherwise. The snapshot is
+// written next to the output and moved in place once complete, so that a filter watching the
+// output maps the new snapshot and never a half written one.
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "envoy/common/exception.h"
+
+#include "common/protobuf/utility.h"
+
+#include "src/dns.pb.h"
+#include "src/dns.pb.validate.h"
+#include "src/dns_snapshot.h"
+
+#include "absl/strings/match.h"
+
+namespace {
+
+struct Options {
+  std::string source_;
+  std::string output_;
+};
+
+[[noreturn]] void usage(const std::string& error) {
+  std::cerr << "error: " << error << "\n\n"
+            << "usage: dns_snapshot_compiler --source <file> --output <file>\n";
+  exit(2);
+}
+
+Options parseOptions(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    const std::string name = argv[i];
+    if (i + 1 >= argc) {
+      usage("missing value for " + name);
+    }
+
+    const std::string value = argv[++i];
+    if (name == "--source") {
+      options.source_ = value;
+    } else if (name == "--output") {
+      options.output_ = value;
+    } else {
+      usage("unknown option " + name);
+    }
+  }
+
+  if (options.source_.empty() || options.output_.empty()) {
+    usage("--source and --output are required");
+  }
+
+  return options;
+}
+
+std::string readFile(const std::string& path) {
+  std::ifstream file(path);
+  if (!file) {
+    usage("cannot open " + path);
+  }
+
+  std::stringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+void writeFile(const std::string& path, const std::string& contents) {
+  const std::string temporary_path = path + ".tmp";
+  std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+  file.write(contents.data(), contents.size());
+  file.close();
+  if (!file) {
+    std::cerr << "error: cannot write " << temporary_path << "\n";
+    exit(1);
+  }
+
+  if (std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+    std::cerr << "error: cannot move " << temporary_path << " to " << path << "\n";
+    exit(1);
+  }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  const Options options = parseOptions(argc, argv);
+
+  envoy::config::filter::listener::udp::DnsSnapshotSource source;
+  std::string snapshot;
+  try {
+    const std::string contents = readFile(options.source_);
+    if (absl::EndsWith(options.source_, ".yaml")) {
+      Envoy::MessageUtil::loadFromYaml(contents, source);
+    } else {
+      Envoy::MessageUtil::loadFromJson(contents, source);
+    }
+
+    Envoy::MessageUtil::validate(source);
+    snapshot = Envoy::Extensions::ListenerFilters::Dns::DnsSnapshot::compile(source);
+  } catch (const Envoy::EnvoyException& e) {
+    std::cerr << "error: " << options.source_ << ": " << e.what() << "\n";
+    return 1;
+  }
+
+  writeFile(options.output_, snapshot);
+  std::cout << "compiled " << source.dns_entries().size() << " dns entries and "
+            << source.static_records().size() << " static records into " << options.output_
+            << " (" << snapshot.size() << " bytes)\n";
+  return 0;
+}
@@ -0,0 +1,199 @@
+// Answers DNS queries over UDP without looking anything up, so that load tests of the recursive
+// path of the DNS filter need no network. Every A question is answered with 192.0.2.1 and every
+// AAAA question with 2001:db8::1, the documentation ranges. Names with a first label of
+// "nxdomain" get NXDOMAIN, and other question types NOTIMP.
+//
+// bazel run //tools:dns_stub_responder -- --port 10054 --ttl 0 --threads 2
+//
+// The TTL of the answers is 0 by default, so that the filter does not cache them and every
+// query for an unknown name is sent on to the responder. Each thread serves its own socket,
+// bound with SO_REUSEPORT.
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Options {
+  std::string address_{"127.0.0.1"};
+  uint16_t port_{10054};
+  uint32_t ttl_{0};
+  uint32_t threads_{1};
+};
+
+[[noreturn]] void usage(const std::string& error) {
+  std::cerr << "error: " << error << "\n\n"
+            << "usage: dns_stub_responder [--address ipv4] [--port n] [--ttl seconds]\n"
+            << "                          [--threads n]\n";
+  exit(2);
+}
+
+Options parseOptions(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    const std::string name = argv[i];
+    if (i + 1 >= argc) {
+      usage("missing value for " + name);
+    }
+
+    const std::string value = argv[++i];
+    if (name == "--address") {
+      options.address_ = value;
+    } else if (name == "--port") {
+      options.port_ = static_cast<uint16_t>(std::stoul(value));
+    } else if (name == "--ttl") {
+      options.ttl_ = std::stoul(value);
+    } else if (name == "--threads") {
+      options.threads_ = std::stoul(value);
+    } else {
+      usage("unknown option " + name);
+    }
+  }
+
+  if (options.threads_ == 0) {
+    usage("--threads must be at least 1");
+  }
+
+  return options;
+}
+
+int bindSocket(const Options& options) {
+  sockaddr_in address;
+  std::memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(options.port_);
+  if (inet_pton(AF_INET, options.address_.c_str(), &address.sin_addr) != 1) {
+    usage("invalid address " + options.address_);
+  }
+
+  const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  const int on = 1;
+  if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+      bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+    std::perror("bind");
+    exit(1);
+  }
+
+  return fd;
+}
+
+// Builds the response to the query in place. Returns its length, or 0 if the query is dropped.
+size_t respond(unsigned char* message, size_t length, size_t capacity, uint32_t ttl) {
+  if (length < HFIXEDSZ || (message[2] & 0x80) != 0 || message[4] != 0 || message[5] != 1) {
+    return 0;
+  }
+
+  // The question is echoed, anything after it is dropped
+  size_t offset = HFIXEDSZ;
+  const bool nxdomain = message[offset] == 8 && offset + 9 <= length &&
+                        std::memcmp(message + offset + 1, "nxdomain", 8) == 0;
+  while (offset < length && message[offset] != 0) {
+    if ((message[offset] & 0xC0) != 0) {
+      return 0;
+    }
+    offset += message[offset] + 1;
+  }
+
+  offset += 1 + QFIXEDSZ;
+  if (offset > length) {
+    return 0;
+  }
+
+  const uint16_t q_type = (message[offset - 4] << 8) | message[offset - 3];
+  uint8_t rcode = ns_r_noerror;
+  if (nxdomain) {
+    rcode = ns_r_nxdomain;
+  } else if (q_type != ns_t_a && q_type != ns_t_aaaa) {
+    rcode = ns_r_notimpl;
+  }
+
+  // QR and RA set, the opcode and RD of the query are kept
+  message[2] = static_cast<unsigned char>((message[2] & 0x79) | 0x80);
+  message[3] = static_cast<unsigned char>(0x80 | rcode);
+  std::memset(message + 6, 0, 6);
+
+  if (rcode != ns_r_noerror) {
+    return offset;
+  }
+
+  const size_t rdata_length = q_type == ns_t_a ? 4 : 16;
+  if (offset + 2 + RRFIXEDSZ + rdata_length > capacity) {
+    return 0;
+  }
+
+  message[7] = 1;
+  unsigned char* answer = message + offset;
+  // A compression pointer to the question name
+  *answer++ = 0xC0;
+  *answer++ = HFIXEDSZ;
+  *answer++ = static_cast<unsigned char>(q_type >> 8);
+  *answer++ = static_cast<unsigned char>(q_type);
+  *answer++ = 0;
+  *answer++ = ns_c_in;
+  *answer++ = static_cast<unsigned char>(ttl >> 24);
+  *answer++ = static_cast<unsigned char>(ttl >> 16);
+  *answer++ = static_cast<unsigned char>(ttl >> 8);
+  *answer++ = static_cast<unsigned char>(ttl);
+  *answer++ = 0;
+  *answer++ = static_cast<unsigned char>(rdata_length);
+
+  if (q_type == ns_t_a) {
+    inet_pton(AF_INET, "192.0.2.1", answer);
+  } else {
+    inet_pton(AF_INET6, "2001:db8::1", answer);
+  }
+
+  return offset + 2 + RRFIXEDSZ + rdata_length;
+}
+
+void serve(int fd, uint32_t ttl) {
+  unsigned char message[4096];
+  sockaddr_storage peer;
+  while (true) {
+    socklen_t peer_length = sizeof(peer);
+    const ssize_t length = recvfrom(fd, message, sizeof(message), 0,
+                                    reinterpret_cast<sockaddr*>(&peer), &peer_length);
+    if (length < 0) {
+      continue;
+    }
+
+    const size_t response_length = respond(message, length, sizeof(message), ttl);
+    if (response_length > 0) {
+      sendto(fd, message, response_length, 0, reinterpret_cast<const sockaddr*>(&peer),
+             peer_length);
+    }
+  }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  const Options options = parseOptions(argc, argv);
+
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < options.threads_; i++) {
+    const int fd = bindSocket(options);
+    threads.emplace_back([fd, &options]() { serve(fd, options.ttl_); });
+  }
+
+  std::printf("listening on %s:%u\n", options.address_.c_str(), options.port_);
+  std::fflush(stdout);
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  return 0;
+}
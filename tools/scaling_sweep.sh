@@ -0,0 +1,84 @@
+#!/bin/bash
+#
+# Measures how the DNS filter scales with the number of workers. For every concurrency level,
+# starts Envoy with loadgen_envoy.yaml and replays query_corpus.txt against it with dns_loadgen.
+# The unknown names are resolved through dns_stub_responder, so that no network is needed.
+#
+# bazel run //tools:scaling_sweep -- [concurrency...]
+#
+# The concurrency levels default to 1 2 4 8. The environment overrides the load:
+#   DURATION     seconds of load per level, 10 by default
+#   OUTSTANDING  queries in flight in the closed loop, 256 by default
+#   RATE         queries per second for an open loop instead of the closed loop
+#   STUB_TTL     TTL of the stub answers, 0 by default so that the recursive cache is bypassed
+
+set -e
+
+TOOLS_DIR=${TOOLS_DIR:-tools}
+ENVOY=${ENVOY:-src/envoy}
+LOADGEN=${LOADGEN:-${TOOLS_DIR}/dns_loadgen}
+STUB=${STUB:-${TOOLS_DIR}/dns_stub_responder}
+CONFIG=${CONFIG:-${TOOLS_DIR}/loadgen_envoy.yaml}
+CORPUS=${CORPUS:-${TOOLS_DIR}/query_corpus.txt}
+DURATION=${DURATION:-10}
+OUTSTANDING=${OUTSTANDING:-256}
+STUB_TTL=${STUB_TTL:-0}
+
+CONCURRENCY_LEVELS=("$@")
+if [[ ${#CONCURRENCY_LEVELS[@]} -eq 0 ]]; then
+  CONCURRENCY_LEVELS=(1 2 4 8)
+fi
+
+LOAD_ARGS=(--server 127.0.0.1:10053 --corpus "${CORPUS}" --duration "${DURATION}")
+if [[ -n "${RATE}" ]]; then
+  LOAD_ARGS+=(--rate "${RATE}")
+else
+  LOAD_ARGS+=(--outstanding "${OUTSTANDING}")
+fi
+
+LOG_DIR=$(mktemp -d)
+STUB_PID=
+ENVOY_PID=
+
+function cleanup() {
+  [[ -n "${ENVOY_PID}" ]] && kill "${ENVOY_PID}" 2>/dev/null || true
+  [[ -n "${STUB_PID}" ]] && kill "${STUB_PID}" 2>/dev/null || true
+}
+trap cleanup EXIT
+
+# Waits until Envoy answers a query for a known name
+function wait_for_envoy() {
+  for _ in $(seq 50); do
+    if "${LOADGEN}" --server 127.0.0.1:10053 --corpus "${CORPUS}" --count 1 --sockets 1 \
+        --timeout 100 >/dev/null 2>&1; then
+      return 0
+    fi
+    sleep 0.1
+  done
+
+  echo "Envoy did not start, see ${LOG_DIR}" >&2
+  return 1
+}
+
+"${STUB}" --port 10054 --ttl "${STUB_TTL}" --threads 4 >"${LOG_DIR}/stub.log" 2>&1 &
+STUB_PID=$!
+
+printf "%-12s %12s %12s %10s %10s %10s %10s\n" concurrency qps qps/worker loss_pct p50_us \
+  p99_us p999_us
+
+for concurrency in "${CONCURRENCY_LEVELS[@]}"; do
+  "${ENVOY}" -c "${CONFIG}" --concurrency "${concurrency}" --disable-hot-restart \
+    >"${LOG_DIR}/envoy_${concurrency}.log" 2>&1 &
+  ENVOY_PID=$!
+  wait_for_envoy
+
+  # The last line of the output holds the results as key=value pairs
+  result=$("${LOADGEN}" "${LOAD_ARGS[@]}" | tail -1)
+  eval "${result// /;}"
+  printf "%-12s %12s %12s %10s %10s %10s %10s\n" "${concurrency}" "${qps}" \
+    "$((qps / concurrency))" "${loss_pct}" "${p50_us}" "${p99_us}" "${p999_us}"
+
+  kill "${ENVOY_PID}"
+  wait "${ENVOY_PID}" 2>/dev/null || true
+  ENVOY_PID=
+done